@@ -0,0 +1,109 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "age_hist.h"
+
+/* Upper bounds of the report buckets, the last one is open */
+static const uint64_t age_hist_bounds[AGE_HIST_BUCKETS - 1] = {
+    10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+    1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull,
+    10000000000000ull,
+};
+
+static const char *age_hist_labels[AGE_HIST_BUCKETS] = {
+    "0 - 10 us", "10 - 100 us", "100 us - 1 ms", "1 - 10 ms", "10 - 100 ms",
+    "100 ms - 1 sec", "1 - 10 sec", "10 - 100 sec", "100 - 1000 sec",
+    "1000 - 10000 sec", "10000+ sec",
+};
+
+const char* age_hist_label(int i)
+{
+    return age_hist_labels[i];
+}
+
+uint64_t age_hist_lower(int i)
+{
+    return i > 0 ? age_hist_bounds[i - 1] : 0;
+}
+
+/* Called with the owner of src gone, e.g. at thread exit */
+void age_epochs_fold(age_epochs_t *dst, age_epochs_t *src)
+{
+    int level, i;
+
+    for(level = 0; level < AGE_EPOCH_LEVELS; level++) {
+        for(i = 0; i < AGE_EPOCH_SLOTS; i++) {
+            age_slot_t *slot = &src->slots[level][i];
+
+            age_slot_add(&dst->slots[level][i], slot->epoch, slot->count);
+        }
+    }
+}
+
+static int age_hist_bucket(uint64_t age)
+{
+    int i;
+
+    for(i = 0; i < AGE_HIST_BUCKETS - 1; i++) {
+        if(age < age_hist_bounds[i]) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Adds the epochs of ages to hist. Every birth time is taken from exactly
+ * one level: level L covers [lo, hi), where lo is the start of its ring
+ * rounded up to an epoch of level L + 1 and hi is the lo of level L - 1.
+ * Since the split points only depend on now_ns, the births and deaths of
+ * an allocation recorded by different threads land in the same bucket. */
+void age_hist_collect(age_hist_t *hist, age_epochs_t *ages, uint64_t now_ns)
+{
+    uint64_t hi = UINT64_MAX;
+    int      level, i;
+
+    for(level = 0; level < AGE_EPOCH_LEVELS; level++) {
+        int      shift = age_epoch_shift(level);
+        int64_t  first = (int64_t)(now_ns >> shift) - AGE_EPOCH_SLOTS + 1;
+        uint64_t lo = first > 0 ? (uint64_t)first << shift : 0;
+
+        if(level < AGE_EPOCH_LEVELS - 1) {
+            uint64_t next = 1ull << age_epoch_shift(level + 1);
+            lo = (lo + next - 1) & ~(next - 1);
+        }
+
+        for(i = 0; i < AGE_EPOCH_SLOTS; i++) {
+            int64_t  epoch = __atomic_load_n(&ages->slots[level][i].epoch, __ATOMIC_RELAXED);
+            int64_t  count = __atomic_load_n(&ages->slots[level][i].count, __ATOMIC_RELAXED);
+            uint64_t start = (uint64_t)epoch << shift;
+            uint64_t mid = start + (1ull << shift) / 2;
+
+            if(count == 0 || start < lo || start >= hi) {
+                continue;
+            }
+            hist->count[age_hist_bucket(now_ns > mid ? now_ns - mid : 0)] += count;
+        }
+        hi = lo;
+    }
+}
@@ -0,0 +1,99 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _AGE_HIST_
+#define _AGE_HIST_
+
+#include <stdint.h>
+
+/* Ages of the live set without visiting any record.
+ * Live allocations are counted by birth epoch at several levels of
+ * resolution. Level 0 epochs are 2^AGE_EPOCH_SHIFT ns (~1 us) wide and
+ * every level is 2^AGE_EPOCH_LEVEL_BITS times coarser; each level keeps
+ * the last AGE_EPOCH_SLOTS epochs in a ring. A birth adds to its epoch at
+ * every level and a death subtracts from the same epochs, so an epoch's
+ * counter is the number of its allocations still alive. A report takes
+ * recent births from the fine levels and older ones from the coarse
+ * levels; the oldest level reaches back ~19 hours.
+ *
+ * Each ring slot is tagged with its epoch. A slot is claimed by the
+ * first update for a newer epoch, and an update for an epoch older than
+ * the slot's is dropped, since that epoch has left the ring anyway. */
+
+#define AGE_EPOCH_SHIFT       10
+#define AGE_EPOCH_LEVEL_BITS  4
+#define AGE_EPOCH_LEVELS      9
+#define AGE_EPOCH_SLOTS       32   /* two epochs of the next level */
+
+typedef struct {
+    int64_t  epoch;
+    int64_t  count;
+} age_slot_t;
+
+typedef struct {
+    age_slot_t  slots[AGE_EPOCH_LEVELS][AGE_EPOCH_SLOTS];
+} age_epochs_t;
+
+/* Report buckets, decades from 10 us to 10000 sec */
+#define AGE_HIST_BUCKETS  11
+
+typedef struct {
+    int64_t  count[AGE_HIST_BUCKETS];
+} age_hist_t;
+
+static inline int age_epoch_shift(int level)
+{
+    return AGE_EPOCH_SHIFT + level * AGE_EPOCH_LEVEL_BITS;
+}
+
+/* Single writer, same as the thread_stats counters */
+static inline void age_slot_add(age_slot_t *slot, int64_t epoch, int64_t num)
+{
+    if(slot->epoch == epoch) {
+        __atomic_store_n(&slot->count, slot->count + num, __ATOMIC_RELAXED);
+    }
+    else if(slot->epoch < epoch) {
+        __atomic_store_n(&slot->count, num, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->epoch, epoch, __ATOMIC_RELAXED);
+    }
+}
+
+/* num live allocations born at birth_ns (negative for deaths) */
+static inline void age_epochs_add(age_epochs_t *ages, uint64_t birth_ns, int64_t num)
+{
+    int level;
+
+    for(level = 0; level < AGE_EPOCH_LEVELS; level++) {
+        int64_t epoch = birth_ns >> age_epoch_shift(level);
+
+        age_slot_add(&ages->slots[level][epoch & (AGE_EPOCH_SLOTS - 1)], epoch, num);
+    }
+}
+
+void        age_epochs_fold(age_epochs_t *dst, age_epochs_t *src);
+void        age_hist_collect(age_hist_t *hist, age_epochs_t *ages, uint64_t now_ns);
+const char* age_hist_label(int i);
+uint64_t    age_hist_lower(int i);   /* in ns */
+
+#endif /* _AGE_HIST_ */
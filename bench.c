@@ -0,0 +1,389 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Measures the per-call cost of the allocator, with or without
+ * memprofiler.so preloaded (bench.sh runs both). One CSV row per call type:
+ *   workload,dist,threads,live,op,ops,ns_per_op
+ * ns_per_op is time spent inside the calls, averaged over all threads.
+ *
+ * Workloads:
+ *   pairs    each thread allocates and frees batches of BATCH blocks
+ *   xthread  each thread allocates blocks that a partner thread frees
+ *   liveset  the threads grow the live set to -l blocks, then free them all */
+
+#define BATCH       256
+#define RING_SIZE   4096
+
+typedef enum {
+    OP_MALLOC,
+    OP_CALLOC,
+    OP_REALLOC,
+    OP_FREE,
+    NUM_OPS
+} bench_op_t;
+
+typedef struct {
+    uint64_t  ns[NUM_OPS];
+    uint64_t  count[NUM_OPS];
+} bench_result_t;
+
+/* Single producer, single consumer pointer queue for xthread */
+typedef struct {
+    void     *slots[RING_SIZE];
+    uint64_t  head __attribute__((aligned(64)));
+    uint64_t  tail __attribute__((aligned(64)));
+} ring_t;
+
+typedef struct {
+    int             id;
+    pthread_t       handle;
+    uint64_t        rng;
+    ring_t         *ring;
+    bench_result_t  res;
+} bench_thread_t;
+
+static const char *op_names[NUM_OPS] = {"malloc", "calloc", "realloc", "free"};
+
+static const char *workload = "pairs";
+static const char *dist = "small";
+static int         num_threads = 1;
+static long        num_ops = 1000000;
+static long        live_blocks = 1000;
+
+static pthread_barrier_t start_barrier;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t next_rand(uint64_t *x)
+{
+    /* xorshift64* */
+    *x ^= *x >> 12;
+    *x ^= *x << 25;
+    *x ^= *x >> 27;
+    return *x * 0x2545f4914f6cdd1dULL;
+}
+
+static inline size_t rand_between(uint64_t *rng, size_t lo, size_t hi)
+{
+    return lo + next_rand(rng) % (hi - lo + 1);
+}
+
+/* Sizes are drawn before the timed loops so the RNG is not measured */
+static void fill_sizes(uint64_t *rng, size_t *sizes, long count)
+{
+    long i;
+
+    for(i = 0; i < count; i++) {
+        if(strcmp(dist, "small") == 0) {
+            sizes[i] = rand_between(rng, 8, 128);
+        }
+        else if(strcmp(dist, "medium") == 0) {
+            sizes[i] = rand_between(rng, 129, 4096);
+        }
+        else if(strcmp(dist, "large") == 0) {
+            sizes[i] = rand_between(rng, 4097, 256 * 1024);
+        }
+        else {
+            /* mixed: 80% small, 15% medium, 5% large */
+            uint64_t r = next_rand(rng) % 100;
+
+            sizes[i] = r < 80 ? rand_between(rng, 8, 128) :
+                       r < 95 ? rand_between(rng, 129, 4096) :
+                                rand_between(rng, 4097, 256 * 1024);
+        }
+    }
+}
+
+static void* xmalloc_sizes(long count)
+{
+    void *mem = malloc(count * sizeof(size_t));
+
+    if(!mem) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return mem;
+}
+
+static inline void record(bench_result_t *res, bench_op_t op, uint64_t start, long count)
+{
+    res->ns[op] += now_ns() - start;
+    res->count[op] += count;
+}
+
+static void run_pairs(bench_thread_t *t)
+{
+    void     *ptrs[BATCH];
+    size_t    sizes[BATCH];
+    size_t    resize[BATCH];
+    uint64_t  start = 0;
+    long      done = 0;
+    int       i;
+
+    while(done < num_ops) {
+        fill_sizes(&t->rng, sizes, BATCH);
+        fill_sizes(&t->rng, resize, BATCH);
+
+        start = now_ns();
+        for(i = 0; i < BATCH; i++) {
+            ptrs[i] = malloc(sizes[i]);
+        }
+        record(&t->res, OP_MALLOC, start, BATCH);
+
+        start = now_ns();
+        for(i = 0; i < BATCH; i++) {
+            ptrs[i] = realloc(ptrs[i], resize[i]);
+        }
+        record(&t->res, OP_REALLOC, start, BATCH);
+
+        start = now_ns();
+        for(i = 0; i < BATCH; i++) {
+            free(ptrs[i]);
+        }
+        record(&t->res, OP_FREE, start, BATCH);
+
+        start = now_ns();
+        for(i = 0; i < BATCH; i++) {
+            ptrs[i] = calloc(1, sizes[i]);
+        }
+        record(&t->res, OP_CALLOC, start, BATCH);
+
+        start = now_ns();
+        for(i = 0; i < BATCH; i++) {
+            free(ptrs[i]);
+        }
+        record(&t->res, OP_FREE, start, BATCH);
+
+        done += 5 * BATCH;
+    }
+}
+
+/* Even ids produce into their ring, odd ids consume their partner's */
+static void run_xthread(bench_thread_t *t)
+{
+    ring_t   *ring = t->ring;
+    void     *ptrs[64];
+    size_t    sizes[64];
+    uint64_t  start = 0;
+    long      done = 0;
+    int       i;
+
+    while(done < num_ops) {
+        uint64_t pos = 0;
+
+        if(t->id % 2 == 0) {
+            fill_sizes(&t->rng, sizes, 64);
+            start = now_ns();
+            for(i = 0; i < 64; i++) {
+                ptrs[i] = malloc(sizes[i]);
+            }
+            record(&t->res, OP_MALLOC, start, 64);
+
+            pos = ring->head;
+            while(pos + 64 - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > RING_SIZE) {
+                sched_yield();
+            }
+            for(i = 0; i < 64; i++) {
+                ring->slots[(pos + i) % RING_SIZE] = ptrs[i];
+            }
+            __atomic_store_n(&ring->head, pos + 64, __ATOMIC_RELEASE);
+        }
+        else {
+            pos = ring->tail;
+            while(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - pos < 64) {
+                sched_yield();
+            }
+            for(i = 0; i < 64; i++) {
+                ptrs[i] = ring->slots[(pos + i) % RING_SIZE];
+            }
+            __atomic_store_n(&ring->tail, pos + 64, __ATOMIC_RELEASE);
+
+            start = now_ns();
+            for(i = 0; i < 64; i++) {
+                free(ptrs[i]);
+            }
+            record(&t->res, OP_FREE, start, 64);
+        }
+        done += 64;
+    }
+}
+
+static void run_liveset(bench_thread_t *t)
+{
+    long      count = live_blocks / num_threads;
+    void    **ptrs = malloc(count * sizeof(void*));
+    size_t   *sizes = xmalloc_sizes(count);
+    uint64_t  start = 0;
+    long      i;
+
+    if(!ptrs) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    fill_sizes(&t->rng, sizes, count);
+
+    start = now_ns();
+    for(i = 0; i < count; i++) {
+        ptrs[i] = malloc(sizes[i]);
+    }
+    record(&t->res, OP_MALLOC, start, count);
+
+    start = now_ns();
+    for(i = 0; i < count; i++) {
+        free(ptrs[i]);
+    }
+    record(&t->res, OP_FREE, start, count);
+
+    free(sizes);
+    free(ptrs);
+}
+
+static void* bench_thread(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t*)arg;
+
+    pthread_barrier_wait(&start_barrier);
+    if(strcmp(workload, "pairs") == 0) {
+        run_pairs(t);
+    }
+    else if(strcmp(workload, "xthread") == 0) {
+        run_xthread(t);
+    }
+    else {
+        run_liveset(t);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-w pairs|xthread|liveset] [-d small|medium|large|mixed]\n"
+                    "       [-t threads] [-n calls per thread] [-l live blocks] [-H]\n"
+                    "  -H  print the CSV header\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_thread_t  *threads = NULL;
+    ring_t          *rings = NULL;
+    bench_result_t   total;
+    int              opt;
+    int              i;
+
+    while((opt = getopt(argc, argv, "w:d:t:n:l:H")) != -1) {
+        switch(opt) {
+        case 'w':
+            workload = optarg;
+            break;
+        case 'd':
+            dist = optarg;
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'n':
+            num_ops = atol(optarg);
+            break;
+        case 'l':
+            live_blocks = atol(optarg);
+            break;
+        case 'H':
+            printf("workload,dist,threads,live,op,ops,ns_per_op\n");
+            return 0;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(num_threads < 1 ||
+       (strcmp(workload, "pairs") && strcmp(workload, "xthread") && strcmp(workload, "liveset")) ||
+       (strcmp(dist, "small") && strcmp(dist, "medium") && strcmp(dist, "large") &&
+        strcmp(dist, "mixed"))) {
+        usage(argv[0]);
+    }
+
+    /* xthread runs a producer and a consumer per requested thread */
+    if(strcmp(workload, "xthread") == 0) {
+        num_threads *= 2;
+        rings = calloc(num_threads / 2, sizeof(*rings));
+    }
+    threads = calloc(num_threads, sizeof(*threads));
+    if(!threads || (strcmp(workload, "xthread") == 0 && !rings)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, num_threads);
+    for(i = 0; i < num_threads; i++) {
+        threads[i].id = i;
+        threads[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        threads[i].ring = rings ? &rings[i / 2] : NULL;
+        if(pthread_create(&threads[i].handle, NULL, bench_thread, &threads[i]) != 0) {
+            fprintf(stderr, "could not start thread %d\n", i);
+            return 1;
+        }
+    }
+
+    memset(&total, 0, sizeof(total));
+    for(i = 0; i < num_threads; i++) {
+        int op;
+
+        pthread_join(threads[i].handle, NULL);
+        for(op = 0; op < NUM_OPS; op++) {
+            total.ns[op] += threads[i].res.ns[op];
+            total.count[op] += threads[i].res.count[op];
+        }
+    }
+
+    for(opt = 0; opt < NUM_OPS; opt++) {
+        if(total.count[opt] == 0) {
+            continue;
+        }
+        printf("%s,%s,%d,%ld,%s,%llu,%.1f\n", workload, dist,
+               strcmp(workload, "xthread") == 0 ? num_threads / 2 : num_threads,
+               strcmp(workload, "liveset") == 0 ? live_blocks : 0, op_names[opt],
+               (unsigned long long)total.count[opt],
+               (double)total.ns[opt] / total.count[opt]);
+    }
+
+    free(threads);
+    free(rings);
+    return 0;
+}
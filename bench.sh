@@ -0,0 +1,51 @@
+#!/bin/sh
+# Runs the bench workloads without a preload and with memprofiler.so in each
+# of its modes, and prints one CSV table on stdout:
+#   config,workload,dist,threads,live,op,ops,ns_per_op
+#
+# Environment:
+#   BENCH_THREADS   thread counts to run (default "1 2 4")
+#   BENCH_DISTS     size distributions (default "small medium large mixed")
+#   BENCH_OPS       calls per thread for pairs and xthread (default 1000000)
+#   BENCH_LIVE      live set sizes for liveset (default "1000 10000 100000 1000000 10000000")
+#   BENCH_CONFIGS   subset of the configs below (default all)
+
+cd "$(dirname "$0")" || exit 1
+
+THREADS=${BENCH_THREADS:-"1 2 4"}
+DISTS=${BENCH_DISTS:-"small medium large mixed"}
+OPS=${BENCH_OPS:-1000000}
+LIVE=${BENCH_LIVE:-"1000 10000 100000 1000000 10000000"}
+CONFIGS=${BENCH_CONFIGS:-"none table header sampled stacks trace"}
+TRACE_FILE=${TMPDIR:-/tmp}/memprof_bench.$$.trace
+
+# Runs ./bench under one config, prefixing each row with the config name
+run() {
+    config=$1
+    shift
+    case $config in
+    none)    env ./bench "$@" ;;
+    table)   env MEMPROF_INTERVAL=0 LD_PRELOAD=$PWD/memprofiler.so ./bench "$@" ;;
+    header)  env MEMPROF_INTERVAL=0 MEMPROF_MODE=header LD_PRELOAD=$PWD/memprofiler.so ./bench "$@" ;;
+    sampled) env MEMPROF_INTERVAL=0 MEMPROF_SAMPLE_INTERVAL=524288 LD_PRELOAD=$PWD/memprofiler.so ./bench "$@" ;;
+    stacks)  env MEMPROF_INTERVAL=0 MEMPROF_STACK_DEPTH=8 LD_PRELOAD=$PWD/memprofiler.so ./bench "$@" ;;
+    trace)   env MEMPROF_INTERVAL=0 MEMPROF_TRACE=$TRACE_FILE LD_PRELOAD=$PWD/memprofiler.so ./bench "$@"
+             rm -f "$TRACE_FILE" ;;
+    *)       echo "unknown config $config" >&2; return 1 ;;
+    esac 2>/dev/null | sed "s/^/$config,/"
+}
+
+printf "config,"
+./bench -H
+
+for config in $CONFIGS; do
+    for dist in $DISTS; do
+        for threads in $THREADS; do
+            run "$config" -w pairs -d "$dist" -t "$threads" -n "$OPS"
+            run "$config" -w xthread -d "$dist" -t "$threads" -n "$OPS"
+        done
+        for live in $LIVE; do
+            run "$config" -w liveset -d "$dist" -t 1 -l "$live"
+        done
+    done
+done
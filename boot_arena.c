@@ -0,0 +1,89 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "boot_arena.h"
+
+char *boot_arena_base = NULL;
+
+/* Offset of the first free byte */
+static size_t boot_used = 0;
+
+/* Maps the reservation on first use; a thread that loses the race drops
+ * its own mapping and takes the winner's */
+static char* boot_map(void)
+{
+    char *base = __atomic_load_n(&boot_arena_base, __ATOMIC_ACQUIRE);
+    char *expected = NULL;
+    void *mem = NULL;
+
+    if(base) {
+        return base;
+    }
+    mem = mmap(NULL, BOOT_ARENA_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED) {
+        return NULL;
+    }
+    if(!__atomic_compare_exchange_n(&boot_arena_base, &expected, (char*)mem, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(mem, BOOT_ARENA_SIZE);
+        return expected;
+    }
+    return (char*)mem;
+}
+
+/* Each block is preceded by its size, in the word right before it */
+void* boot_alloc(size_t size, size_t align)
+{
+    char   *base = boot_map();
+    size_t  used = 0;
+    size_t  start = 0;
+
+    if(!base) {
+        return NULL;
+    }
+    if(align < alignof(max_align_t)) {
+        align = alignof(max_align_t);
+    }
+
+    used = __atomic_load_n(&boot_used, __ATOMIC_RELAXED);
+    do {
+        start = (used + sizeof(size_t) + align - 1) & ~(align - 1);
+        if(start > BOOT_ARENA_SIZE || size > BOOT_ARENA_SIZE - start) {
+            return NULL;
+        }
+    } while(!__atomic_compare_exchange_n(&boot_used, &used, start + size, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    ((size_t*)(base + start))[-1] = size;
+    return base + start;
+}
+
+size_t boot_size(void *ptr)
+{
+    return ((size_t*)ptr)[-1];
+}
@@ -0,0 +1,56 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _BOOT_ARENA_
+#define _BOOT_ARENA_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Memory for the allocations made while the real allocator is still being
+ * looked up (dlsym itself calls calloc), by that thread or any other.
+ * A bump pointer in one mmap'd reservation, advanced with a CAS loop, so
+ * it takes no lock and any size fits until the reservation runs out.
+ * Blocks are zeroed and never reused; free() of one is a no-op, told
+ * apart from real blocks by address. */
+
+#define BOOT_ARENA_SIZE  (64 << 20)   /* reserved, pages are touched on use */
+
+extern char *boot_arena_base;
+
+/* align is a power of two, 0 for malloc alignment. NULL when out of room. */
+void*  boot_alloc(size_t size, size_t align);
+
+/* Size requested for a block of the arena */
+size_t boot_size(void *ptr);
+
+static inline bool boot_owns(void *ptr)
+{
+    char *base = __atomic_load_n(&boot_arena_base, __ATOMIC_RELAXED);
+
+    return base && (uintptr_t)ptr - (uintptr_t)base < BOOT_ARENA_SIZE;
+}
+
+#endif /* _BOOT_ARENA_ */
@@ -0,0 +1,308 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "control.h"
+
+/* Per-connection I/O timeout, so a stuck client cannot hold the channel */
+#define CONTROL_TIMEOUT_SEC  5
+
+/* Kept free at the end of the reply for this line */
+#define CONTROL_TRUNCATED    "truncated 1\n"
+
+struct control_reply {
+    char    status[CONTROL_LINE_MAX];   /* empty means ok */
+    size_t  len;
+    bool    truncated;
+    char    buf[CONTROL_REPLY_SIZE];
+};
+
+static const control_cmd_t  *control_cmds = NULL;
+static void                (*control_thread_init)(void) = NULL;
+static char                  control_dir[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static char                  control_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static pid_t                 control_pid = 0;
+static int                   control_fd = -1;
+
+/* Only the control thread uses these */
+static control_reply_t  curr_reply;
+static char             curr_request[CONTROL_LINE_MAX];
+
+void control_printf(control_reply_t *reply, const char *format, ...)
+{
+    va_list  args;
+    size_t   room = sizeof(reply->buf) - sizeof(CONTROL_TRUNCATED) - reply->len;
+    int      len = 0;
+
+    if(reply->truncated) {
+        return;
+    }
+    va_start(args, format);
+    len = vsnprintf(reply->buf + reply->len, room, format, args);
+    va_end(args);
+
+    if(len < 0 || (size_t)len >= room) {
+        reply->truncated = true;
+        return;
+    }
+    reply->len += len;
+}
+
+int control_error(control_reply_t *reply, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(reply->status, sizeof(reply->status), format, args);
+    va_end(args);
+    if(reply->status[0] == '\0') {
+        strcpy(reply->status, "failed");
+    }
+    return -1;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while(len > 0) {
+        ssize_t ret = write(fd, data, len);
+
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret <= 0) {
+            return -1;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void cmd_help(control_reply_t *reply)
+{
+    const control_cmd_t *cmd = NULL;
+
+    for(cmd = control_cmds; cmd->name; cmd++) {
+        control_printf(reply, "command %s%s%s\n", cmd->name,
+                       cmd->usage ? " " : "", cmd->usage ? cmd->usage : "");
+    }
+    control_printf(reply, "command help\n");
+}
+
+static int dispatch(int fd, char *line)
+{
+    const control_cmd_t *cmd = NULL;
+    char                *args = line + strcspn(line, " \t");
+    char                 status[CONTROL_LINE_MAX + 16];
+
+    if(*args) {
+        *args++ = '\0';
+        args += strspn(args, " \t");
+    }
+
+    memset(curr_reply.status, 0, sizeof(curr_reply.status));
+    curr_reply.len = 0;
+    curr_reply.truncated = false;
+
+    if(strcmp(line, "help") == 0) {
+        cmd_help(&curr_reply);
+    }
+    else {
+        for(cmd = control_cmds; cmd->name; cmd++) {
+            if(strcmp(line, cmd->name) == 0) {
+                cmd->handler(&curr_reply, args);
+                break;
+            }
+        }
+        if(!cmd->name) {
+            control_error(&curr_reply, "unknown command %.64s, try help", line);
+        }
+    }
+    if(curr_reply.truncated) {
+        memcpy(curr_reply.buf + curr_reply.len, CONTROL_TRUNCATED, sizeof(CONTROL_TRUNCATED) - 1);
+        curr_reply.len += sizeof(CONTROL_TRUNCATED) - 1;
+    }
+
+    if(curr_reply.status[0]) {
+        snprintf(status, sizeof(status), "error %s\n", curr_reply.status);
+        curr_reply.len = 0;
+    }
+    else {
+        strcpy(status, "ok\n");
+    }
+    if(write_all(fd, status, strlen(status)) != 0 ||
+       write_all(fd, curr_reply.buf, curr_reply.len) != 0 ||
+       write_all(fd, ".\n", 2) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads request lines until the client hangs up */
+static void serve(int fd)
+{
+    size_t len = 0;
+
+    for(;;) {
+        char    *end = NULL;
+        ssize_t  ret = 0;
+
+        while((end = memchr(curr_request, '\n', len)) != NULL) {
+            size_t line_len = end - curr_request;
+
+            *end = '\0';
+            if(line_len > 0 && curr_request[line_len - 1] == '\r') {
+                curr_request[line_len - 1] = '\0';
+            }
+            if(curr_request[0] && dispatch(fd, curr_request) != 0) {
+                return;
+            }
+            len -= line_len + 1;
+            memmove(curr_request, end + 1, len);
+        }
+        if(len == sizeof(curr_request)) {
+            return;   /* line too long */
+        }
+
+        ret = read(fd, curr_request + len, sizeof(curr_request) - len);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret <= 0) {
+            return;
+        }
+        len += ret;
+    }
+}
+
+static void* control_main(void *arg)
+{
+    int listen_fd = (int)(long)arg;
+
+    if(control_thread_init) {
+        control_thread_init();
+    }
+
+    for(;;) {
+        struct timeval  timeout = {CONTROL_TIMEOUT_SEC, 0};
+        int             fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;   /* shut down by control_stop() */
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int control_listen(void)
+{
+    struct sockaddr_un  addr;
+    pthread_t           tid;
+    pthread_attr_t      attr;
+    int                 fd = -1;
+    int                 len = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/memprof.%d.sock",
+                   control_dir, (int)getpid());
+    if(len < 0 || (size_t)len >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    /* A leftover of an earlier process with the same pid */
+    unlink(addr.sun_path);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&tid, &attr, control_main, (void*)(long)fd) != 0) {
+        pthread_attr_destroy(&attr);
+        unlink(addr.sun_path);
+        close(fd);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    memcpy(control_path, addr.sun_path, sizeof(control_path));
+    control_pid = getpid();
+    control_fd = fd;
+    return 0;
+}
+
+int control_start(const char *dir, const control_cmd_t *cmds,
+                  void (*thread_init)(void))
+{
+    if(strlen(dir) >= sizeof(control_dir)) {
+        return -1;
+    }
+    strcpy(control_dir, dir);
+    control_cmds = cmds;
+    control_thread_init = thread_init;
+    return control_listen();
+}
+
+void control_stop(void)
+{
+    if(control_fd < 0 || control_pid != getpid()) {
+        return;
+    }
+    unlink(control_path);
+    shutdown(control_fd, SHUT_RDWR);
+}
+
+void control_fork_child(void)
+{
+    if(control_fd < 0) {
+        return;
+    }
+    /* The parent's socket file stays, it is still the parent's */
+    close(control_fd);
+    control_fd = -1;
+    control_listen();
+}
@@ -0,0 +1,72 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _CONTROL_
+#define _CONTROL_
+
+#include <stdbool.h>
+
+/* Control channel (MEMPROF_CONTROL=dir).
+ * A thread of its own listens on the Unix socket dir/memprof.<pid>.sock
+ * and serves one connection at a time, so allocating threads never wait
+ * for it. A request is one line, "command [args]". The reply is a status
+ * line, "ok" or "error <reason>", then the result as "key value" lines,
+ * then a line holding a single ".". Nothing here calls malloc. */
+
+#define CONTROL_LINE_MAX    512
+#define CONTROL_REPLY_SIZE  (64 * 1024)
+
+typedef struct control_reply control_reply_t;
+
+/* args is the rest of the request line, "" if none. Returns 0, or the
+ * result of control_error(). */
+typedef int (*control_handler_t)(control_reply_t *reply, char *args);
+
+typedef struct {
+    const char        *name;
+    control_handler_t  handler;
+    const char        *usage;
+} control_cmd_t;
+
+/* cmds ends with a NULL name. thread_init runs first thing on the
+ * control thread. Returns 0 on success, -1 on error. */
+int  control_start(const char *dir, const control_cmd_t *cmds,
+                   void (*thread_init)(void));
+
+/* Appends a line of the result; results longer than CONTROL_REPLY_SIZE
+ * are cut short and marked with a "truncated 1" line */
+void control_printf(control_reply_t *reply, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Fails the request with the given reason, returns -1 */
+int  control_error(control_reply_t *reply, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Removes the socket; the thread ends with the process */
+void control_stop(void);
+
+/* The child of fork() listens on a socket of its own */
+void control_fork_child(void);
+
+#endif /* _CONTROL_ */
@@ -0,0 +1,409 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "hash_table.h"
+
+/* Marks a slot of the draining array whose entry was deleted or moved.
+ * The live array uses backward-shift deletion and never holds tombstones. */
+#define HASH_TOMBSTONE ((void*)1)
+
+/* Keep the load factor under 70% */
+#define HASH_NEEDS_GROW(count, capacity) ((count) * 10 >= (capacity) * 7)
+
+static inline uint64_t hash_ptr(void *key)
+{
+    /* MurmurHash3 64-bit finalizer */
+    uint64_t h = (uint64_t)(uintptr_t)key;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline hash_shard_t* get_shard(hash_table_t *table, uint64_t h)
+{
+    return &table->shards[h >> (64 - HASH_SHARD_BITS)];
+}
+
+static int array_alloc(hash_table_t *table, hash_array_t *arr, size_t capacity)
+{
+    size_t  len = capacity * sizeof(hash_entry_t);
+    void   *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(mem == MAP_FAILED) {
+        return -1;
+    }
+
+    arr->slots    = (hash_entry_t*)mem;
+    arr->capacity = capacity;
+    arr->count    = 0;
+    __atomic_add_fetch(&table->mapped_bytes, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void array_release(hash_table_t *table, hash_array_t *arr)
+{
+    size_t len = arr->capacity * sizeof(hash_entry_t);
+
+    munmap(arr->slots, len);
+    __atomic_sub_fetch(&table->mapped_bytes, len, __ATOMIC_RELAXED);
+    memset(arr, 0, sizeof(*arr));
+}
+
+/* Returns the slot holding key, or NULL. Skips tombstones so it is also
+ * valid for the draining array. */
+static hash_entry_t* array_lookup(hash_array_t *arr, uint64_t h, void *key)
+{
+    size_t mask = arr->capacity - 1;
+    size_t i;
+
+    if(!arr->slots) {
+        return NULL;
+    }
+
+    for(i = h & mask; arr->slots[i].key != NULL; i = (i + 1) & mask) {
+        if(arr->slots[i].key == key) {
+            return &arr->slots[i];
+        }
+    }
+    return NULL;
+}
+
+/* Caller guarantees there is a free slot and key is not present */
+static void array_put(hash_array_t *arr, uint64_t h, void *key, void *val)
+{
+    size_t mask = arr->capacity - 1;
+    size_t i = h & mask;
+
+    while(arr->slots[i].key != NULL) {
+        i = (i + 1) & mask;
+    }
+    arr->slots[i].key = key;
+    arr->slots[i].val = val;
+    arr->count++;
+}
+
+/* Backward-shift deletion: pull later entries of the probe run into the
+ * hole so lookups never need tombstones in the live array */
+static void array_erase(hash_array_t *arr, hash_entry_t *slot)
+{
+    size_t mask = arr->capacity - 1;
+    size_t hole = slot - arr->slots;
+    size_t i = hole;
+
+    for(;;) {
+        size_t home;
+
+        i = (i + 1) & mask;
+        if(arr->slots[i].key == NULL) {
+            break;
+        }
+
+        home = hash_ptr(arr->slots[i].key) & mask;
+        if((hole <= i) ? (hole < home && home <= i)
+                       : (hole < home || home <= i)) {
+            continue;
+        }
+        arr->slots[hole] = arr->slots[i];
+        hole = i;
+    }
+
+    arr->slots[hole].key = NULL;
+    arr->slots[hole].val = NULL;
+    arr->count--;
+}
+
+static void shard_migrate(hash_table_t *table, hash_shard_t *shard, size_t nslots)
+{
+    hash_array_t *prev = &shard->prev;
+
+    if(!prev->slots) {
+        return;
+    }
+
+    while(nslots-- > 0 && shard->migrate_pos < prev->capacity) {
+        hash_entry_t *e = &prev->slots[shard->migrate_pos++];
+
+        if(e->key != NULL && e->key != HASH_TOMBSTONE) {
+            array_put(&shard->curr, hash_ptr(e->key), e->key, e->val);
+            e->key = HASH_TOMBSTONE;
+            prev->count--;
+        }
+    }
+
+    if(shard->migrate_pos == prev->capacity || prev->count == 0) {
+        array_release(table, prev);
+        shard->migrate_pos = 0;
+    }
+}
+
+static int shard_grow(hash_table_t *table, hash_shard_t *shard)
+{
+    hash_array_t next;
+    size_t       capacity = HASH_INIT_CAPACITY;
+
+    /* Only one array may be draining at a time */
+    shard_migrate(table, shard, (size_t)-1);
+
+    if(shard->curr.slots) {
+        capacity = shard->curr.capacity * 2;
+    }
+    if(array_alloc(table, &next, capacity) != 0) {
+        return -1;
+    }
+
+    if(shard->curr.slots) {
+        shard->prev = shard->curr;
+        shard->migrate_pos = 0;
+    }
+    shard->curr = next;
+    return 0;
+}
+
+/* Caller holds the shard lock. Runs replaced, if given, on the value key
+ * mapped to before, still under the lock. */
+static int shard_insert(hash_table_t *table, hash_shard_t *shard, uint64_t h,
+                        void *key, void *val, hash_visit_t replaced, void *arg)
+{
+    hash_entry_t *slot = NULL;
+
+    /* Replace an existing mapping in place */
+    slot = array_lookup(&shard->curr, h, key);
+    if(slot) {
+        if(replaced) {
+            replaced(key, slot->val, arg);
+        }
+        slot->val = val;
+        return 0;
+    }
+    slot = array_lookup(&shard->prev, h, key);
+    if(slot) {
+        if(replaced) {
+            replaced(key, slot->val, arg);
+        }
+        slot->key = HASH_TOMBSTONE;
+        shard->prev.count--;
+    }
+
+    if(!shard->curr.slots ||
+       HASH_NEEDS_GROW(shard->curr.count + shard->prev.count + 1,
+                       shard->curr.capacity)) {
+        if(shard_grow(table, shard) != 0) {
+            return -1;
+        }
+    }
+    array_put(&shard->curr, h, key, val);
+    return 0;
+}
+
+/* Caller holds the shard lock */
+static int shard_delete_val(hash_shard_t *shard, uint64_t h, void *key, void *val)
+{
+    hash_entry_t *slot = NULL;
+
+    slot = array_lookup(&shard->curr, h, key);
+    if(slot && slot->val == val) {
+        array_erase(&shard->curr, slot);
+        return 0;
+    }
+    else if(!slot) {
+        slot = array_lookup(&shard->prev, h, key);
+        if(slot && slot->val == val) {
+            slot->key = HASH_TOMBSTONE;
+            shard->prev.count--;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* replaced, if given, is run on the value a replaced mapping had, under
+ * the shard lock, so it sees the value as it was when it left the table */
+int hash_insert(hash_table_t *table, void *key, void *val, hash_visit_t replaced, void *arg)
+{
+    uint64_t      h = hash_ptr(key);
+    hash_shard_t *shard = get_shard(table, h);
+    int           ret = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    shard_migrate(table, shard, HASH_MIGRATE_STEP);
+    ret = shard_insert(table, shard, h, key, val, replaced, arg);
+    pthread_mutex_unlock(&shard->lock);
+    return ret;
+}
+
+void* hash_delete(hash_table_t *table, void *key)
+{
+    uint64_t      h = hash_ptr(key);
+    hash_shard_t *shard = get_shard(table, h);
+    hash_entry_t *slot = NULL;
+    void         *val = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    shard_migrate(table, shard, HASH_MIGRATE_STEP);
+
+    slot = array_lookup(&shard->curr, h, key);
+    if(slot) {
+        val = slot->val;
+        array_erase(&shard->curr, slot);
+    }
+    else {
+        slot = array_lookup(&shard->prev, h, key);
+        if(slot) {
+            val = slot->val;
+            slot->key = HASH_TOMBSTONE;
+            shard->prev.count--;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return val;
+}
+
+/* Deletes key only while it still maps to val. Returns 0 if it did. */
+int hash_delete_val(hash_table_t *table, void *key, void *val)
+{
+    uint64_t      h = hash_ptr(key);
+    hash_shard_t *shard = get_shard(table, h);
+    int           ret = -1;
+
+    pthread_mutex_lock(&shard->lock);
+    shard_migrate(table, shard, HASH_MIGRATE_STEP);
+    ret = shard_delete_val(shard, h, key, val);
+    pthread_mutex_unlock(&shard->lock);
+    return ret;
+}
+
+/* Re-keys val from old_key to new_key under both shard locks, taken in
+ * shard order, so no lookup finds it under neither key. old_key is only
+ * deleted while it still maps to val. replaced is run like in hash_insert
+ * on a replaced mapping of new_key. Returns -1 if the insert failed, the
+ * old mapping is gone anyway. */
+int hash_move(hash_table_t *table, void *old_key, void *new_key, void *val,
+              hash_visit_t replaced, void *arg)
+{
+    uint64_t      old_h = hash_ptr(old_key);
+    uint64_t      new_h = hash_ptr(new_key);
+    hash_shard_t *old_shard = get_shard(table, old_h);
+    hash_shard_t *new_shard = get_shard(table, new_h);
+    hash_shard_t *first = old_shard < new_shard ? old_shard : new_shard;
+    hash_shard_t *second = old_shard < new_shard ? new_shard : old_shard;
+    int           ret = 0;
+
+    pthread_mutex_lock(&first->lock);
+    if(second != first) {
+        pthread_mutex_lock(&second->lock);
+    }
+    shard_migrate(table, old_shard, HASH_MIGRATE_STEP);
+    if(new_shard != old_shard) {
+        shard_migrate(table, new_shard, HASH_MIGRATE_STEP);
+    }
+
+    shard_delete_val(old_shard, old_h, old_key, val);
+    ret = shard_insert(table, new_shard, new_h, new_key, val, replaced, arg);
+
+    if(second != first) {
+        pthread_mutex_unlock(&second->lock);
+    }
+    pthread_mutex_unlock(&first->lock);
+    return ret;
+}
+
+void* hash_find(hash_table_t *table, void *key)
+{
+    uint64_t      h = hash_ptr(key);
+    hash_shard_t *shard = get_shard(table, h);
+    hash_entry_t *slot = NULL;
+    void         *val = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    slot = array_lookup(&shard->curr, h, key);
+    if(!slot) {
+        slot = array_lookup(&shard->prev, h, key);
+    }
+    if(slot) {
+        val = slot->val;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return val;
+}
+
+/* hash_find that also runs visit on the entry, under the shard lock, so
+ * nothing in hash_foreach sees the entry between the two */
+void* hash_find_visit(hash_table_t *table, void *key, hash_visit_t visit, void *arg)
+{
+    uint64_t      h = hash_ptr(key);
+    hash_shard_t *shard = get_shard(table, h);
+    hash_entry_t *slot = NULL;
+    void         *val = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    slot = array_lookup(&shard->curr, h, key);
+    if(!slot) {
+        slot = array_lookup(&shard->prev, h, key);
+    }
+    if(slot) {
+        val = slot->val;
+        visit(key, val, arg);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return val;
+}
+
+/* Visits every entry, holding one shard lock at a time */
+void hash_foreach(hash_table_t *table, hash_visit_t visit, void *arg)
+{
+    int i;
+
+    for(i = 0; i < HASH_NUM_SHARDS; i++) {
+        hash_shard_t *shard = &table->shards[i];
+        hash_array_t *arrs[2] = {&shard->curr, &shard->prev};
+        int           a;
+
+        pthread_mutex_lock(&shard->lock);
+        for(a = 0; a < 2; a++) {
+            size_t j;
+
+            for(j = 0; arrs[a]->slots && j < arrs[a]->capacity; j++) {
+                hash_entry_t *e = &arrs[a]->slots[j];
+                if(e->key != NULL && e->key != HASH_TOMBSTONE) {
+                    visit(e->key, e->val, arg);
+                }
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+size_t hash_mem_usage(hash_table_t *table)
+{
+    return __atomic_load_n(&table->mapped_bytes, __ATOMIC_RELAXED);
+}
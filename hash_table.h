@@ -0,0 +1,81 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _HASH_TABLE_
+#define _HASH_TABLE_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Pointer keyed hash table, split into independently locked shards.
+ * Each shard is an open-addressing (linear probing) array. When a shard
+ * grows, the old array is kept around and drained a few slots at a time
+ * by subsequent operations on that shard, so no single call pays for a
+ * full rehash. Slot arrays are mmap'd directly and never go through malloc. */
+
+#define HASH_SHARD_BITS     6
+#define HASH_NUM_SHARDS     (1 << HASH_SHARD_BITS)
+#define HASH_INIT_CAPACITY  256   /* slots per shard, power of 2 */
+#define HASH_MIGRATE_STEP   16    /* old slots moved per operation */
+
+typedef struct {
+    void *key;
+    void *val;
+} hash_entry_t;
+
+typedef struct {
+    hash_entry_t *slots;
+    size_t        capacity;
+    size_t        count;
+} hash_array_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    hash_array_t    curr;
+    hash_array_t    prev;        /* array being drained, if resizing */
+    size_t          migrate_pos;
+} __attribute__((aligned(64))) hash_shard_t;
+
+typedef struct {
+    hash_shard_t shards[HASH_NUM_SHARDS];
+    size_t       mapped_bytes;
+} hash_table_t;
+
+#define HASH_TABLE_INITIALIZER                                  \
+    { .shards = { [0 ... HASH_NUM_SHARDS - 1] =                 \
+                  { .lock = PTHREAD_MUTEX_INITIALIZER } } }
+
+typedef void (*hash_visit_t)(void *key, void *val, void *arg);
+
+int    hash_insert(hash_table_t *table, void *key, void *val, hash_visit_t replaced, void *arg);
+void*  hash_delete(hash_table_t *table, void *key);
+int    hash_delete_val(hash_table_t *table, void *key, void *val);
+int    hash_move(hash_table_t *table, void *old_key, void *new_key, void *val,
+                 hash_visit_t replaced, void *arg);
+void*  hash_find(hash_table_t *table, void *key);
+void*  hash_find_visit(hash_table_t *table, void *key, hash_visit_t visit, void *arg);
+void   hash_foreach(hash_table_t *table, hash_visit_t visit, void *arg);
+size_t hash_mem_usage(hash_table_t *table);
+
+#endif /* _HASH_TABLE_ */
@@ -0,0 +1,109 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "heap_stats.h"
+
+/* Reads a small /proc file whole. Returns its length or -1. */
+static ssize_t read_proc(const char *path, char *buf, size_t len)
+{
+    int     fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t got = 0;
+    ssize_t ret = 0;
+
+    if(fd < 0) {
+        return -1;
+    }
+    while((size_t)got < len - 1 && (ret = read(fd, buf + got, len - 1 - got)) > 0) {
+        got += ret;
+    }
+    close(fd);
+    if(ret < 0) {
+        return -1;
+    }
+    buf[got] = '\0';
+    return got;
+}
+
+/* Value of a "Name:   123 kB" line of smaps_rollup in bytes, -1 if absent */
+static int64_t rollup_field(const char *buf, const char *name)
+{
+    size_t      len = strlen(name);
+    const char *line = buf;
+
+    while(line && *line) {
+        if(strncmp(line, name, len) == 0 && line[len] == ':') {
+            return strtoll(line + len + 1, NULL, 10) * 1024;
+        }
+        line = strchr(line, '\n');
+        line = line ? line + 1 : NULL;
+    }
+    return -1;
+}
+
+static void read_mallinfo(heap_stats_t *out)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+#else
+    /* int fields, which wrap past 2GB */
+    struct mallinfo mi = mallinfo();
+#endif
+
+    out->heap_mmap = mi.hblkhd;
+    out->heap_total = (int64_t)mi.arena + mi.hblkhd;
+    out->heap_used = (int64_t)mi.uordblks + mi.hblkhd;
+    out->heap_free = mi.fordblks;
+    out->heap_top = mi.keepcost;
+}
+
+int heap_stats_read(heap_stats_t *out)
+{
+    char  buf[4096];
+    char *end = NULL;
+    long  resident = 0;
+
+    memset(out, 0, sizeof(*out));
+    read_mallinfo(out);
+
+    out->anon = -1;
+    out->swap = -1;
+    if(read_proc("/proc/self/smaps_rollup", buf, sizeof(buf)) > 0) {
+        out->anon = rollup_field(buf, "Anonymous");
+        out->swap = rollup_field(buf, "Swap");
+    }
+
+    if(read_proc("/proc/self/statm", buf, sizeof(buf)) <= 0) {
+        return -1;
+    }
+    /* size resident shared text lib data dt, in pages */
+    strtol(buf, &end, 10);
+    resident = strtol(end, NULL, 10);
+    out->rss = (int64_t)resident * sysconf(_SC_PAGESIZE);
+    return 0;
+}
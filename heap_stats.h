@@ -0,0 +1,71 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _HEAP_STATS_
+#define _HEAP_STATS_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "size_hist.h"
+
+/* What the allocator and the kernel hold beyond the requested bytes.
+ * heap_stats_read() takes the allocator's view from mallinfo2() and the
+ * kernel's from /proc/self/statm and /proc/self/smaps_rollup, read with
+ * plain open/read into stack buffers. Nothing here calls malloc. */
+
+typedef struct {
+    int64_t  heap_total;   /* from the system: main and other arenas plus mmap'd chunks */
+    int64_t  heap_used;    /* in use, allocator metadata and untracked blocks included */
+    int64_t  heap_free;    /* free chunks kept in the arenas */
+    int64_t  heap_top;     /* of which releasable at the top of the main arena */
+    int64_t  heap_mmap;    /* chunks served by mmap directly */
+    int64_t  rss;          /* resident set */
+    int64_t  anon;         /* anonymous resident memory, -1 without smaps_rollup */
+    int64_t  swap;         /* swapped out, -1 without smaps_rollup */
+} heap_stats_t;
+
+/* Requested against usable bytes of the live set, by requested size */
+typedef struct {
+    int64_t  count[SIZE_HIST_BUCKETS];
+    int64_t  requested[SIZE_HIST_BUCKETS];
+    int64_t  usable[SIZE_HIST_BUCKETS];
+    int64_t  skipped;      /* blocks caught in a realloc */
+} heap_frag_t;
+
+/* One block of the live set; it stands for weight bytes per byte, and
+ * for num blocks as counted in the live set */
+static inline void heap_frag_add(heap_frag_t *frag, size_t requested, size_t usable,
+                                 double weight, int64_t num)
+{
+    int i = size_hist_index(requested);
+
+    frag->count[i] += num;
+    frag->requested[i] += (int64_t)(weight * requested + 0.5);
+    frag->usable[i] += (int64_t)(weight * usable + 0.5);
+}
+
+/* Returns 0, or -1 if /proc/self/statm could not be read */
+int heap_stats_read(heap_stats_t *out);
+
+#endif /* _HEAP_STATS_ */
@@ -0,0 +1,899 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "leak_check.h"
+
+#define LEAK_BATCH_BYTES    (64 * 1024)   /* read by one process_vm_readv() */
+#define LEAK_BATCH_IOVS     256
+#define LEAK_ROOT_CHUNK     (256 * 1024)  /* roots are handed out in pieces */
+#define LEAK_TCB_SIZE       4096          /* scanned from pthread_self() */
+#define LEAK_STATIC_TLS_MAX (1 << 20)     /* static TLS sits this close to it */
+#define LEAK_MAX_SEGMENTS   1024
+#define LEAK_MAX_TLS        64
+#define LEAK_PER_WORKER     4096          /* blocks per extra worker thread */
+#define LEAK_NO_SELF        UINT32_MAX
+
+typedef struct {
+    uintptr_t  start;
+    uintptr_t  end;
+} leak_range_t;
+
+/* A pending read: len bytes at addr, found in block self */
+typedef struct {
+    uintptr_t  addr;
+    size_t     len;
+    uint32_t   self;
+} leak_read_t;
+
+typedef struct {
+    pthread_mutex_t  lock;
+    uint32_t        *stack;      /* reachable blocks not scanned yet */
+    size_t           num;
+    pthread_t        thread;
+    bool             started;
+    int              num_reads;
+    size_t           batch_len;
+    leak_read_t      reads[LEAK_BATCH_IOVS];
+    struct iovec     local[LEAK_BATCH_IOVS];
+    struct iovec     remote[LEAK_BATCH_IOVS];
+    uintptr_t        buf[LEAK_BATCH_BYTES / sizeof(uintptr_t)];
+} __attribute__((aligned(64))) leak_worker_t;
+
+typedef struct {
+    leak_block_t    *blocks;
+    size_t           num;
+    uintptr_t        lo;          /* no block outside [lo, hi) */
+    uintptr_t        hi;
+    pid_t            pid;
+    leak_range_t    *roots;       /* in pieces of at most LEAK_ROOT_CHUNK */
+    size_t           num_roots;
+    size_t           next_root;
+    size_t           pending;     /* roots and pushed blocks not scanned yet */
+    uint32_t        *unreached;
+    size_t           num_unreached;
+    size_t           next_unreached;
+    uint32_t         mark;        /* given to blocks found: REACHABLE or INDIRECT */
+    leak_worker_t   *workers;
+    int              num_workers;
+    void           (*phase)(leak_worker_t *w);
+    void           (*thread_init)(void);
+    const pid_t     *tids;
+    int              num_threads;
+    mcontext_t      *regs;        /* per thread, filled by spill_regs() */
+    int              acks;        /* handlers that filled their regs */
+    int              busy;        /* handlers running */
+    int              accepting;   /* regs may still be written */
+    struct sigaction old_sa;      /* the application's LEAK_SIGNAL action */
+} leak_ctx_t;
+
+typedef struct {
+    leak_range_t    *ranges;
+    size_t           num;
+    size_t           max;
+    uintptr_t        self;        /* pthread_self() of the caller */
+    leak_range_t     tls[LEAK_MAX_TLS];   /* static TLS, as offsets from self */
+    int              num_tls;
+} leak_roots_t;
+
+/* One check at a time, they share the globals below */
+static pthread_mutex_t leak_lock = PTHREAD_MUTEX_INITIALIZER;
+static leak_ctx_t      ctx;
+static size_t          radix_count[1 << 16];
+static bool            use_vm_readv = true;
+
+static void* map_anon(size_t len)
+{
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+static double elapsed_secs(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* LSD radix sort by address, 16 bits per pass. Blocks are at least 16
+ * byte aligned, so the low 4 bits are skipped. */
+static int sort_blocks(leak_block_t *blocks, size_t num)
+{
+    leak_block_t *tmp = NULL;
+    leak_block_t *src = blocks;
+    leak_block_t *dst = NULL;
+    uintptr_t     max = 0;
+    size_t        i;
+    int           shift;
+
+    for(i = 0; i < num; i++) {
+        if(blocks[i].addr > max) {
+            max = blocks[i].addr;
+        }
+    }
+    tmp = map_anon(num * sizeof(leak_block_t));
+    if(!tmp) {
+        return -1;
+    }
+    dst = tmp;
+
+    for(shift = 4; shift < 64 && (max >> shift) != 0; shift += 16) {
+        leak_block_t *swap = NULL;
+        size_t        pos = 0;
+
+        memset(radix_count, 0, sizeof(radix_count));
+        for(i = 0; i < num; i++) {
+            radix_count[(src[i].addr >> shift) & 0xffff]++;
+        }
+        for(i = 0; i < (1 << 16); i++) {
+            size_t n = radix_count[i];
+            radix_count[i] = pos;
+            pos += n;
+        }
+        for(i = 0; i < num; i++) {
+            dst[radix_count[(src[i].addr >> shift) & 0xffff]++] = src[i];
+        }
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if(src != blocks) {
+        memcpy(blocks, src, num * sizeof(leak_block_t));
+    }
+    munmap(tmp, num * sizeof(leak_block_t));
+    return 0;
+}
+
+/* Index of the block holding p, or -1 */
+static inline int64_t find_block(uintptr_t p)
+{
+    leak_block_t *b = NULL;
+    size_t        lo = 0;
+    size_t        hi = ctx.num;
+
+    while(hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if(ctx.blocks[mid].addr <= p) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    b = &ctx.blocks[lo];
+    if(p >= b->addr && p < b->addr + (b->size ? b->size : 1)) {
+        return lo;
+    }
+    return -1;
+}
+
+static void push_block(leak_worker_t *w, uint32_t idx)
+{
+    __atomic_add_fetch(&ctx.pending, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&w->lock);
+    w->stack[w->num++] = idx;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Takes up to LEAK_BATCH_IOVS blocks to scan, from our own stack or else
+ * half of another worker's */
+static int take_blocks(leak_worker_t *w, uint32_t *out)
+{
+    int i;
+
+    for(i = 0; i < ctx.num_workers; i++) {
+        leak_worker_t *v = &ctx.workers[(w - ctx.workers + i) % ctx.num_workers];
+        size_t         n = 0;
+
+        if(__atomic_load_n(&v->num, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        pthread_mutex_lock(&v->lock);
+        n = (v == w) ? v->num : (v->num + 1) / 2;
+        if(n > LEAK_BATCH_IOVS) {
+            n = LEAK_BATCH_IOVS;
+        }
+        v->num -= n;
+        memcpy(out, &v->stack[v->num], n * sizeof(uint32_t));
+        pthread_mutex_unlock(&v->lock);
+        if(n > 0) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+static void scan_words(leak_worker_t *w, const uintptr_t *words, size_t num, uint32_t self)
+{
+    size_t i;
+
+    for(i = 0; i < num; i++) {
+        uintptr_t  p = words[i];
+        int64_t    idx = 0;
+        uint32_t   unvisited = LEAK_UNVISITED;
+
+        if(p < ctx.lo || p >= ctx.hi) {
+            continue;
+        }
+        idx = find_block(p);
+        if(idx < 0 || idx == self ||
+           __atomic_load_n(&ctx.blocks[idx].state, __ATOMIC_RELAXED) != LEAK_UNVISITED) {
+            continue;
+        }
+        if(__atomic_compare_exchange_n(&ctx.blocks[idx].state, &unvisited, ctx.mark, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+           ctx.mark == LEAK_REACHABLE) {
+            push_block(w, idx);
+        }
+    }
+}
+
+/* Reads and scans the batch. A read that runs into an unmapped page keeps
+ * what came before it and the rest of the batch is read again. */
+static void flush_reads(leak_worker_t *w)
+{
+    int n = w->num_reads;
+    int done = 0;
+
+    while(done < n) {
+        ssize_t got = -1;
+        int     i;
+
+        if(__atomic_load_n(&use_vm_readv, __ATOMIC_RELAXED)) {
+            got = process_vm_readv(ctx.pid, &w->local[done], n - done,
+                                   &w->remote[done], n - done, 0);
+            if(got < 0 && (errno == ENOSYS || errno == EPERM)) {
+                __atomic_store_n(&use_vm_readv, false, __ATOMIC_RELAXED);
+            }
+        }
+        if(!__atomic_load_n(&use_vm_readv, __ATOMIC_RELAXED)) {
+            /* Blocked by seccomp or the like, read in place */
+            for(i = done; i < n; i++) {
+                scan_words(w, (const uintptr_t*)w->reads[i].addr,
+                           w->reads[i].len / sizeof(uintptr_t), w->reads[i].self);
+            }
+            break;
+        }
+        if(got < 0) {
+            got = 0;
+        }
+
+        for(i = done; i < n && (size_t)got >= w->reads[i].len; i++) {
+            scan_words(w, w->local[i].iov_base, w->reads[i].len / sizeof(uintptr_t),
+                       w->reads[i].self);
+            got -= w->reads[i].len;
+        }
+        if(i < n) {
+            scan_words(w, w->local[i].iov_base, got / sizeof(uintptr_t), w->reads[i].self);
+            i++;
+        }
+        done = i;
+    }
+    w->num_reads = 0;
+    w->batch_len = 0;
+}
+
+/* Queues the aligned words of [addr, addr + len) for scanning */
+static void add_read(leak_worker_t *w, uintptr_t addr, size_t len, uint32_t self)
+{
+    uintptr_t start = (addr + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+    uintptr_t end = (addr + len) & ~(sizeof(uintptr_t) - 1);
+
+    while(start < end) {
+        size_t piece = end - start;
+
+        if(w->num_reads == LEAK_BATCH_IOVS || w->batch_len == LEAK_BATCH_BYTES) {
+            flush_reads(w);
+        }
+        if(piece > LEAK_BATCH_BYTES - w->batch_len) {
+            piece = LEAK_BATCH_BYTES - w->batch_len;
+        }
+        w->reads[w->num_reads].addr = start;
+        w->reads[w->num_reads].len = piece;
+        w->reads[w->num_reads].self = self;
+        w->local[w->num_reads].iov_base = (char*)w->buf + w->batch_len;
+        w->local[w->num_reads].iov_len = piece;
+        w->remote[w->num_reads].iov_base = (void*)start;
+        w->remote[w->num_reads].iov_len = piece;
+        w->num_reads++;
+        w->batch_len += piece;
+        start += piece;
+    }
+}
+
+/* Phase 1: everything the roots lead to */
+static void mark_reachable(leak_worker_t *w)
+{
+    uint32_t batch[LEAK_BATCH_IOVS];
+
+    for(;;) {
+        size_t r = __atomic_fetch_add(&ctx.next_root, 1, __ATOMIC_RELAXED);
+        int    n = 0;
+        int    i;
+
+        if(r < ctx.num_roots) {
+            add_read(w, ctx.roots[r].start, ctx.roots[r].end - ctx.roots[r].start, LEAK_NO_SELF);
+            flush_reads(w);
+            __atomic_sub_fetch(&ctx.pending, 1, __ATOMIC_ACQ_REL);
+            continue;
+        }
+
+        n = take_blocks(w, batch);
+        if(n > 0) {
+            for(i = 0; i < n; i++) {
+                add_read(w, ctx.blocks[batch[i]].addr, ctx.blocks[batch[i]].size, batch[i]);
+            }
+            flush_reads(w);
+            __atomic_sub_fetch(&ctx.pending, n, __ATOMIC_ACQ_REL);
+            continue;
+        }
+        if(__atomic_load_n(&ctx.pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        }
+        sched_yield();
+    }
+}
+
+/* Phase 2: unreached blocks pointed to by other unreached blocks */
+static void mark_indirect(leak_worker_t *w)
+{
+    for(;;) {
+        size_t i = __atomic_fetch_add(&ctx.next_unreached, 64, __ATOMIC_RELAXED);
+        size_t end = i + 64;
+
+        if(i >= ctx.num_unreached) {
+            break;
+        }
+        if(end > ctx.num_unreached) {
+            end = ctx.num_unreached;
+        }
+        for(; i < end; i++) {
+            uint32_t idx = ctx.unreached[i];
+            add_read(w, ctx.blocks[idx].addr, ctx.blocks[idx].size, idx);
+        }
+        flush_reads(w);
+    }
+}
+
+static void* worker_main(void *arg)
+{
+    leak_worker_t *w = (leak_worker_t*)arg;
+
+    if(ctx.thread_init) {
+        ctx.thread_init();
+    }
+    ctx.phase(w);
+    return NULL;
+}
+
+/* The caller is worker 0. Workers that fail to start are not missed:
+ * their share is taken by the others. */
+static void run_phase(void (*phase)(leak_worker_t *w))
+{
+    int i;
+
+    ctx.phase = phase;
+    for(i = 1; i < ctx.num_workers; i++) {
+        ctx.workers[i].started =
+            pthread_create(&ctx.workers[i].thread, NULL, worker_main, &ctx.workers[i]) == 0;
+    }
+    phase(&ctx.workers[0]);
+    for(i = 1; i < ctx.num_workers; i++) {
+        if(ctx.workers[i].started) {
+            pthread_join(ctx.workers[i].thread, NULL);
+        }
+    }
+}
+
+static void add_root(leak_roots_t *roots, uintptr_t start, uintptr_t end)
+{
+    if(start < end && roots->num < roots->max) {
+        roots->ranges[roots->num].start = start;
+        roots->ranges[roots->num].end = end;
+        roots->num++;
+    }
+}
+
+/* Writable segments and static TLS of every object but ours */
+static int add_object_roots(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    leak_roots_t *roots = (leak_roots_t*)arg;
+    uintptr_t     own = (uintptr_t)&leak_scan;
+    int           i;
+
+    for(i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        uintptr_t         start = info->dlpi_addr + ph->p_vaddr;
+
+        if(ph->p_type == PT_LOAD && own >= start && own < start + ph->p_memsz) {
+            return 0;
+        }
+    }
+
+    for(i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        uintptr_t         start = info->dlpi_addr + ph->p_vaddr;
+        uintptr_t         tls = (uintptr_t)info->dlpi_tls_data;
+
+        if(ph->p_type == PT_LOAD && (ph->p_flags & PF_W)) {
+            add_root(roots, start, start + ph->p_memsz);
+        }
+        /* Static TLS is at the same offset from every thread's descriptor,
+         * dynamic TLS is in blocks reached from the descriptor */
+        if(ph->p_type == PT_TLS && tls && roots->num_tls < LEAK_MAX_TLS &&
+           tls + LEAK_STATIC_TLS_MAX > roots->self && tls < roots->self + LEAK_STATIC_TLS_MAX) {
+            roots->tls[roots->num_tls].start = tls - roots->self;
+            roots->tls[roots->num_tls].end = tls - roots->self + ph->p_memsz;
+            roots->num_tls++;
+        }
+    }
+    return 0;
+}
+
+/* Sets vmas[i] to the mapping holding addrs[i], or {0, 0}, and *main_stack
+ * to the "[stack]" mapping */
+static void find_mappings(const uintptr_t *addrs, leak_range_t *vmas, int num,
+                          leak_range_t *main_stack)
+{
+    char     buf[16 * 1024];
+    size_t   len = 0;
+    ssize_t  got = 0;
+    int      fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    int      i;
+
+    memset(vmas, 0, num * sizeof(leak_range_t));
+    memset(main_stack, 0, sizeof(*main_stack));
+    if(fd < 0) {
+        return;
+    }
+
+    while((got = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0 || len > 0) {
+        char *line = buf;
+        char *nl = NULL;
+
+        len += got > 0 ? got : 0;
+        buf[len] = '\0';
+        while((nl = strchr(line, '\n')) != NULL || (got <= 0 && *line)) {
+            char      *end = NULL;
+            uintptr_t  start = 0;
+            uintptr_t  stop = 0;
+
+            if(nl) {
+                *nl = '\0';
+            }
+            start = strtoull(line, &end, 16);
+            if(*end == '-') {
+                stop = strtoull(end + 1, &end, 16);
+            }
+            for(i = 0; i < num; i++) {
+                if(addrs[i] >= start && addrs[i] < stop) {
+                    vmas[i].start = start;
+                    vmas[i].end = stop;
+                }
+            }
+            if(strstr(end, "[stack]")) {
+                main_stack->start = start;
+                main_stack->end = stop;
+            }
+            line = nl ? nl + 1 : line + strlen(line);
+        }
+        len -= line - buf;
+        memmove(buf, line, len);
+        if(got <= 0) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+/* Shell sort by start, then merge overlaps, so nothing is scanned twice */
+static void merge_roots(leak_roots_t *roots)
+{
+    static const size_t gaps[] = { 1750, 701, 301, 132, 57, 23, 10, 4, 1 };
+    leak_range_t       *r = roots->ranges;
+    size_t              g;
+    size_t              i;
+    size_t              num = 0;
+
+    for(g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+        for(i = gaps[g]; i < roots->num; i++) {
+            leak_range_t tmp = r[i];
+            size_t       j = i;
+
+            for(; j >= gaps[g] && r[j - gaps[g]].start > tmp.start; j -= gaps[g]) {
+                r[j] = r[j - gaps[g]];
+            }
+            r[j] = tmp;
+        }
+    }
+    for(i = 0; i < roots->num; i++) {
+        if(num > 0 && r[i].start <= r[num - 1].end) {
+            if(r[i].end > r[num - 1].end) {
+                r[num - 1].end = r[i].end;
+            }
+        }
+        else {
+            r[num++] = r[i];
+        }
+    }
+    roots->num = num;
+}
+
+/* Passes a LEAK_SIGNAL the scan did not send, such as the kernel's for
+ * out-of-band socket data, on to the action the application had */
+static void chain_signal(int sig, siginfo_t *info, void *arg)
+{
+    struct sigaction *old = &ctx.old_sa;
+
+    if(old->sa_flags & SA_SIGINFO) {
+        old->sa_sigaction(sig, info, arg);
+    }
+    else if(old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+        old->sa_handler(sig);
+    }
+}
+
+/* LEAK_SIGNAL handler: copies the registers the thread was interrupted
+ * with into its entry of ctx.regs. Async-signal-safe, takes no lock. */
+static void spill_regs(int sig, siginfo_t *info, void *arg)
+{
+    ucontext_t *uc = (ucontext_t*)arg;
+    int         saved_errno = errno;
+    pid_t       tid = 0;
+    int         i;
+
+    if(info->si_code != SI_TKILL || info->si_pid != ctx.pid) {
+        errno = saved_errno;
+        chain_signal(sig, info, arg);
+        return;
+    }
+    __atomic_add_fetch(&ctx.busy, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ctx.accepting, __ATOMIC_SEQ_CST)) {
+        tid = (pid_t)syscall(SYS_gettid);
+        for(i = 0; i < ctx.num_threads; i++) {
+            if(ctx.tids[i] == tid) {
+                ctx.regs[i] = uc->uc_mcontext;
+                __atomic_add_fetch(&ctx.acks, 1, __ATOMIC_RELEASE);
+                break;
+            }
+        }
+    }
+    __atomic_sub_fetch(&ctx.busy, 1, __ATOMIC_SEQ_CST);
+    errno = saved_errno;
+}
+
+/* Signals every other thread and waits up to LEAK_SIGNAL_MS for their
+ * registers. Meanwhile the signals the scan did not send go on to the
+ * application's action. The previous disposition is back on return, and
+ * no handler writes to ctx.regs any more. */
+static int spill_thread_regs(leak_summary_t *summary)
+{
+    struct sigaction  sa;
+    struct sigaction  old;
+    struct timespec   tick = {0, 1000000};
+    pid_t             self = (pid_t)syscall(SYS_gettid);
+    int               sent = 0;
+    int               i;
+
+    if(ctx.num_threads == 0) {
+        return 0;
+    }
+    ctx.regs = map_anon(ctx.num_threads * sizeof(mcontext_t));
+    if(!ctx.regs) {
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = spill_regs;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigfillset(&sa.sa_mask);
+    /* Read first, so that a handler running as soon as it is installed
+       has the action to chain to */
+    if(sigaction(LEAK_SIGNAL, NULL, &ctx.old_sa) != 0 ||
+       sigaction(LEAK_SIGNAL, &sa, &old) != 0) {
+        return -1;
+    }
+    __atomic_store_n(&ctx.accepting, 1, __ATOMIC_SEQ_CST);
+
+    for(i = 0; i < ctx.num_threads; i++) {
+        if(ctx.tids[i] == self) {
+            continue;
+        }
+        summary->threads++;
+        if(syscall(SYS_tgkill, ctx.pid, ctx.tids[i], LEAK_SIGNAL) == 0) {
+            sent++;
+        }
+    }
+    for(i = 0; i < LEAK_SIGNAL_MS &&
+               __atomic_load_n(&ctx.acks, __ATOMIC_ACQUIRE) < sent; i++) {
+        nanosleep(&tick, NULL);
+    }
+
+    /* Late handlers leave the buffer alone from here */
+    __atomic_store_n(&ctx.accepting, 0, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&ctx.busy, __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+    sigaction(LEAK_SIGNAL, &old, NULL);
+    summary->no_regs = summary->threads - __atomic_load_n(&ctx.acks, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+/* Collects the roots, cut in LEAK_ROOT_CHUNK pieces, into ctx.roots.
+ * The caller's stack is taken from sp up. */
+static int collect_roots(uintptr_t sp, const uintptr_t *stacks, const uintptr_t *selves,
+                         int num_threads, size_t *root_bytes)
+{
+    leak_roots_t   roots;
+    leak_range_t  *vmas = NULL;
+    leak_range_t   main_stack;
+    uintptr_t     *addrs = NULL;
+    size_t         roots_len = 0;
+    size_t         addrs_len = 0;
+    size_t         i;
+    int            num = 2 * num_threads + 2;
+    int            t;
+    int            ret = -1;
+
+    memset(&roots, 0, sizeof(roots));
+    roots.self = (uintptr_t)pthread_self();
+    roots.max = LEAK_MAX_SEGMENTS + (num_threads + 1) * (2 + LEAK_MAX_TLS);
+    roots_len = roots.max * sizeof(leak_range_t);
+    addrs_len = num * (sizeof(uintptr_t) + sizeof(leak_range_t));
+    roots.ranges = map_anon(roots_len);
+    addrs = map_anon(addrs_len);
+    if(!roots.ranges || !addrs) {
+        goto out;
+    }
+    vmas = (leak_range_t*)(addrs + num);
+
+    dl_iterate_phdr(add_object_roots, &roots);
+
+    /* Stacks: the caller's from its current frame, the others whole since
+     * their stack pointers are unknown */
+    addrs[0] = sp;
+    addrs[1] = roots.self;
+    for(t = 0; t < num_threads; t++) {
+        addrs[2 + 2 * t] = stacks[t];
+        addrs[3 + 2 * t] = selves[t];
+    }
+    find_mappings(addrs, vmas, num, &main_stack);
+    for(t = 0; t < num; t++) {
+        leak_range_t *vma = &vmas[t];
+
+        if(t % 2 == 0) {
+            add_root(&roots, vma->start <= sp && sp < vma->end ? sp : vma->start, vma->end);
+        }
+        else if(vma->end) {
+            int k;
+
+            add_root(&roots, addrs[t], addrs[t] + LEAK_TCB_SIZE < vma->end ?
+                                       addrs[t] + LEAK_TCB_SIZE : vma->end);
+            for(k = 0; k < roots.num_tls; k++) {
+                add_root(&roots, addrs[t] + roots.tls[k].start, addrs[t] + roots.tls[k].end);
+            }
+        }
+    }
+    if(main_stack.start <= sp && sp < main_stack.end) {
+        main_stack.start = sp;
+    }
+    add_root(&roots, main_stack.start, main_stack.end);
+    if(ctx.regs) {
+        add_root(&roots, (uintptr_t)ctx.regs, (uintptr_t)(ctx.regs + ctx.num_threads));
+    }
+    merge_roots(&roots);
+
+    /* Cut in pieces so that workers share big segments */
+    ctx.num_roots = 0;
+    *root_bytes = 0;
+    for(i = 0; i < roots.num; i++) {
+        *root_bytes += roots.ranges[i].end - roots.ranges[i].start;
+        ctx.num_roots += (roots.ranges[i].end - roots.ranges[i].start +
+                          LEAK_ROOT_CHUNK - 1) / LEAK_ROOT_CHUNK;
+    }
+    ctx.roots = map_anon((ctx.num_roots + 1) * sizeof(leak_range_t));
+    if(!ctx.roots) {
+        goto out;
+    }
+    ctx.num_roots = 0;
+    for(i = 0; i < roots.num; i++) {
+        uintptr_t start = roots.ranges[i].start;
+
+        for(; start < roots.ranges[i].end; start += LEAK_ROOT_CHUNK) {
+            ctx.roots[ctx.num_roots].start = start;
+            ctx.roots[ctx.num_roots].end = roots.ranges[i].end - start > LEAK_ROOT_CHUNK ?
+                                           start + LEAK_ROOT_CHUNK : roots.ranges[i].end;
+            ctx.num_roots++;
+        }
+    }
+    ret = 0;
+
+out:
+    if(roots.ranges) {
+        munmap(roots.ranges, roots_len);
+    }
+    if(addrs) {
+        munmap(addrs, addrs_len);
+    }
+    return ret;
+}
+
+static int setup_workers(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    int  i;
+
+    if(n > LEAK_MAX_WORKERS) {
+        n = LEAK_MAX_WORKERS;
+    }
+    if(n > (long)(1 + ctx.num / LEAK_PER_WORKER)) {
+        n = 1 + ctx.num / LEAK_PER_WORKER;
+    }
+    if(n < 1) {
+        n = 1;
+    }
+
+    ctx.workers = map_anon(n * sizeof(leak_worker_t));
+    if(!ctx.workers) {
+        return -1;
+    }
+    ctx.num_workers = n;
+    for(i = 0; i < n; i++) {
+        pthread_mutex_init(&ctx.workers[i].lock, NULL);
+        /* A block is pushed once, so no stack holds more than all of them */
+        ctx.workers[i].stack = map_anon(ctx.num * sizeof(uint32_t));
+        if(!ctx.workers[i].stack) {
+            ctx.num_workers = i;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void release_ctx(void)
+{
+    int i;
+
+    for(i = 0; ctx.workers && i < ctx.num_workers; i++) {
+        pthread_mutex_destroy(&ctx.workers[i].lock);
+        munmap(ctx.workers[i].stack, ctx.num * sizeof(uint32_t));
+    }
+    if(ctx.workers) {
+        munmap(ctx.workers, ctx.num_workers * sizeof(leak_worker_t));
+    }
+    if(ctx.roots) {
+        munmap(ctx.roots, (ctx.num_roots + 1) * sizeof(leak_range_t));
+    }
+    if(ctx.unreached) {
+        munmap(ctx.unreached, ctx.num * sizeof(uint32_t));
+    }
+    if(ctx.regs) {
+        munmap(ctx.regs, ctx.num_threads * sizeof(mcontext_t));
+    }
+    memset(&ctx, 0, sizeof(ctx));
+}
+
+int leak_scan(leak_block_t *blocks, size_t num,
+              const uintptr_t *stacks, const uintptr_t *selves, const pid_t *tids,
+              int num_threads, void (*thread_init)(void), leak_summary_t *summary)
+{
+    struct timespec start;
+    jmp_buf         regs;
+    size_t          i;
+    volatile int    ret = -1;
+
+    memset(summary, 0, sizeof(*summary));
+    if(num >= LEAK_NO_SELF) {
+        return -1;
+    }
+    if(num == 0) {
+        return 0;
+    }
+
+    /* Spill the callee-saved registers into this frame. The stack is
+     * scanned from regs up: the frames of the workers run below it. */
+    __builtin_unwind_init();
+    setjmp(regs);
+
+    pthread_mutex_lock(&leak_lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.blocks = blocks;
+    ctx.num = num;
+    ctx.pid = getpid();
+    ctx.thread_init = thread_init;
+    ctx.tids = tids;
+    ctx.num_threads = num_threads;
+
+    if(sort_blocks(blocks, num) != 0) {
+        goto out;
+    }
+    ctx.lo = blocks[0].addr;
+    for(i = 0; i < num; i++) {
+        uintptr_t end = blocks[i].addr + (blocks[i].size ? blocks[i].size : 1);
+
+        blocks[i].state = LEAK_UNVISITED;
+        if(end > ctx.hi) {
+            ctx.hi = end;
+        }
+    }
+
+    if(spill_thread_regs(summary) != 0 ||
+       collect_roots((uintptr_t)&regs, stacks, selves, num_threads, &summary->roots) != 0 ||
+       setup_workers() != 0) {
+        goto out;
+    }
+
+    ctx.mark = LEAK_REACHABLE;
+    ctx.pending = ctx.num_roots;
+    run_phase(mark_reachable);
+
+    ctx.unreached = map_anon(num * sizeof(uint32_t));
+    if(!ctx.unreached) {
+        goto out;
+    }
+    for(i = 0; i < num; i++) {
+        if(blocks[i].state == LEAK_UNVISITED) {
+            ctx.unreached[ctx.num_unreached++] = i;
+        }
+    }
+    ctx.mark = LEAK_INDIRECT;
+    run_phase(mark_indirect);
+
+    for(i = 0; i < num; i++) {
+        if(blocks[i].state == LEAK_UNVISITED) {
+            blocks[i].state = LEAK_DEFINITE;
+        }
+        summary->num[blocks[i].state]++;
+        summary->bytes[blocks[i].state] += blocks[i].size;
+    }
+    summary->workers = ctx.num_workers;
+    summary->secs = elapsed_secs(&start);
+    ret = 0;
+
+out:
+    release_ctx();
+    pthread_mutex_unlock(&leak_lock);
+    return ret;
+}
@@ -0,0 +1,90 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _LEAK_CHECK_
+#define _LEAK_CHECK_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/types.h>
+
+/* Conservative leak check over the tracked live set.
+ * The roots are the writable segments of every loaded object except the
+ * profiler (data and bss), the stacks and static TLS of the given threads,
+ * the main stack, and the registers of every thread. The calling thread
+ * spills its own; the others are sent LEAK_SIGNAL, whose handler copies
+ * the interrupted registers into a buffer that is scanned as a root. Any aligned
+ * word pointing into a block, interior pointers included, makes it
+ * reachable, and reachable blocks are scanned in turn. A block nothing
+ * reaches is indirectly leaked if another leaked block points to it and
+ * definitely leaked otherwise, so a leaked cycle only shows up as indirect.
+ *
+ * Marking runs on several threads that share work by stealing. Other
+ * threads of the process keep running, so the result is a best effort.
+ * Threads that block the signal or do not answer within LEAK_SIGNAL_MS
+ * are counted as having no registers: what only they hold may show up as
+ * leaked.
+ * Memory is read with process_vm_readv(), which fails cleanly on pages
+ * unmapped under our feet. Nothing here calls malloc. */
+
+#define LEAK_MAX_WORKERS  16
+#define LEAK_SIGNAL       SIGURG   /* ignored by default: a late one is harmless;
+                                      the application's own are passed on */
+#define LEAK_SIGNAL_MS    100      /* wait for the handlers, at most */
+
+typedef enum {
+    LEAK_UNVISITED = 0,
+    LEAK_REACHABLE,
+    LEAK_INDIRECT,
+    LEAK_DEFINITE,
+    LEAK_NUM_STATES,
+} leak_state_t;
+
+typedef struct {
+    uintptr_t  addr;
+    size_t     size;
+    uint32_t   stack_id;
+    uint32_t   state;      /* leak_state_t, set by leak_scan */
+} leak_block_t;
+
+typedef struct {
+    size_t  num[LEAK_NUM_STATES];
+    size_t  bytes[LEAK_NUM_STATES];
+    size_t  roots;         /* bytes of roots scanned */
+    int     threads;       /* other threads scanned */
+    int     no_regs;       /* of those, without registers: unreliable */
+    int     workers;
+    double  secs;
+} leak_summary_t;
+
+/* Classifies blocks[], which it sorts by address. stacks[] holds an
+ * address on the stack of each thread to scan, selves[] its pthread_self()
+ * and tids[] its kernel thread id. thread_init runs first thing on every
+ * worker thread. Returns 0 on success, -1 on error. */
+int leak_scan(leak_block_t *blocks, size_t num,
+              const uintptr_t *stacks, const uintptr_t *selves, const pid_t *tids,
+              int num_threads, void (*thread_init)(void), leak_summary_t *summary);
+
+#endif /* _LEAK_CHECK_ */
@@ -22,62 +22,44 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
-#include <stddef.h>
-#include "linked_list.h"
+#include "life_hist.h"
 
-void list_insert(list_node_t **head, list_node_t *node)
+uint64_t life_hist_lower(int i)
 {
-	if(!head) {
-		return;
-	}
-
-	/* Always insert at head */
-    node->next = *head;
-	*head = node;
-	return;
+    return i > 0 ? 1ull << (LIFE_HIST_MIN_SHIFT + i - 1) : 0;
 }
 
-void* list_delete(list_node_t **head, void *key)
+int64_t life_hist_total(const life_hist_t *hist)
 {
-	list_node_t *current = NULL;
-	
-	if(!head) {
-		return NULL;
-	}
-
-	current = *head;
+    int64_t total = 0;
+    int     i;
 
-	/* special case for head */
-	if (current != NULL && current->key == key) {
-        *head = current->next;
+    for(i = 0; i < LIFE_HIST_BUCKETS; i++) {
+        total += hist->count[i];
     }
-	else {	
-		list_node_t *prev = NULL;
-		while (current != NULL && current->key != key) {
-			prev = current;
-			current = current->next;
-		}
-
-		if (current) {
-			prev->next = current->next;
-		}
-	}
-
-	return current;
+    return total;
 }
 
-void* list_find(list_node_t *head, void *key)
+uint64_t life_hist_quantile(const life_hist_t *hist, double q)
 {
-	list_node_t  *current = head;
-	void         *ret = NULL;
+    int64_t total = life_hist_total(hist);
+    double  rank = q * total;
+    int64_t below = 0;
+    int     i;
 
-	while (current != NULL && current->key != key) {
-		current = current->next;
-	}
+    if(total <= 0) {
+        return 0;
+    }
+    for(i = 0; i < LIFE_HIST_BUCKETS - 1; i++) {
+        int64_t count = hist->count[i];
 
-	if (current) {
-		ret = &current->val;
-	}	
+        if(count > 0 && below + count >= rank) {
+            uint64_t lo = life_hist_lower(i);
+            uint64_t hi = life_hist_lower(i + 1);
 
-	return ret;
+            return lo + (uint64_t)((hi - lo) * ((rank - below) / count));
+        }
+        below += count;
+    }
+    return life_hist_lower(LIFE_HIST_BUCKETS - 1);
 }
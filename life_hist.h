@@ -0,0 +1,63 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _LIFE_HIST_
+#define _LIFE_HIST_
+
+#include <stdint.h>
+
+/* Lifetimes of freed blocks, taken at free time from the birth stamp in
+ * the block's record. The buckets are powers of two of nanoseconds:
+ * bucket 0 is under 2^LIFE_HIST_MIN_SHIFT ns and bucket i > 0 starts at
+ * 2^(LIFE_HIST_MIN_SHIFT + i - 1) ns. The last bucket (from ~137 sec) is
+ * open. Unlike the live set ages (age_hist.h) these resolve the
+ * sub-microsecond range, where pooling candidates live. */
+
+#define LIFE_HIST_MIN_SHIFT  7    /* 128 ns */
+#define LIFE_HIST_BUCKETS    32
+
+typedef struct {
+    int64_t  count[LIFE_HIST_BUCKETS];
+} life_hist_t;
+
+static inline int life_hist_index(uint64_t ns)
+{
+    int i = 0;
+
+    if(ns < (1ull << LIFE_HIST_MIN_SHIFT)) {
+        return 0;
+    }
+    i = 63 - __builtin_clzll(ns) - LIFE_HIST_MIN_SHIFT + 1;
+    return i < LIFE_HIST_BUCKETS ? i : LIFE_HIST_BUCKETS - 1;
+}
+
+/* Smallest lifetime in bucket i, in ns; bucket i ends where i + 1 starts */
+uint64_t life_hist_lower(int i);
+int64_t  life_hist_total(const life_hist_t *hist);
+
+/* Lifetime below which a fraction q of the counts fall, interpolated
+ * within its bucket. 0 for an empty histogram. */
+uint64_t life_hist_quantile(const life_hist_t *hist, double q);
+
+#endif /* _LIFE_HIST_ */
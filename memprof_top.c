@@ -0,0 +1,353 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm_stats_format.h"
+
+/* Live view of every process running with MEMPROF_SHM, read from their
+ * stats segments in SHM_STATS_DIR. Nothing is asked of the processes.
+ *
+ *   memprof_top [-b] [-d seconds] [-n iterations] [-p pid]
+ *
+ * -b  batch mode: no screen clearing, for logging
+ * -d  delay between updates (default 1)
+ * -n  stop after this many updates (default: run until interrupted)
+ * -p  also print the size and age histograms of one process
+ *
+ * Rates are computed between two updates of the same process. Segments
+ * left behind by processes that died without running their destructors
+ * are skipped. */
+
+#define MAX_PROCS     1024
+#define READ_TRIES    100
+
+typedef struct {
+    shm_stats_t  stats;
+    double       alloc_rate;
+    double       free_rate;
+} proc_t;
+
+/* Last sample of each process, for the rates */
+typedef struct {
+    uint32_t  pid;
+    uint64_t  update_ns;
+    int64_t   num_alloc;
+    int64_t   num_free;
+    double    alloc_rate;
+    double    free_rate;
+} prev_t;
+
+static proc_t  procs[MAX_PROCS];
+static prev_t  prevs[MAX_PROCS];
+static prev_t  next_prevs[MAX_PROCS];
+static int     num_prevs = 0;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-b] [-d seconds] [-n iterations] [-p pid]\n", prog);
+    exit(2);
+}
+
+static void format_size(char *buf, size_t len, double size)
+{
+    static const char units[] = "KMGT";
+    int               unit = -1;
+
+    while(size >= 1024 && unit < (int)sizeof(units) - 2) {
+        size /= 1024;
+        unit++;
+    }
+    if(unit < 0) {
+        snprintf(buf, len, "%.0f", size);
+    }
+    else {
+        snprintf(buf, len, "%.4g%c", size, units[unit]);
+    }
+}
+
+static void format_age(char *buf, size_t len, uint64_t ns)
+{
+    if(ns < 1000) {
+        snprintf(buf, len, "%lluns", (unsigned long long)ns);
+    }
+    else if(ns < 1000000) {
+        snprintf(buf, len, "%.4gus", ns / 1e3);
+    }
+    else if(ns < 1000000000) {
+        snprintf(buf, len, "%.4gms", ns / 1e6);
+    }
+    else {
+        snprintf(buf, len, "%.6gs", ns / 1e9);
+    }
+}
+
+static int pid_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/* Maps the segment read-only and copies a consistent snapshot */
+static int read_segment(const char *name, shm_stats_t *out)
+{
+    char                path[512];
+    struct stat         st;
+    const shm_stats_t  *seg = NULL;
+    int                 fd = -1;
+    int                 ret = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", SHM_STATS_DIR, name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return -1;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(shm_stats_t)) {
+        close(fd);
+        return -1;
+    }
+    seg = mmap(NULL, sizeof(shm_stats_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(seg == MAP_FAILED) {
+        return -1;
+    }
+
+    if(memcmp(seg->magic, SHM_STATS_MAGIC, sizeof(seg->magic)) == 0 &&
+       seg->version == SHM_STATS_VERSION && seg->size == sizeof(shm_stats_t)) {
+        ret = shm_stats_read(seg, out, READ_TRIES);
+    }
+    munmap((void*)seg, sizeof(shm_stats_t));
+    return ret;
+}
+
+static void compute_rates(proc_t *proc)
+{
+    int i;
+
+    for(i = 0; i < num_prevs; i++) {
+        prev_t *prev = &prevs[i];
+
+        if(prev->pid != proc->stats.pid) {
+            continue;
+        }
+        /* Not republished since, keep the last rates */
+        if(proc->stats.update_ns <= prev->update_ns) {
+            proc->alloc_rate = prev->alloc_rate;
+            proc->free_rate = prev->free_rate;
+        }
+        else {
+            double secs = (proc->stats.update_ns - prev->update_ns) / 1e9;
+
+            proc->alloc_rate = (proc->stats.num_alloc - prev->num_alloc) / secs;
+            proc->free_rate = (proc->stats.num_free - prev->num_free) / secs;
+        }
+        return;
+    }
+}
+
+static int scan(void)
+{
+    DIR           *dir = opendir(SHM_STATS_DIR);
+    struct dirent *ent = NULL;
+    int            num = 0;
+
+    if(!dir) {
+        return 0;
+    }
+    while((ent = readdir(dir)) != NULL && num < MAX_PROCS) {
+        const char *pid_str = ent->d_name + strlen(SHM_STATS_PREFIX);
+        proc_t     *proc = &procs[num];
+
+        if(strncmp(ent->d_name, SHM_STATS_PREFIX, strlen(SHM_STATS_PREFIX)) != 0 ||
+           strspn(pid_str, "0123456789") != strlen(pid_str) || !*pid_str) {
+            continue;
+        }
+        memset(proc, 0, sizeof(*proc));
+        if(read_segment(ent->d_name, &proc->stats) != 0 ||
+           !pid_alive((pid_t)proc->stats.pid)) {
+            continue;
+        }
+        compute_rates(proc);
+        num++;
+    }
+    closedir(dir);
+    return num;
+}
+
+static int by_live_sz(const void *a, const void *b)
+{
+    int64_t x = ((const proc_t*)a)->stats.live_sz;
+    int64_t y = ((const proc_t*)b)->stats.live_sz;
+
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static void print_histograms(const shm_stats_t *stats)
+{
+    char lo[16], hi[16], bytes[16];
+    int  i;
+
+    printf("\nPID %u live allocations by size:\n", stats->pid);
+    for(i = 0; i < SHM_STATS_SIZE_BUCKETS; i++) {
+        if(stats->size_count[i] == 0) {
+            continue;
+        }
+        format_size(lo, sizeof(lo), stats->size_lower[i]);
+        if(i + 1 < SHM_STATS_SIZE_BUCKETS) {
+            format_size(hi, sizeof(hi), stats->size_lower[i + 1]);
+        }
+        else {
+            snprintf(hi, sizeof(hi), "max");
+        }
+        format_size(bytes, sizeof(bytes), stats->size_bytes[i]);
+        printf("%8s - %-8s count:%lld bytes:%s\n", lo, hi,
+               (long long)stats->size_count[i], bytes);
+    }
+
+    printf("\nPID %u live allocations by age:\n", stats->pid);
+    for(i = 0; i < SHM_STATS_AGE_BUCKETS; i++) {
+        format_age(lo, sizeof(lo), stats->age_lower[i]);
+        if(i + 1 < SHM_STATS_AGE_BUCKETS) {
+            format_age(hi, sizeof(hi), stats->age_lower[i + 1]);
+        }
+        else {
+            snprintf(hi, sizeof(hi), "max");
+        }
+        printf("%8s - %-8s count:%lld\n", lo, hi, (long long)stats->age_count[i]);
+    }
+}
+
+static void print_procs(int num, int batch, long detail_pid)
+{
+    char       now_str[32];
+    time_t     now = time(NULL);
+    int        i;
+
+    strftime(now_str, sizeof(now_str), "%H:%M:%S", localtime(&now));
+    if(!batch) {
+        printf("\033[H\033[2J");
+    }
+    printf("memprof_top - %s, %d processes\n\n", now_str, num);
+    printf("%7s %-16s %10s %10s %11s %10s %10s %10s\n", "PID", "COMMAND", "ALLOC/s",
+           "FREE/s", "LIVE", "LIVE SIZE", "ALLOCATED", "PROF MEM");
+
+    for(i = 0; i < num; i++) {
+        shm_stats_t *stats = &procs[i].stats;
+        char         live_sz[16], alloc_sz[16], prof_mem[16];
+
+        format_size(live_sz, sizeof(live_sz), stats->live_sz);
+        format_size(alloc_sz, sizeof(alloc_sz), stats->alloc_sz);
+        format_size(prof_mem, sizeof(prof_mem), stats->profiler_mem);
+        /* ~ marks estimates from sampled allocations */
+        printf("%7u %-16.16s %10.0f %10.0f %s%10lld %10s %10s %10s\n", stats->pid, stats->cmd,
+               procs[i].alloc_rate, procs[i].free_rate, stats->sample_interval ? "~" : " ",
+               (long long)stats->live_num, live_sz, alloc_sz, prof_mem);
+    }
+
+    for(i = 0; i < num; i++) {
+        if(procs[i].stats.pid == (uint32_t)detail_pid) {
+            print_histograms(&procs[i].stats);
+        }
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    struct timespec  delay = {1, 0};
+    long             iterations = -1;
+    long             detail_pid = -1;
+    int              batch = 0;
+    int              opt;
+
+    while((opt = getopt(argc, argv, "bd:n:p:")) != -1) {
+        switch(opt) {
+        case 'b':
+            batch = 1;
+            break;
+        case 'd': {
+            double secs = strtod(optarg, NULL);
+
+            if(secs <= 0) {
+                usage(argv[0]);
+            }
+            delay.tv_sec = (time_t)secs;
+            delay.tv_nsec = (long)((secs - delay.tv_sec) * 1e9);
+            break;
+        }
+        case 'n':
+            iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'p':
+            detail_pid = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc) {
+        usage(argv[0]);
+    }
+
+    while(iterations != 0) {
+        int num = scan();
+        int i;
+
+        qsort(procs, num, sizeof(procs[0]), by_live_sz);
+        print_procs(num, batch, detail_pid);
+
+        for(i = 0; i < num; i++) {
+            next_prevs[i].pid = procs[i].stats.pid;
+            next_prevs[i].update_ns = procs[i].stats.update_ns;
+            next_prevs[i].num_alloc = procs[i].stats.num_alloc;
+            next_prevs[i].num_free = procs[i].stats.num_free;
+            next_prevs[i].alloc_rate = procs[i].alloc_rate;
+            next_prevs[i].free_rate = procs[i].free_rate;
+        }
+        memcpy(prevs, next_prevs, num * sizeof(prevs[0]));
+        num_prevs = num;
+
+        if(iterations > 0) {
+            iterations--;
+        }
+        if(iterations != 0) {
+            nanosleep(&delay, NULL);
+            if(batch) {
+                printf("\n");
+            }
+        }
+    }
+    return 0;
+}
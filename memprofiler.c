@@ -25,43 +25,65 @@ SOFTWARE.
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <dlfcn.h>
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include <malloc.h>
 #include <assert.h>
 #include <pthread.h>
-#include "linked_list.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "hash_table.h"
+#include "thread_stats.h"
+#include "slab.h"
+#include "stack_table.h"
+#include "trace.h"
+#include "size_hist.h"
+#include "prof_clock.h"
+#include "control.h"
+#include "shm_stats.h"
+#include "leak_check.h"
+#include "snap_ring.h"
+#include "report_buf.h"
+#include "boot_arena.h"
+#include "heap_stats.h"
 
 /*-----------------------------------------------------------------------------
                                     MACROS
 -----------------------------------------------------------------------------*/
-static char log_msg[256];
+/* The library is built with -fvisibility=hidden: only the hooks below are
+ * exported, so a host symbol of the same name as one of the internal
+ * helpers (bash has its own hash_insert) never replaces it */
+#define MEMPROF_EXPORT __attribute__((visibility("default")))
+
+/* Formats on the caller's stack and writes to stderr in one call: no
+ * shared buffer, no stdio, safe inside the hooks (see report_buf.h) */
+static void log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
 //#define LOG_DEBUG
 #define LOG_ERROR
 #define LOG_INFO
 
 #ifdef LOG_ERROR
-#define log_error(format, args...) \
-    snprintf(log_msg, 256, "ERR:\t"format, ##args); \
-    fputs(log_msg, stderr);
+#define log_error(format, args...) log_write("ERR:\t"format, ##args)
 #else
 #define log_error(format, args...)
 #endif
 
 #ifdef LOG_INFO
-#define log_info(format, args...) \
-    snprintf(log_msg, 256, format, ##args); \
-    fputs(log_msg, stderr);
+#define log_info(format, args...) log_write(format, ##args)
 #else
 #define log_info(format, args...)
 #endif
 
 #ifdef LOG_DEBUG
-#define log_debug(format, args...) \
-    snprintf(log_msg, 256, "DBG:\t"format, ##args); \
-    fputs(log_msg, stderr);
+#define log_debug(format, args...) log_write("DBG:\t"format, ##args)
 #else
 #define log_debug(format, args...)
 #endif
@@ -73,498 +95,3519 @@ typedef void* (*orig_malloc_t)(size_t);
 typedef void* (*orig_calloc_t)(size_t, size_t);
 typedef void* (*orig_realloc_t)(void*, size_t);
 typedef void  (*orig_free_t)(void*);
+typedef void* (*orig_memalign_t)(size_t, size_t);
+typedef size_t (*orig_usable_size_t)(void*);
+typedef int (*orig_setname_t)(pthread_t, const char*);
+
+
+typedef enum {
+    TRACK_TABLE,     /* records kept in curr_alloc_table */
+    TRACK_HEADER,    /* records kept in a header in front of each block */
+} track_mode_t;
+
+typedef enum {
+    REPORT_TEXT,     /* for people, the default */
+    REPORT_JSON,     /* one JSON object per line */
+    REPORT_PROM,     /* Prometheus text exposition format */
+} report_format_t;
+
+/* alloc_info_t flags */
+#define ALLOC_FLAG_HEADER   0x1   /* record lives in an alloc_hdr_t */
+
+/* Bits 1-7: reallocs the block went through so far, saturating */
+#define ALLOC_CHAIN_SHIFT   1
+#define ALLOC_CHAIN_MAX     0x7f
+
+/* Bits 8-15 of the flags of an aligned block with a header: log2 of the
+ * distance from the start of the real block to the user pointer, when it
+ * is more than sizeof(alloc_hdr_t). 0 means the header starts the block. */
+#define ALLOC_OFFSET_SHIFT  8
+
+/* Bit 8 of a table record without a header: the real realloc is running
+ * on the block, which may be freed before the record is re-keyed */
+#define ALLOC_FLAG_RESIZING 0x100
 
+/* Alignment of every block the real malloc returns */
+#define MALLOC_ALIGN        (2 * sizeof(size_t))
 
+/* Per-thread state of the allocation sampler */
 typedef struct {
-    size_t  alloc_sz;
-    time_t  alloc_time;
-} alloc_info_t;
+    uint64_t  rng;
+    int64_t   bytes_until_sample;
+} sampler_t;
 
 typedef struct {
-    long  under_4B;
-    long  btwn_4B_8B;
-    long  btwn_8B_16B;
-    long  btwn_16B_32B;
-    long  btwn_32B_64B;
-    long  btwn_64B_128B;
-    long  btwn_128B_256B;
-    long  btwn_256B_512B;
-    long  btwn_512B_1024B;
-    long  btwn_1024B_2048B;
-    long  btwn_2048B_4096B;
-    long  over_4096B;
-} alloc_size_info_t;
+    size_t    alloc_sz;
+    uint64_t  alloc_ts;      /* birth, prof_clock_ns() */
+    uint32_t  stack_id;      /* allocation site, see stack_table.h */
+    uint16_t  flags;
+    uint8_t   sample_idx;    /* sampled with sample_rates[sample_idx] */
+    uint8_t   name_id;       /* name of the allocating thread, see thread_stats.h */
+} alloc_info_t;
+
+/* Header placed in front of every block handed out in TRACK_HEADER mode.
+ * magic is the last field so that checking a pointer we did not hand out
+ * only reads the 8 bytes right before it, which for any glibc block is
+ * the chunk size field and always mapped. */
+#define ALLOC_HDR_MAGIC 0xa110c8ed5eedf00dULL
 
 typedef struct {
-    long  under_1s;
-    long  btwn_1s_10s;
-    long  btwn_10s_100s;
-    long  btwn_100s_1000s;
-    long  over_1000s;
-} alloc_age_info_t;
+    alloc_info_t  info;
+    uintptr_t     magic;     /* user pointer ^ ALLOC_HDR_MAGIC */
+} __attribute__((aligned(16))) alloc_hdr_t;
+
+_Static_assert(sizeof(alloc_hdr_t) % _Alignof(max_align_t) == 0,
+               "alloc_hdr_t must keep user pointers malloc-aligned");
 
 /*-----------------------------------------------------------------------------
                                 GLOBALS
 -----------------------------------------------------------------------------*/
 
-/* Buffer to resolve calloc and dlsym inter-dependency
- * Used only for the first time */
+/* Set while the profiler allocates for itself, and for profiler threads,
+ * whose allocations are not tracked */
 static __thread int no_hook;
-static char alloc_buff[128];
+
+/* The real allocator is looked up and the configuration read once, by the
+ * first hooked call. Calls made meanwhile (by dlsym, or by other threads)
+ * are served from the bootstrap arena (boot_arena.c). */
+typedef enum {
+    HOOKS_NONE,
+    HOOKS_RESOLVING,
+    HOOKS_READY,
+} hooks_state_t;
+
+static int hooks_state = HOOKS_NONE;
 
 /* Function pointers to store the hooks to original system calls */
 static orig_malloc_t orig_malloc = NULL;
 static orig_calloc_t orig_calloc = NULL;
 static orig_realloc_t orig_realloc = NULL;
 static orig_free_t orig_free = NULL;
-
-static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
-
-/* Overall allocations */
-static long      overall_num_alloc = 0;
-static long long overall_alloc_sz  = 0;
-
-/* Linked List to store current allocations */
-static list_node_t *curr_alloc_list = NULL;
+static orig_memalign_t orig_memalign = NULL;
+static orig_usable_size_t orig_malloc_usable_size = NULL;
+static orig_setname_t orig_setname = NULL;   /* looked up on first use */
+
+/* Selected with MEMPROF_MODE=table|header, read once on first use */
+static track_mode_t track_mode = TRACK_TABLE;
+
+/* Mean number of bytes between sampled allocations (MEMPROF_SAMPLE_INTERVAL),
+ * 0 tracks every allocation */
+static long sample_interval = 0;
+
+/* Every interval used so far, sample_rates[sample_idx] is the current one.
+ * Records keep the index of theirs, so that changing the interval at run
+ * time ("sample" control command) leaves the weights of older blocks alone. */
+#define SAMPLE_RATES_MAX 16
+static long    sample_rates[SAMPLE_RATES_MAX] = {0};
+static int     num_sample_rates = 1;
+static uint8_t sample_idx = 0;
+
+/* Tracked blocks carry an alloc_hdr_t: always in header mode, and for
+ * sampled blocks so that unsampled ones are told apart without a lookup */
+static bool use_hdr = false;
+
+static __thread sampler_t sampler __attribute__((tls_model("initial-exec")));
+
+/* Frames captured per tracked allocation (MEMPROF_STACK_DEPTH), 0 disables.
+ * Capture starts once the constructor has set up the stack table. */
+static int           stack_depth = 0;
+static unwind_mode_t unwind_mode = UNWIND_FP;
+static bool          stacks_enabled = false;
+
+/* Rows of the per-site tables in the report (MEMPROF_TOP_SITES) */
+static int top_sites = 10;
+
+/* Sites whose blocks have a median lifetime under this many microseconds
+ * are reported as churn (MEMPROF_CHURN_US) */
+static long churn_us = 100;
+
+/* Seconds between reports from the reporter thread (MEMPROF_INTERVAL),
+ * 0 reports only at exit */
+static long report_interval = 5;
+
+/* Directory of the control socket (MEMPROF_CONTROL), NULL disables */
+static const char *control_dir = NULL;
+
+/* Milliseconds between updates of the stats segment (MEMPROF_SHM),
+ * 0 disables */
+static long shm_interval = 0;
+
+/* Leak check at exit (MEMPROF_LEAK_CHECK=1) */
+static bool leak_check_at_exit = false;
+
+/* Seconds between live-set snapshots (MEMPROF_SNAPSHOT), 0 disables */
+static long snapshot_interval = 0;
+
+/* Heap overhead in every report (MEMPROF_HEAP_STATS=1). In table mode it
+ * walks the live set for the usable size of every block. */
+static bool heap_stats_enabled = false;
+
+/* Report output (MEMPROF_REPORT_FORMAT, MEMPROF_REPORT_FILE, MEMPROF_REPORT_FD).
+ * A Prometheus file is replaced by each report, other files appended to. */
+#define REPORT_BUF_SIZE (1 << 20)
+static report_format_t report_format = REPORT_TEXT;
+static const char     *report_path = NULL;
+static int             report_fd = STDERR_FILENO;
+static char           *report_mem = NULL;     /* REPORT_BUF_SIZE, under report_lock */
+
+_Static_assert(SIZE_HIST_BUCKETS == SHM_STATS_SIZE_BUCKETS &&
+               AGE_HIST_BUCKETS == SHM_STATS_AGE_BUCKETS,
+               "shm_stats_t buckets must match the report histograms");
+
+/* Reporter thread. report_lock also guards counters_base and names_base. */
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  report_cond;
+static bool            reporter_stop = false;
+static bool            reporter_running = false;
+
+/* Overall and per thread name counters at the last "reset" control command */
+static thread_counters_t    counters_base;
+static thread_name_stats_t  names_base[THREAD_NAMES_MAX];
+
+/* prof_clock_ns() when the hooks came up and at the last "reset", the
+ * start of the windows the report rates are taken over */
+static uint64_t start_ns = 0;
+static uint64_t counters_base_ns = 0;
+
+/* Hash table to store current allocations, keyed by pointer */
+static hash_table_t curr_alloc_table = HASH_TABLE_INITIALIZER;
+
+/* alloc_info_t records of curr_alloc_table, kept off the profiled heap */
+static slab_cache_t alloc_info_cache =
+    SLAB_CACHE_INITIALIZER(sizeof(alloc_info_t), 0);
 
 /*-----------------------------------------------------------------------------
                           INTERNAL FUNCTIONS
 -----------------------------------------------------------------------------*/
 
-static int increment_overall_num_alloc(void)
+static void log_write(const char *format, ...)
 {
-    pthread_mutex_lock(&alloc_lock);
-    overall_num_alloc++;
-    pthread_mutex_unlock(&alloc_lock);
-    return 0;
+    char     buf[256];
+    rbuf_t   rb;
+    va_list  ap;
+
+    rbuf_init(&rb, buf, sizeof(buf));
+    va_start(ap, format);
+    rbuf_vprintf(&rb, format, ap);
+    va_end(ap);
+    rbuf_write(&rb, STDERR_FILENO);
 }
 
-static int add_overall_alloc_sz(size_t size)
+/* Overall allocations, kept in per-thread counters (thread_stats.c), and
+ * again under the thread's name */
+static void add_overall_alloc(size_t size)
 {
-    pthread_mutex_lock(&alloc_lock);
-    overall_alloc_sz += size;
-    pthread_mutex_unlock(&alloc_lock);
-    return 0;
+    thread_stats_t     *stats = thread_stats_get();
+    thread_name_ctrs_t *name = thread_stats_name_ctrs(stats);
+
+    thread_stat_add(stats, &stats->ctrs.num_alloc, 1);
+    thread_stat_add(stats, &stats->ctrs.alloc_sz, size);
+    thread_stat_add(stats, &name->num_alloc, 1);
+    thread_stat_add(stats, &name->alloc_sz, size);
 }
 
-static int add_curr_alloc_list(void *ptr, size_t size)
+static void add_overall_cxx_alloc(size_t size)
 {
-    list_node_t *node = (list_node_t*)orig_calloc(1, sizeof(list_node_t));
-    if (!node) {
-        log_error("Could not allocate lined list node for %p\n", ptr);
-        return -1;
-    }
-    alloc_info_t *info
-        = (alloc_info_t*)orig_calloc(1, sizeof(alloc_info_t));
-    info->alloc_sz = size;
-    time(&info->alloc_time);
-    node->key = ptr;
-    node->val = info;
-
-    log_debug("Adding node:%p\n", ptr);
+    thread_stats_t *stats = thread_stats_get();
 
-    pthread_mutex_lock(&alloc_lock);
-    list_insert(&curr_alloc_list, node);
-    pthread_mutex_unlock(&alloc_lock);
-    return 0;
+    thread_stat_add(stats, &stats->ctrs.cxx_num_alloc, 1);
+    thread_stat_add(stats, &stats->ctrs.cxx_alloc_sz, size);
 }
 
-static int del_curr_alloc_list(void *ptr)
+static void add_overall_alloc_sz(size_t size)
 {
-    list_node_t *node = NULL;
+    thread_stats_t *stats = thread_stats_get();
 
-    pthread_mutex_lock(&alloc_lock);
-    node = list_delete(&curr_alloc_list, ptr);
-    pthread_mutex_unlock(&alloc_lock);
+    thread_stat_add(stats, &stats->ctrs.alloc_sz, size);
+    thread_stat_add(stats, &thread_stats_name_ctrs(stats)->alloc_sz, size);
+}
 
-    if(!node) {
-        log_error("Could not find node:%p\n", ptr);
-        return -1;
+/* Bytes a realloc from old_sz to size added, on every realloc path */
+static void add_realloc_growth(size_t old_sz, size_t size)
+{
+    if(size > old_sz) {
+        add_overall_alloc_sz(size - old_sz);
     }
+}
 
-    log_debug("Deleting node:%p\n", ptr);
-    orig_free(node->val);
-    orig_free(node);
-    return 0;
+static void add_overall_free(size_t size)
+{
+    thread_stats_t     *stats = thread_stats_get();
+    thread_name_ctrs_t *name = thread_stats_name_ctrs(stats);
+
+    thread_stat_add(stats, &stats->ctrs.num_free, 1);
+    thread_stat_add(stats, &stats->ctrs.free_sz, size);
+    thread_stat_add(stats, &name->num_free, 1);
+    thread_stat_add(stats, &name->free_sz, size);
 }
 
-static void fill_curr_size_info(alloc_size_info_t *alloc_size_info, size_t size)
+static void load_config(void)
 {
-    if(!alloc_size_info) {
-        return;
+    const char *mode = getenv("MEMPROF_MODE");
+    const char *interval = getenv("MEMPROF_INTERVAL");
+    const char *sample = getenv("MEMPROF_SAMPLE_INTERVAL");
+    const char *depth = getenv("MEMPROF_STACK_DEPTH");
+    const char *unwind = getenv("MEMPROF_UNWIND");
+    const char *top = getenv("MEMPROF_TOP_SITES");
+    const char *churn = getenv("MEMPROF_CHURN_US");
+    const char *trace = getenv("MEMPROF_TRACE");
+    const char *control = getenv("MEMPROF_CONTROL");
+    const char *shm = getenv("MEMPROF_SHM");
+    const char *leaks = getenv("MEMPROF_LEAK_CHECK");
+    const char *snaps = getenv("MEMPROF_SNAPSHOT");
+    const char *heap = getenv("MEMPROF_HEAP_STATS");
+    const char *format = getenv("MEMPROF_REPORT_FORMAT");
+    const char *report_file = getenv("MEMPROF_REPORT_FILE");
+    const char *report_fd_env = getenv("MEMPROF_REPORT_FD");
+
+    if(mode && strcmp(mode, "header") == 0) {
+        track_mode = TRACK_HEADER;
     }
-
-    if(size <= 4) {
-        alloc_size_info->under_4B++;
+    if(interval) {
+        report_interval = strtol(interval, NULL, 10);
     }
-    else if(size > 4 && size <= 8) {
-        alloc_size_info->btwn_4B_8B++;
+    if(sample && strtol(sample, NULL, 10) > 0) {
+        sample_interval = strtol(sample, NULL, 10);
+        sample_rates[0] = sample_interval;
     }
-    else if(size > 8 && size <= 16) {
-        alloc_size_info->btwn_8B_16B++;
+    if(depth) {
+        stack_depth = strtol(depth, NULL, 10);
+        if(stack_depth > STACK_MAX_DEPTH) {
+            stack_depth = STACK_MAX_DEPTH;
+        }
     }
-    else if(size > 16 && size <= 32) {
-        alloc_size_info->btwn_16B_32B++;
+    if(unwind && strcmp(unwind, "dwarf") == 0) {
+        unwind_mode = UNWIND_DWARF;
     }
-    else if(size > 32 && size <= 64) {
-        alloc_size_info->btwn_32B_64B++;
+    if(top) {
+        top_sites = strtol(top, NULL, 10);
     }
-    else if(size > 64 && size <= 128) {
-        alloc_size_info->btwn_64B_128B++;
+    if(churn && strtol(churn, NULL, 10) > 0) {
+        churn_us = strtol(churn, NULL, 10);
     }
-    else if(size > 128 && size <= 256) {
-        alloc_size_info->btwn_128B_256B++;
+    if(trace && *trace && trace_open(trace) != 0) {
+        log_error("Could not open trace file %s\n", trace);
     }
-    else if(size > 256 && size <= 512) {
-        alloc_size_info->btwn_256B_512B++;
+    if(control && *control) {
+        control_dir = control;
     }
-    else if(size > 512 && size <= 1024) {
-        alloc_size_info->btwn_512B_1024B++;
+    if(shm && strtol(shm, NULL, 10) > 0) {
+        shm_interval = strtol(shm, NULL, 10);
     }
-    else if(size > 1024 && size <= 2048) {
-        alloc_size_info->btwn_1024B_2048B++;
+    if(leaks && strtol(leaks, NULL, 10) > 0) {
+        leak_check_at_exit = true;
     }
-    else if(size > 2048 && size <= 4096) {
-        alloc_size_info->btwn_2048B_4096B++;
+    if(snaps && strtol(snaps, NULL, 10) > 0) {
+        snapshot_interval = strtol(snaps, NULL, 10);
     }
-    else {
-        alloc_size_info->over_4096B++;
+    if(heap && strtol(heap, NULL, 10) > 0) {
+        heap_stats_enabled = true;
     }
-
-    return;
+    if(format && strcmp(format, "json") == 0) {
+        report_format = REPORT_JSON;
+    }
+    else if(format && strcmp(format, "prom") == 0) {
+        report_format = REPORT_PROM;
+    }
+    if(report_fd_env && *report_fd_env) {
+        report_fd = strtol(report_fd_env, NULL, 10);
+    }
+    if(report_file && *report_file) {
+        report_path = report_file;
+        if(report_format != REPORT_PROM) {
+            report_fd = open(report_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if(report_fd < 0) {
+                log_error("Could not open report file %s\n", report_file);
+                report_fd = STDERR_FILENO;
+            }
+        }
+    }
+    use_hdr = (track_mode == TRACK_HEADER) || (sample_interval > 0);
 }
 
-static void fill_curr_age_info(alloc_age_info_t *alloc_age_info, time_t curr_time, time_t alloc_time)
+/* Draws the number of bytes until the next sample, exponentially
+ * distributed with mean sample_interval (a Poisson process over bytes) */
+static int64_t next_sample_interval(void)
 {
-    long time_diff = 0;
-
-    if(!alloc_age_info) {
-        return;
-    }
+    uint64_t  x = sampler.rng;
+    double    u = 0;
 
-    if(curr_time < alloc_time) {
-        return;
+    if(x == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        x = ((uintptr_t)&sampler ^ (uint64_t)ts.tv_nsec) | 1;
     }
-    time_diff = curr_time - alloc_time;
+    /* xorshift64* */
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sampler.rng = x;
+
+    u = ((x * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+    return (int64_t)(-log(1.0 - u) * sample_interval) + 1;
+}
 
-    if(time_diff <= 1) {
-        alloc_age_info->under_1s++;
+/* Whether the next allocation of size bytes enters the live set */
+static inline bool sample_alloc(size_t size)
+{
+    if(sample_interval == 0) {
+        return true;
     }
-    else if(time_diff > 1 && time_diff <= 10) {
-        alloc_age_info->btwn_1s_10s++;
+    if(__builtin_expect(sampler.rng == 0, 0)) {
+        sampler.bytes_until_sample = next_sample_interval();
     }
-    else if(time_diff > 10 && time_diff <= 100) {
-        alloc_age_info->btwn_10s_100s++;
+
+    sampler.bytes_until_sample -= size;
+    if(sampler.bytes_until_sample > 0) {
+        return false;
     }
-    else if(time_diff > 100 && time_diff <= 1000) {
-        alloc_age_info->btwn_100s_1000s++;
+    sampler.bytes_until_sample = next_sample_interval();
+    return true;
+}
+
+/* Unbiased estimate of the allocations a sampled block stands for.
+ * A block of size s is sampled with probability 1 - exp(-s/interval). */
+static inline double sample_weight(size_t size, long interval)
+{
+    if(interval == 0) {
+        return 1.0;
     }
-    else {
-        alloc_age_info->over_1000s++;
+    if(size == 0) {
+        size = 1;
     }
+    return 1.0 / (1.0 - exp(-(double)size / interval));
+}
 
-    return;
+/* The weight of a block as a whole number of allocations: rounded up with
+ * probability equal to its fractional part, so the counts stay unbiased.
+ * The draw is a hash of the record, so a block always rounds the same way
+ * and its free takes back exactly what its allocation added. */
+static inline int64_t sample_count(alloc_info_t *info, double weight)
+{
+    double   whole = floor(weight);
+    uint64_t h = info->alloc_ts ^ (info->alloc_sz * 0x9e3779b97f4a7c15ULL);
+
+    if(weight == whole) {
+        return (int64_t)whole;
+    }
+    /* MurmurHash3 64-bit finalizer */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (int64_t)whole + ((h >> 11) * (1.0 / 9007199254740992.0) < weight - whole);
 }
 
-static void print_curr_size_info(alloc_size_info_t *alloc_size_info)
+/* Live allocation counters, maintained in every mode. The block's name
+ * row is in this thread's own slot, whoever allocated it. fresh counts a
+ * new allocation at the block's site. Returns the bytes the block stands
+ * for. */
+static int64_t count_curr_alloc(alloc_info_t *info, int delta, bool fresh)
 {
-    if(!alloc_size_info) {
-        return;
+    thread_stats_t *stats = thread_stats_get();
+    double          weight = sample_weight(info->alloc_sz, sample_rates[info->sample_idx]);
+    int64_t         bytes = llround(weight * info->alloc_sz);
+    int64_t         num = delta * sample_count(info, weight);
+    int64_t         size = delta * bytes;
+    int             idx;
+
+    thread_stat_add(stats, &stats->ctrs.live_num, num);
+    thread_stat_add(stats, &stats->ctrs.live_sz, size);
+    idx = size_hist_index(info->alloc_sz);
+    thread_stat_add(stats, &stats->ctrs.live_hist.count[idx], num);
+    thread_stat_add(stats, &stats->ctrs.live_hist.bytes[idx], size);
+    thread_stat_add(stats, &stats->by_name[info->name_id].live_num, num);
+    thread_stat_add(stats, &stats->by_name[info->name_id].live_sz, size);
+    thread_stats_age_add(stats, info->alloc_ts, num);
+    if(info->stack_id) {
+        stack_account(info->stack_id, num, size, fresh ? num : 0);
     }
+    return bytes;
+}
 
-    log_info("\nCurrent allocations by size:\n");
-    log_info("0 - 4 bytes: %ld\n", alloc_size_info->under_4B);
-    log_info("4 - 8 bytes: %ld\n", alloc_size_info->btwn_4B_8B);
-    log_info("8 - 16 bytes: %ld\n", alloc_size_info->btwn_8B_16B);
-    log_info("16 - 32 bytes: %ld\n", alloc_size_info->btwn_16B_32B);
-    log_info("32 - 64 bytes: %ld\n", alloc_size_info->btwn_32B_64B);
-    log_info("64 - 128 bytes: %ld\n", alloc_size_info->btwn_64B_128B);
-    log_info("128 - 256 bytes: %ld\n", alloc_size_info->btwn_128B_256B);
-    log_info("256 - 512 bytes: %ld\n", alloc_size_info->btwn_256B_512B);
-    log_info("512 - 1024 bytes: %ld\n", alloc_size_info->btwn_512B_1024B);
-    log_info("1024 - 2048 bytes: %ld\n", alloc_size_info->btwn_1024B_2048B);
-    log_info("2048 - 4096 bytes: %ld\n", alloc_size_info->btwn_2048B_4096B);
-    log_info("4096+ bytes: %ld\n", alloc_size_info->over_4096B);
+/* Returns the interned call stack of the current allocation, 0 if none */
+static uint32_t capture_stack(void)
+{
+    void *frames[STACK_MAX_DEPTH];
+    int   depth = 0;
 
-    return;
+    if(!stacks_enabled) {
+        return 0;
+    }
+    if(__builtin_expect(!stack_thread_ready, 0)) {
+        int saved = no_hook;
+
+        /* Looking up the stack bounds may allocate */
+        no_hook = 1;
+        stack_thread_init();
+        no_hook = saved;
+    }
+    depth = stack_capture(frames, stack_depth);
+    return stack_intern(frames, depth);
 }
 
-static void print_curr_age_info(alloc_age_info_t *alloc_age_info)
+/* Returns the header of a tracked block when use_hdr is set, or NULL for
+ * any other pointer (unsampled blocks, bootstrap arena, aligned allocators) */
+static inline alloc_hdr_t* get_alloc_hdr(void *ptr)
 {
-    if(!alloc_age_info) {
-        return;
+    alloc_hdr_t *hdr = (alloc_hdr_t*)ptr - 1;
+
+    if(boot_owns(ptr)) {
+        return NULL;
+    }
+    if(hdr->magic != ((uintptr_t)ptr ^ ALLOC_HDR_MAGIC)) {
+        return NULL;
     }
+    return hdr;
+}
+
+/* Converts a block with room for the header into the user pointer */
+static inline void* hdr_to_user(void *base)
+{
+    return base ? (alloc_hdr_t*)base + 1 : NULL;
+}
 
-    log_info("\nCurrent allocations by age:\n");
-    log_info("0 - 1 sec: %ld\n", alloc_age_info->under_1s);
-    log_info("1 - 10 sec: %ld\n", alloc_age_info->btwn_1s_10s);
-    log_info("10 - 100 sec: %ld\n", alloc_age_info->btwn_10s_100s);
-    log_info("100 - 1000 sec: %ld\n", alloc_age_info->btwn_100s_1000s);
-    log_info("1000+ sec: %ld\n", alloc_age_info->over_1000s);
+/* Start of the real block a tracked header lives in */
+static inline void* hdr_base(void *ptr, alloc_hdr_t *hdr)
+{
+    unsigned shift = hdr->info.flags >> ALLOC_OFFSET_SHIFT;
 
-    return;
+    return shift ? (char*)ptr - ((size_t)1 << shift) : (void*)hdr;
+}
+
+static inline bool hdr_size_overflows(size_t size)
+{
+    if(size > SIZE_MAX - sizeof(alloc_hdr_t)) {
+        errno = ENOMEM;
+        return true;
+    }
+    return false;
 }
 
-static void print_stats(bool force_print)
+/* A block that went through reallocs ends its chain when freed */
+static void count_realloc_chain(alloc_info_t *info)
 {
-    static time_t      time_last_printed = 0;
-    static time_t      curr_time;
-    list_node_t       *current = NULL;
-    size_t             ovrl_alloc_sz = 0;
-    long               ovrl_num_alloc = 0;
-    long long          curr_alloc_sz = 0;
-    long               curr_num_alloc = 0;
-    alloc_size_info_t  curr_alloc_sz_info = {0};
-    alloc_age_info_t   curr_alloc_age_info = {0};
+    thread_stats_t *stats = NULL;
+    unsigned        links = (info->flags >> ALLOC_CHAIN_SHIFT) & ALLOC_CHAIN_MAX;
+    int             idx = 0;
 
-    /* print stats if 5 seconds have elapsed since last print
-       or force print */
-    time(&curr_time);
-    if((force_print == false) &&(curr_time - time_last_printed) < 5) {
+    if(!links) {
         return;
     }
-    time_last_printed = curr_time;
+    stats = thread_stats_get();
+    idx = 31 - __builtin_clz(links);
+    if(idx >= REALLOC_CHAIN_BUCKETS) {
+        idx = REALLOC_CHAIN_BUCKETS - 1;
+    }
+    thread_stat_add(stats, &stats->ctrs.realloc_chains[idx], 1);
+}
 
-    pthread_mutex_lock(&alloc_lock);
-    current = curr_alloc_list;
+/* A freed block's lifetime, from the birth stamp already in its record.
+ * Blocks that only leave the profile (sampled reallocs) are not counted. */
+static void count_lifetime(alloc_info_t *info)
+{
+    thread_stats_t *stats = thread_stats_get();
+    uint64_t        now = prof_clock_ns();
+    uint64_t        ns = now > info->alloc_ts ? now - info->alloc_ts : 0;
+    int64_t         num = sample_count(info, sample_weight(info->alloc_sz,
+                                                           sample_rates[info->sample_idx]));
+
+    thread_stat_add(stats, &stats->ctrs.lifetimes.count[life_hist_index(ns)], num);
+    thread_stat_add(stats, &stats->ctrs.lifetime_ns, num * (int64_t)ns);
+    if(info->stack_id) {
+        stack_account_free(info->stack_id, ns, num);
+    }
+}
 
-    /* Traverse Linked list */
-    while(current != NULL) {
-        alloc_info_t *info = (alloc_info_t*)current->val;
-        curr_num_alloc++;
-        curr_alloc_sz += info->alloc_sz;
-        current = current->next;
+/* Realloc of a tracked block. The record stays with the block: it keeps
+ * its birth and site, takes the new size and adds a link to the chain. */
+static void resize_curr_alloc(alloc_info_t *info, size_t size, bool moved)
+{
+    thread_stats_t *stats = thread_stats_get();
+    size_t          curr_size = info->alloc_sz;
+    size_t          copied = moved ? (size < curr_size ? size : curr_size) : 0;
+    unsigned        links = (info->flags >> ALLOC_CHAIN_SHIFT) & ALLOC_CHAIN_MAX;
 
-        fill_curr_size_info(&curr_alloc_sz_info, info->alloc_sz);
-        fill_curr_age_info(&curr_alloc_age_info, curr_time, info->alloc_time);
+    count_curr_alloc(info, -1, false);
+    info->alloc_sz = size;
+    if(links < ALLOC_CHAIN_MAX) {
+        info->flags += 1 << ALLOC_CHAIN_SHIFT;
     }
+    count_curr_alloc(info, 1, false);
 
-    ovrl_alloc_sz  = overall_alloc_sz;
-    ovrl_num_alloc = overall_num_alloc;
-    pthread_mutex_unlock(&alloc_lock);
+    thread_stat_add(stats, &stats->ctrs.num_realloc, 1);
+    if(moved) {
+        thread_stat_add(stats, &stats->ctrs.realloc_moved, 1);
+        thread_stat_add(stats, &stats->ctrs.realloc_copied, copied);
+    }
+    if(info->stack_id) {
+        stack_account_realloc(info->stack_id, copied);
+    }
+    add_realloc_growth(curr_size, size);
+}
 
-    log_info("\n\n>>>>>>>>>> %s", ctime(&curr_time));
-    log_info("Overall Stats:\n");
-    log_info("Overall number of allocations: %ld\n", ovrl_num_alloc);
-    log_info("Overall allocation size:%ld \n\n", ovrl_alloc_sz);
-    log_info("Current Stats:\n");
-    log_info("Current number of allocations:%ld\n", curr_num_alloc);
-    log_info("Current allocation size:%lld\n", curr_alloc_sz);
+/* Replaced callback of hash_insert and hash_move, under the shard lock.
+ * A record still keyed by an address that was handed out again: its block
+ * was freed where no hook saw it, or by a realloc that moved it and has not
+ * re-keyed the record yet. That realloc owns a record it marked resizing,
+ * and re-keys it once done, so the record is only taken when unmarked. */
+static void take_stale(void *key, void *val, void *arg)
+{
+    alloc_info_t *info = (alloc_info_t*)val;
 
-    print_curr_size_info(&curr_alloc_sz_info);
-    print_curr_age_info(&curr_alloc_age_info);
-    return;
+    if(!(__atomic_load_n(&info->flags, __ATOMIC_RELAXED) & ALLOC_FLAG_RESIZING)) {
+        *(alloc_info_t**)arg = info;
+    }
 }
 
-/*-----------------------------------------------------------------------------
-                          EXTERNAL FUNCTIONS
------------------------------------------------------------------------------*/
-void* malloc(size_t size)
+/* Only table records outlive their block, a header went with the block's
+ * memory */
+static void release_stale(alloc_info_t *stale, alloc_info_t *info)
 {
-    void* ret_ptr = NULL;
+    if(!stale || stale == info || use_hdr) {
+        return;
+    }
+    count_curr_alloc(stale, -1, false);
+    slab_free(&alloc_info_cache, stale);
+}
 
-    /* assign "real" malloc function to func_ptr using dlsym */
-    if(orig_malloc == NULL) {
-        orig_malloc = (orig_malloc_t)dlsym(RTLD_NEXT, "malloc");
-        if(!orig_malloc) {
-            assert(0);
-        }
+/* flags go into the record before it can be found, by the table or by
+ * its header's magic: a heap walk needs the offset of an aligned block */
+static int add_curr_alloc(void *ptr, size_t size, uint16_t flags)
+{
+    alloc_info_t *info = NULL;
+    alloc_info_t *stale = NULL;
+
+    if(use_hdr) {
+        alloc_hdr_t *hdr = (alloc_hdr_t*)ptr - 1;
+
+        info = &hdr->info;
+        info->flags = ALLOC_FLAG_HEADER | flags;
+        hdr->magic = (uintptr_t)ptr ^ ALLOC_HDR_MAGIC;
     }
-    if(orig_calloc == NULL) {
-        orig_calloc = (orig_calloc_t)dlsym(RTLD_NEXT, "calloc");
-        if(!orig_calloc) {
-            assert(0);
+    else {
+        info = (alloc_info_t*)slab_alloc(&alloc_info_cache);
+        if (!info) {
+            log_error("Could not allocate info for %p\n", ptr);
+            return -1;
         }
+        info->flags = flags;
     }
-    if(orig_realloc == NULL) {
-        orig_realloc = (orig_realloc_t)dlsym(RTLD_NEXT, "realloc");
-        if(!orig_realloc) {
-            assert(0);
+    info->alloc_sz = size;
+    info->stack_id = capture_stack();
+    info->alloc_ts = prof_clock_ns();
+    info->sample_idx = sample_idx;
+    info->name_id = __atomic_load_n(&thread_stats_get()->name_id, __ATOMIC_RELAXED);
+
+    if (track_mode == TRACK_TABLE &&
+        hash_insert(&curr_alloc_table, ptr, info, take_stale, &stale) != 0) {
+        log_error("Could not insert node:%p\n", ptr);
+        if(!(info->flags & ALLOC_FLAG_HEADER)) {
+            slab_free(&alloc_info_cache, info);
         }
+        return -1;
     }
-    if(orig_free == NULL) {
-        orig_free = (orig_free_t)dlsym(RTLD_NEXT, "free");
-        if(!orig_free) {
-            assert(0);
+    release_stale(stale, info);
+    count_curr_alloc(info, 1, true);
+    return 0;
+}
+
+/* hdr is the block's header when use_hdr is set. freed is false when the
+ * block lives on untracked. weighted_sz, if given, is set to the bytes the
+ * block stood for in the live set. */
+static int del_curr_alloc(void *ptr, alloc_hdr_t *hdr, bool freed, int64_t *weighted_sz)
+{
+    alloc_info_t *info = NULL;
+    int64_t       sz = 0;
+
+    if(track_mode == TRACK_TABLE) {
+        /* Blocks from before the hooks were up are expected here, and
+           rejected quietly */
+        info = hash_delete(&curr_alloc_table, ptr);
+        if(!info) {
+            return -1;
         }
     }
+    else {
+        info = &hdr->info;
+    }
+    if(hdr) {
+        hdr->magic = 0;
+    }
 
-    /* call "real" malloc function */
-    ret_ptr = orig_malloc(size);
-    log_debug("malloc size:%ld ret_ptr:%p\n", size, ret_ptr);
+    sz = count_curr_alloc(info, -1, false);
+    count_realloc_chain(info);
+    if(freed) {
+        count_lifetime(info);
+    }
+    if(weighted_sz) {
+        *weighted_sz = sz;
+    }
+    if(!(info->flags & ALLOC_FLAG_HEADER)) {
+        slab_free(&alloc_info_cache, info);
+    }
+    return 0;
+}
 
-    /* update stats */
-    if(ret_ptr) {
-        increment_overall_num_alloc();
-        add_overall_alloc_sz(size);
-        add_curr_alloc_list(ret_ptr, size);
-        print_stats(false);
+/* Formats a size with a binary unit suffix, e.g. 1536 -> "1.5K" */
+static void format_size(char *buf, size_t len, size_t size)
+{
+    static const char units[] = "KMGT";
+    double            val = size;
+    int               unit = -1;
+    rbuf_t            rb;
+
+    while(val >= 1024 && unit < (int)sizeof(units) - 2) {
+        val /= 1024;
+        unit++;
     }
-    return ret_ptr;
+    rbuf_init(&rb, buf, len - 1);
+    if(unit < 0) {
+        rbuf_printf(&rb, "%zu", size);
+    }
+    else {
+        rbuf_printf(&rb, "%.4g%c", val, units[unit]);
+    }
+    buf[rb.len] = '\0';
 }
 
-void* calloc(size_t nmemb, size_t size)
+/* "lower - upper" of size bucket i, upper is "max" for the last one */
+static void format_size_bucket(int i, char *lo, char *hi, size_t len)
 {
-    void* ret_ptr = NULL;
+    format_size(lo, len, size_hist_lower(i));
+    if(i + 1 < SIZE_HIST_BUCKETS) {
+        format_size(hi, len, size_hist_lower(i + 1));
+    }
+    else {
+        strcpy(hi, "max");
+    }
+}
+
+/* Formats a duration with a unit suffix, e.g. 1500 -> "1.5us" */
+static void format_duration(char *buf, size_t len, uint64_t ns)
+{
+    rbuf_t rb;
 
-    /* dlsym calls calloc, to avoid endless recursion
-       return static allocated buffer */
-    if(no_hook && orig_calloc == NULL) {
-        return alloc_buff;
+    rbuf_init(&rb, buf, len - 1);
+    if(ns < 1000) {
+        rbuf_printf(&rb, "%lluns", (unsigned long long)ns);
+    }
+    else if(ns < 1000000) {
+        rbuf_printf(&rb, "%.3gus", ns / 1e3);
+    }
+    else if(ns < 1000000000) {
+        rbuf_printf(&rb, "%.3gms", ns / 1e6);
+    }
+    else {
+        rbuf_printf(&rb, "%.4gs", ns / 1e9);
     }
+    buf[rb.len] = '\0';
+}
 
-    /* assign "real" calloc function to func_ptr using dlsym */
-    if(orig_calloc == NULL) {
-        no_hook = 1;
-        orig_calloc = (orig_calloc_t)dlsym(RTLD_NEXT, "calloc");
-        no_hook = 0;
+/* One line per non-empty bucket, [lower - next lower) */
+static void print_curr_size_info(rbuf_t *rb, size_hist_t *hist)
+{
+    int i;
+
+    if(!hist) {
+        return;
     }
-    if(orig_malloc == NULL) {
-        orig_malloc = (orig_malloc_t)dlsym(RTLD_NEXT, "malloc");
-        if(!orig_malloc) {
-            assert(0);
+
+    rbuf_puts(rb, "\nCurrent allocations by size:\n");
+    for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+        char lo[16];
+        char hi[16];
+        char bytes[16];
+
+        if(hist->count[i] == 0) {
+            continue;
         }
+        format_size_bucket(i, lo, hi, sizeof(lo));
+        format_size(bytes, sizeof(bytes), hist->bytes[i]);
+        rbuf_printf(rb, "%8s - %-8s count:%ld bytes:%s\n", lo, hi, (long)hist->count[i], bytes);
     }
-    if(orig_realloc == NULL) {
-        orig_realloc = (orig_realloc_t)dlsym(RTLD_NEXT, "realloc");
-        if(!orig_realloc) {
-            assert(0);
-        }
+
+    return;
+}
+
+/* live_num is the whole live set; what the epochs miss is older than
+   their oldest level and goes to the last bucket */
+static void collect_curr_age_info(age_hist_t *hist, int64_t live_num)
+{
+    int64_t total = 0;
+    int     i;
+
+    thread_stats_age_hist(hist, prof_clock_ns());
+    for(i = 0; i < AGE_HIST_BUCKETS; i++) {
+        total += hist->count[i];
     }
-    if(orig_free == NULL) {
-        orig_free = (orig_free_t)dlsym(RTLD_NEXT, "free");
-        if(!orig_free) {
-            assert(0);
-        }
+    if(live_num > total) {
+        hist->count[AGE_HIST_BUCKETS - 1] += live_num - total;
     }
+}
 
-    /* call "real" calloc function */
-    ret_ptr = orig_calloc(nmemb, size);
-    log_debug("calloc size:%ld*%ld ret_ptr:%p\n", nmemb, size, ret_ptr);
+static void print_curr_age_info(rbuf_t *rb, age_hist_t *hist)
+{
+    int i;
 
-    /* update stats */
-    if(ret_ptr) {
-        increment_overall_num_alloc();
-        add_overall_alloc_sz(nmemb * size);
+    rbuf_puts(rb, "\nCurrent allocations by age:\n");
+    for(i = 0; i < AGE_HIST_BUCKETS; i++) {
+        rbuf_printf(rb, "%s: %ld\n", age_hist_label(i), (long)hist->count[i]);
+    }
+}
+
+typedef struct {
+    uint32_t       id;
+    stack_entry_t *entry;
+} site_rank_t;
+
+typedef struct {
+    site_rank_t  by_live[STACK_TABLE_SIZE < 100 ? STACK_TABLE_SIZE : 100];
+    site_rank_t  by_count[STACK_TABLE_SIZE < 100 ? STACK_TABLE_SIZE : 100];
+    site_rank_t  by_realloc[STACK_TABLE_SIZE < 100 ? STACK_TABLE_SIZE : 100];
+    site_rank_t  by_churn[STACK_TABLE_SIZE < 100 ? STACK_TABLE_SIZE : 100];
+    int          num_live;
+    int          num_count;
+    int          num_realloc;
+    int          num_churn;
+    int          max;
+} top_sites_t;
+
+/* Keeps rank[] sorted by key, descending, with at most max entries */
+static void rank_site(site_rank_t *rank, int *num, int max, uint32_t id,
+                      stack_entry_t *entry, int64_t (*key)(stack_entry_t*))
+{
+    int pos = *num;
 
-        add_curr_alloc_list(ret_ptr, size);
-        print_stats(false);
+    if(key(entry) <= 0 || (pos == max && key(rank[max - 1].entry) >= key(entry))) {
+        return;
+    }
+    if(pos == max) {
+        pos--;
     }
+    else {
+        (*num)++;
+    }
+    while(pos > 0 && key(rank[pos - 1].entry) < key(entry)) {
+        rank[pos] = rank[pos - 1];
+        pos--;
+    }
+    rank[pos].id = id;
+    rank[pos].entry = entry;
+}
 
-    return ret_ptr;
+static int64_t site_live_sz(stack_entry_t *entry)
+{
+    return __atomic_load_n(&entry->live_sz, __ATOMIC_RELAXED);
 }
 
-void* realloc(void* ptr, size_t size)
+static int64_t site_num_alloc(stack_entry_t *entry)
 {
-    void *ret_ptr = NULL;
-    size_t curr_size = 0;
+    return __atomic_load_n(&entry->num_alloc, __ATOMIC_RELAXED);
+}
+
+static int64_t site_num_realloc(stack_entry_t *entry)
+{
+    return __atomic_load_n(&entry->num_realloc, __ATOMIC_RELAXED);
+}
+
+static void site_lifetimes(stack_entry_t *entry, life_hist_t *hist)
+{
+    int i;
 
-    /* assign "real" realloc function to func_ptr using dlsym */
-    if(orig_realloc == NULL) {
-        orig_realloc = (orig_realloc_t)dlsym(RTLD_NEXT, "realloc");
+    for(i = 0; i < LIFE_HIST_BUCKETS; i++) {
+        hist->count[i] = __atomic_load_n(&entry->lifetimes.count[i], __ATOMIC_RELAXED);
     }
-    if(orig_malloc == NULL) {
-        orig_malloc = (orig_malloc_t)dlsym(RTLD_NEXT, "malloc");
-        if(!orig_malloc) {
-            assert(0);
-        }
+}
+
+static uint64_t site_median_lifetime(stack_entry_t *entry)
+{
+    life_hist_t hist;
+
+    site_lifetimes(entry, &hist);
+    return life_hist_quantile(&hist, 0.5);
+}
+
+/* Allocations of a site whose freed blocks mostly lived under churn_us,
+ * 0 for any other site */
+static int64_t site_churn(stack_entry_t *entry)
+{
+    life_hist_t hist;
+
+    site_lifetimes(entry, &hist);
+    if(life_hist_total(&hist) == 0 ||
+       life_hist_quantile(&hist, 0.5) >= (uint64_t)churn_us * 1000) {
+        return 0;
     }
-    if(orig_calloc == NULL) {
-        orig_calloc = (orig_calloc_t)dlsym(RTLD_NEXT, "calloc");
-        if(!orig_calloc) {
-            assert(0);
-        }
-    }    
-    if(orig_free == NULL) {
-        orig_free = (orig_free_t)dlsym(RTLD_NEXT, "free");
-        if(!orig_free) {
-            assert(0);
-        }
+    return site_num_alloc(entry);
+}
+
+static void collect_top_sites(uint32_t id, stack_entry_t *entry, void *arg)
+{
+    top_sites_t *top = (top_sites_t*)arg;
+
+    rank_site(top->by_live, &top->num_live, top->max, id, entry, site_live_sz);
+    rank_site(top->by_count, &top->num_count, top->max, id, entry, site_num_alloc);
+    rank_site(top->by_realloc, &top->num_realloc, top->max, id, entry, site_num_realloc);
+    rank_site(top->by_churn, &top->num_churn, top->max, id, entry, site_churn);
+}
+
+/* "symbol+0xoff (object)"; dladdr is only safe outside the hooks */
+static void format_frame(rbuf_t *rb, void *pc)
+{
+    Dl_info     dli;
+    const char *obj = "?";
+
+    if(!dladdr(pc, &dli)) {
+        rbuf_printf(rb, "%p (?)", pc);
+        return;
+    }
+    if(dli.dli_fname) {
+        obj = strrchr(dli.dli_fname, '/') ? strrchr(dli.dli_fname, '/') + 1 : dli.dli_fname;
+    }
+    if(dli.dli_sname) {
+        rbuf_printf(rb, "%s+0x%lx (%s)", dli.dli_sname,
+                    (unsigned long)((char*)pc - (char*)dli.dli_saddr), obj);
+    }
+    else {
+        rbuf_printf(rb, "%p (%s)", pc, obj);
     }
+}
 
-    /* call "real" realloc function */
-    ret_ptr = orig_realloc(ptr, size);
-    log_debug("realloc ptr:%p size:%ld ret_ptr:%p\n", ptr, size, ret_ptr);
+static void print_site_frames(rbuf_t *rb, stack_entry_t *entry)
+{
+    uint32_t i;
 
-    /* update stats */
-    if(ptr) {
-        /* get current alloc size */
-        pthread_mutex_lock(&alloc_lock);
-        alloc_info_t *curr_info = list_find(curr_alloc_list, ptr);
-        pthread_mutex_unlock(&alloc_lock);
+    if(entry->depth == 0) {
+        rbuf_puts(rb, "    <no stack>\n");
+    }
+    for(i = 0; i < entry->depth; i++) {
+        rbuf_puts(rb, "    ");
+        format_frame(rb, entry->frames[i]);
+        rbuf_puts(rb, "\n");
+    }
+}
 
-        del_curr_alloc_list(ptr);
+static void print_top_sites(rbuf_t *rb, site_rank_t *rank, int num, const char *title)
+{
+    int i;
+
+    rbuf_printf(rb, "\n%s\n", title);
+    for(i = 0; i < num; i++) {
+        stack_entry_t *entry = rank[i].entry;
+
+        rbuf_printf(rb, "#%d site:%u live size:%lld live allocations:%lld allocations:%lld\n",
+                    i + 1, rank[i].id,
+                    (long long)__atomic_load_n(&entry->live_sz, __ATOMIC_RELAXED),
+                    (long long)__atomic_load_n(&entry->live_num, __ATOMIC_RELAXED),
+                    (long long)__atomic_load_n(&entry->num_alloc, __ATOMIC_RELAXED));
+        print_site_frames(rb, entry);
     }
-    if(ret_ptr) {
-        /* If new size is greater than previous, add the difference
-           to overall stats */
-        if((curr_size != 0) && (size > curr_size)) {
-            add_overall_alloc_sz(size - curr_size);
-        }
-        add_curr_alloc_list(ret_ptr, size);
+}
+
+/* Label of realloc chain bucket i: "1", "2 - 3", ... "64+" */
+static void format_chain_bucket(rbuf_t *rb, int i)
+{
+    if(i == 0) {
+        rbuf_puts(rb, "1");
+    }
+    else if(i + 1 < REALLOC_CHAIN_BUCKETS) {
+        rbuf_printf(rb, "%d - %d", 1 << i, (2 << i) - 1);
+    }
+    else {
+        rbuf_printf(rb, "%d+", 1 << i);
     }
+}
+
+/* Reallocs of tracked blocks. Many reallocs per allocation at a site
+ * usually means a buffer grown step by step without reserving up front. */
+static void print_realloc_info(rbuf_t *rb, thread_counters_t *ovrl, top_sites_t *top)
+{
+    int i;
 
-    if (ptr || ret_ptr) {
-        print_stats(false);
+    if(ovrl->num_realloc == 0) {
+        return;
+    }
+    rbuf_printf(rb, "\nReallocs: %lld in place:%lld moved:%lld bytes copied:%lld\n",
+                (long long)ovrl->num_realloc,
+                (long long)(ovrl->num_realloc - ovrl->realloc_moved),
+                (long long)ovrl->realloc_moved, (long long)ovrl->realloc_copied);
+    rbuf_puts(rb, "Freed blocks by reallocs:\n");
+    for(i = 0; i < REALLOC_CHAIN_BUCKETS; i++) {
+        format_chain_bucket(rb, i);
+        rbuf_printf(rb, ": %lld\n", (long long)ovrl->realloc_chains[i]);
     }
 
-    return ret_ptr;
+    if(!top || top->num_realloc == 0) {
+        return;
+    }
+    rbuf_puts(rb, "\nTop realloc sites:\n");
+    for(i = 0; i < top->num_realloc; i++) {
+        stack_entry_t *entry = top->by_realloc[i].entry;
+        int64_t        allocs = site_num_alloc(entry);
+
+        rbuf_printf(rb, "#%d site:%u reallocs:%lld per allocation:%.1f bytes copied:%lld\n",
+                    i + 1, top->by_realloc[i].id, (long long)site_num_realloc(entry),
+                    allocs > 0 ? (double)site_num_realloc(entry) / allocs : 0.0,
+                    (long long)__atomic_load_n(&entry->realloc_copied, __ATOMIC_RELAXED));
+        print_site_frames(rb, entry);
+    }
 }
 
-void free(void* ptr)
+/* Lifetimes of freed blocks. secs is the window of the overall counters,
+ * site_secs that of the site counters, which "reset" leaves alone. Sites
+ * allocating at a high rate blocks that die young are the candidates for
+ * a pool or the stack. */
+static void print_lifetime_info(rbuf_t *rb, thread_counters_t *ovrl, top_sites_t *top,
+                                double secs, double site_secs)
 {
-    /* assign "real" free function to func_ptr using dlsym */
-    if(orig_free == NULL) {
-        orig_free = (orig_free_t)dlsym(RTLD_NEXT, "free");
+    int64_t total = life_hist_total(&ovrl->lifetimes);
+    char    lo[16];
+    char    hi[16];
+    int     i;
+
+    if(secs > 0) {
+        rbuf_printf(rb, "\nAllocation rate:%.1f/s free rate:%.1f/s\n",
+                    ovrl->num_alloc / secs, ovrl->num_free / secs);
     }
-    if(orig_malloc == NULL) {
-        orig_malloc = (orig_malloc_t)dlsym(RTLD_NEXT, "malloc");
-        if(!orig_malloc) {
-            assert(0);
-        }
+    if(total <= 0) {
+        return;
     }
-    if(orig_calloc == NULL) {
-        orig_calloc = (orig_calloc_t)dlsym(RTLD_NEXT, "calloc");
-        if(!orig_calloc) {
-            assert(0);
+    format_duration(lo, sizeof(lo), life_hist_quantile(&ovrl->lifetimes, 0.5));
+    format_duration(hi, sizeof(hi), ovrl->lifetime_ns / total);
+    rbuf_printf(rb, "Freed allocations by lifetime (median:%s mean:%s):\n", lo, hi);
+    for(i = 0; i < LIFE_HIST_BUCKETS; i++) {
+        if(ovrl->lifetimes.count[i] == 0) {
+            continue;
         }
-    }
-    if(orig_realloc == NULL) {
-        orig_realloc = (orig_realloc_t)dlsym(RTLD_NEXT, "realloc");
-        if(!orig_realloc) {
-            assert(0);
+        format_duration(lo, sizeof(lo), life_hist_lower(i));
+        if(i + 1 < LIFE_HIST_BUCKETS) {
+            format_duration(hi, sizeof(hi), life_hist_lower(i + 1));
+        }
+        else {
+            strcpy(hi, "max");
         }
+        rbuf_printf(rb, "%8s - %-8s count:%lld\n", lo, hi, (long long)ovrl->lifetimes.count[i]);
     }
 
-    log_debug("free %p\n", ptr);
+    if(!top || top->num_churn == 0 || site_secs <= 0) {
+        return;
+    }
+    rbuf_printf(rb, "\nTop short-lived allocation sites (median lifetime under %ldus):\n",
+                churn_us);
+    for(i = 0; i < top->num_churn; i++) {
+        stack_entry_t *entry = top->by_churn[i].entry;
+        life_hist_t    hist;
+
+        site_lifetimes(entry, &hist);
+        format_duration(lo, sizeof(lo), life_hist_quantile(&hist, 0.5));
+        rbuf_printf(rb, "#%d site:%u allocations/s:%.1f frees:%lld median lifetime:%s\n",
+                    i + 1, top->by_churn[i].id, site_num_alloc(entry) / site_secs,
+                    (long long)life_hist_total(&hist), lo);
+        print_site_frames(rb, entry);
+    }
+}
 
-    /* Do not free the static buffer */
-    if(ptr != alloc_buff) {
-        orig_free(ptr);
+/* Sums the thread counters, less the overall counts discarded by the
+ * "reset" control command. Caller holds report_lock. */
+static void sum_counters(thread_counters_t *out)
+{
+    int i;
+
+    thread_stats_sum(out);
+    out->num_alloc -= counters_base.num_alloc;
+    out->alloc_sz -= counters_base.alloc_sz;
+    out->num_free -= counters_base.num_free;
+    out->free_sz -= counters_base.free_sz;
+    out->cxx_num_alloc -= counters_base.cxx_num_alloc;
+    out->cxx_alloc_sz -= counters_base.cxx_alloc_sz;
+    out->num_realloc -= counters_base.num_realloc;
+    out->realloc_moved -= counters_base.realloc_moved;
+    out->realloc_copied -= counters_base.realloc_copied;
+    for(i = 0; i < REALLOC_CHAIN_BUCKETS; i++) {
+        out->realloc_chains[i] -= counters_base.realloc_chains[i];
+    }
+    for(i = 0; i < LIFE_HIST_BUCKETS; i++) {
+        out->lifetimes.count[i] -= counters_base.lifetimes.count[i];
+    }
+    out->lifetime_ns -= counters_base.lifetime_ns;
+}
 
-        /* update stats */
-        if(ptr) {
-            del_curr_alloc_list(ptr);
+/* Per thread name counters, less the counts discarded by "reset". Fills
+ * order[] with the names that saw any use, by allocated bytes, and returns
+ * their number. Caller holds report_lock. */
+static int sum_thread_names(thread_name_stats_t *names, int *order)
+{
+    int num = thread_stats_by_name(names);
+    int n = 0;
+    int i;
+
+    for(i = 0; i < num; i++) {
+        thread_name_ctrs_t *ctrs = &names[i].ctrs;
+        int                 pos = n++;
+
+        ctrs->num_alloc -= names_base[i].ctrs.num_alloc;
+        ctrs->alloc_sz -= names_base[i].ctrs.alloc_sz;
+        ctrs->num_free -= names_base[i].ctrs.num_free;
+        ctrs->free_sz -= names_base[i].ctrs.free_sz;
+        if(!ctrs->num_alloc && !ctrs->num_free && !ctrs->live_num && !names[i].threads) {
+            n--;
+            continue;
+        }
+        while(pos > 0 && names[order[pos - 1]].ctrs.alloc_sz < ctrs->alloc_sz) {
+            order[pos] = order[pos - 1];
+            pos--;
         }
-        print_stats(false);
+        order[pos] = i;
     }
-    return;
+    return n;
 }
 
+/* Gathers and writes one report, see the report section below */
+static void write_report(bool at_exit);
 
-/*-----------------------------------------------------------------------------
-                    GCC constructor and destructor - Unused
-Cannot use constructors to assign pointers since constructor (init) is not
-guaranteed to be invoked before other memory alloc functions.
------------------------------------------------------------------------------*/
-__attribute__ ((constructor)) void init(void)
+static void* reporter_main(void *arg)
 {
-    log_debug("Memory Profiler Constructor called!!\n");
-    return;
+    struct timespec deadline;
+
+    /* Symbolizing and tzset in the report may allocate, keep it out of the stats */
+    no_hook = 1;
+
+    prof_clock_calibrate();
+
+    pthread_mutex_lock(&report_lock);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while(!reporter_stop) {
+        long interval = report_interval;
+
+        /* Paused by the "interval" control command */
+        if(interval <= 0) {
+            pthread_cond_wait(&report_cond, &report_lock);
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            continue;
+        }
+
+        deadline.tv_sec += interval;
+        while(!reporter_stop && report_interval == interval &&
+              pthread_cond_timedwait(&report_cond, &report_lock, &deadline) == 0);
+        if(reporter_stop) {
+            break;
+        }
+        if(report_interval != interval) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            continue;
+        }
+        write_report(false);
+    }
+    pthread_mutex_unlock(&report_lock);
+    return NULL;
 }
-__attribute__ ((destructor)) void fini(void)
+
+/* Caller holds report_lock, or is the only thread */
+static void start_reporter_thread(void)
+{
+    pthread_t       tid;
+    pthread_attr_t  attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&tid, &attr, reporter_main, NULL) != 0) {
+        log_error("Could not start reporter thread\n");
+    }
+    else {
+        reporter_running = true;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static void start_reporter(void)
+{
+    pthread_condattr_t cond_attr;
+
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&report_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    reporter_running = false;
+    if(report_interval > 0) {
+        start_reporter_thread();
+    }
+}
+
+/* Threads do not survive fork, the child gets its own reporter */
+static void reporter_fork_child(void)
+{
+    pthread_mutex_init(&report_lock, NULL);
+    start_reporter();
+}
+
+/* Stats segment publisher (MEMPROF_SHM). The thread only ever writes the
+ * segment; readers poll it at their own pace. */
+static void publish_stats(void)
+{
+    static shm_stats_t  snap;
+    thread_counters_t   ovrl;
+    age_hist_t          ages;
+    int                 i;
+
+    pthread_mutex_lock(&report_lock);
+    sum_counters(&ovrl);
+    pthread_mutex_unlock(&report_lock);
+    collect_curr_age_info(&ages, ovrl.live_num);
+
+    snap.num_alloc = ovrl.num_alloc;
+    snap.alloc_sz = ovrl.alloc_sz;
+    snap.num_free = ovrl.num_free;
+    snap.free_sz = ovrl.free_sz;
+    snap.cxx_num_alloc = ovrl.cxx_num_alloc;
+    snap.cxx_alloc_sz = ovrl.cxx_alloc_sz;
+    snap.live_num = ovrl.live_num;
+    snap.live_sz = ovrl.live_sz;
+    snap.sample_interval = sample_interval;
+    snap.profiler_mem = hash_mem_usage(&curr_alloc_table) + slab_mem_usage(&alloc_info_cache) +
+                        stack_mem_usage();
+    for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+        snap.size_lower[i] = size_hist_lower(i);
+        snap.size_count[i] = ovrl.live_hist.count[i];
+        snap.size_bytes[i] = ovrl.live_hist.bytes[i];
+    }
+    for(i = 0; i < AGE_HIST_BUCKETS; i++) {
+        snap.age_lower[i] = age_hist_lower(i);
+        snap.age_count[i] = ages.count[i];
+    }
+    shm_stats_publish(&snap);
+}
+
+static void* publisher_main(void *arg)
+{
+    struct timespec deadline;
+
+    no_hook = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    for(;;) {
+        publish_stats();
+
+        deadline.tv_nsec += (shm_interval % 1000) * 1000000;
+        deadline.tv_sec += shm_interval / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+    }
+    return NULL;
+}
+
+static void start_publisher(void)
+{
+    pthread_t       tid;
+    pthread_attr_t  attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&tid, &attr, publisher_main, NULL) != 0) {
+        log_error("Could not start publisher thread\n");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* The child publishes into a segment of its own */
+static void publisher_fork_child(void)
+{
+    shm_stats_fork_child();
+    start_publisher();
+}
+
+/* Live-set snapshots (MEMPROF_SNAPSHOT), see snap_ring.h. snap_lock
+ * guards the two states below, which are too big for a thread stack. */
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static snap_state_t    snap_curr;
+static snap_state_t    snap_growth;
+
+static void collect_site_cells(uint32_t id, stack_entry_t *entry, void *arg)
+{
+    snap_state_t *state = (snap_state_t*)arg;
+
+    state->sites[id].num = __atomic_load_n(&entry->live_num, __ATOMIC_RELAXED);
+    state->sites[id].bytes = __atomic_load_n(&entry->live_sz, __ATOMIC_RELAXED);
+}
+
+/* Reads the per-thread and per-site counters, the records are not
+ * walked. Returns the sequence number of the snapshot, or -1. */
+static int64_t take_snapshot(void)
+{
+    thread_counters_t  ovrl;
+    int64_t            seq = -1;
+    int                i;
+
+    pthread_mutex_lock(&report_lock);
+    sum_counters(&ovrl);
+    pthread_mutex_unlock(&report_lock);
+
+    pthread_mutex_lock(&snap_lock);
+    snap_curr.time_ns = prof_clock_ns();
+    snap_curr.total.num = ovrl.live_num;
+    snap_curr.total.bytes = ovrl.live_sz;
+    for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+        snap_curr.sizes[i].num = ovrl.live_hist.count[i];
+        snap_curr.sizes[i].bytes = ovrl.live_hist.bytes[i];
+    }
+    if(stacks_enabled) {
+        stack_foreach(collect_site_cells, &snap_curr);
+    }
+    seq = snap_ring_add(&snap_curr);
+    pthread_mutex_unlock(&snap_lock);
+    return seq;
+}
+
+static void* snapshot_main(void *arg)
+{
+    struct timespec deadline;
+
+    no_hook = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    for(;;) {
+        take_snapshot();
+
+        deadline.tv_sec += snapshot_interval;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+    }
+    return NULL;
+}
+
+static void start_snapshots(void)
+{
+    pthread_t       tid;
+    pthread_attr_t  attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&tid, &attr, snapshot_main, NULL) != 0) {
+        log_error("Could not start snapshot thread\n");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* The child keeps the snapshots taken so far */
+static void snapshot_fork_child(void)
+{
+    pthread_mutex_init(&snap_lock, NULL);
+    snap_ring_fork_child();
+    start_snapshots();
+}
+
+/* Fills top[] with the indexes of the max cells that grew the most in
+ * bytes, descending. Returns how many. */
+static int rank_growth(const snap_cell_t *cells, int num, int *top, int max)
+{
+    int n = 0;
+    int i;
+
+    for(i = 0; i < num && max > 0; i++) {
+        int pos = n;
+
+        if(cells[i].bytes <= 0 || (n == max && cells[top[max - 1]].bytes >= cells[i].bytes)) {
+            continue;
+        }
+        if(pos == max) {
+            pos--;
+        }
+        else {
+            n++;
+        }
+        while(pos > 0 && cells[top[pos - 1]].bytes < cells[i].bytes) {
+            top[pos] = top[pos - 1];
+            pos--;
+        }
+        top[pos] = i;
+    }
+    return n;
+}
+
+static void print_thread_names(rbuf_t *rb, thread_name_stats_t *names, int *order, int num)
+{
+    int i;
+
+    rbuf_puts(rb, "\nAllocations by thread name:\n");
+    for(i = 0; i < num; i++) {
+        thread_name_stats_t *name = &names[order[i]];
+
+        rbuf_printf(rb, "%-15s threads:%d allocations:%lld size:%lld frees:%lld free size:%lld "
+                    "live allocations:%lld live size:%lld\n", name->name, name->threads,
+                    (long long)name->ctrs.num_alloc, (long long)name->ctrs.alloc_sz,
+                    (long long)name->ctrs.num_free, (long long)name->ctrs.free_sz,
+                    (long long)name->ctrs.live_num, (long long)name->ctrs.live_sz);
+    }
+}
+
+/* Growth between two snapshots, most grown sites and sizes first */
+static void print_growth_info(rbuf_t *rb, snap_state_t *growth, uint32_t from, uint32_t to)
+{
+    int       top[100];
+    int       max = top_sites < 100 ? top_sites : 100;
+    int       num = 0;
+    int       i;
+
+    rbuf_printf(rb, "\nGrowth over snapshots %u - %u (%.1f sec): count:%+lld size:%+lld\n",
+                from, to, growth->time_ns / 1e9, (long long)growth->total.num,
+                (long long)growth->total.bytes);
+
+    num = rank_growth(growth->sites, STACK_TABLE_SIZE, top, max);
+    if(num > 0) {
+        rbuf_puts(rb, "\nTop growing allocation sites:\n");
+    }
+    for(i = 0; i < num; i++) {
+        stack_entry_t *entry = stack_get(top[i]);
+
+        rbuf_printf(rb, "#%d site:%d growth size:%+lld allocations:%+lld\n", i + 1, top[i],
+                    (long long)growth->sites[top[i]].bytes,
+                    (long long)growth->sites[top[i]].num);
+        if(entry) {
+            print_site_frames(rb, entry);
+        }
+    }
+
+    num = rank_growth(growth->sizes, SIZE_HIST_BUCKETS, top, max);
+    if(num > 0) {
+        rbuf_puts(rb, "\nTop growing sizes:\n");
+    }
+    for(i = 0; i < num; i++) {
+        char lo[16];
+        char hi[16];
+
+        format_size_bucket(top[i], lo, hi, sizeof(lo));
+        rbuf_printf(rb, "%8s - %-8s count:%+lld bytes:%+lld\n", lo, hi,
+                    (long long)growth->sizes[top[i]].num,
+                    (long long)growth->sizes[top[i]].bytes);
+    }
+}
+
+/* Thread start hook of the control thread and the leak check workers */
+static void untracked_thread_setup(void)
+{
+    /* Its allocations, if any, stay out of the stats */
+    no_hook = 1;
+}
+
+/* Snapshots of the live set (dump and leak check) are copied out of the
+ * table into an mmap'd buffer with room for every slot of the table plus
+ * some growth during the walk. Returns NULL if out of memory. */
+static void* map_live_set(size_t rec_size, size_t *cap, size_t *map_len)
+{
+    void *mem = NULL;
+
+    *cap = hash_mem_usage(&curr_alloc_table) / sizeof(hash_entry_t);
+    *cap += *cap / 8 + 1024;
+    *map_len = *cap * rec_size;
+    mem = mmap(NULL, *map_len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+typedef struct {
+    leak_block_t *blocks;
+    size_t        num;
+    size_t        cap;
+    size_t        missed;
+} leak_buf_t;
+
+typedef struct {
+    uint32_t  id;
+    int64_t   num;
+    int64_t   bytes;
+} leak_site_t;
+
+typedef struct {
+    leak_summary_t  sum;
+    size_t          missed;      /* blocks that did not fit the snapshot */
+    leak_site_t     top[100];    /* by definitely leaked bytes */
+    int             num_top;
+} leak_report_t;
+
+/* Definitely leaked blocks per allocation site, and the thread list.
+ * leak_check_lock guards them. */
+static pthread_mutex_t leak_check_lock = PTHREAD_MUTEX_INITIALIZER;
+static leak_site_t     leak_sites[STACK_TABLE_SIZE];
+static uintptr_t       leak_stacks[THREAD_STATS_MAX_THREADS];
+static uintptr_t       leak_selves[THREAD_STATS_MAX_THREADS];
+static pid_t           leak_tids[THREAD_STATS_MAX_THREADS];
+
+/* Runs under a shard lock */
+static void collect_leak_block(void *key, void *val, void *arg)
+{
+    alloc_info_t *info = (alloc_info_t*)val;
+    leak_buf_t   *buf = (leak_buf_t*)arg;
+    leak_block_t *block = NULL;
+
+    if(buf->num == buf->cap) {
+        buf->missed++;
+        return;
+    }
+    block = &buf->blocks[buf->num++];
+    block->addr = (uintptr_t)key;
+    block->size = info->alloc_sz;
+    block->stack_id = info->stack_id;
+    block->state = LEAK_UNVISITED;
+}
+
+/* Keeps top[] sorted by bytes, descending, with at most max entries */
+static void rank_leak_site(leak_report_t *report, int max, leak_site_t *site)
+{
+    int pos = report->num_top;
+
+    if(pos == max && report->top[max - 1].bytes >= site->bytes) {
+        return;
+    }
+    if(pos == max) {
+        pos--;
+    }
+    else {
+        report->num_top++;
+    }
+    while(pos > 0 && report->top[pos - 1].bytes < site->bytes) {
+        report->top[pos] = report->top[pos - 1];
+        pos--;
+    }
+    report->top[pos] = *site;
+}
+
+/* Conservative reachability scan of the live set, see leak_check.h.
+ * Needs every live block in the table. Returns 0 or -1. */
+static int run_leak_check(leak_report_t *report)
+{
+    leak_buf_t  buf = {0};
+    size_t      map_len = 0;
+    size_t      i;
+    int         num_threads = 0;
+    int         max = top_sites < 100 ? top_sites : 100;
+    int         ret = 0;
+
+    memset(report, 0, sizeof(*report));
+    buf.blocks = map_live_set(sizeof(leak_block_t), &buf.cap, &map_len);
+    if(!buf.blocks) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&leak_check_lock);
+    hash_foreach(&curr_alloc_table, collect_leak_block, &buf);
+    num_threads = thread_stats_threads(leak_stacks, leak_selves, leak_tids,
+                                       THREAD_STATS_MAX_THREADS);
+    ret = leak_scan(buf.blocks, buf.num, leak_stacks, leak_selves, leak_tids, num_threads,
+                    untracked_thread_setup, &report->sum);
+    report->missed = buf.missed;
+
+    if(ret == 0 && stacks_enabled && max > 0) {
+        memset(leak_sites, 0, sizeof(leak_sites));
+        for(i = 0; i < buf.num; i++) {
+            if(buf.blocks[i].state == LEAK_DEFINITE) {
+                leak_sites[buf.blocks[i].stack_id].num++;
+                leak_sites[buf.blocks[i].stack_id].bytes += buf.blocks[i].size;
+            }
+        }
+        for(i = 0; i < STACK_TABLE_SIZE; i++) {
+            if(leak_sites[i].num > 0) {
+                leak_sites[i].id = i;
+                rank_leak_site(report, max, &leak_sites[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&leak_check_lock);
+
+    munmap(buf.blocks, map_len);
+    return ret;
+}
+
+static void print_leak_info(rbuf_t *rb, leak_report_t *report)
+{
+    leak_summary_t *sum = &report->sum;
+    int             i;
+
+    rbuf_printf(rb, "\nLeak check: %zu blocks, %zu bytes of roots, %d workers, %.3f sec\n",
+                sum->num[LEAK_REACHABLE] + sum->num[LEAK_INDIRECT] + sum->num[LEAK_DEFINITE],
+                sum->roots, sum->workers, sum->secs);
+    rbuf_printf(rb, "Reachable: %zu size:%zu\n", sum->num[LEAK_REACHABLE],
+                sum->bytes[LEAK_REACHABLE]);
+    rbuf_printf(rb, "Indirectly leaked: %zu size:%zu\n", sum->num[LEAK_INDIRECT],
+                sum->bytes[LEAK_INDIRECT]);
+    rbuf_printf(rb, "Definitely leaked: %zu size:%zu\n", sum->num[LEAK_DEFINITE],
+                sum->bytes[LEAK_DEFINITE]);
+    if(report->missed) {
+        rbuf_printf(rb, "Not checked: %zu\n", report->missed);
+    }
+    if(sum->no_regs) {
+        rbuf_printf(rb, "Threads without registers: %d of %d (unreliable)\n", sum->no_regs,
+                    sum->threads);
+    }
+
+    if(report->num_top > 0) {
+        rbuf_puts(rb, "\nTop definitely leaked sites:\n");
+    }
+    for(i = 0; i < report->num_top; i++) {
+        stack_entry_t *entry = stack_get(report->top[i].id);
+
+        rbuf_printf(rb, "#%d site:%u leaked size:%lld leaked allocations:%lld\n", i + 1,
+                    report->top[i].id, (long long)report->top[i].bytes,
+                    (long long)report->top[i].num);
+        if(entry) {
+            print_site_frames(rb, entry);
+        }
+    }
+}
+
+/* Heap overhead (MEMPROF_HEAP_STATS). The walk holds each shard lock in
+ * turn, so no block in the table is freed while its usable size is read:
+ * free removes the record first, and realloc marks it. */
+static void collect_heap_block(void *key, void *val, void *arg)
+{
+    alloc_info_t *info = (alloc_info_t*)val;
+    heap_frag_t  *frag = (heap_frag_t*)arg;
+    uint16_t      flags = __atomic_load_n(&info->flags, __ATOMIC_RELAXED);
+    double        weight = 1.0;
+    size_t        usable = 0;
+
+    if(flags & ALLOC_FLAG_HEADER) {
+        /* Sampled, the record is in the block's header */
+        void *base = hdr_base(key, (alloc_hdr_t*)key - 1);
+
+        usable = orig_malloc_usable_size(base) - ((char*)key - (char*)base);
+        weight = sample_weight(info->alloc_sz, sample_rates[info->sample_idx]);
+    }
+    else if(flags & ALLOC_FLAG_RESIZING) {
+        frag->skipped++;
+        return;
+    }
+    else {
+        usable = orig_malloc_usable_size(key);
+    }
+    heap_frag_add(frag, info->alloc_sz, usable, weight, sample_count(info, weight));
+}
+
+/* "size  +delta what" line of the heap waterfall */
+static void print_heap_step(rbuf_t *rb, const char *label, int64_t bytes, int64_t prev,
+                            const char *what)
+{
+    char val[16];
+    char delta[16];
+
+    format_size(val, sizeof(val), bytes);
+    format_size(delta, sizeof(delta), bytes >= prev ? bytes - prev : prev - bytes);
+    rbuf_printf(rb, "%-12s %8s  %c%s %s", label, val, bytes >= prev ? '+' : '-', delta, what);
+}
+
+/* Requested, usable, heap and resident bytes, each step with what it
+ * adds. frag is NULL when the live set could not be walked. */
+static void print_heap_info(rbuf_t *rb, heap_stats_t *heap, heap_frag_t *frag,
+                            int64_t live_sz)
+{
+    int64_t requested = live_sz;
+    int64_t usable = 0;
+    char    val[16];
+    int     i;
+
+    if(frag) {
+        requested = 0;
+        for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+            requested += frag->requested[i];
+            usable += frag->usable[i];
+        }
+    }
+
+    rbuf_puts(rb, "\nHeap overhead:\n");
+    format_size(val, sizeof(val), requested);
+    rbuf_printf(rb, "%-12s %8s\n", "Requested:", val);
+    if(frag) {
+        print_heap_step(rb, "Usable:", usable, requested, "internal fragmentation");
+        rbuf_printf(rb, " (%.1f%%)\n", usable > 0 ? 100.0 * (usable - requested) / usable : 0.0);
+    }
+    print_heap_step(rb, "Heap in use:", heap->heap_used, frag ? usable : requested,
+                    frag ? "allocator overhead and untracked blocks\n"
+                         : "allocator overhead, rounding and untracked blocks\n");
+    print_heap_step(rb, "Heap total:", heap->heap_total, heap->heap_used, "free in the arenas");
+    format_size(val, sizeof(val), heap->heap_top);
+    rbuf_printf(rb, " (releasable at the top:%s", val);
+    format_size(val, sizeof(val), heap->heap_mmap);
+    rbuf_printf(rb, " mmap'd chunks:%s)\n", val);
+    print_heap_step(rb, "RSS:", heap->rss, heap->heap_total, "code, stacks and other mappings");
+    if(heap->anon >= 0) {
+        format_size(val, sizeof(val), heap->anon);
+        rbuf_printf(rb, " (anonymous:%s", val);
+        format_size(val, sizeof(val), heap->swap > 0 ? heap->swap : 0);
+        rbuf_printf(rb, " swap:%s)", val);
+    }
+    rbuf_puts(rb, "\n");
+
+    if(!frag) {
+        rbuf_puts(rb, "Usable sizes need MEMPROF_MODE=table\n");
+        return;
+    }
+    if(frag->skipped) {
+        rbuf_printf(rb, "%lld blocks in a realloc skipped\n", (long long)frag->skipped);
+    }
+    rbuf_puts(rb, "Internal fragmentation by size:\n");
+    for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+        char lo[16];
+        char hi[16];
+        char req[16];
+        char use[16];
+
+        if(frag->count[i] == 0) {
+            continue;
+        }
+        format_size_bucket(i, lo, hi, sizeof(lo));
+        format_size(req, sizeof(req), frag->requested[i]);
+        format_size(use, sizeof(use), frag->usable[i]);
+        rbuf_printf(rb, "%8s - %-8s count:%lld requested:%s usable:%s overhead:%.1f%%\n",
+                    lo, hi, (long long)frag->count[i], req, use,
+                    frag->usable[i] > 0 ?
+                    100.0 * (frag->usable[i] - frag->requested[i]) / frag->usable[i] : 0.0);
+    }
+}
+
+/* Reports: everything is gathered first, rendered into report_mem as
+ * text, JSON or Prometheus exposition format, then written out in one
+ * call. Nothing here goes through malloc or stdio. */
+
+typedef struct {
+    time_t                time;
+    thread_counters_t     ovrl;
+    age_hist_t            ages;
+    double                secs;           /* since start or the last reset */
+    double                site_secs;      /* since start */
+    size_t                table_mem;
+    size_t                records_mem;
+    size_t                stacks_mem;
+    thread_name_stats_t  *names;
+    int                  *name_order;     /* rows of names[] to show */
+    int                   num_names;
+    top_sites_t          *top;            /* NULL without stacks */
+    snap_state_t         *growth;         /* at exit, with snapshots */
+    uint32_t              growth_from;
+    uint32_t              growth_to;
+    leak_report_t        *leaks;          /* at exit, with MEMPROF_LEAK_CHECK */
+    const char           *leak_error;
+    heap_stats_t         *heap;           /* with MEMPROF_HEAP_STATS */
+    heap_frag_t          *frag;           /* the same, in table mode */
+} report_t;
+
+static const char *leak_kinds[LEAK_NUM_STATES] = {
+    [LEAK_REACHABLE] = "reachable",
+    [LEAK_INDIRECT]  = "indirect",
+    [LEAK_DEFINITE]  = "definite",
+};
+
+/* Same layout as ctime(), which is not safe here */
+static void render_time(rbuf_t *rb, time_t time)
+{
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm         tm;
+
+    localtime_r(&time, &tm);
+    rbuf_printf(rb, "%.3s %.3s%3d %.2d:%.2d:%.2d %d\n", days + 3 * tm.tm_wday,
+                months + 3 * tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                1900 + tm.tm_year);
+}
+
+static void render_text(rbuf_t *rb, report_t *r)
+{
+    thread_counters_t *ovrl = &r->ovrl;
+
+    rbuf_puts(rb, "\n\n>>>>>>>>>> ");
+    render_time(rb, r->time);
+    rbuf_puts(rb, "Overall Stats:\n");
+    rbuf_printf(rb, "Overall number of allocations: %ld\n", (long)ovrl->num_alloc);
+    rbuf_printf(rb, "Overall allocation size:%lld \n", (long long)ovrl->alloc_sz);
+    rbuf_printf(rb, "Overall number of frees: %ld\n", (long)ovrl->num_free);
+    rbuf_printf(rb, "Overall free size:%lld \n", (long long)ovrl->free_sz);
+    rbuf_printf(rb, "C allocations: %ld size:%lld\n",
+                (long)(ovrl->num_alloc - ovrl->cxx_num_alloc),
+                (long long)(ovrl->alloc_sz - ovrl->cxx_alloc_sz));
+    rbuf_printf(rb, "C++ allocations: %ld size:%lld\n\n", (long)ovrl->cxx_num_alloc,
+                (long long)ovrl->cxx_alloc_sz);
+    rbuf_puts(rb, "Current Stats:\n");
+    if(sample_interval) {
+        rbuf_printf(rb, "Estimated from allocations sampled every %ld bytes\n",
+                    sample_interval);
+    }
+    rbuf_printf(rb, "Current number of allocations:%ld\n", (long)ovrl->live_num);
+    rbuf_printf(rb, "Current allocation size:%lld\n", (long long)ovrl->live_sz);
+    rbuf_printf(rb, "Profiler memory:%zu (table:%zu records:%zu stacks:%zu)\n",
+                r->table_mem + r->records_mem + r->stacks_mem,
+                r->table_mem, r->records_mem, r->stacks_mem);
+
+    if(r->top) {
+        print_top_sites(rb, r->top->by_live, r->top->num_live,
+                        "Top allocation sites by live size:");
+        print_top_sites(rb, r->top->by_count, r->top->num_count,
+                        "Top allocation sites by allocations:");
+    }
+
+    /* Both maintained on every insert and delete, no traversal needed */
+    print_curr_size_info(rb, &ovrl->live_hist);
+    print_curr_age_info(rb, &r->ages);
+    print_thread_names(rb, r->names, r->name_order, r->num_names);
+    print_realloc_info(rb, ovrl, r->top);
+    print_lifetime_info(rb, ovrl, r->top, r->secs, r->site_secs);
+    if(r->heap) {
+        print_heap_info(rb, r->heap, r->frag, ovrl->live_sz);
+    }
+
+    if(r->growth) {
+        print_growth_info(rb, r->growth, r->growth_from, r->growth_to);
+    }
+    if(r->leaks) {
+        print_leak_info(rb, r->leaks);
+    }
+    else if(r->leak_error) {
+        rbuf_printf(rb, "\nLeak check %s\n", r->leak_error);
+    }
+}
+
+static void json_frames(rbuf_t *rb, stack_entry_t *entry)
+{
+    char     buf[512];
+    rbuf_t   frame;
+    uint32_t i;
+
+    rbuf_puts(rb, "[");
+    for(i = 0; entry && i < entry->depth; i++) {
+        rbuf_init(&frame, buf, sizeof(buf) - 1);
+        format_frame(&frame, entry->frames[i]);
+        buf[frame.len] = '\0';
+        if(i > 0) {
+            rbuf_puts(rb, ",");
+        }
+        rbuf_json_str(rb, buf);
+    }
+    rbuf_puts(rb, "]");
+}
+
+static void json_top_sites(rbuf_t *rb, const char *key, site_rank_t *rank, int num)
+{
+    int i;
+
+    rbuf_printf(rb, ",\"%s\":[", key);
+    for(i = 0; i < num; i++) {
+        stack_entry_t *entry = rank[i].entry;
+
+        rbuf_printf(rb, "%s{\"site\":%u,\"live_sz\":%lld,\"live_num\":%lld,\"num_alloc\":%lld,"
+                    "\"frames\":", i > 0 ? "," : "", rank[i].id,
+                    (long long)__atomic_load_n(&entry->live_sz, __ATOMIC_RELAXED),
+                    (long long)__atomic_load_n(&entry->live_num, __ATOMIC_RELAXED),
+                    (long long)__atomic_load_n(&entry->num_alloc, __ATOMIC_RELAXED));
+        json_frames(rb, entry);
+        rbuf_puts(rb, "}");
+    }
+    rbuf_puts(rb, "]");
+}
+
+/* Chains are keyed by the fewest reallocs of their bucket */
+static void json_reallocs(rbuf_t *rb, thread_counters_t *ovrl, top_sites_t *top)
+{
+    int i;
+
+    rbuf_printf(rb, ",\"reallocs\":{\"num\":%lld,\"moved\":%lld,\"copied\":%lld,\"chains\":[",
+                (long long)ovrl->num_realloc, (long long)ovrl->realloc_moved,
+                (long long)ovrl->realloc_copied);
+    for(i = 0; i < REALLOC_CHAIN_BUCKETS; i++) {
+        rbuf_printf(rb, "%s{\"min\":%d,\"num\":%lld}", i > 0 ? "," : "", 1 << i,
+                    (long long)ovrl->realloc_chains[i]);
+    }
+    rbuf_puts(rb, "],\"sites\":[");
+    for(i = 0; top && i < top->num_realloc; i++) {
+        stack_entry_t *entry = top->by_realloc[i].entry;
+
+        rbuf_printf(rb, "%s{\"site\":%u,\"num_realloc\":%lld,\"num_alloc\":%lld,"
+                    "\"copied\":%lld,\"frames\":", i > 0 ? "," : "", top->by_realloc[i].id,
+                    (long long)site_num_realloc(entry), (long long)site_num_alloc(entry),
+                    (long long)__atomic_load_n(&entry->realloc_copied, __ATOMIC_RELAXED));
+        json_frames(rb, entry);
+        rbuf_puts(rb, "}");
+    }
+    rbuf_puts(rb, "]}");
+}
+
+/* Non-empty lifetime buckets by lower bound, and the churn sites */
+static void json_lifetimes(rbuf_t *rb, report_t *r)
+{
+    thread_counters_t *ovrl = &r->ovrl;
+    top_sites_t       *top = r->top;
+    int                i;
+
+    rbuf_printf(rb, ",\"lifetimes\":{\"secs\":%.3f,\"num\":%lld,\"sum_ns\":%lld,"
+                "\"median_ns\":%llu,\"buckets\":[", r->secs,
+                (long long)life_hist_total(&ovrl->lifetimes), (long long)ovrl->lifetime_ns,
+                (unsigned long long)life_hist_quantile(&ovrl->lifetimes, 0.5));
+    for(i = 0; i < LIFE_HIST_BUCKETS; i++) {
+        if(ovrl->lifetimes.count[i] != 0) {
+            rbuf_printf(rb, "%s{\"lower_ns\":%llu,\"num\":%lld}",
+                        rb->buf[rb->len - 1] == '[' ? "" : ",",
+                        (unsigned long long)life_hist_lower(i),
+                        (long long)ovrl->lifetimes.count[i]);
+        }
+    }
+    rbuf_printf(rb, "],\"churn_us\":%ld,\"site_secs\":%.3f,\"sites\":[", churn_us,
+                r->site_secs);
+    for(i = 0; top && i < top->num_churn; i++) {
+        stack_entry_t *entry = top->by_churn[i].entry;
+        life_hist_t    hist;
+
+        site_lifetimes(entry, &hist);
+        rbuf_printf(rb, "%s{\"site\":%u,\"num_alloc\":%lld,\"num_free\":%lld,"
+                    "\"median_ns\":%llu,\"frames\":", i > 0 ? "," : "", top->by_churn[i].id,
+                    (long long)site_num_alloc(entry), (long long)life_hist_total(&hist),
+                    (unsigned long long)life_hist_quantile(&hist, 0.5));
+        json_frames(rb, entry);
+        rbuf_puts(rb, "}");
+    }
+    rbuf_puts(rb, "]}");
+}
+
+/* usable and sizes only when the live set was walked */
+static void json_heap(rbuf_t *rb, report_t *r)
+{
+    heap_stats_t *heap = r->heap;
+    heap_frag_t  *frag = r->frag;
+    int           i;
+
+    rbuf_printf(rb, ",\"heap\":{\"live_sz\":%lld,\"heap_used\":%lld,\"heap_total\":%lld,"
+                "\"heap_free\":%lld,\"heap_top\":%lld,\"heap_mmap\":%lld,\"rss\":%lld,"
+                "\"anon\":%lld,\"swap\":%lld", (long long)r->ovrl.live_sz,
+                (long long)heap->heap_used, (long long)heap->heap_total,
+                (long long)heap->heap_free, (long long)heap->heap_top,
+                (long long)heap->heap_mmap, (long long)heap->rss, (long long)heap->anon,
+                (long long)heap->swap);
+    if(frag) {
+        rbuf_printf(rb, ",\"skipped\":%lld,\"sizes\":[", (long long)frag->skipped);
+        for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+            if(frag->count[i] != 0) {
+                rbuf_printf(rb, "%s{\"lower\":%zu,\"num\":%lld,\"requested\":%lld,"
+                            "\"usable\":%lld}", rb->buf[rb->len - 1] == '[' ? "" : ",",
+                            size_hist_lower(i), (long long)frag->count[i],
+                            (long long)frag->requested[i], (long long)frag->usable[i]);
+            }
+        }
+        rbuf_puts(rb, "]");
+    }
+    rbuf_puts(rb, "}");
+}
+
+static void json_growth(rbuf_t *rb, report_t *r)
+{
+    snap_state_t *growth = r->growth;
+    int           top[100];
+    int           max = top_sites < 100 ? top_sites : 100;
+    int           num;
+    int           i;
+
+    rbuf_printf(rb, ",\"growth\":{\"from\":%u,\"to\":%u,\"elapsed_ns\":%llu,"
+                "\"num\":%lld,\"bytes\":%lld,\"sites\":[", r->growth_from, r->growth_to,
+                (unsigned long long)growth->time_ns, (long long)growth->total.num,
+                (long long)growth->total.bytes);
+    num = rank_growth(growth->sites, STACK_TABLE_SIZE, top, max);
+    for(i = 0; i < num; i++) {
+        rbuf_printf(rb, "%s{\"site\":%d,\"num\":%lld,\"bytes\":%lld,\"frames\":",
+                    i > 0 ? "," : "", top[i], (long long)growth->sites[top[i]].num,
+                    (long long)growth->sites[top[i]].bytes);
+        json_frames(rb, stack_get(top[i]));
+        rbuf_puts(rb, "}");
+    }
+    rbuf_puts(rb, "],\"sizes\":[");
+    num = rank_growth(growth->sizes, SIZE_HIST_BUCKETS, top, max);
+    for(i = 0; i < num; i++) {
+        rbuf_printf(rb, "%s{\"lower\":%zu,\"num\":%lld,\"bytes\":%lld}", i > 0 ? "," : "",
+                    size_hist_lower(top[i]), (long long)growth->sizes[top[i]].num,
+                    (long long)growth->sizes[top[i]].bytes);
+    }
+    rbuf_puts(rb, "]}");
+}
+
+static void json_leaks(rbuf_t *rb, leak_report_t *report)
+{
+    leak_summary_t *sum = &report->sum;
+    int             i;
+
+    rbuf_puts(rb, ",\"leaks\":{");
+    for(i = LEAK_REACHABLE; i < LEAK_NUM_STATES; i++) {
+        rbuf_printf(rb, "\"%s\":{\"num\":%zu,\"bytes\":%zu},", leak_kinds[i], sum->num[i],
+                    sum->bytes[i]);
+    }
+    rbuf_printf(rb, "\"missed\":%zu,\"roots\":%zu,\"threads\":%d,\"no_regs\":%d,"
+                "\"workers\":%d,\"secs\":%.6f,\"sites\":[", report->missed, sum->roots,
+                sum->threads, sum->no_regs, sum->workers, sum->secs);
+    for(i = 0; i < report->num_top; i++) {
+        rbuf_printf(rb, "%s{\"site\":%u,\"num\":%lld,\"bytes\":%lld,\"frames\":",
+                    i > 0 ? "," : "", report->top[i].id, (long long)report->top[i].num,
+                    (long long)report->top[i].bytes);
+        json_frames(rb, stack_get(report->top[i].id));
+        rbuf_puts(rb, "}");
+    }
+    rbuf_puts(rb, "]}");
+}
+
+/* One object per report, on a single line */
+static void render_json(rbuf_t *rb, report_t *r)
+{
+    thread_counters_t *ovrl = &r->ovrl;
+    int                i;
+
+    rbuf_printf(rb, "{\"time\":%lld,\"pid\":%d,\"sample_interval\":%ld",
+                (long long)r->time, (int)getpid(), sample_interval);
+    rbuf_printf(rb, ",\"overall\":{\"num_alloc\":%lld,\"alloc_sz\":%lld,\"num_free\":%lld,"
+                "\"free_sz\":%lld,\"cxx_num_alloc\":%lld,\"cxx_alloc_sz\":%lld}",
+                (long long)ovrl->num_alloc, (long long)ovrl->alloc_sz,
+                (long long)ovrl->num_free, (long long)ovrl->free_sz,
+                (long long)ovrl->cxx_num_alloc, (long long)ovrl->cxx_alloc_sz);
+    rbuf_printf(rb, ",\"current\":{\"live_num\":%lld,\"live_sz\":%lld}",
+                (long long)ovrl->live_num, (long long)ovrl->live_sz);
+    rbuf_printf(rb, ",\"profiler_mem\":{\"table\":%zu,\"records\":%zu,\"stacks\":%zu}",
+                r->table_mem, r->records_mem, r->stacks_mem);
+
+    /* Non-empty size buckets by lower bound, every age bucket */
+    rbuf_puts(rb, ",\"sizes\":[");
+    for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+        if(ovrl->live_hist.count[i] != 0) {
+            rbuf_printf(rb, "%s{\"lower\":%zu,\"num\":%lld,\"bytes\":%lld}",
+                        rb->buf[rb->len - 1] == '[' ? "" : ",", size_hist_lower(i),
+                        (long long)ovrl->live_hist.count[i],
+                        (long long)ovrl->live_hist.bytes[i]);
+        }
+    }
+    rbuf_puts(rb, "],\"ages\":[");
+    for(i = 0; i < AGE_HIST_BUCKETS; i++) {
+        rbuf_printf(rb, "%s{\"lower_ns\":%llu,\"num\":%lld}", i > 0 ? "," : "",
+                    (unsigned long long)age_hist_lower(i), (long long)r->ages.count[i]);
+    }
+    rbuf_puts(rb, "],\"threads\":[");
+    for(i = 0; i < r->num_names; i++) {
+        thread_name_stats_t *name = &r->names[r->name_order[i]];
+
+        rbuf_printf(rb, "%s{\"name\":", i > 0 ? "," : "");
+        rbuf_json_str(rb, name->name);
+        rbuf_printf(rb, ",\"threads\":%d,\"num_alloc\":%lld,\"alloc_sz\":%lld,\"num_free\":%lld,"
+                    "\"free_sz\":%lld,\"live_num\":%lld,\"live_sz\":%lld}", name->threads,
+                    (long long)name->ctrs.num_alloc, (long long)name->ctrs.alloc_sz,
+                    (long long)name->ctrs.num_free, (long long)name->ctrs.free_sz,
+                    (long long)name->ctrs.live_num, (long long)name->ctrs.live_sz);
+    }
+    rbuf_puts(rb, "]");
+
+    if(r->top) {
+        json_top_sites(rb, "top_live", r->top->by_live, r->top->num_live);
+        json_top_sites(rb, "top_count", r->top->by_count, r->top->num_count);
+    }
+    json_reallocs(rb, ovrl, r->top);
+    json_lifetimes(rb, r);
+    if(r->heap) {
+        json_heap(rb, r);
+    }
+    if(r->growth) {
+        json_growth(rb, r);
+    }
+    if(r->leaks) {
+        json_leaks(rb, r->leaks);
+    }
+    else if(r->leak_error) {
+        rbuf_puts(rb, ",\"leaks\":{\"error\":");
+        rbuf_json_str(rb, r->leak_error);
+        rbuf_puts(rb, "}");
+    }
+    rbuf_puts(rb, "}\n");
+}
+
+static void prom_header(rbuf_t *rb, const char *name, const char *type, const char *help)
+{
+    rbuf_printf(rb, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void prom_metric(rbuf_t *rb, const char *name, const char *type, const char *help,
+                        int pid, long long value)
+{
+    prom_header(rb, name, type, help);
+    rbuf_printf(rb, "%s{pid=\"%d\"} %lld\n", name, pid, value);
+}
+
+/* Label values escape backslash, double quote and newline */
+static void prom_label_str(rbuf_t *rb, const char *s)
+{
+    for(; *s; s++) {
+        if(*s == '\\' || *s == '"') {
+            rbuf_printf(rb, "\\%c", *s);
+        }
+        else if(*s == '\n') {
+            rbuf_puts(rb, "\\n");
+        }
+        else {
+            rbuf_printf(rb, "%c", *s);
+        }
+    }
+}
+
+/* One sample per thread name of each per-name metric */
+static void prom_thread_names(rbuf_t *rb, report_t *r, int pid)
+{
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+        size_t      offset;
+    } metrics[] = {
+        { "memprof_thread_allocations_total", "counter", "Allocations by thread name.",
+          offsetof(thread_name_ctrs_t, num_alloc) },
+        { "memprof_thread_allocated_bytes_total", "counter", "Bytes allocated by thread name.",
+          offsetof(thread_name_ctrs_t, alloc_sz) },
+        { "memprof_thread_frees_total", "counter", "Frees by thread name.",
+          offsetof(thread_name_ctrs_t, num_free) },
+        { "memprof_thread_freed_bytes_total", "counter", "Bytes freed by thread name.",
+          offsetof(thread_name_ctrs_t, free_sz) },
+        { "memprof_thread_live_allocations", "gauge",
+          "Live allocations by the name of the allocating thread.",
+          offsetof(thread_name_ctrs_t, live_num) },
+        { "memprof_thread_live_bytes", "gauge",
+          "Live bytes by the name of the allocating thread.",
+          offsetof(thread_name_ctrs_t, live_sz) },
+    };
+    size_t m;
+    int    i;
+
+    for(m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+        prom_header(rb, metrics[m].name, metrics[m].type, metrics[m].help);
+        for(i = 0; i < r->num_names; i++) {
+            thread_name_stats_t *name = &r->names[r->name_order[i]];
+
+            rbuf_printf(rb, "%s{pid=\"%d\",thread=\"", metrics[m].name, pid);
+            prom_label_str(rb, name->name);
+            rbuf_printf(rb, "\"} %lld\n",
+                        (long long)*(int64_t*)((char*)&name->ctrs + metrics[m].offset));
+        }
+    }
+}
+
+/* Prometheus text exposition format, for a textfile collector or a scrape
+ * of the report file */
+static void render_prom(rbuf_t *rb, report_t *r)
+{
+    thread_counters_t *ovrl = &r->ovrl;
+    int                pid = getpid();
+    long long          cum = 0;
+    int                i;
+
+    prom_metric(rb, "memprof_allocations_total", "counter",
+                "Allocations since start or the last reset.", pid, ovrl->num_alloc);
+    prom_metric(rb, "memprof_allocated_bytes_total", "counter",
+                "Bytes allocated since start or the last reset.", pid, ovrl->alloc_sz);
+    prom_metric(rb, "memprof_frees_total", "counter",
+                "Frees since start or the last reset.", pid, ovrl->num_free);
+    prom_metric(rb, "memprof_freed_bytes_total", "counter",
+                "Bytes freed since start or the last reset.", pid, ovrl->free_sz);
+    prom_metric(rb, "memprof_cxx_allocations_total", "counter",
+                "C++ allocations since start or the last reset.", pid, ovrl->cxx_num_alloc);
+    prom_metric(rb, "memprof_cxx_allocated_bytes_total", "counter",
+                "C++ bytes allocated since start or the last reset.", pid, ovrl->cxx_alloc_sz);
+    prom_metric(rb, "memprof_live_allocations", "gauge",
+                "Allocations not yet freed.", pid, ovrl->live_num);
+    prom_metric(rb, "memprof_live_bytes", "gauge",
+                "Bytes not yet freed.", pid, ovrl->live_sz);
+    prom_metric(rb, "memprof_profiler_memory_bytes", "gauge",
+                "Memory used by the profiler itself.", pid,
+                (long long)(r->table_mem + r->records_mem + r->stacks_mem));
+    prom_metric(rb, "memprof_sample_interval_bytes", "gauge",
+                "Sampling interval, 0 when every allocation is tracked.", pid, sample_interval);
+
+    /* le is the largest size of each bucket, the buckets are cumulative */
+    prom_header(rb, "memprof_live_size_bytes", "histogram", "Live allocations by size.");
+    for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+        cum += ovrl->live_hist.count[i];
+        if(i + 1 < SIZE_HIST_BUCKETS) {
+            rbuf_printf(rb, "memprof_live_size_bytes_bucket{pid=\"%d\",le=\"%zu\"} %lld\n", pid,
+                        size_hist_lower(i + 1) - 1, cum);
+        }
+        else {
+            rbuf_printf(rb, "memprof_live_size_bytes_bucket{pid=\"%d\",le=\"+Inf\"} %lld\n", pid,
+                        cum);
+        }
+    }
+    rbuf_printf(rb, "memprof_live_size_bytes_sum{pid=\"%d\"} %lld\n", pid,
+                (long long)ovrl->live_sz);
+    rbuf_printf(rb, "memprof_live_size_bytes_count{pid=\"%d\"} %lld\n", pid, cum);
+
+    prom_header(rb, "memprof_live_allocations_by_age", "gauge",
+                "Live allocations by age bucket, labelled by the bucket's lower bound.");
+    for(i = 0; i < AGE_HIST_BUCKETS; i++) {
+        rbuf_printf(rb, "memprof_live_allocations_by_age{pid=\"%d\",min_age_seconds=\"%g\"} %lld\n",
+                    pid, age_hist_lower(i) / 1e9, (long long)r->ages.count[i]);
+    }
+
+    prom_thread_names(rb, r, pid);
+
+    prom_metric(rb, "memprof_reallocs_total", "counter",
+                "Reallocs of tracked blocks.", pid, ovrl->num_realloc);
+    prom_metric(rb, "memprof_realloc_moves_total", "counter",
+                "Reallocs that moved the block.", pid, ovrl->realloc_moved);
+    prom_metric(rb, "memprof_realloc_copied_bytes_total", "counter",
+                "Bytes copied by reallocs that moved the block.", pid, ovrl->realloc_copied);
+    prom_header(rb, "memprof_realloc_chains_total", "counter",
+                "Freed blocks by the number of reallocs they went through, labelled by the "
+                "bucket's lower bound.");
+    for(i = 0; i < REALLOC_CHAIN_BUCKETS; i++) {
+        rbuf_printf(rb, "memprof_realloc_chains_total{pid=\"%d\",min_reallocs=\"%d\"} %lld\n",
+                    pid, 1 << i, (long long)ovrl->realloc_chains[i]);
+    }
+
+    /* le is the upper bound of each bucket, in seconds */
+    prom_header(rb, "memprof_free_lifetime_seconds", "histogram",
+                "Freed allocations by lifetime, since start or the last reset.");
+    cum = 0;
+    for(i = 0; i < LIFE_HIST_BUCKETS; i++) {
+        cum += ovrl->lifetimes.count[i];
+        if(i + 1 < LIFE_HIST_BUCKETS) {
+            rbuf_printf(rb, "memprof_free_lifetime_seconds_bucket{pid=\"%d\",le=\"%g\"} %lld\n",
+                        pid, life_hist_lower(i + 1) / 1e9, cum);
+        }
+        else {
+            rbuf_printf(rb, "memprof_free_lifetime_seconds_bucket{pid=\"%d\",le=\"+Inf\"} %lld\n",
+                        pid, cum);
+        }
+    }
+    rbuf_printf(rb, "memprof_free_lifetime_seconds_sum{pid=\"%d\"} %.9f\n", pid,
+                ovrl->lifetime_ns / 1e9);
+    rbuf_printf(rb, "memprof_free_lifetime_seconds_count{pid=\"%d\"} %lld\n", pid, cum);
+
+    if(r->top) {
+        prom_header(rb, "memprof_site_churn_allocations_total", "counter",
+                    "Allocations of the sites with the most allocations whose median "
+                    "lifetime is under MEMPROF_CHURN_US.");
+        for(i = 0; i < r->top->num_churn; i++) {
+            rbuf_printf(rb, "memprof_site_churn_allocations_total{pid=\"%d\",site=\"%u\"} %lld\n",
+                        pid, r->top->by_churn[i].id,
+                        (long long)site_num_alloc(r->top->by_churn[i].entry));
+        }
+        prom_header(rb, "memprof_site_median_lifetime_seconds", "gauge",
+                    "Median lifetime of the freed blocks of the same sites.");
+        for(i = 0; i < r->top->num_churn; i++) {
+            rbuf_printf(rb, "memprof_site_median_lifetime_seconds{pid=\"%d\",site=\"%u\"} %.9f\n",
+                        pid, r->top->by_churn[i].id,
+                        site_median_lifetime(r->top->by_churn[i].entry) / 1e9);
+        }
+        prom_header(rb, "memprof_site_live_bytes", "gauge",
+                    "Live bytes of the allocation sites with the most live bytes.");
+        for(i = 0; i < r->top->num_live; i++) {
+            rbuf_printf(rb, "memprof_site_live_bytes{pid=\"%d\",site=\"%u\"} %lld\n", pid,
+                        r->top->by_live[i].id, (long long)site_live_sz(r->top->by_live[i].entry));
+        }
+        prom_header(rb, "memprof_site_live_allocations", "gauge",
+                    "Live allocations of the allocation sites with the most live bytes.");
+        for(i = 0; i < r->top->num_live; i++) {
+            rbuf_printf(rb, "memprof_site_live_allocations{pid=\"%d\",site=\"%u\"} %lld\n", pid,
+                        r->top->by_live[i].id,
+                        (long long)__atomic_load_n(&r->top->by_live[i].entry->live_num,
+                                                   __ATOMIC_RELAXED));
+        }
+    }
+
+    if(r->heap) {
+        static const struct {
+            const char *kind;
+            size_t      offset;
+        } kinds[] = {
+            { "heap_used",  offsetof(heap_stats_t, heap_used) },
+            { "heap_total", offsetof(heap_stats_t, heap_total) },
+            { "heap_free",  offsetof(heap_stats_t, heap_free) },
+            { "heap_top",   offsetof(heap_stats_t, heap_top) },
+            { "heap_mmap",  offsetof(heap_stats_t, heap_mmap) },
+            { "rss",        offsetof(heap_stats_t, rss) },
+            { "anon",       offsetof(heap_stats_t, anon) },
+            { "swap",       offsetof(heap_stats_t, swap) },
+        };
+        size_t k;
+
+        prom_header(rb, "memprof_heap_bytes", "gauge",
+                    "Memory held by the allocator (mallinfo2) and the process (/proc).");
+        for(k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+            int64_t val = *(int64_t*)((char*)r->heap + kinds[k].offset);
+
+            if(val >= 0) {
+                rbuf_printf(rb, "memprof_heap_bytes{pid=\"%d\",kind=\"%s\"} %lld\n", pid,
+                            kinds[k].kind, (long long)val);
+            }
+        }
+    }
+    if(r->frag) {
+        prom_header(rb, "memprof_live_requested_bytes", "gauge",
+                    "Requested bytes of the live set by size bucket, labelled by its lower bound.");
+        for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+            if(r->frag->count[i] != 0) {
+                rbuf_printf(rb, "memprof_live_requested_bytes{pid=\"%d\",min_size=\"%zu\"} %lld\n",
+                            pid, size_hist_lower(i), (long long)r->frag->requested[i]);
+            }
+        }
+        prom_header(rb, "memprof_live_usable_bytes", "gauge",
+                    "Usable bytes (malloc_usable_size) of the same buckets.");
+        for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+            if(r->frag->count[i] != 0) {
+                rbuf_printf(rb, "memprof_live_usable_bytes{pid=\"%d\",min_size=\"%zu\"} %lld\n",
+                            pid, size_hist_lower(i), (long long)r->frag->usable[i]);
+            }
+        }
+    }
+
+    if(r->leaks) {
+        prom_header(rb, "memprof_leak_check_allocations", "gauge",
+                    "Live allocations by leak check verdict.");
+        for(i = LEAK_REACHABLE; i < LEAK_NUM_STATES; i++) {
+            rbuf_printf(rb, "memprof_leak_check_allocations{pid=\"%d\",kind=\"%s\"} %zu\n", pid,
+                        leak_kinds[i], r->leaks->sum.num[i]);
+        }
+        prom_header(rb, "memprof_leak_check_bytes", "gauge",
+                    "Live bytes by leak check verdict.");
+        for(i = LEAK_REACHABLE; i < LEAK_NUM_STATES; i++) {
+            rbuf_printf(rb, "memprof_leak_check_bytes{pid=\"%d\",kind=\"%s\"} %zu\n", pid,
+                        leak_kinds[i], r->leaks->sum.bytes[i]);
+        }
+    }
+}
+
+/* A Prometheus file is replaced whole so a collector never reads half a
+ * report; everything else is appended to report_fd */
+static void emit_report(rbuf_t *rb)
+{
+    char    tmp[4096];
+    rbuf_t  name;
+    int     fd;
+
+    if(report_format != REPORT_PROM || !report_path) {
+        if(rbuf_write(rb, report_fd) != 0) {
+            log_error("Could not write the report: %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    rbuf_init(&name, tmp, sizeof(tmp) - 1);
+    rbuf_printf(&name, "%s.tmp", report_path);
+    tmp[name.len] = '\0';
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        log_error("Could not open %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    if(rbuf_write(rb, fd) != 0 || close(fd) != 0 || rename(tmp, report_path) != 0) {
+        log_error("Could not write %s: %s\n", report_path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* Caller holds report_lock. At exit the report also carries the growth
+ * over the snapshot ring and the leak check. */
+static void write_report(bool at_exit)
+{
+    static top_sites_t          top;
+    static leak_report_t        leaks;
+    static report_t             r;
+    static thread_name_stats_t  names[THREAD_NAMES_MAX];
+    static int                  name_order[THREAD_NAMES_MAX];
+    static heap_stats_t         heap;
+    static heap_frag_t          frag;
+    rbuf_t                      rb;
+    uint32_t                    from = 0;
+    uint32_t                    to = 0;
+    bool                        growth_locked = false;
+
+    if(!report_mem) {
+        void *mem = mmap(NULL, REPORT_BUF_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if(mem == MAP_FAILED) {
+            log_error("Could not map the report buffer\n");
+            return;
+        }
+        report_mem = mem;
+    }
+
+    memset(&r, 0, sizeof(r));
+    time(&r.time);
+    sum_counters(&r.ovrl);
+    r.secs = (prof_clock_ns() - counters_base_ns) / 1e9;
+    r.site_secs = (prof_clock_ns() - start_ns) / 1e9;
+    collect_curr_age_info(&r.ages, r.ovrl.live_num);
+    r.table_mem = hash_mem_usage(&curr_alloc_table);
+    r.records_mem = slab_mem_usage(&alloc_info_cache);
+    r.stacks_mem = stack_mem_usage();
+    r.names = names;
+    r.name_order = name_order;
+    r.num_names = sum_thread_names(names, name_order);
+
+    if(stacks_enabled && top_sites > 0) {
+        memset(&top, 0, sizeof(top));
+        top.max = top_sites < 100 ? top_sites : 100;
+        stack_foreach(collect_top_sites, &top);
+        r.top = &top;
+    }
+
+    if(heap_stats_enabled) {
+        if(heap_stats_read(&heap) != 0) {
+            log_error("Could not read /proc/self/statm\n");
+        }
+        r.heap = &heap;
+        if(track_mode == TRACK_TABLE) {
+            memset(&frag, 0, sizeof(frag));
+            hash_foreach(&curr_alloc_table, collect_heap_block, &frag);
+            r.frag = &frag;
+        }
+    }
+
+    if(at_exit && snapshot_interval > 0 && snap_ring_bounds(&from, &to) == 0 && from != to) {
+        pthread_mutex_lock(&snap_lock);
+        growth_locked = true;
+        if(snap_ring_diff(from, to, &snap_growth) == 0) {
+            r.growth = &snap_growth;
+            r.growth_from = from;
+            r.growth_to = to;
+        }
+    }
+
+    if(at_exit && leak_check_at_exit) {
+        if(track_mode != TRACK_TABLE || use_hdr) {
+            r.leak_error = "needs MEMPROF_MODE=table without sampling";
+        }
+        else if(run_leak_check(&leaks) != 0) {
+            r.leak_error = "failed";
+        }
+        else {
+            r.leaks = &leaks;
+        }
+    }
+
+    rbuf_init(&rb, report_mem, REPORT_BUF_SIZE);
+    if(report_format == REPORT_JSON) {
+        render_json(&rb, &r);
+    }
+    else if(report_format == REPORT_PROM) {
+        render_prom(&rb, &r);
+    }
+    else {
+        render_text(&rb, &r);
+    }
+    if(growth_locked) {
+        pthread_mutex_unlock(&snap_lock);
+    }
+
+    if(rb.truncated) {
+        log_error("Report cut short at %d bytes\n", REPORT_BUF_SIZE);
+    }
+    emit_report(&rb);
+}
+
+/* Control channel commands (MEMPROF_CONTROL), run on the control thread */
+
+static int cmd_snapshot(control_reply_t *reply, char *args)
+{
+    thread_counters_t  ovrl;
+    age_hist_t         ages;
+    int                i;
+
+    pthread_mutex_lock(&report_lock);
+    sum_counters(&ovrl);
+    pthread_mutex_unlock(&report_lock);
+    collect_curr_age_info(&ages, ovrl.live_num);
+
+    control_printf(reply, "pid %d\n", (int)getpid());
+    control_printf(reply, "time_ns %llu\n", (unsigned long long)prof_clock_ns());
+    control_printf(reply, "num_alloc %lld\n", (long long)ovrl.num_alloc);
+    control_printf(reply, "alloc_sz %lld\n", (long long)ovrl.alloc_sz);
+    control_printf(reply, "num_free %lld\n", (long long)ovrl.num_free);
+    control_printf(reply, "free_sz %lld\n", (long long)ovrl.free_sz);
+    control_printf(reply, "cxx_num_alloc %lld\n", (long long)ovrl.cxx_num_alloc);
+    control_printf(reply, "cxx_alloc_sz %lld\n", (long long)ovrl.cxx_alloc_sz);
+    control_printf(reply, "live_num %lld\n", (long long)ovrl.live_num);
+    control_printf(reply, "live_sz %lld\n", (long long)ovrl.live_sz);
+    control_printf(reply, "sample_interval %ld\n", sample_interval);
+    control_printf(reply, "profiler_mem %zu\n",
+                   hash_mem_usage(&curr_alloc_table) + slab_mem_usage(&alloc_info_cache) +
+                   stack_mem_usage());
+    /* size <lower bound> <count> <bytes>, non-empty buckets only */
+    for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+        if(ovrl.live_hist.count[i] != 0) {
+            control_printf(reply, "size %zu %lld %lld\n", size_hist_lower(i),
+                           (long long)ovrl.live_hist.count[i],
+                           (long long)ovrl.live_hist.bytes[i]);
+        }
+    }
+    /* age <lower bound in ns> <count> */
+    for(i = 0; i < AGE_HIST_BUCKETS; i++) {
+        control_printf(reply, "age %llu %lld\n", (unsigned long long)age_hist_lower(i),
+                       (long long)ages.count[i]);
+    }
+    return 0;
+}
+
+/* Restarts the overall counters from zero; the live set is left alone */
+static int cmd_reset(control_reply_t *reply, char *args)
+{
+    pthread_mutex_lock(&report_lock);
+    thread_stats_sum(&counters_base);
+    thread_stats_by_name(names_base);
+    counters_base_ns = prof_clock_ns();
+    pthread_mutex_unlock(&report_lock);
+    return 0;
+}
+
+static int cmd_interval(control_reply_t *reply, char *args)
+{
+    char *end = NULL;
+    long  interval = strtol(args, &end, 10);
+
+    if(end == args || *end != '\0' || interval < 0) {
+        return control_error(reply, "usage: interval <seconds>, 0 pauses");
+    }
+
+    pthread_mutex_lock(&report_lock);
+    report_interval = interval;
+    if(interval > 0 && !reporter_running) {
+        start_reporter_thread();
+    }
+    pthread_cond_signal(&report_cond);
+    pthread_mutex_unlock(&report_lock);
+
+    control_printf(reply, "interval %ld\n", interval);
+    return 0;
+}
+
+static int cmd_sample(control_reply_t *reply, char *args)
+{
+    char *end = NULL;
+    long  interval = strtol(args, &end, 10);
+    int   i;
+
+    if(end == args || *end != '\0' || interval < 0) {
+        return control_error(reply, "usage: sample <bytes>, 0 tracks every allocation");
+    }
+    /* Table mode without sampling has no way to tell unsampled blocks apart */
+    if(!use_hdr) {
+        return control_error(reply, "needs MEMPROF_MODE=header or MEMPROF_SAMPLE_INTERVAL");
+    }
+
+    pthread_mutex_lock(&report_lock);
+    for(i = 0; i < num_sample_rates && sample_rates[i] != interval; i++);
+    if(i == num_sample_rates) {
+        if(i == SAMPLE_RATES_MAX) {
+            pthread_mutex_unlock(&report_lock);
+            return control_error(reply, "too many different sampling intervals");
+        }
+        sample_rates[i] = interval;
+        num_sample_rates++;
+    }
+    __atomic_store_n(&sample_interval, interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&sample_idx, i, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&report_lock);
+
+    control_printf(reply, "sample_interval %ld\n", interval);
+    return 0;
+}
+
+static int cmd_trace(control_reply_t *reply, char *args)
+{
+    if(strncmp(args, "start ", 6) == 0 && args[6]) {
+        if(trace_enabled) {
+            return control_error(reply, "trace already running");
+        }
+        if(trace_open(args + 6) != 0) {
+            return control_error(reply, "could not open %s: %s", args + 6, strerror(errno));
+        }
+        control_printf(reply, "trace %s\n", args + 6);
+        return 0;
+    }
+    if(strcmp(args, "stop") == 0) {
+        if(!trace_enabled) {
+            return control_error(reply, "no trace running");
+        }
+        trace_close();
+        return 0;
+    }
+    return control_error(reply, "usage: trace start <path> | stop");
+}
+
+typedef struct {
+    void      *ptr;
+    size_t     size;
+    uint64_t   alloc_ts;
+    uint32_t   stack_id;
+} dump_rec_t;
+
+typedef struct {
+    dump_rec_t *recs;
+    size_t      num;
+    size_t      cap;
+    size_t      missed;
+} dump_buf_t;
+
+/* Runs under a shard lock: only copies, the file is written after */
+static void collect_dump_rec(void *key, void *val, void *arg)
+{
+    alloc_info_t *info = (alloc_info_t*)val;
+    dump_buf_t   *dump = (dump_buf_t*)arg;
+    dump_rec_t   *rec = NULL;
+
+    if(dump->num == dump->cap) {
+        dump->missed++;
+        return;
+    }
+    rec = &dump->recs[dump->num];
+    rec->ptr = key;
+    rec->size = info->alloc_sz;
+    rec->alloc_ts = info->alloc_ts;
+    rec->stack_id = info->stack_id;
+    dump->num++;
+}
+
+/* Writes the live set to a file, one "ptr size age_ns site" line per block */
+static int cmd_dump(control_reply_t *reply, char *args)
+{
+    static char  out[64 * 1024];
+    dump_buf_t   dump = {0};
+    size_t       len = 0;
+    size_t       map_len = 0;
+    size_t       i;
+    uint64_t     now = 0;
+    int          fd = -1;
+
+    if(!*args) {
+        return control_error(reply, "usage: dump <path>");
+    }
+    if(track_mode != TRACK_TABLE) {
+        return control_error(reply, "needs MEMPROF_MODE=table");
+    }
+
+    dump.recs = map_live_set(sizeof(dump_rec_t), &dump.cap, &map_len);
+    if(!dump.recs) {
+        return control_error(reply, "out of memory");
+    }
+
+    fd = open(args, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        munmap(dump.recs, map_len);
+        return control_error(reply, "could not open %s: %s", args, strerror(errno));
+    }
+
+    hash_foreach(&curr_alloc_table, collect_dump_rec, &dump);
+    now = prof_clock_ns();
+
+    len = snprintf(out, sizeof(out), "# ptr size age_ns site\n");
+    for(i = 0; i < dump.num; i++) {
+        dump_rec_t *rec = &dump.recs[i];
+
+        if(len + 96 > sizeof(out)) {
+            if(write(fd, out, len) != (ssize_t)len) {
+                break;
+            }
+            len = 0;
+        }
+        len += snprintf(out + len, sizeof(out) - len, "%p %zu %llu %u\n", rec->ptr, rec->size,
+                        (unsigned long long)(now > rec->alloc_ts ? now - rec->alloc_ts : 0),
+                        rec->stack_id);
+    }
+    if(i < dump.num || write(fd, out, len) != (ssize_t)len) {
+        close(fd);
+        munmap(dump.recs, map_len);
+        return control_error(reply, "could not write %s: %s", args, strerror(errno));
+    }
+    close(fd);
+    munmap(dump.recs, map_len);
+
+    control_printf(reply, "path %s\n", args);
+    control_printf(reply, "records %zu\n", dump.num);
+    control_printf(reply, "missed %zu\n", dump.missed);
+    return 0;
+}
+
+/* Leak check of the live set: "<class> <count> <bytes>" lines, then the
+ * sites of the most definitely leaked bytes as "site <id> <count> <bytes>" */
+static int cmd_leaks(control_reply_t *reply, char *args)
+{
+    static leak_report_t report;
+    leak_summary_t      *sum = &report.sum;
+    int                  i;
+
+    if(track_mode != TRACK_TABLE || use_hdr) {
+        return control_error(reply, "needs MEMPROF_MODE=table without sampling");
+    }
+    if(run_leak_check(&report) != 0) {
+        return control_error(reply, "out of memory");
+    }
+
+    control_printf(reply, "reachable %zu %zu\n", sum->num[LEAK_REACHABLE],
+                   sum->bytes[LEAK_REACHABLE]);
+    control_printf(reply, "indirect %zu %zu\n", sum->num[LEAK_INDIRECT],
+                   sum->bytes[LEAK_INDIRECT]);
+    control_printf(reply, "definite %zu %zu\n", sum->num[LEAK_DEFINITE],
+                   sum->bytes[LEAK_DEFINITE]);
+    control_printf(reply, "missed %zu\n", report.missed);
+    control_printf(reply, "roots_bytes %zu\n", sum->roots);
+    control_printf(reply, "threads %d %d\n", sum->threads, sum->no_regs);
+    control_printf(reply, "workers %d\n", sum->workers);
+    control_printf(reply, "secs %.6f\n", sum->secs);
+    for(i = 0; i < report.num_top; i++) {
+        control_printf(reply, "site %u %lld %lld\n", report.top[i].id,
+                       (long long)report.top[i].num, (long long)report.top[i].bytes);
+    }
+    return 0;
+}
+
+/* Lists the retained snapshots as "snap <seq> <age_ns> <live_num>
+ * <live_sz> <changed cells> <encoded bytes>"; "take" adds one first */
+static int cmd_snapshots(control_reply_t *reply, char *args)
+{
+    static snap_info_t  info[SNAP_RING_MAX];
+    uint64_t            now = prof_clock_ns();
+    int                 num = 0;
+    int                 i;
+
+    if(!snapshot_interval) {
+        return control_error(reply, "needs MEMPROF_SNAPSHOT");
+    }
+    if(strcmp(args, "take") == 0) {
+        int64_t seq = take_snapshot();
+
+        if(seq < 0) {
+            return control_error(reply, "snapshot does not fit in the ring");
+        }
+        control_printf(reply, "taken %lld\n", (long long)seq);
+    }
+    else if(*args) {
+        return control_error(reply, "usage: snapshots [take]");
+    }
+
+    /* Only the control thread uses info[] */
+    num = snap_ring_list(info, SNAP_RING_MAX);
+    for(i = 0; i < num; i++) {
+        control_printf(reply, "snap %u %llu %lld %lld %u %u\n", info[i].seq,
+                       (unsigned long long)(now > info[i].time_ns ? now - info[i].time_ns : 0),
+                       (long long)info[i].total.num, (long long)info[i].total.bytes,
+                       info[i].cells, info[i].len);
+    }
+    return 0;
+}
+
+/* Top growers between two retained snapshots, the oldest and the newest
+ * by default: "site <id> <count> <bytes>" and "size <lower> <count> <bytes>"
+ * lines, by bytes grown */
+static int cmd_growth(control_reply_t *reply, char *args)
+{
+    int           top[100];
+    int           max = top_sites < 100 ? top_sites : 100;
+    int           num = 0;
+    int           i;
+    uint32_t      from = 0;
+    uint32_t      to = 0;
+    char         *end = NULL;
+
+    if(!snapshot_interval) {
+        return control_error(reply, "needs MEMPROF_SNAPSHOT");
+    }
+    if(snap_ring_bounds(&from, &to) != 0) {
+        return control_error(reply, "no snapshots yet");
+    }
+    if(*args) {
+        from = strtoul(args, &end, 10);
+        if(*end == ' ') {
+            to = strtoul(end + 1, &end, 10);
+        }
+        if(*end != '\0') {
+            return control_error(reply, "usage: growth [<from> [<to>]]");
+        }
+    }
+
+    pthread_mutex_lock(&snap_lock);
+    if(snap_ring_diff(from, to, &snap_growth) != 0) {
+        pthread_mutex_unlock(&snap_lock);
+        return control_error(reply, "snapshots %u - %u not retained", from, to);
+    }
+    control_printf(reply, "from %u\n", from);
+    control_printf(reply, "to %u\n", to);
+    control_printf(reply, "elapsed_ns %llu\n", (unsigned long long)snap_growth.time_ns);
+    control_printf(reply, "total %lld %lld\n", (long long)snap_growth.total.num,
+                   (long long)snap_growth.total.bytes);
+    num = rank_growth(snap_growth.sites, STACK_TABLE_SIZE, top, max);
+    for(i = 0; i < num; i++) {
+        control_printf(reply, "site %d %lld %lld\n", top[i],
+                       (long long)snap_growth.sites[top[i]].num,
+                       (long long)snap_growth.sites[top[i]].bytes);
+    }
+    num = rank_growth(snap_growth.sizes, SIZE_HIST_BUCKETS, top, max);
+    for(i = 0; i < num; i++) {
+        control_printf(reply, "size %zu %lld %lld\n", size_hist_lower(top[i]),
+                       (long long)snap_growth.sizes[top[i]].num,
+                       (long long)snap_growth.sizes[top[i]].bytes);
+    }
+    pthread_mutex_unlock(&snap_lock);
+    return 0;
+}
+
+static const control_cmd_t control_cmds[] = {
+    { "snapshot", cmd_snapshot, NULL },
+    { "reset",    cmd_reset,    NULL },
+    { "interval", cmd_interval, "<seconds>" },
+    { "sample",   cmd_sample,   "<bytes>" },
+    { "trace",    cmd_trace,    "start <path> | stop" },
+    { "dump",     cmd_dump,     "<path>" },
+    { "leaks",    cmd_leaks,    NULL },
+    { "snapshots", cmd_snapshots, "[take]" },
+    { "growth",   cmd_growth,   "[<from> [<to>]]" },
+    { NULL,       NULL,         NULL },
+};
+
+/* Allocation paths shared by the hooks. zero selects calloc semantics. */
+static void* prof_malloc(size_t size, bool zero)
+{
+    void *ret_ptr = NULL;
+    bool  tracked = !no_hook && sample_alloc(size);
+
+    if(tracked && use_hdr) {
+        if(hdr_size_overflows(size)) {
+            return NULL;
+        }
+        ret_ptr = hdr_to_user(zero ? orig_calloc(1, size + sizeof(alloc_hdr_t))
+                                   : orig_malloc(size + sizeof(alloc_hdr_t)));
+    }
+    else {
+        ret_ptr = zero ? orig_calloc(1, size) : orig_malloc(size);
+    }
+
+    /* update stats */
+    if(ret_ptr && !no_hook) {
+        add_overall_alloc(size);
+        if(tracked) {
+            add_curr_alloc(ret_ptr, size, 0);
+        }
+    }
+    return ret_ptr;
+}
+
+/* align is a power of two */
+static void* prof_memalign(size_t align, size_t size)
+{
+    void *ret_ptr = NULL;
+    bool  tracked = false;
+
+    if(align <= MALLOC_ALIGN) {
+        return prof_malloc(size, false);
+    }
+
+    tracked = !no_hook && sample_alloc(size);
+    if(tracked && use_hdr) {
+        /* The header goes in the last bytes of a leading pad of align
+           bytes, which keeps the user pointer aligned */
+        if(size > SIZE_MAX - align) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        ret_ptr = orig_memalign(align, size + align);
+        ret_ptr = ret_ptr ? (char*)ret_ptr + align : NULL;
+    }
+    else {
+        ret_ptr = orig_memalign(align, size);
+    }
+
+    if(ret_ptr && !no_hook) {
+        add_overall_alloc(size);
+        if(tracked) {
+            add_curr_alloc(ret_ptr, size,
+                           use_hdr ? __builtin_ctzl(align) << ALLOC_OFFSET_SHIFT : 0);
+        }
+    }
+    return ret_ptr;
+}
+
+/* Run under the shard lock: from here the heap walk leaves the block alone */
+static void mark_resizing(void *key, void *val, void *arg)
+{
+    alloc_info_t *info = (alloc_info_t*)val;
+
+    __atomic_or_fetch(&info->flags, ALLOC_FLAG_RESIZING, __ATOMIC_RELAXED);
+}
+
+/* Freed bytes only ever come from the block's record, weighted like the
+ * live set: under sampling the sampled frees stand for all the others,
+ * so the exact size of an unsampled sized delete would count twice. */
+static void prof_free(void *ptr)
+{
+    alloc_hdr_t *hdr = NULL;
+    int64_t      size = 0;
+
+    if(use_hdr) {
+        hdr = get_alloc_hdr(ptr);
+        if(!hdr) {
+            /* Unsampled or not ours: no lookup needed */
+            if(sample_interval && !no_hook) {
+                add_overall_free(0);
+            }
+            orig_free(ptr);
+            return;
+        }
+    }
+
+    /* update stats before the address can be handed out again */
+    if(del_curr_alloc(ptr, hdr, true, &size) == 0) {
+        add_overall_free(size);
+    }
+    orig_free(hdr ? hdr_base(ptr, hdr) : ptr);
+}
+
+/* realloc for blocks that carry a header. The header travels with the
+ * block, so the record is updated wherever it lands. Its magic is cleared
+ * meanwhile: the old address must not pass the check once freed. With
+ * sampling in table mode the table also points into the header, so the
+ * record is out of the table meanwhile. */
+static void* hdr_realloc(void *ptr, alloc_hdr_t *hdr, size_t size)
+{
+    alloc_hdr_t *new_hdr = NULL;
+    void        *ret_ptr = NULL;
+    bool         in_table = false;
+
+    if(hdr_size_overflows(size)) {
+        return NULL;
+    }
+
+    if(track_mode == TRACK_TABLE) {
+        in_table = hash_delete(&curr_alloc_table, ptr) != NULL;
+    }
+    hdr->magic = 0;
+    new_hdr = orig_realloc(hdr, size + sizeof(alloc_hdr_t));
+    if(!new_hdr) {
+        hdr->magic = (uintptr_t)ptr ^ ALLOC_HDR_MAGIC;
+        if(in_table) {
+            hash_insert(&curr_alloc_table, ptr, &hdr->info, NULL, NULL);
+        }
+        return NULL;
+    }
+
+    ret_ptr = hdr_to_user(new_hdr);
+    new_hdr->magic = (uintptr_t)ret_ptr ^ ALLOC_HDR_MAGIC;
+    if(in_table && hash_insert(&curr_alloc_table, ret_ptr, &new_hdr->info, NULL, NULL) != 0) {
+        log_error("Could not insert node:%p\n", ret_ptr);
+        count_curr_alloc(&new_hdr->info, -1, false);
+        return ret_ptr;
+    }
+    resize_curr_alloc(&new_hdr->info, size, ret_ptr != ptr);
+    return ret_ptr;
+}
+
+/* realloc of a block with a header to a block without one. The record
+ * comes along at the start of the new block and is dropped there; until
+ * then it is left as it was, to be put back if the realloc fails. */
+static void* hdr_realloc_drop(void *ptr, alloc_hdr_t *hdr, size_t size)
+{
+    alloc_hdr_t *new_hdr = NULL;
+    void        *ret_ptr = NULL;
+    size_t       old_sz = hdr->info.alloc_sz;
+    bool         in_table = false;
+
+    if(track_mode == TRACK_TABLE) {
+        in_table = hash_delete(&curr_alloc_table, ptr) != NULL;
+    }
+    hdr->magic = 0;
+    new_hdr = orig_realloc(hdr, size + sizeof(alloc_hdr_t));
+    if(!new_hdr) {
+        hdr->magic = (uintptr_t)ptr ^ ALLOC_HDR_MAGIC;
+        if(in_table) {
+            hash_insert(&curr_alloc_table, ptr, &hdr->info, NULL, NULL);
+        }
+        return NULL;
+    }
+
+    /* Blocks not found in the table were never counted, as in
+       del_curr_alloc */
+    if(track_mode == TRACK_HEADER || in_table) {
+        count_curr_alloc(&new_hdr->info, -1, false);
+        count_realloc_chain(&new_hdr->info);
+    }
+    add_realloc_growth(old_sz, size);
+    memmove(new_hdr, hdr_to_user(new_hdr), old_sz < size ? old_sz : size);
+
+    /* Gives back the header's room, so that the usable size the block's
+       next realloc starts from is its own */
+    ret_ptr = orig_realloc(new_hdr, size);
+    return ret_ptr ? ret_ptr : new_hdr;
+}
+
+static void* prof_realloc(void *ptr, size_t size)
+{
+    void          *ret_ptr = NULL;
+    alloc_info_t  *info = NULL;
+
+    if(!ptr) {
+        return prof_malloc(size, false);
+    }
+    if(size == 0) {
+        prof_free(ptr);
+        return NULL;
+    }
+    if(boot_owns(ptr)) {
+        ret_ptr = prof_malloc(size, false);
+        if(ret_ptr) {
+            memcpy(ret_ptr, ptr, size < boot_size(ptr) ? size : boot_size(ptr));
+        }
+        return ret_ptr;
+    }
+
+    if(use_hdr) {
+        alloc_hdr_t *hdr = get_alloc_hdr(ptr);
+        bool         tracked = false;
+        size_t       copy_sz = 0;
+        void        *base = NULL;
+
+        tracked = !no_hook && sample_alloc(size);
+        if(tracked && hdr_size_overflows(size)) {
+            return NULL;
+        }
+
+        /* Aligned blocks do not start at their header; realloc does not
+           keep the alignment anyway, so move the contents */
+        if(hdr && hdr_base(ptr, hdr) != (void*)hdr) {
+            copy_sz = hdr->info.alloc_sz;
+            base = orig_malloc(tracked ? size + sizeof(alloc_hdr_t) : size);
+            if(!base) {
+                return NULL;
+            }
+            ret_ptr = tracked ? hdr_to_user(base) : base;
+            memcpy(ret_ptr, ptr, copy_sz < size ? copy_sz : size);
+
+            base = hdr_base(ptr, hdr);
+            del_curr_alloc(ptr, hdr, false, NULL);
+            orig_free(base);
+            add_realloc_growth(copy_sz, size);
+            if(tracked) {
+                add_curr_alloc(ret_ptr, size, 0);
+            }
+            return ret_ptr;
+        }
+        if(hdr && tracked) {
+            return hdr_realloc(ptr, hdr, size);
+        }
+        if(!hdr && !tracked) {
+            /* No record: the growth is taken from the usable size */
+            copy_sz = orig_malloc_usable_size(ptr);
+            ret_ptr = orig_realloc(ptr, size);
+            if(ret_ptr && !no_hook) {
+                add_realloc_growth(copy_sz, size);
+            }
+            return ret_ptr;
+        }
+        if(hdr_size_overflows(size)) {
+            return NULL;
+        }
+
+        /* Like any allocation, the new block is sampled or not on its own
+           account. Move the contents in place to add or drop the header. */
+        if(hdr) {
+            return hdr_realloc_drop(ptr, hdr, size);
+        }
+
+        copy_sz = orig_malloc_usable_size(ptr);
+        base = orig_realloc(ptr, size + sizeof(alloc_hdr_t));
+        if(!base) {
+            return NULL;
+        }
+        ret_ptr = hdr_to_user(base);
+        memmove(ret_ptr, base, copy_sz < size ? copy_sz : size);
+        add_realloc_growth(copy_sz, size);
+        add_curr_alloc(ret_ptr, size, 0);
+        return ret_ptr;
+    }
+    if(no_hook) {
+        return orig_realloc(ptr, size);
+    }
+
+    /* call "real" realloc function */
+    info = hash_find_visit(&curr_alloc_table, ptr, mark_resizing, NULL);
+    ret_ptr = orig_realloc(ptr, size);
+    if(!ret_ptr) {
+        if(info) {
+            __atomic_and_fetch(&info->flags, ~ALLOC_FLAG_RESIZING, __ATOMIC_RELAXED);
+        }
+        return NULL;
+    }
+
+    /* Blocks from before the hooks were up start being tracked here, as
+       if allocated now, so that their free is matched */
+    if(!info) {
+        add_overall_alloc(size);
+        add_curr_alloc(ret_ptr, size, 0);
+        return ret_ptr;
+    }
+
+    /* A moved record is re-keyed. The old address is already free and may
+       be in use again, with a record of its own that must stay. */
+    if(ret_ptr != ptr) {
+        alloc_info_t *stale = NULL;
+
+        if(hash_move(&curr_alloc_table, ptr, ret_ptr, info, take_stale, &stale) != 0) {
+            log_error("Could not insert node:%p\n", ret_ptr);
+            count_curr_alloc(info, -1, false);
+            slab_free(&alloc_info_cache, info);
+            return ret_ptr;
+        }
+        release_stale(stale, info);
+    }
+    resize_curr_alloc(info, size, ret_ptr != ptr);
+    __atomic_and_fetch(&info->flags, ~ALLOC_FLAG_RESIZING, __ATOMIC_RELAXED);
+    return ret_ptr;
+}
+
+/* Looks up one real allocator function, the hooks are useless without it */
+static void* resolve_orig(const char *name)
+{
+    void *func = dlsym(RTLD_NEXT, name);
+
+    if(!func) {
+        log_error("Could not find the real %s\n", name);
+        abort();
+    }
+    return func;
+}
+
+/* Run by the first hooked call, in whichever thread. Returns false while
+ * another call is resolving: dlsym's own allocations in this thread, or a
+ * thread starting alongside. Those are served from the bootstrap arena. */
+static bool init_hooks_slow(void)
+{
+    int state = HOOKS_NONE;
+
+    if(!__atomic_compare_exchange_n(&hooks_state, &state, HOOKS_RESOLVING, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        return state == HOOKS_READY;
+    }
+
+    orig_malloc = (orig_malloc_t)resolve_orig("malloc");
+    orig_calloc = (orig_calloc_t)resolve_orig("calloc");
+    orig_realloc = (orig_realloc_t)resolve_orig("realloc");
+    orig_free = (orig_free_t)resolve_orig("free");
+    orig_memalign = (orig_memalign_t)resolve_orig("memalign");
+    orig_malloc_usable_size = (orig_usable_size_t)resolve_orig("malloc_usable_size");
+    load_config();
+    start_ns = prof_clock_ns();
+    counters_base_ns = start_ns;
+
+    __atomic_store_n(&hooks_state, HOOKS_READY, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* A single well-predicted branch once the hooks are set up */
+static inline bool init_hooks(void)
+{
+    if(__builtin_expect(__atomic_load_n(&hooks_state, __ATOMIC_ACQUIRE) == HOOKS_READY, 1)) {
+        return true;
+    }
+    return init_hooks_slow();
+}
+
+static inline bool is_power_of_2(size_t x)
+{
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+/* Shared tail of the aligned allocation hooks, align is a power of two */
+static void* memalign_hook(size_t align, size_t size)
+{
+    void *ret_ptr = NULL;
+
+    if(!init_hooks()) {
+        return boot_alloc(size, align);
+    }
+
+    ret_ptr = prof_memalign(align, size);
+    if(trace_enabled && !no_hook) {
+        trace_event(TRACE_OP_MEMALIGN, ret_ptr, size, (void*)align);
+    }
+    return ret_ptr;
+}
+
+/* libstdc++ pieces operator new needs when it runs out of memory, looked
+ * up on first use: std::get_new_handler() and std::__throw_bad_alloc() */
+typedef void (*new_handler_t)(void);
+typedef new_handler_t (*get_new_handler_t)(void);
+typedef void (*throw_bad_alloc_t)(void);
+
+static get_new_handler_t cxx_get_new_handler = NULL;
+static throw_bad_alloc_t cxx_throw_bad_alloc = NULL;
+
+/* Shared body of the operator new family. align is 0 for the plain
+ * operators. Follows the standard: call the new handler until it
+ * succeeds, and throw std::bad_alloc when there is none (unless nothrow). */
+static void* cxx_new(size_t size, size_t align, bool nothrow)
+{
+    void* ret_ptr = NULL;
+
+    if(!init_hooks()) {
+        ret_ptr = boot_alloc(size, align);
+        if(!ret_ptr && !nothrow) {
+            abort();
+        }
+        return ret_ptr;
+    }
+
+    while(!(ret_ptr = align ? prof_memalign(align, size) : prof_malloc(size, false))) {
+        new_handler_t handler = NULL;
+
+        if(!cxx_get_new_handler) {
+            int saved = no_hook;
+
+            no_hook = 1;
+            cxx_get_new_handler = (get_new_handler_t)dlsym(RTLD_DEFAULT, "_ZSt15get_new_handlerv");
+            cxx_throw_bad_alloc = (throw_bad_alloc_t)dlsym(RTLD_DEFAULT, "_ZSt17__throw_bad_allocv");
+            no_hook = saved;
+            if(!cxx_get_new_handler || !cxx_throw_bad_alloc) {
+                abort();
+            }
+        }
+        handler = cxx_get_new_handler();
+        if(!handler) {
+            if(nothrow) {
+                return NULL;
+            }
+            cxx_throw_bad_alloc();
+        }
+        handler();
+    }
+
+    if(!no_hook) {
+        add_overall_cxx_alloc(size);
+        if(trace_enabled) {
+            trace_event(align ? TRACE_OP_MEMALIGN : TRACE_OP_MALLOC, ret_ptr, size,
+                        (void*)align);
+        }
+    }
+    return ret_ptr;
+}
+
+/* Shared body of the operator delete family. The sizes the sized forms
+ * pass are not used: the record has the size, and has to be found to be
+ * dropped anyway, so they would not save the lookup. */
+static void cxx_delete(void* ptr)
+{
+    /* Bootstrap blocks are never given back */
+    if(!ptr || boot_owns(ptr) || !init_hooks()) {
+        return;
+    }
+    if(trace_enabled && !no_hook) {
+        trace_event(TRACE_OP_FREE, ptr, 0, NULL);
+    }
+    prof_free(ptr);
+}
+
+/*-----------------------------------------------------------------------------
+                          EXTERNAL FUNCTIONS
+-----------------------------------------------------------------------------*/
+MEMPROF_EXPORT void* malloc(size_t size)
+{
+    void* ret_ptr = NULL;
+
+    if(!init_hooks()) {
+        return boot_alloc(size, 0);
+    }
+
+    ret_ptr = prof_malloc(size, false);
+    if(trace_enabled && !no_hook) {
+        trace_event(TRACE_OP_MALLOC, ret_ptr, size, NULL);
+    }
+    return ret_ptr;
+}
+
+MEMPROF_EXPORT void* calloc(size_t nmemb, size_t size)
+{
+    void* ret_ptr = NULL;
+    size_t total = 0;
+
+    if(__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    /* dlsym calls calloc; arena memory is already zeroed */
+    if(!init_hooks()) {
+        return boot_alloc(total, 0);
+    }
+
+    ret_ptr = prof_malloc(total, true);
+    if(trace_enabled && !no_hook) {
+        trace_event(TRACE_OP_CALLOC, ret_ptr, total, NULL);
+    }
+    return ret_ptr;
+}
+
+MEMPROF_EXPORT void* realloc(void* ptr, size_t size)
+{
+    void* ret_ptr = NULL;
+    uint64_t ts = 0;
+
+    /* Only bootstrap blocks exist before the hooks are ready */
+    if(!init_hooks()) {
+        ret_ptr = boot_alloc(size, 0);
+        if(ret_ptr && ptr) {
+            memcpy(ret_ptr, ptr, size < boot_size(ptr) ? size : boot_size(ptr));
+        }
+        return ret_ptr;
+    }
+
+    /* Stamped before the old block is released, like a free: another
+       thread may be handed its address before the event is logged */
+    if(trace_enabled) {
+        ts = prof_clock_ns();
+    }
+    ret_ptr = prof_realloc(ptr, size);
+    if(trace_enabled && !no_hook) {
+        trace_event_at(TRACE_OP_REALLOC, ts ? ts : prof_clock_ns(), ret_ptr, size, ptr);
+    }
+    return ret_ptr;
+}
+
+MEMPROF_EXPORT void* reallocarray(void* ptr, size_t nmemb, size_t size)
+{
+    size_t total = 0;
+
+    if(__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+MEMPROF_EXPORT void free(void* ptr)
+{
+    /* Bootstrap blocks are never given back */
+    if(!ptr || boot_owns(ptr) || !init_hooks()) {
+        return;
+    }
+
+    /* Traced first, the address may be handed out again right after */
+    if(trace_enabled && !no_hook) {
+        trace_event(TRACE_OP_FREE, ptr, 0, NULL);
+    }
+    prof_free(ptr);
+    return;
+}
+
+MEMPROF_EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    void* ret_ptr = NULL;
+
+    if(!is_power_of_2(alignment) || alignment % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+    ret_ptr = memalign_hook(alignment, size);
+    if(!ret_ptr) {
+        return ENOMEM;
+    }
+    *memptr = ret_ptr;
+    return 0;
+}
+
+MEMPROF_EXPORT void* aligned_alloc(size_t alignment, size_t size)
+{
+    if(!is_power_of_2(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign_hook(alignment, size);
+}
+
+MEMPROF_EXPORT void* memalign(size_t alignment, size_t size)
+{
+    /* Like glibc, round other alignments up to a power of two */
+    if(!is_power_of_2(alignment)) {
+        if(alignment > SIZE_MAX / 2 + 1) {
+            errno = EINVAL;
+            return NULL;
+        }
+        alignment = alignment <= 1 ? 1 : (size_t)1 << (64 - __builtin_clzl(alignment - 1));
+    }
+    return memalign_hook(alignment, size);
+}
+
+MEMPROF_EXPORT void* valloc(size_t size)
+{
+    return memalign_hook(getpagesize(), size);
+}
+
+MEMPROF_EXPORT void* pvalloc(size_t size)
+{
+    size_t page = getpagesize();
+
+    if(size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = size ? (size + page - 1) & ~(page - 1) : page;
+    return memalign_hook(page, size);
+}
+
+MEMPROF_EXPORT size_t malloc_usable_size(void* ptr)
+{
+    alloc_hdr_t *hdr = NULL;
+
+    if(!ptr) {
+        return 0;
+    }
+    if(boot_owns(ptr)) {
+        return boot_size(ptr);
+    }
+    if(!init_hooks()) {
+        return 0;
+    }
+    if(use_hdr && (hdr = get_alloc_hdr(ptr))) {
+        char *base = hdr_base(ptr, hdr);
+
+        return orig_malloc_usable_size(base) - ((char*)ptr - base);
+    }
+    return orig_malloc_usable_size(ptr);
+}
+
+/* Moves the thread's counters to its new name (thread_stats.c) */
+MEMPROF_EXPORT int pthread_setname_np(pthread_t thread, const char* name)
+{
+    int ret = 0;
+
+    if(!orig_setname) {
+        int saved = no_hook;
+
+        no_hook = 1;
+        orig_setname = (orig_setname_t)dlsym(RTLD_NEXT, "pthread_setname_np");
+        no_hook = saved;
+        if(!orig_setname) {
+            return ENOSYS;
+        }
+    }
+    ret = orig_setname(thread, name);
+    if(ret == 0) {
+        thread_stats_set_name((uintptr_t)thread, name);
+    }
+    return ret;
+}
+
+/* C++ operator new and delete, under their Itanium C++ ABI names for LP64
+ * (size_t is 'm'). The std::align_val_t and std::nothrow_t arguments are
+ * passed as a size_t and an unused reference. */
+MEMPROF_EXPORT void* cxx_new_1(size_t size) __asm__("_Znwm");
+MEMPROF_EXPORT void* cxx_new_2(size_t size) __asm__("_Znam");
+MEMPROF_EXPORT void* cxx_new_3(size_t size, const void* nt) __asm__("_ZnwmRKSt9nothrow_t");
+MEMPROF_EXPORT void* cxx_new_4(size_t size, const void* nt) __asm__("_ZnamRKSt9nothrow_t");
+MEMPROF_EXPORT void* cxx_new_5(size_t size, size_t align) __asm__("_ZnwmSt11align_val_t");
+MEMPROF_EXPORT void* cxx_new_6(size_t size, size_t align) __asm__("_ZnamSt11align_val_t");
+MEMPROF_EXPORT void* cxx_new_7(size_t size, size_t align, const void* nt)
+    __asm__("_ZnwmSt11align_val_tRKSt9nothrow_t");
+MEMPROF_EXPORT void* cxx_new_8(size_t size, size_t align, const void* nt)
+    __asm__("_ZnamSt11align_val_tRKSt9nothrow_t");
+
+MEMPROF_EXPORT void cxx_delete_1(void* ptr) __asm__("_ZdlPv");
+MEMPROF_EXPORT void cxx_delete_2(void* ptr) __asm__("_ZdaPv");
+MEMPROF_EXPORT void cxx_delete_3(void* ptr, size_t size) __asm__("_ZdlPvm");
+MEMPROF_EXPORT void cxx_delete_4(void* ptr, size_t size) __asm__("_ZdaPvm");
+MEMPROF_EXPORT void cxx_delete_5(void* ptr, const void* nt) __asm__("_ZdlPvRKSt9nothrow_t");
+MEMPROF_EXPORT void cxx_delete_6(void* ptr, const void* nt) __asm__("_ZdaPvRKSt9nothrow_t");
+MEMPROF_EXPORT void cxx_delete_7(void* ptr, size_t align) __asm__("_ZdlPvSt11align_val_t");
+MEMPROF_EXPORT void cxx_delete_8(void* ptr, size_t align) __asm__("_ZdaPvSt11align_val_t");
+MEMPROF_EXPORT void cxx_delete_9(void* ptr, size_t size, size_t align) __asm__("_ZdlPvmSt11align_val_t");
+MEMPROF_EXPORT void cxx_delete_10(void* ptr, size_t size, size_t align) __asm__("_ZdaPvmSt11align_val_t");
+MEMPROF_EXPORT void cxx_delete_11(void* ptr, size_t align, const void* nt)
+    __asm__("_ZdlPvSt11align_val_tRKSt9nothrow_t");
+MEMPROF_EXPORT void cxx_delete_12(void* ptr, size_t align, const void* nt)
+    __asm__("_ZdaPvSt11align_val_tRKSt9nothrow_t");
+
+_Static_assert(sizeof(size_t) == sizeof(unsigned long),
+               "operator new/delete names assume size_t is unsigned long");
+
+void* cxx_new_1(size_t size) { return cxx_new(size, 0, false); }
+void* cxx_new_2(size_t size) { return cxx_new(size, 0, false); }
+void* cxx_new_3(size_t size, const void* nt) { return cxx_new(size, 0, true); }
+void* cxx_new_4(size_t size, const void* nt) { return cxx_new(size, 0, true); }
+void* cxx_new_5(size_t size, size_t align) { return cxx_new(size, align, false); }
+void* cxx_new_6(size_t size, size_t align) { return cxx_new(size, align, false); }
+void* cxx_new_7(size_t size, size_t align, const void* nt) { return cxx_new(size, align, true); }
+void* cxx_new_8(size_t size, size_t align, const void* nt) { return cxx_new(size, align, true); }
+
+void cxx_delete_1(void* ptr) { cxx_delete(ptr); }
+void cxx_delete_2(void* ptr) { cxx_delete(ptr); }
+void cxx_delete_3(void* ptr, size_t size) { cxx_delete(ptr); }
+void cxx_delete_4(void* ptr, size_t size) { cxx_delete(ptr); }
+void cxx_delete_5(void* ptr, const void* nt) { cxx_delete(ptr); }
+void cxx_delete_6(void* ptr, const void* nt) { cxx_delete(ptr); }
+void cxx_delete_7(void* ptr, size_t align) { cxx_delete(ptr); }
+void cxx_delete_8(void* ptr, size_t align) { cxx_delete(ptr); }
+void cxx_delete_9(void* ptr, size_t size, size_t align) { cxx_delete(ptr); }
+void cxx_delete_10(void* ptr, size_t size, size_t align) { cxx_delete(ptr); }
+void cxx_delete_11(void* ptr, size_t align, const void* nt) { cxx_delete(ptr); }
+void cxx_delete_12(void* ptr, size_t align, const void* nt) { cxx_delete(ptr); }
+
+
+/*-----------------------------------------------------------------------------
+                    GCC constructor and destructor
+Cannot rely on constructors to assign pointers since constructor (init) is
+not guaranteed to be invoked before other memory alloc functions. It sets up
+the hooks only if no allocation did so yet, then starts the reporter thread.
+-----------------------------------------------------------------------------*/
+__attribute__ ((constructor)) void init(void)
+{
+    log_debug("Memory Profiler Constructor called!!\n");
+    init_hooks();
+
+    if(stack_depth > 0) {
+        no_hook = 1;
+        if(stack_table_init(unwind_mode) == 0) {
+            stacks_enabled = true;
+        }
+        no_hook = 0;
+    }
+
+    pthread_atfork(NULL, NULL, reporter_fork_child);
+    pthread_atfork(NULL, NULL, trace_fork_child);
+    start_reporter();
+
+    if(control_dir) {
+        if(control_start(control_dir, control_cmds, untracked_thread_setup) != 0) {
+            log_error("Could not listen on a control socket in %s\n", control_dir);
+        }
+        pthread_atfork(NULL, NULL, control_fork_child);
+    }
+    if(snapshot_interval > 0) {
+        if(snap_ring_init(SNAP_RING_BYTES) == 0) {
+            start_snapshots();
+            pthread_atfork(NULL, NULL, snapshot_fork_child);
+        }
+        else {
+            log_error("Could not map the snapshot ring\n");
+            snapshot_interval = 0;
+        }
+    }
+    if(shm_interval > 0) {
+        if(shm_stats_open(shm_interval) == 0) {
+            start_publisher();
+            pthread_atfork(NULL, NULL, publisher_fork_child);
+        }
+        else {
+            log_error("Could not create the stats segment\n");
+        }
+    }
+    return;
+}
+__attribute__ ((destructor)) void fini(void)
 {
     log_debug("Memory Profiler Destructor called!!\n");
-    print_stats(true);
+
+    /* Keep allocations made while reporting out of the stats */
+    no_hook = 1;
+
+    /* The last snapshot ends the growth window of the exit report */
+    if(snapshot_interval > 0) {
+        take_snapshot();
+    }
+
+    pthread_mutex_lock(&report_lock);
+    reporter_stop = true;
+    pthread_cond_signal(&report_cond);
+    write_report(true);
+    pthread_mutex_unlock(&report_lock);
+
+    trace_close();
+    control_stop();
+    shm_stats_close();
     return;
 }
@@ -0,0 +1,117 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "trace_reader.h"
+
+/* Prints a MEMPROF_TRACE file as text, one event per line:
+ *   <ts ns> <pid> <tid> <op> <ptr> [size] [old ptr | alignment]
+ * With -s only the per-operation totals are printed. */
+
+static const char *op_names[] = {
+    [TRACE_OP_MALLOC]  = "malloc",
+    [TRACE_OP_CALLOC]  = "calloc",
+    [TRACE_OP_REALLOC] = "realloc",
+    [TRACE_OP_FREE]    = "free",
+    [TRACE_OP_MEMALIGN] = "memalign",
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s] <trace file>\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    trace_reader_t  *reader = NULL;
+    trace_event_t    event;
+    const char      *path = NULL;
+    int              summary = 0;
+    int              ret = 0;
+    uint64_t         count[TRACE_OP_MEMALIGN + 1] = {0};
+    uint64_t         bytes[TRACE_OP_MEMALIGN + 1] = {0};
+    int              i;
+
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-s") == 0) {
+            summary = 1;
+        }
+        else if(!path) {
+            path = argv[i];
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+    if(!path) {
+        usage(argv[0]);
+    }
+
+    reader = trace_reader_open(path);
+    if(!reader) {
+        fprintf(stderr, "%s: not a readable trace\n", path);
+        return 1;
+    }
+
+    while((ret = trace_reader_next(reader, &event)) == 1) {
+        count[event.op]++;
+        bytes[event.op] += event.size;
+        if(summary) {
+            continue;
+        }
+
+        printf("%" PRIu64 " %u %u %s 0x%" PRIx64, event.ts, event.pid, event.tid,
+               op_names[event.op], event.ptr);
+        if(event.op != TRACE_OP_FREE) {
+            printf(" %" PRIu64, event.size);
+        }
+        if(event.op == TRACE_OP_REALLOC) {
+            printf(" 0x%" PRIx64, event.old_ptr);
+        }
+        if(event.op == TRACE_OP_MEMALIGN) {
+            printf(" %" PRIu64, event.align);
+        }
+        printf("\n");
+    }
+    if(ret < 0) {
+        fprintf(stderr, "%s: corrupt trace\n", path);
+    }
+
+    if(summary) {
+        for(i = TRACE_OP_MALLOC; i <= TRACE_OP_MEMALIGN; i++) {
+            printf("%-8s count:%" PRIu64, op_names[i], count[i]);
+            if(i != TRACE_OP_FREE) {
+                printf(" bytes:%" PRIu64, bytes[i]);
+            }
+            printf("\n");
+        }
+    }
+
+    trace_reader_close(reader);
+    return ret < 0 ? 1 : 0;
+}
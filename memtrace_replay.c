@@ -0,0 +1,717 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "trace_reader.h"
+
+/* Replays a MEMPROF_TRACE file against whatever allocator this process
+ * uses (glibc, or one linked in or LD_PRELOADed) and reports throughput,
+ * per-call latency percentiles and peak RSS.
+ *
+ *   memtrace_replay [-m serial|threads|timed] [-p pid] [-T] <trace file>
+ *
+ * serial   one thread replays every call in trace order (default)
+ * threads  one thread per traced thread, as fast as possible
+ * timed    one thread per traced thread, at the recorded offsets
+ *
+ * Calls are ordered by timestamp and every block gets a slot, so a
+ * realloc chain is a sequence of slots. A free or realloc of a block
+ * allocated on another thread waits until that allocation has been
+ * replayed. Frees of blocks allocated before tracing began are skipped,
+ * reallocs of such blocks are replayed as fresh allocations. */
+
+#define SLOT_NONE     UINT32_MAX
+#define REPLAY_FAILED ((void*)1)    /* slot whose replayed allocation failed */
+
+typedef enum {
+    MODE_SERIAL,
+    MODE_THREADS,
+    MODE_TIMED,
+} replay_mode_t;
+
+typedef struct {
+    uint64_t  ts;
+    uint64_t  size;
+    uint64_t  ptr;        /* traced pointer, then the slot */
+    uint64_t  old_ptr;    /* traced old pointer, then the old slot; alignment
+                             for memalign */
+    uint32_t  seq;        /* trace order, breaks timestamp ties */
+    uint16_t  thread;
+    uint8_t   op;
+    uint8_t   skip;
+} replay_op_t;
+
+typedef struct {
+    uint32_t   tid;
+    uint32_t  *ops;       /* indexes into the sorted op array */
+    size_t     num_ops;
+    size_t     cap_ops;
+    uint32_t  *lat[TRACE_OP_MEMALIGN + 1];  /* ns per call */
+    size_t     num_lat[TRACE_OP_MEMALIGN + 1];
+    pthread_t  handle;
+} replay_thread_t;
+
+static replay_op_t      *ops = NULL;
+static size_t            num_ops = 0;
+static replay_thread_t  *threads = NULL;
+static size_t            num_threads = 0;
+static void            **slots = NULL;
+static uint32_t          num_slots = 0;
+static replay_mode_t     mode = MODE_SERIAL;
+static int               touch_pages = 1;
+static uint64_t          trace_start = 0;
+static uint64_t          replay_start = 0;
+
+static uint64_t          untracked_frees = 0;
+static uint64_t          untracked_reallocs = 0;
+static uint64_t          failed_calls = 0;
+
+static volatile int      rss_stop = 0;
+static long              rss_peak = 0;
+
+static const char *op_names[] = {
+    [TRACE_OP_MALLOC]  = "malloc",
+    [TRACE_OP_CALLOC]  = "calloc",
+    [TRACE_OP_REALLOC] = "realloc",
+    [TRACE_OP_FREE]    = "free",
+    [TRACE_OP_MEMALIGN] = "memalign",
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void* xrealloc(void *ptr, size_t size)
+{
+    void *ret = realloc(ptr, size);
+
+    if(!ret) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return ret;
+}
+
+/*-----------------------------------------------------------------------------
+                       Loading and slot assignment
+-----------------------------------------------------------------------------*/
+
+/* Traced pointer -> slot of the block that currently lives there */
+typedef struct {
+    uint64_t  *keys;
+    uint32_t  *vals;
+    size_t     cap;
+    size_t     count;
+} ptr_map_t;
+
+static inline size_t ptr_hash(uint64_t key, size_t mask)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key & mask;
+}
+
+static void map_put(ptr_map_t *map, uint64_t key, uint32_t val);
+
+static void map_grow(ptr_map_t *map)
+{
+    ptr_map_t  old = *map;
+    size_t     i;
+
+    map->cap = old.cap ? old.cap * 2 : 1024;
+    map->keys = calloc(map->cap, sizeof(*map->keys));
+    map->vals = calloc(map->cap, sizeof(*map->vals));
+    map->count = 0;
+    if(!map->keys || !map->vals) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(i = 0; i < old.cap; i++) {
+        if(old.keys[i]) {
+            map_put(map, old.keys[i], old.vals[i]);
+        }
+    }
+    free(old.keys);
+    free(old.vals);
+}
+
+static void map_put(ptr_map_t *map, uint64_t key, uint32_t val)
+{
+    size_t mask = 0;
+    size_t i;
+
+    if((map->count + 1) * 2 > map->cap) {
+        map_grow(map);
+    }
+    mask = map->cap - 1;
+    for(i = ptr_hash(key, mask); map->keys[i]; i = (i + 1) & mask) {
+        if(map->keys[i] == key) {
+            map->vals[i] = val;
+            return;
+        }
+    }
+    map->keys[i] = key;
+    map->vals[i] = val;
+    map->count++;
+}
+
+/* Returns SLOT_NONE if key is not mapped */
+static uint32_t map_take(ptr_map_t *map, uint64_t key)
+{
+    size_t    mask = map->cap - 1;
+    size_t    i;
+    uint32_t  val = SLOT_NONE;
+
+    if(!map->cap) {
+        return SLOT_NONE;
+    }
+    for(i = ptr_hash(key, mask); map->keys[i]; i = (i + 1) & mask) {
+        if(map->keys[i] == key) {
+            break;
+        }
+    }
+    if(!map->keys[i]) {
+        return SLOT_NONE;
+    }
+    val = map->vals[i];
+
+    /* Backward-shift deletion */
+    for(;;) {
+        size_t j = i;
+        size_t home;
+
+        for(;;) {
+            j = (j + 1) & mask;
+            if(!map->keys[j]) {
+                map->keys[i] = 0;
+                map->count--;
+                return val;
+            }
+            home = ptr_hash(map->keys[j], mask);
+            if((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+                break;
+            }
+        }
+        map->keys[i] = map->keys[j];
+        map->vals[i] = map->vals[j];
+        i = j;
+    }
+}
+
+static uint16_t thread_index(uint32_t tid)
+{
+    size_t i;
+
+    for(i = 0; i < num_threads; i++) {
+        if(threads[i].tid == tid) {
+            return i;
+        }
+    }
+    if(num_threads == UINT16_MAX) {
+        fprintf(stderr, "too many threads in trace\n");
+        exit(1);
+    }
+    threads = xrealloc(threads, (num_threads + 1) * sizeof(*threads));
+    memset(&threads[num_threads], 0, sizeof(*threads));
+    threads[num_threads].tid = tid;
+    return num_threads++;
+}
+
+static int load_trace(const char *path, uint32_t *pid)
+{
+    trace_reader_t  *reader = trace_reader_open(path);
+    trace_event_t    event;
+    size_t           cap = 0;
+    int              ret = 0;
+
+    if(!reader) {
+        fprintf(stderr, "%s: not a readable trace\n", path);
+        return -1;
+    }
+
+    while((ret = trace_reader_next(reader, &event)) == 1) {
+        replay_op_t *op = NULL;
+
+        /* A trace holds fork() children too; replay one process */
+        if(*pid == 0) {
+            *pid = event.pid;
+        }
+        if(event.pid != *pid) {
+            continue;
+        }
+        if(num_ops == cap) {
+            cap = cap ? cap * 2 : 65536;
+            ops = xrealloc(ops, cap * sizeof(*ops));
+        }
+        op = &ops[num_ops];
+        op->ts = event.ts;
+        op->size = event.size;
+        op->ptr = event.ptr;
+        op->old_ptr = event.op == TRACE_OP_MEMALIGN ? event.align : event.old_ptr;
+        op->seq = num_ops++;
+        op->thread = thread_index(event.tid);
+        op->op = event.op;
+        op->skip = 0;
+    }
+    trace_reader_close(reader);
+
+    if(ret < 0) {
+        fprintf(stderr, "%s: corrupt trace, replaying the %zu calls before the error\n",
+                path, num_ops);
+    }
+    return 0;
+}
+
+static int cmp_op(const void *a, const void *b)
+{
+    const replay_op_t *x = a;
+    const replay_op_t *y = b;
+
+    if(x->ts != y->ts) {
+        return x->ts < y->ts ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : 1;
+}
+
+/* Gives every block a slot, following realloc chains, and drops calls
+ * that cannot be replayed */
+static void assign_slots(void)
+{
+    ptr_map_t  map = {0};
+    size_t     i;
+
+    for(i = 0; i < num_ops; i++) {
+        replay_op_t *op = &ops[i];
+        uint64_t     ptr = op->ptr;
+        uint32_t     old_slot = SLOT_NONE;
+
+        switch(op->op) {
+        case TRACE_OP_FREE:
+            op->ptr = map_take(&map, ptr);
+            if(op->ptr == SLOT_NONE) {
+                untracked_frees++;
+                op->skip = 1;
+            }
+            continue;
+
+        case TRACE_OP_REALLOC:
+            if(op->old_ptr) {
+                old_slot = map_take(&map, op->old_ptr);
+                if(old_slot == SLOT_NONE) {
+                    untracked_reallocs++;
+                }
+            }
+            if(!ptr) {
+                if(op->size != 0 && old_slot != SLOT_NONE) {
+                    /* Failed, the old block is still there */
+                    map_put(&map, op->old_ptr, old_slot);
+                    old_slot = SLOT_NONE;
+                    op->skip = 1;
+                }
+                else if(old_slot == SLOT_NONE) {
+                    op->skip = 1;
+                }
+                else {
+                    /* realloc(p, 0) frees p */
+                    op->op = TRACE_OP_FREE;
+                    op->ptr = old_slot;
+                    continue;
+                }
+            }
+            op->old_ptr = old_slot;
+            break;
+
+        default:
+            if(!ptr) {
+                op->skip = 1;
+            }
+            break;
+        }
+
+        if(!op->skip) {
+            op->ptr = num_slots++;
+            map_put(&map, ptr, op->ptr);
+        }
+    }
+
+    free(map.keys);
+    free(map.vals);
+}
+
+static void build_thread_lists(void)
+{
+    size_t i;
+
+    for(i = 0; i < num_ops; i++) {
+        replay_thread_t *t = &threads[ops[i].thread];
+
+        if(ops[i].skip) {
+            continue;
+        }
+        if(t->num_ops == t->cap_ops) {
+            t->cap_ops = t->cap_ops ? t->cap_ops * 2 : 1024;
+            t->ops = xrealloc(t->ops, t->cap_ops * sizeof(*t->ops));
+        }
+        t->ops[t->num_ops++] = i;
+    }
+    for(i = 0; i < num_threads; i++) {
+        int op;
+
+        for(op = TRACE_OP_MALLOC; op <= TRACE_OP_MEMALIGN; op++) {
+            threads[i].lat[op] = xrealloc(NULL, (threads[i].num_ops + 1) * sizeof(uint32_t));
+        }
+    }
+}
+
+/*-----------------------------------------------------------------------------
+                                  Replay
+-----------------------------------------------------------------------------*/
+
+/* Blocks the thread until the slot's allocation has been replayed */
+static inline void* wait_slot(uint32_t slot)
+{
+    void *ptr = NULL;
+
+    while(!(ptr = __atomic_load_n(&slots[slot], __ATOMIC_ACQUIRE))) {
+        if(mode == MODE_SERIAL) {
+            return NULL;
+        }
+        sched_yield();
+    }
+    return ptr;
+}
+
+static inline void touch(void *ptr, size_t size)
+{
+    size_t off;
+
+    for(off = 0; off < size; off += 4096) {
+        ((volatile char*)ptr)[off] = 1;
+    }
+}
+
+static void replay_one(replay_thread_t *t, replay_op_t *op)
+{
+    void     *ptr = NULL;
+    void     *old = NULL;
+    uint64_t  start = 0;
+    uint64_t  lat = 0;
+
+    if(mode == MODE_TIMED) {
+        uint64_t due = replay_start + (op->ts - trace_start);
+        uint64_t now = now_ns();
+
+        if(due > now + 100000) {
+            struct timespec ts = {0, 0};
+
+            ts.tv_sec = (due - now) / 1000000000ull;
+            ts.tv_nsec = (due - now) % 1000000000ull;
+            nanosleep(&ts, NULL);
+        }
+        while(now_ns() < due);
+    }
+
+    if(op->op == TRACE_OP_FREE || (op->op == TRACE_OP_REALLOC && op->old_ptr != SLOT_NONE)) {
+        uint32_t slot = op->op == TRACE_OP_FREE ? op->ptr : op->old_ptr;
+
+        old = wait_slot(slot);
+        __atomic_store_n(&slots[slot], NULL, __ATOMIC_RELAXED);
+        if(old == REPLAY_FAILED) {
+            old = NULL;
+        }
+    }
+
+    start = now_ns();
+    switch(op->op) {
+    case TRACE_OP_MALLOC:
+        ptr = malloc(op->size);
+        break;
+    case TRACE_OP_CALLOC:
+        ptr = calloc(1, op->size);
+        break;
+    case TRACE_OP_REALLOC:
+        ptr = realloc(old, op->size);
+        break;
+    case TRACE_OP_FREE:
+        free(old);
+        break;
+    case TRACE_OP_MEMALIGN:
+        if(posix_memalign(&ptr, op->old_ptr < sizeof(void*) ? sizeof(void*) : op->old_ptr,
+                          op->size) != 0) {
+            ptr = NULL;
+        }
+        break;
+    }
+    lat = now_ns() - start;
+    t->lat[op->op][t->num_lat[op->op]++] = lat > UINT32_MAX ? UINT32_MAX : lat;
+
+    if(op->op == TRACE_OP_FREE) {
+        return;
+    }
+    if(!ptr) {
+        __atomic_add_fetch(&failed_calls, 1, __ATOMIC_RELAXED);
+        ptr = REPLAY_FAILED;
+    }
+    else if(touch_pages && op->op != TRACE_OP_CALLOC) {
+        touch(ptr, op->size);
+    }
+    __atomic_store_n(&slots[op->ptr], ptr, __ATOMIC_RELEASE);
+}
+
+static void* replay_thread(void *arg)
+{
+    replay_thread_t *t = (replay_thread_t*)arg;
+    size_t           i;
+
+    for(i = 0; i < t->num_ops; i++) {
+        replay_one(t, &ops[t->ops[i]]);
+    }
+    return NULL;
+}
+
+static long read_rss(void)
+{
+    char  buf[128];
+    long  size = 0;
+    long  resident = 0;
+    int   fd = open("/proc/self/statm", O_RDONLY);
+    int   n = 0;
+
+    if(fd < 0) {
+        return 0;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    sscanf(buf, "%ld %ld", &size, &resident);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void* rss_sampler(void *arg)
+{
+    struct timespec ts = {0, 5000000};
+
+    while(!rss_stop) {
+        long rss = read_rss();
+
+        if(rss > rss_peak) {
+            rss_peak = rss;
+        }
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+                                  Report
+-----------------------------------------------------------------------------*/
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_latency(int op)
+{
+    uint32_t  *all = NULL;
+    size_t     count = 0;
+    size_t     i;
+
+    for(i = 0; i < num_threads; i++) {
+        count += threads[i].num_lat[op];
+    }
+    if(count == 0) {
+        printf("%-8s count:0\n", op_names[op]);
+        return;
+    }
+
+    all = xrealloc(NULL, count * sizeof(*all));
+    count = 0;
+    for(i = 0; i < num_threads; i++) {
+        memcpy(all + count, threads[i].lat[op], threads[i].num_lat[op] * sizeof(*all));
+        count += threads[i].num_lat[op];
+    }
+    qsort(all, count, sizeof(*all), cmp_u32);
+
+    printf("%-8s count:%zu p50:%u p90:%u p99:%u p99.9:%u max:%u ns\n", op_names[op], count,
+           all[count / 2], all[count * 90 / 100], all[count * 99 / 100],
+           all[count * 999 / 1000], all[count - 1]);
+    free(all);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m serial|threads|timed] [-p pid] [-T] <trace file>\n"
+                    "  -T  do not touch the pages of allocated blocks\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char  *path = NULL;
+    uint32_t     pid = 0;
+    pthread_t    sampler;
+    uint64_t     elapsed = 0;
+    size_t       replayed = 0;
+    long         rss_base = 0;
+    int          opt;
+    size_t       i;
+
+    while((opt = getopt(argc, argv, "m:p:T")) != -1) {
+        switch(opt) {
+        case 'm':
+            if(strcmp(optarg, "serial") == 0) {
+                mode = MODE_SERIAL;
+            }
+            else if(strcmp(optarg, "threads") == 0) {
+                mode = MODE_THREADS;
+            }
+            else if(strcmp(optarg, "timed") == 0) {
+                mode = MODE_TIMED;
+            }
+            else {
+                usage(argv[0]);
+            }
+            break;
+        case 'p':
+            pid = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            touch_pages = 0;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1) {
+        usage(argv[0]);
+    }
+    path = argv[optind];
+
+    if(load_trace(path, &pid) != 0) {
+        return 1;
+    }
+    if(num_ops == 0) {
+        fprintf(stderr, "%s: no calls to replay\n", path);
+        return 1;
+    }
+    qsort(ops, num_ops, sizeof(*ops), cmp_op);
+    assign_slots();
+    build_thread_lists();
+    slots = calloc(num_slots + 1, sizeof(*slots));
+    if(!slots) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for(i = 0; i < num_threads; i++) {
+        replayed += threads[i].num_ops;
+    }
+    trace_start = ops[0].ts;
+
+    rss_base = read_rss();
+    rss_peak = rss_base;
+    pthread_create(&sampler, NULL, rss_sampler, NULL);
+
+    replay_start = now_ns();
+    if(mode == MODE_SERIAL) {
+        replay_thread_t all = {0};
+        size_t          n = 0;
+
+        all.ops = xrealloc(NULL, replayed * sizeof(*all.ops));
+        for(i = 0; i < num_ops; i++) {
+            if(!ops[i].skip) {
+                all.ops[n++] = i;
+            }
+        }
+        all.num_ops = n;
+        for(opt = TRACE_OP_MALLOC; opt <= TRACE_OP_MEMALIGN; opt++) {
+            all.lat[opt] = xrealloc(NULL, (n + 1) * sizeof(uint32_t));
+        }
+        replay_thread(&all);
+
+        /* Report from a single list */
+        for(i = 0; i < num_threads; i++) {
+            memset(threads[i].num_lat, 0, sizeof(threads[i].num_lat));
+        }
+        for(opt = TRACE_OP_MALLOC; opt <= TRACE_OP_MEMALIGN; opt++) {
+            free(threads[0].lat[opt]);
+            threads[0].lat[opt] = all.lat[opt];
+            threads[0].num_lat[opt] = all.num_lat[opt];
+        }
+        free(all.ops);
+    }
+    else {
+        for(i = 0; i < num_threads; i++) {
+            if(pthread_create(&threads[i].handle, NULL, replay_thread, &threads[i]) != 0) {
+                fprintf(stderr, "could not start replay thread %zu\n", i);
+                exit(1);
+            }
+        }
+        for(i = 0; i < num_threads; i++) {
+            pthread_join(threads[i].handle, NULL);
+        }
+    }
+    elapsed = now_ns() - replay_start;
+
+    rss_stop = 1;
+    pthread_join(sampler, NULL);
+    if(read_rss() > rss_peak) {
+        rss_peak = read_rss();
+    }
+
+    printf("trace:%s pid:%u threads:%zu mode:%s\n", path, pid, num_threads,
+           mode == MODE_SERIAL ? "serial" : mode == MODE_THREADS ? "threads" : "timed");
+    printf("calls:%zu replayed:%zu untracked frees:%" PRIu64 " untracked reallocs:%" PRIu64
+           " failed:%" PRIu64 "\n", num_ops, replayed, untracked_frees, untracked_reallocs,
+           failed_calls);
+    printf("elapsed:%.3f s throughput:%.0f calls/s\n", elapsed / 1e9,
+           replayed / (elapsed / 1e9));
+    for(opt = TRACE_OP_MALLOC; opt <= TRACE_OP_MEMALIGN; opt++) {
+        print_latency(opt);
+    }
+    printf("peak RSS:%ld bytes (%ld above the %ld bytes before replay)\n",
+           rss_peak, rss_peak - rss_base, rss_base);
+    return 0;
+}
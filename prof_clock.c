@@ -0,0 +1,79 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <time.h>
+#include "prof_clock.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+/* Length of the calibration window */
+#define PROF_CLOCK_CALIB_NS  20000000ull
+
+prof_clock_t prof_clock;
+
+#if defined(__x86_64__)
+/* CPUID 0x80000007 EDX bit 8: the TSC ticks at a constant rate in every
+ * P- and C-state and is synchronized across cores */
+static int tsc_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (edx >> 8) & 1;
+}
+#endif
+
+/* Sleeps for the calibration window, so call it off the hot path (the
+ * reporter thread does) and only once. Timestamps taken before and after
+ * come from the same time line. */
+void prof_clock_calibrate(void)
+{
+#if defined(__x86_64__)
+    struct timespec  window = {0, PROF_CLOCK_CALIB_NS};
+    uint64_t         tsc0, ns0, tsc1, ns1;
+
+    if(prof_clock.mult || !tsc_invariant()) {
+        return;
+    }
+
+    ns0 = prof_clock_mono_ns();
+    tsc0 = __builtin_ia32_rdtsc();
+    nanosleep(&window, NULL);
+    ns1 = prof_clock_mono_ns();
+    tsc1 = __builtin_ia32_rdtsc();
+    if(tsc1 <= tsc0 || ns1 <= ns0) {
+        return;
+    }
+
+    prof_clock.base_tsc = tsc1;
+    prof_clock.base_ns = ns1;
+    __atomic_store_n(&prof_clock.mult,
+                     (uint64_t)(((unsigned __int128)(ns1 - ns0) << 32) / (tsc1 - tsc0)),
+                     __ATOMIC_RELEASE);
+#endif
+}
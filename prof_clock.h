@@ -0,0 +1,69 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _PROF_CLOCK_
+#define _PROF_CLOCK_
+
+#include <stdint.h>
+#include <time.h>
+
+/* Cheap monotonic nanosecond clock for timestamps taken on the hot path.
+ * On x86-64 with an invariant TSC the time is rdtsc scaled by a factor
+ * measured against CLOCK_MONOTONIC, which is a few cycles instead of a
+ * vDSO call. Until prof_clock_calibrate() has run, and on other machines,
+ * it reads CLOCK_MONOTONIC, so the two sources line up. CLOCK_MONOTONIC_COARSE
+ * is not used: it only ticks once per jiffy (1 - 10 ms). */
+
+typedef struct {
+    uint64_t  base_tsc;
+    uint64_t  base_ns;
+    uint64_t  mult;      /* ns per tick << 32, 0 until calibrated */
+} prof_clock_t;
+
+extern prof_clock_t prof_clock;
+
+void prof_clock_calibrate(void);
+
+static inline uint64_t prof_clock_mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t prof_clock_ns(void)
+{
+#if defined(__x86_64__)
+    uint64_t mult = __atomic_load_n(&prof_clock.mult, __ATOMIC_ACQUIRE);
+
+    if(mult) {
+        uint64_t delta = __builtin_ia32_rdtsc() - prof_clock.base_tsc;
+        return prof_clock.base_ns + (uint64_t)(((unsigned __int128)delta * mult) >> 32);
+    }
+#endif
+    return prof_clock_mono_ns();
+}
+
+#endif /* _PROF_CLOCK_ */
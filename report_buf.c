@@ -0,0 +1,489 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "report_buf.h"
+
+#define FMT_LEFT   0x1
+#define FMT_PLUS   0x2
+#define FMT_ZERO   0x4
+#define FMT_SPACE  0x8
+#define FMT_ALT    0x10
+
+/* Longest number we render: 64-bit octal, or %f of up to 1e19 with the
+ * largest precision allowed */
+#define FMT_NUM_MAX    40
+#define FMT_PREC_MAX   9
+
+void rbuf_init(rbuf_t *rb, char *buf, size_t cap)
+{
+    rb->buf = buf;
+    rb->len = 0;
+    rb->cap = cap;
+    rb->truncated = false;
+}
+
+static inline void put_char(rbuf_t *rb, char c)
+{
+    if(rb->len < rb->cap) {
+        rb->buf[rb->len++] = c;
+    }
+    else {
+        rb->truncated = true;
+    }
+}
+
+static void put_mem(rbuf_t *rb, const char *s, size_t n)
+{
+    if(n > rb->cap - rb->len) {
+        n = rb->cap - rb->len;
+        rb->truncated = true;
+    }
+    memcpy(rb->buf + rb->len, s, n);
+    rb->len += n;
+}
+
+static void put_fill(rbuf_t *rb, char c, int n)
+{
+    while(n-- > 0) {
+        put_char(rb, c);
+    }
+}
+
+/* Writes sign (if any) and body in a field of width chars */
+static void put_field(rbuf_t *rb, char sign, const char *body, size_t n, int width, int flags)
+{
+    int pad = width - (int)n - (sign ? 1 : 0);
+
+    if(!(flags & FMT_LEFT) && !(flags & FMT_ZERO)) {
+        put_fill(rb, ' ', pad);
+    }
+    if(sign) {
+        put_char(rb, sign);
+    }
+    if(!(flags & FMT_LEFT) && (flags & FMT_ZERO)) {
+        put_fill(rb, '0', pad);
+    }
+    put_mem(rb, body, n);
+    if(flags & FMT_LEFT) {
+        put_fill(rb, ' ', pad);
+    }
+}
+
+/* Digits of v, most significant first, at the end of buf. Returns the
+ * first one. At least min digits. */
+static char* format_uint(char *end, uint64_t v, unsigned base, bool upper, int min)
+{
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char       *p = end;
+
+    do {
+        *--p = digits[v % base];
+        v /= base;
+        min--;
+    } while(v != 0 || min > 0);
+    return p;
+}
+
+static char sign_char(bool neg, int flags)
+{
+    if(neg) {
+        return '-';
+    }
+    return (flags & FMT_PLUS) ? '+' : (flags & FMT_SPACE) ? ' ' : 0;
+}
+
+/* |v| with prec decimals (at most FMT_PREC_MAX). Returns the length. */
+static size_t format_fixed(char *buf, double v, int prec)
+{
+    static const uint64_t pow10[FMT_PREC_MAX + 1] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+    };
+    char      tmp[FMT_NUM_MAX];
+    char     *p = NULL;
+    uint64_t  ip = 0;
+    uint64_t  fp = 0;
+    double    frac = 0;
+    double    err = 0;
+    size_t    len = 0;
+
+    if(v >= 1e19) {
+        memcpy(buf, "inf", 3);
+        return 3;
+    }
+    ip = (uint64_t)v;
+    frac = (v - ip) * pow10[prec];
+    err = __builtin_fma(v - ip, pow10[prec], -frac);
+    fp = (uint64_t)frac;
+    frac -= fp;
+    /* Round to nearest on the exact value (err is what the product lost),
+     * half to even on exact ties, like glibc */
+    if(frac > 0.5 || (frac == 0.5 && (err > 0 || (err == 0 && ((prec > 0 ? fp : ip) & 1))))) {
+        fp++;
+    }
+    if(fp >= pow10[prec] && prec > 0) {
+        ip++;
+        fp -= pow10[prec];
+    }
+    else if(prec == 0) {
+        ip += fp;
+    }
+
+    p = format_uint(tmp + sizeof(tmp), ip, 10, false, 1);
+    len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    if(prec > 0) {
+        buf[len++] = '.';
+        p = format_uint(tmp + sizeof(tmp), fp, 10, false, prec);
+        memcpy(buf + len, p, prec);
+        len += prec;
+    }
+    return len;
+}
+
+/* Drops trailing zeros of the decimals, and the point if none are left */
+static size_t strip_zeros(char *buf, size_t len)
+{
+    if(!memchr(buf, '.', len)) {
+        return len;
+    }
+    while(buf[len - 1] == '0') {
+        len--;
+    }
+    if(buf[len - 1] == '.') {
+        len--;
+    }
+    return len;
+}
+
+static double pow10_of(int exp)
+{
+    double r = 1;
+
+    for(; exp > 0; exp--) {
+        r *= 10;
+    }
+    for(; exp < 0; exp++) {
+        r /= 10;
+    }
+    return r;
+}
+
+/* %g of |v|: prec significant digits, exponent form outside 1e-4 .. 1e(prec) */
+static size_t format_general(char *buf, double v, int prec)
+{
+    int     exp = 0;
+    double  m = v;
+    size_t  len = 0;
+    char    tmp[8];
+    char   *p = NULL;
+
+    if(prec == 0) {
+        prec = 1;
+    }
+    if(v == 0) {
+        buf[0] = '0';
+        return 1;
+    }
+    if(__builtin_isinf(v)) {
+        memcpy(buf, "inf", 3);
+        return 3;
+    }
+
+    while(m >= 10) {
+        m /= 10;
+        exp++;
+    }
+    while(m < 1) {
+        m *= 10;
+        exp--;
+    }
+    /* Rounding to prec digits may carry into the next power of ten */
+    if(v >= (10 - 5 * pow10_of(-prec)) * pow10_of(exp)) {
+        exp++;
+    }
+
+    if(exp < -4 || exp >= prec) {
+        char    digits[FMT_NUM_MAX];
+        int     shift = prec - 1 - exp;
+        double  q = shift >= 0 ? v * pow10_of(shift) : v / pow10_of(-shift);
+
+        /* The prec leading digits, rounded as a whole number */
+        len = format_fixed(digits, q, 0);
+        if(len > (size_t)prec) {
+            exp++;
+        }
+        buf[0] = digits[0];
+        buf[1] = '.';
+        memcpy(buf + 2, digits + 1, prec - 1);
+        len = strip_zeros(buf, prec + 1);
+        buf[len++] = 'e';
+        buf[len++] = exp < 0 ? '-' : '+';
+        p = format_uint(tmp + sizeof(tmp), exp < 0 ? -exp : exp, 10, false, 2);
+        memcpy(buf + len, p, tmp + sizeof(tmp) - p);
+        return len + (tmp + sizeof(tmp) - p);
+    }
+    return strip_zeros(buf, format_fixed(buf, v, prec - 1 - exp > FMT_PREC_MAX ?
+                                                 FMT_PREC_MAX : prec - 1 - exp));
+}
+
+void rbuf_vprintf(rbuf_t *rb, const char *format, va_list ap)
+{
+    const char *f = format;
+
+    while(*f) {
+        char        num[FMT_NUM_MAX];
+        char       *end = num + sizeof(num);
+        const char *s = NULL;
+        int         flags = 0;
+        int         width = 0;
+        int         prec = -1;
+        int         lng = 0;     /* 1: l, 2: ll/z/j/t */
+        uint64_t    u = 0;
+        bool        neg = false;
+
+        if(*f != '%') {
+            const char *pct = strchr(f, '%');
+            size_t      n = pct ? (size_t)(pct - f) : strlen(f);
+
+            put_mem(rb, f, n);
+            f += n;
+            continue;
+        }
+        f++;
+
+        for(;; f++) {
+            if(*f == '-') {
+                flags |= FMT_LEFT;
+            }
+            else if(*f == '+') {
+                flags |= FMT_PLUS;
+            }
+            else if(*f == '0') {
+                flags |= FMT_ZERO;
+            }
+            else if(*f == ' ') {
+                flags |= FMT_SPACE;
+            }
+            else if(*f == '#') {
+                flags |= FMT_ALT;
+            }
+            else {
+                break;
+            }
+        }
+        if(*f == '*') {
+            width = va_arg(ap, int);
+            if(width < 0) {
+                flags |= FMT_LEFT;
+                width = -width;
+            }
+            f++;
+        }
+        while(*f >= '0' && *f <= '9') {
+            width = width * 10 + (*f++ - '0');
+        }
+        if(*f == '.') {
+            f++;
+            prec = 0;
+            if(*f == '*') {
+                prec = va_arg(ap, int);
+                f++;
+            }
+            while(*f >= '0' && *f <= '9') {
+                prec = prec * 10 + (*f++ - '0');
+            }
+        }
+        while(*f == 'h') {
+            f++;
+        }
+        if(*f == 'l') {
+            lng = 1;
+            if(*++f == 'l') {
+                lng = 2;
+                f++;
+            }
+        }
+        else if(*f == 'z' || *f == 'j' || *f == 't') {
+            lng = 2;
+            f++;
+        }
+
+        switch(*f) {
+        case 'd':
+        case 'i': {
+            int64_t v = lng == 2 ? va_arg(ap, long long) :
+                        lng == 1 ? va_arg(ap, long) : va_arg(ap, int);
+
+            neg = v < 0;
+            u = neg ? -(uint64_t)v : (uint64_t)v;
+            s = format_uint(end, u, 10, false, prec < 0 ? 1 : prec);
+            if(prec == 0 && u == 0) {
+                s = end;
+            }
+            put_field(rb, sign_char(neg, flags), s, end - s, width,
+                      prec < 0 ? flags : flags & ~FMT_ZERO);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o': {
+            char *p = NULL;
+
+            u = lng == 2 ? va_arg(ap, unsigned long long) :
+                lng == 1 ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            p = format_uint(end, u, *f == 'u' ? 10 : *f == 'o' ? 8 : 16, *f == 'X',
+                            prec < 0 ? 1 : prec);
+            if(prec == 0 && u == 0) {
+                p = end;
+            }
+            if((flags & FMT_ALT) && u != 0 && *f != 'u') {
+                if(*f != 'o') {
+                    *--p = *f;
+                }
+                if(*f != 'o' || *p != '0') {
+                    *--p = '0';
+                }
+            }
+            put_field(rb, 0, p, end - p, width, prec < 0 ? flags : flags & ~FMT_ZERO);
+            break;
+        }
+        case 'p':
+            u = (uintptr_t)va_arg(ap, void*);
+            if(u == 0) {
+                put_field(rb, 0, "(nil)", 5, width, flags & ~FMT_ZERO);
+                break;
+            }
+            {
+                char *p = format_uint(end, u, 16, false, 1);
+
+                *--p = 'x';
+                *--p = '0';
+                put_field(rb, 0, p, end - p, width, flags & ~FMT_ZERO);
+            }
+            break;
+        case 's':
+            s = va_arg(ap, const char*);
+            if(!s) {
+                s = "(null)";
+            }
+            put_field(rb, 0, s, prec < 0 ? strlen(s) : strnlen(s, prec), width,
+                      flags & ~FMT_ZERO);
+            break;
+        case 'c':
+            num[0] = (char)va_arg(ap, int);
+            put_field(rb, 0, num, 1, width, flags & ~FMT_ZERO);
+            break;
+        case 'f':
+        case 'g': {
+            double  v = va_arg(ap, double);
+            size_t  n = 0;
+
+            if(v != v) {
+                put_field(rb, 0, "nan", 3, width, flags & ~FMT_ZERO);
+                break;
+            }
+            neg = __builtin_signbit(v);
+            if(prec < 0) {
+                prec = 6;
+            }
+            if(prec > FMT_PREC_MAX) {
+                prec = FMT_PREC_MAX;
+            }
+            n = (*f == 'f') ? format_fixed(num, neg ? -v : v, prec)
+                            : format_general(num, neg ? -v : v, prec);
+            put_field(rb, sign_char(neg, flags), num, n, width, flags);
+            break;
+        }
+        case '%':
+            put_char(rb, '%');
+            break;
+        default:
+            /* Unknown conversion: copy it as is */
+            put_char(rb, '%');
+            if(!*f) {
+                return;
+            }
+            put_char(rb, *f);
+            break;
+        }
+        f++;
+    }
+}
+
+void rbuf_printf(rbuf_t *rb, const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    rbuf_vprintf(rb, format, ap);
+    va_end(ap);
+}
+
+void rbuf_puts(rbuf_t *rb, const char *s)
+{
+    put_mem(rb, s, strlen(s));
+}
+
+void rbuf_json_str(rbuf_t *rb, const char *s)
+{
+    put_char(rb, '"');
+    for(; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+
+        if(c == '"' || c == '\\') {
+            put_char(rb, '\\');
+            put_char(rb, c);
+        }
+        else if(c < 0x20) {
+            rbuf_printf(rb, "\\u%04x", c);
+        }
+        else {
+            put_char(rb, c);
+        }
+    }
+    put_char(rb, '"');
+}
+
+int rbuf_write(rbuf_t *rb, int fd)
+{
+    size_t done = 0;
+
+    while(done < rb->len) {
+        ssize_t ret = write(fd, rb->buf + done, rb->len - done);
+
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret <= 0) {
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
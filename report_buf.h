@@ -0,0 +1,59 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _REPORT_BUF_
+#define _REPORT_BUF_
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Report text built in a caller supplied buffer and written out with a
+ * single write(2). The formatter is our own and never allocates, takes a
+ * lock or touches stdio, so it is safe inside the hooks and from any
+ * thread. It knows the printf subset the profiler uses: flags "-+0 #",
+ * width and precision (also "*"), the h, l, ll, z, j and t lengths and
+ * the d i u x X o p s c f g % conversions. Output that does not fit is
+ * dropped and marks the buffer truncated. */
+
+typedef struct {
+    char    *buf;
+    size_t   len;
+    size_t   cap;
+    bool     truncated;
+} rbuf_t;
+
+void rbuf_init(rbuf_t *rb, char *buf, size_t cap);
+void rbuf_printf(rbuf_t *rb, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void rbuf_vprintf(rbuf_t *rb, const char *format, va_list ap);
+void rbuf_puts(rbuf_t *rb, const char *s);
+
+/* Appends s as a JSON string, quotes included */
+void rbuf_json_str(rbuf_t *rb, const char *s);
+
+/* Writes the buffer to fd, normally in one call. Returns 0 or -1. */
+int  rbuf_write(rbuf_t *rb, int fd);
+
+#endif /* _REPORT_BUF_ */
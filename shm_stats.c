@@ -0,0 +1,141 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "shm_stats.h"
+
+/* The stats start right after the seqlock */
+#define SHM_STATS_BODY  offsetof(shm_stats_t, update_ns)
+
+static shm_stats_t *shm_seg = NULL;
+static char         shm_path[64];
+static pid_t        shm_pid = 0;
+static uint32_t     shm_interval_ms = 0;
+
+/* Process name for readers, from /proc since argv is out of reach here */
+static void read_comm(char *buf, size_t len)
+{
+    int     fd = open("/proc/self/comm", O_RDONLY | O_CLOEXEC);
+    ssize_t ret = 0;
+
+    buf[0] = '\0';
+    if(fd < 0) {
+        return;
+    }
+    ret = read(fd, buf, len - 1);
+    close(fd);
+    if(ret <= 0) {
+        return;
+    }
+    buf[ret] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+}
+
+/* Opened directly under SHM_STATS_DIR, which is what shm_open() does,
+ * without pulling in librt */
+int shm_stats_open(uint32_t interval_ms)
+{
+    shm_stats_t *seg = NULL;
+    int          fd = -1;
+
+    shm_pid = getpid();
+    shm_interval_ms = interval_ms;
+    snprintf(shm_path, sizeof(shm_path), "%s/%s%d", SHM_STATS_DIR, SHM_STATS_PREFIX,
+             (int)shm_pid);
+
+    fd = open(shm_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return -1;
+    }
+    if(ftruncate(fd, sizeof(shm_stats_t)) != 0) {
+        close(fd);
+        unlink(shm_path);
+        return -1;
+    }
+    seg = mmap(NULL, sizeof(shm_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(seg == MAP_FAILED) {
+        unlink(shm_path);
+        return -1;
+    }
+
+    seg->version = SHM_STATS_VERSION;
+    seg->size = sizeof(shm_stats_t);
+    seg->pid = (uint32_t)shm_pid;
+    seg->interval_ms = interval_ms;
+    read_comm(seg->cmd, sizeof(seg->cmd));
+    /* Readers check the magic first, so it goes in last */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(seg->magic, SHM_STATS_MAGIC, sizeof(seg->magic));
+
+    shm_seg = seg;
+    return 0;
+}
+
+void shm_stats_publish(const shm_stats_t *snap)
+{
+    shm_stats_t     *seg = shm_seg;
+    uint64_t         seq = 0;
+    struct timespec  ts;
+
+    if(!seg) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    seq = seg->seq;
+    __atomic_store_n(&seg->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy((char*)seg + SHM_STATS_BODY, (const char*)snap + SHM_STATS_BODY,
+           sizeof(shm_stats_t) - SHM_STATS_BODY);
+    seg->update_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+    __atomic_store_n(&seg->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void shm_stats_close(void)
+{
+    if(!shm_seg || shm_pid != getpid()) {
+        return;
+    }
+    unlink(shm_path);
+}
+
+void shm_stats_fork_child(void)
+{
+    if(!shm_seg) {
+        return;
+    }
+    /* The inherited mapping is the parent's segment */
+    munmap(shm_seg, sizeof(shm_stats_t));
+    shm_seg = NULL;
+    shm_stats_open(shm_interval_ms);
+}
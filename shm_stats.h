@@ -0,0 +1,47 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SHM_STATS_
+#define _SHM_STATS_
+
+#include <stdint.h>
+#include "shm_stats_format.h"
+
+/* Writer side of the stats segment (MEMPROF_SHM), see shm_stats_format.h.
+ * Updates come from a single thread. Nothing here calls malloc. */
+
+/* Creates the segment of the current process. Returns 0 on success,
+ * -1 on error. */
+int  shm_stats_open(uint32_t interval_ms);
+
+/* Copies the stats of snap (everything after seq) into the segment */
+void shm_stats_publish(const shm_stats_t *snap);
+
+/* Removes the segment, from the process that created it only */
+void shm_stats_close(void);
+
+/* The child of fork() publishes into a segment of its own */
+void shm_stats_fork_child(void);
+
+#endif /* _SHM_STATS_ */
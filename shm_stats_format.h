@@ -0,0 +1,103 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SHM_STATS_FORMAT_
+#define _SHM_STATS_FORMAT_
+
+#include <stdint.h>
+#include <string.h>
+
+/* Layout of the stats segment published with MEMPROF_SHM, shared by
+ * memprofiler.so and its readers (memprof_top).
+ *
+ * Every instrumented process owns SHM_STATS_DIR/memprof.<pid>, one
+ * shm_stats_t. The profiler rewrites it in place under a seqlock: seq is
+ * odd while an update is in progress, and a reader retries until it has
+ * copied the segment between two equal, even values of seq. Readers never
+ * write to the segment, so they cannot hold the writer up.
+ *
+ * All fields are fixed width. Incompatible changes bump SHM_STATS_VERSION;
+ * readers check magic, version and size before anything else. */
+
+#define SHM_STATS_MAGIC         "MEMPROFS"
+#define SHM_STATS_VERSION       1
+#define SHM_STATS_DIR           "/dev/shm"
+#define SHM_STATS_PREFIX        "memprof."
+#define SHM_STATS_SIZE_BUCKETS  188
+#define SHM_STATS_AGE_BUCKETS   11
+#define SHM_STATS_CMD_LEN       64
+
+typedef struct {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  size;            /* sizeof(shm_stats_t) */
+    uint32_t  pid;
+    uint32_t  interval_ms;     /* publishing period */
+    char      cmd[SHM_STATS_CMD_LEN];
+
+    uint64_t  seq;
+    uint64_t  update_ns;       /* CLOCK_MONOTONIC of the last update */
+
+    int64_t   num_alloc;
+    int64_t   alloc_sz;
+    int64_t   num_free;
+    int64_t   free_sz;
+    int64_t   cxx_num_alloc;
+    int64_t   cxx_alloc_sz;
+    int64_t   live_num;
+    int64_t   live_sz;
+    int64_t   sample_interval; /* 0: exact, else live numbers are estimates */
+    int64_t   profiler_mem;
+
+    /* Live set by size; bucket i holds sizes in [size_lower[i], size_lower[i + 1]) */
+    uint64_t  size_lower[SHM_STATS_SIZE_BUCKETS];
+    int64_t   size_count[SHM_STATS_SIZE_BUCKETS];
+    int64_t   size_bytes[SHM_STATS_SIZE_BUCKETS];
+
+    /* Live set by age in ns, same convention */
+    uint64_t  age_lower[SHM_STATS_AGE_BUCKETS];
+    int64_t   age_count[SHM_STATS_AGE_BUCKETS];
+} shm_stats_t;
+
+/* Copies a consistent snapshot of seg into out. Returns 0, or -1 if no
+ * stable copy was seen in tries attempts (writer busy or gone mid-update). */
+static inline int shm_stats_read(const shm_stats_t *seg, shm_stats_t *out, int tries)
+{
+    while(tries-- > 0) {
+        uint64_t seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+
+        if(seq & 1) {
+            continue;
+        }
+        memcpy(out, (const void*)seg, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == seq) {
+            out->seq = seq;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+#endif /* _SHM_STATS_FORMAT_ */
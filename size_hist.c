@@ -22,17 +22,24 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
-#ifndef _LINKED_LIST_
-#define _LINKED_LIST_
-
-typedef struct list_node {
-    void *key;
-    void *val;
-    struct list_node *next;
-} list_node_t;
-
-void  list_insert(list_node_t **head, list_node_t *node);
-void* list_delete(list_node_t **head, void *key);
-void* list_find(list_node_t *head, void *key);
-
-#endif /* _LINKED_LIST_ */
+#include "size_hist.h"
+
+size_t size_hist_lower(int i)
+{
+    int shift = (i >> SIZE_HIST_SUB_BITS) - 1;
+
+    if(i < 2 * SIZE_HIST_SUB) {
+        return i;
+    }
+    return (size_t)(SIZE_HIST_SUB + (i & (SIZE_HIST_SUB - 1))) << shift;
+}
+
+void size_hist_merge(size_hist_t *dst, const size_hist_t *src)
+{
+    int i;
+
+    for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+        dst->count[i] += src->count[i];
+        dst->bytes[i] += src->bytes[i];
+    }
+}
@@ -0,0 +1,76 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SIZE_HIST_
+#define _SIZE_HIST_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Log-linear (HDR style) histogram of allocation sizes.
+ * Every power of two is split into SIZE_HIST_SUB linear sub-buckets, so a
+ * bucket is never wider than 1/SIZE_HIST_SUB of its lower bound. Sizes
+ * below SIZE_HIST_SUB * 2 get a bucket each. The index is computed from
+ * the position of the highest set bit, with no comparisons.
+ * Each bucket keeps the count and the total bytes of its sizes, so the
+ * totals are exact, and histograms merge by adding buckets. */
+
+#define SIZE_HIST_SUB_BITS  2
+#define SIZE_HIST_SUB       (1 << SIZE_HIST_SUB_BITS)
+#define SIZE_HIST_MAX_BITS  48    /* larger sizes share the last bucket */
+#define SIZE_HIST_BUCKETS   ((SIZE_HIST_MAX_BITS - SIZE_HIST_SUB_BITS + 1) * SIZE_HIST_SUB)
+
+typedef struct {
+    int64_t  count[SIZE_HIST_BUCKETS];
+    int64_t  bytes[SIZE_HIST_BUCKETS];
+} size_hist_t;
+
+static inline int size_hist_index(size_t size)
+{
+    int msb = 0;
+
+    if(size < SIZE_HIST_SUB) {
+        return size;
+    }
+    if(size >> SIZE_HIST_MAX_BITS) {
+        return SIZE_HIST_BUCKETS - 1;
+    }
+    msb = 63 - __builtin_clzl(size);
+    return ((msb - SIZE_HIST_SUB_BITS + 1) << SIZE_HIST_SUB_BITS) +
+           ((size >> (msb - SIZE_HIST_SUB_BITS)) & (SIZE_HIST_SUB - 1));
+}
+
+static inline void size_hist_add(size_hist_t *hist, size_t size, int64_t count, int64_t bytes)
+{
+    int i = size_hist_index(size);
+
+    hist->count[i] += count;
+    hist->bytes[i] += bytes;
+}
+
+/* Smallest size that falls in bucket i; bucket i ends where i + 1 starts */
+size_t size_hist_lower(int i);
+void   size_hist_merge(size_hist_t *dst, const size_hist_t *src);
+
+#endif /* _SIZE_HIST_ */
@@ -0,0 +1,200 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+/* Free objects are linked through their first word. The first object of
+ * a batch in the global pool also records the next batch and the length. */
+typedef struct slab_obj {
+    struct slab_obj *next;
+    struct slab_obj *next_batch;
+    size_t           count;
+} slab_obj_t;
+
+typedef struct {
+    slab_obj_t    *head;
+    size_t         count;
+    slab_cache_t  *cache;
+} slab_tcache_t;
+
+static __thread slab_tcache_t tcaches[SLAB_MAX_CACHES]
+    __attribute__((tls_model("initial-exec")));
+
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  slab_key;
+
+/* Caller holds cache->lock */
+static void push_batch(slab_cache_t *cache, slab_obj_t *head, size_t count)
+{
+    head->count = count;
+    head->next_batch = (slab_obj_t*)cache->batches;
+    cache->batches = head;
+}
+
+/* Hand every thread-local object back to the global pools */
+static void thread_exit(void *arg)
+{
+    int i;
+
+    for(i = 0; i < SLAB_MAX_CACHES; i++) {
+        slab_tcache_t *tc = &tcaches[i];
+
+        if(tc->head) {
+            pthread_mutex_lock(&tc->cache->lock);
+            push_batch(tc->cache, tc->head, tc->count);
+            pthread_mutex_unlock(&tc->cache->lock);
+            tc->head = NULL;
+            tc->count = 0;
+        }
+    }
+}
+
+static void slab_init(void)
+{
+    pthread_key_create(&slab_key, thread_exit);
+}
+
+/* Caller holds cache->lock. Carves up to SLAB_BATCH objects off the
+ * current chunk, mapping a new one when it runs out. */
+static slab_obj_t* carve_batch(slab_cache_t *cache, size_t *count)
+{
+    slab_obj_t *head = NULL;
+    slab_obj_t *tail = NULL;
+
+    if(cache->bump_end - cache->bump < (ptrdiff_t)cache->obj_sz) {
+        void *mem = mmap(NULL, SLAB_CHUNK_SZ, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED) {
+            return NULL;
+        }
+        cache->bump = (char*)mem;
+        cache->bump_end = cache->bump + SLAB_CHUNK_SZ;
+        __atomic_add_fetch(&cache->mapped_bytes, SLAB_CHUNK_SZ, __ATOMIC_RELAXED);
+    }
+
+    *count = 0;
+    while(*count < SLAB_BATCH &&
+          cache->bump_end - cache->bump >= (ptrdiff_t)cache->obj_sz) {
+        slab_obj_t *obj = (slab_obj_t*)cache->bump;
+
+        cache->bump += cache->obj_sz;
+        obj->next = NULL;
+        if(tail) {
+            tail->next = obj;
+        }
+        else {
+            head = obj;
+        }
+        tail = obj;
+        (*count)++;
+    }
+    return head;
+}
+
+/* First use of a cache by this thread: arrange for the flush at exit */
+static void bind_tcache(slab_cache_t *cache, slab_tcache_t *tc)
+{
+    pthread_once(&slab_once, slab_init);
+    tc->cache = cache;
+    pthread_setspecific(slab_key, tcaches);
+}
+
+static int refill(slab_cache_t *cache, slab_tcache_t *tc)
+{
+    slab_obj_t *batch = NULL;
+    size_t      count = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    batch = (slab_obj_t*)cache->batches;
+    if(batch) {
+        cache->batches = batch->next_batch;
+        count = batch->count;
+    }
+    else {
+        batch = carve_batch(cache, &count);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    tc->head = batch;
+    tc->count = count;
+    return batch ? 0 : -1;
+}
+
+void* slab_alloc(slab_cache_t *cache)
+{
+    slab_tcache_t *tc = &tcaches[cache->id];
+    slab_obj_t    *obj = NULL;
+
+    if(__builtin_expect(!tc->cache, 0)) {
+        bind_tcache(cache, tc);
+    }
+    if(!tc->head && refill(cache, tc) != 0) {
+        return NULL;
+    }
+
+    obj = tc->head;
+    tc->head = obj->next;
+    tc->count--;
+    memset(obj, 0, cache->obj_sz);
+    return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *ptr)
+{
+    slab_tcache_t *tc = &tcaches[cache->id];
+    slab_obj_t    *obj = (slab_obj_t*)ptr;
+
+    if(__builtin_expect(!tc->cache, 0)) {
+        bind_tcache(cache, tc);
+    }
+    obj->next = tc->head;
+    tc->head = obj;
+    tc->count++;
+
+    /* Keep at most two batches locally, give one back to the pool */
+    if(tc->count >= 2 * SLAB_BATCH) {
+        slab_obj_t *batch = tc->head;
+        slab_obj_t *last = batch;
+        size_t      i;
+
+        for(i = 1; i < SLAB_BATCH; i++) {
+            last = last->next;
+        }
+        tc->head = last->next;
+        tc->count -= SLAB_BATCH;
+        last->next = NULL;
+
+        pthread_mutex_lock(&cache->lock);
+        push_batch(cache, batch, SLAB_BATCH);
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+size_t slab_mem_usage(slab_cache_t *cache)
+{
+    return __atomic_load_n(&cache->mapped_bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SLAB_
+#define _SLAB_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Fixed-size object allocator for profiler-internal records.
+ * Memory comes from mmap'd chunks, never from malloc. Each thread keeps a
+ * private free list and trades objects with the cache's global pool in
+ * batches of SLAB_BATCH, so the lock is taken once per SLAB_BATCH calls. */
+
+#define SLAB_MAX_CACHES   4
+#define SLAB_BATCH        64
+#define SLAB_CHUNK_SZ     (1 << 20)
+
+typedef struct {
+    size_t           obj_sz;
+    int              id;          /* index of the per-thread free list */
+    pthread_mutex_t  lock;
+    void            *batches;     /* global pool, list of object lists */
+    char            *bump;        /* uncarved part of the current chunk */
+    char            *bump_end;
+    size_t           mapped_bytes;
+} slab_cache_t;
+
+/* Objects are 8-byte aligned and at least three words: a free object
+ * stores its list link, the next batch and the batch length. */
+#define SLAB_OBJ_SZ(sz) \
+    ((sz) < 3 * sizeof(void*) ? 3 * sizeof(void*) : (((sz) + 7) & ~(size_t)7))
+
+#define SLAB_CACHE_INITIALIZER(sz, cache_id) \
+    { .obj_sz = SLAB_OBJ_SZ(sz), .id = (cache_id), \
+      .lock = PTHREAD_MUTEX_INITIALIZER }
+
+void*  slab_alloc(slab_cache_t *cache);
+void   slab_free(slab_cache_t *cache, void *obj);
+size_t slab_mem_usage(slab_cache_t *cache);
+
+#endif /* _SLAB_ */
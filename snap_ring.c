@@ -0,0 +1,275 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "trace_format.h"
+#include "snap_ring.h"
+
+/* Longest encoding of one cell: index gap, count and bytes */
+#define SNAP_MAX_CELL_SZ  30
+
+typedef struct {
+    uint32_t     seq;
+    uint64_t     time_ns;
+    snap_cell_t  total;
+    uint32_t     cells;
+    size_t       off;        /* of the encoded delta in ring */
+    uint32_t     len;
+} snap_rec_t;
+
+static pthread_mutex_t  ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t         *ring = NULL;
+static size_t           ring_size = 0;
+static size_t           ring_head = 0;     /* where the next delta goes */
+static snap_rec_t       recs[SNAP_RING_MAX];
+static int              first = 0;         /* oldest in recs[] */
+static int              count = 0;
+static uint32_t         next_seq = 1;
+static snap_state_t    *base = NULL;       /* state before recs[first] */
+static snap_state_t    *last = NULL;       /* state of the newest */
+
+static void* map_anon(size_t len)
+{
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+int snap_ring_init(size_t ring_bytes)
+{
+    pthread_mutex_lock(&ring_lock);
+    if(!ring) {
+        ring = map_anon(ring_bytes);
+        base = map_anon(sizeof(snap_state_t));
+        last = map_anon(sizeof(snap_state_t));
+        ring_size = ring_bytes;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return (ring && base && last) ? 0 : -1;
+}
+
+/* Adds the delta of rec to cells */
+static void apply_delta(snap_cell_t *cells, const snap_rec_t *rec)
+{
+    const uint8_t *p = ring + rec->off;
+    const uint8_t *end = p + rec->len;
+    uint64_t       idx = 0;
+
+    while(p < end) {
+        uint64_t gap = 0;
+        uint64_t num = 0;
+        uint64_t bytes = 0;
+
+        if(!(p = trace_get_varint(p, end, &gap)) ||
+           !(p = trace_get_varint(p, end, &num)) ||
+           !(p = trace_get_varint(p, end, &bytes))) {
+            break;
+        }
+        idx += gap;
+        if(idx >= SNAP_CELLS) {
+            break;
+        }
+        cells[idx].num += trace_unzigzag(num);
+        cells[idx].bytes += trace_unzigzag(bytes);
+    }
+}
+
+static snap_rec_t* find_rec(uint32_t seq)
+{
+    uint32_t oldest = recs[first].seq;
+
+    if(count == 0 || seq < oldest || seq - oldest >= (uint32_t)count) {
+        return NULL;
+    }
+    return &recs[(first + (seq - oldest)) % SNAP_RING_MAX];
+}
+
+/* Folds the oldest snapshot into base */
+static void evict_oldest(void)
+{
+    snap_rec_t *rec = &recs[first];
+
+    apply_delta(base->cells, rec);
+    base->time_ns = rec->time_ns;
+    base->total = rec->total;
+    first = (first + 1) % SNAP_RING_MAX;
+    count--;
+}
+
+int64_t snap_ring_add(const snap_state_t *state)
+{
+    const snap_cell_t *cur = state->cells;
+    snap_cell_t       *prev = NULL;
+    snap_rec_t        *rec = NULL;
+    uint8_t           *p = NULL;
+    size_t             bound = 0;
+    uint32_t           changed = 0;
+    uint32_t           at = 0;
+    uint32_t           i;
+    int64_t            seq = -1;
+
+    pthread_mutex_lock(&ring_lock);
+    if(!ring || !base || !last) {
+        goto out;
+    }
+    prev = last->cells;
+
+    for(i = 0; i < SNAP_CELLS; i++) {
+        if(cur[i].num != prev[i].num || cur[i].bytes != prev[i].bytes) {
+            changed++;
+        }
+    }
+    bound = changed * SNAP_MAX_CELL_SZ;
+    if(bound > ring_size) {
+        goto out;
+    }
+
+    /* Deltas are laid out in order and wrap to the start when the next
+     * one may not fit, so the oldest always sits right after ring_head.
+     * Wrapping drops the tail left from the previous lap first. */
+    if(ring_head + bound > ring_size) {
+        while(count > 0 && recs[first].off >= ring_head) {
+            evict_oldest();
+        }
+        ring_head = 0;
+    }
+    while(count > 0 &&
+          (count == SNAP_RING_MAX ||
+           (recs[first].off < ring_head + bound &&
+            recs[first].off + recs[first].len > ring_head))) {
+        evict_oldest();
+    }
+
+    p = ring + ring_head;
+    for(i = 0; i < SNAP_CELLS; i++) {
+        if(cur[i].num != prev[i].num || cur[i].bytes != prev[i].bytes) {
+            p = trace_put_varint(p, i - at);
+            p = trace_put_varint(p, trace_zigzag(cur[i].num - prev[i].num));
+            p = trace_put_varint(p, trace_zigzag(cur[i].bytes - prev[i].bytes));
+            at = i;
+        }
+    }
+
+    rec = &recs[(first + count) % SNAP_RING_MAX];
+    rec->seq = next_seq++;
+    rec->time_ns = state->time_ns;
+    rec->total = state->total;
+    rec->cells = changed;
+    rec->off = ring_head;
+    rec->len = p - (ring + ring_head);
+    count++;
+    ring_head += rec->len;
+    memcpy(last, state, sizeof(*last));
+    seq = rec->seq;
+
+out:
+    pthread_mutex_unlock(&ring_lock);
+    return seq;
+}
+
+int snap_ring_list(snap_info_t *out, int max)
+{
+    int i;
+
+    pthread_mutex_lock(&ring_lock);
+    for(i = 0; i < count && i < max; i++) {
+        snap_rec_t *rec = &recs[(first + i) % SNAP_RING_MAX];
+
+        out[i].seq = rec->seq;
+        out[i].time_ns = rec->time_ns;
+        out[i].total = rec->total;
+        out[i].cells = rec->cells;
+        out[i].len = rec->len;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return i;
+}
+
+int snap_ring_bounds(uint32_t *oldest, uint32_t *newest)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&ring_lock);
+    if(count > 0) {
+        *oldest = recs[first].seq;
+        *newest = recs[first].seq + count - 1;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return ret;
+}
+
+int snap_ring_diff(uint32_t from, uint32_t to, snap_state_t *out)
+{
+    snap_rec_t *rec_from = NULL;
+    snap_rec_t *rec_to = NULL;
+    uint32_t    seq;
+    int         ret = -1;
+
+    pthread_mutex_lock(&ring_lock);
+    rec_from = find_rec(from);
+    rec_to = find_rec(to);
+    if(rec_from && rec_to && from <= to) {
+        memset(out, 0, sizeof(*out));
+        for(seq = from + 1; seq <= to; seq++) {
+            apply_delta(out->cells, find_rec(seq));
+        }
+        out->time_ns = rec_to->time_ns - rec_from->time_ns;
+        out->total.num = rec_to->total.num - rec_from->total.num;
+        out->total.bytes = rec_to->total.bytes - rec_from->total.bytes;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return ret;
+}
+
+int snap_ring_get(uint32_t seq, snap_state_t *out)
+{
+    snap_rec_t *rec = NULL;
+    uint32_t    s;
+    int         ret = -1;
+
+    pthread_mutex_lock(&ring_lock);
+    rec = find_rec(seq);
+    if(rec) {
+        memcpy(out, base, sizeof(*out));
+        for(s = recs[first].seq; s <= seq; s++) {
+            apply_delta(out->cells, find_rec(s));
+        }
+        out->time_ns = rec->time_ns;
+        out->total = rec->total;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return ret;
+}
+
+/* The lock may have been held by a thread that is gone in the child */
+void snap_ring_fork_child(void)
+{
+    pthread_mutex_init(&ring_lock, NULL);
+}
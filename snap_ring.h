@@ -0,0 +1,95 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SNAP_RING_
+#define _SNAP_RING_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "size_hist.h"
+#include "stack_table.h"
+
+/* Periodic live-set snapshots (MEMPROF_SNAPSHOT=secs).
+ * A snapshot is the live count and size per size bucket and per allocation
+ * site, read off the incremental counters, never off the records. Each one
+ * is stored as the delta to the one before it: the cells that changed, as
+ * varints, in a bounded byte ring. The absolute state just before the
+ * oldest retained snapshot is kept aside and the oldest is folded into it
+ * when the ring is full, so any retained snapshot can be rebuilt, and the
+ * growth between two of them is the sum of the deltas in between.
+ * Nothing here calls malloc. */
+
+#define SNAP_RING_BYTES  (4 << 20)
+#define SNAP_RING_MAX    1024         /* snapshots retained at most */
+#define SNAP_CELLS       (SIZE_HIST_BUCKETS + STACK_TABLE_SIZE)
+
+typedef struct {
+    int64_t  num;
+    int64_t  bytes;
+} snap_cell_t;
+
+typedef struct {
+    uint64_t     time_ns;                   /* prof_clock_ns() */
+    snap_cell_t  total;
+    union {
+        snap_cell_t  cells[SNAP_CELLS];
+        struct {
+            snap_cell_t  sizes[SIZE_HIST_BUCKETS];  /* by size_hist bucket */
+            snap_cell_t  sites[STACK_TABLE_SIZE];   /* by stack id */
+        };
+    };
+} snap_state_t;
+
+typedef struct {
+    uint32_t     seq;
+    uint64_t     time_ns;
+    snap_cell_t  total;
+    uint32_t     cells;      /* cells that changed since the one before */
+    uint32_t     len;        /* bytes taken in the ring */
+} snap_info_t;
+
+/* Returns 0 on success, -1 on error */
+int  snap_ring_init(size_t ring_bytes);
+
+/* Stores state as the newest snapshot, dropping the oldest ones to make
+ * room. Returns its sequence number, or -1 if it does not fit at all. */
+int64_t snap_ring_add(const snap_state_t *state);
+
+/* Fills out[] with up to max retained snapshots, oldest first, and
+ * returns how many */
+int  snap_ring_list(snap_info_t *out, int max);
+
+/* Sets *oldest and *newest; -1 if the ring is empty */
+int  snap_ring_bounds(uint32_t *oldest, uint32_t *newest);
+
+/* out = snapshot to - snapshot from, cell by cell, total and time too
+ * (from <= to). Returns -1 if either has left the ring. */
+int  snap_ring_diff(uint32_t from, uint32_t to, snap_state_t *out);
+
+/* out = snapshot seq. Returns -1 if it has left the ring. */
+int  snap_ring_get(uint32_t seq, snap_state_t *out);
+
+void snap_ring_fork_child(void);
+
+#endif /* _SNAP_RING_ */
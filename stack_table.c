@@ -0,0 +1,252 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <link.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include "stack_table.h"
+
+__thread int stack_thread_ready
+    __attribute__((tls_model("initial-exec"))) = 0;
+
+/* Bounds of the current thread's stack, for the frame pointer walk */
+static __thread uintptr_t stack_lo __attribute__((tls_model("initial-exec")));
+static __thread uintptr_t stack_hi __attribute__((tls_model("initial-exec")));
+
+static unwind_mode_t  unwind_mode = UNWIND_FP;
+static stack_entry_t *stack_table = NULL;
+static size_t         stack_used = 0;
+
+/* Text of this library, whose frames are dropped from captured stacks */
+static uintptr_t self_lo = 0;
+static uintptr_t self_hi = 0;
+
+static int find_self(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    uintptr_t addr = (uintptr_t)arg;
+    int       i;
+
+    for(i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        uintptr_t         lo = info->dlpi_addr + ph->p_vaddr;
+
+        if(ph->p_type == PT_LOAD && (ph->p_flags & PF_X) &&
+           addr >= lo && addr < lo + ph->p_memsz) {
+            self_lo = lo;
+            self_hi = lo + ph->p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int in_self(void *pc)
+{
+    return (uintptr_t)pc >= self_lo && (uintptr_t)pc < self_hi;
+}
+
+int stack_table_init(unwind_mode_t mode)
+{
+    void *mem = mmap(NULL, STACK_TABLE_SIZE * sizeof(stack_entry_t),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if(mem == MAP_FAILED) {
+        return -1;
+    }
+    stack_table = (stack_entry_t*)mem;
+    unwind_mode = mode;
+    dl_iterate_phdr(find_self, (void*)(uintptr_t)stack_capture);
+
+    /* The first backtrace() loads libgcc_s; do it now, not inside a hook */
+    if(unwind_mode == UNWIND_DWARF) {
+        void *frames[4];
+        backtrace(frames, 4);
+    }
+    return 0;
+}
+
+/* May allocate (pthread_getattr_np); the caller keeps the hooks out */
+void stack_thread_init(void)
+{
+    pthread_attr_t  attr;
+    void           *addr = NULL;
+    size_t          size = 0;
+
+    if(pthread_getattr_np(pthread_self(), &attr) == 0) {
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+    }
+    stack_lo = (uintptr_t)addr;
+    stack_hi = (uintptr_t)addr + size;
+    stack_thread_ready = 1;
+}
+
+static int capture_fp(void **frames, int max_depth)
+{
+    uintptr_t *fp = (uintptr_t*)__builtin_frame_address(0);
+    int        depth = 0;
+
+    while(depth < max_depth) {
+        uintptr_t *next;
+        void      *pc;
+
+        if((uintptr_t)fp < stack_lo || (uintptr_t)fp + 2 * sizeof(uintptr_t) > stack_hi ||
+           ((uintptr_t)fp & (sizeof(uintptr_t) - 1))) {
+            break;
+        }
+        next = (uintptr_t*)fp[0];
+        pc = (void*)fp[1];
+        if(!pc) {
+            break;
+        }
+        if(depth > 0 || !in_self(pc)) {
+            frames[depth++] = pc;
+        }
+        /* Frames grow towards higher addresses while unwinding */
+        if(next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+    return depth;
+}
+
+static int capture_dwarf(void **frames, int max_depth)
+{
+    void *buf[STACK_MAX_DEPTH + 8];
+    int   n = backtrace(buf, max_depth + 8);
+    int   skip = 0;
+
+    while(skip < n && in_self(buf[skip])) {
+        skip++;
+    }
+    n -= skip;
+    if(n > max_depth) {
+        n = max_depth;
+    }
+    memcpy(frames, buf + skip, n * sizeof(void*));
+    return n;
+}
+
+int stack_capture(void **frames, int max_depth)
+{
+    if(max_depth > STACK_MAX_DEPTH) {
+        max_depth = STACK_MAX_DEPTH;
+    }
+    if(unwind_mode == UNWIND_DWARF) {
+        return capture_dwarf(frames, max_depth);
+    }
+    return capture_fp(frames, max_depth);
+}
+
+static uint64_t hash_frames(void **frames, int depth)
+{
+    /* FNV-1a over the return addresses */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int      i;
+
+    for(i = 0; i < depth; i++) {
+        h ^= (uint64_t)(uintptr_t)frames[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+}
+
+uint32_t stack_intern(void **frames, int depth)
+{
+    uint64_t h = 0;
+    uint32_t mask = STACK_TABLE_SIZE - 1;
+    uint32_t i, n;
+
+    if(!stack_table || depth <= 0) {
+        return 0;
+    }
+    h = hash_frames(frames, depth);
+
+    /* Slot 0 is reserved for "unknown" */
+    for(n = 0, i = h & mask; n < STACK_TABLE_SIZE; n++, i = (i + 1) & mask) {
+        stack_entry_t *e = &stack_table[i];
+        uint64_t       slot_hash = __atomic_load_n(&e->hash, __ATOMIC_ACQUIRE);
+
+        if(i == 0) {
+            continue;
+        }
+        if(slot_hash == 0) {
+            uint64_t expected = 0;
+            if(__atomic_compare_exchange_n(&e->hash, &expected, h, false,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_add_fetch(&stack_used, 1, __ATOMIC_RELAXED);
+                e->depth = depth;
+                memcpy(e->frames, frames, depth * sizeof(void*));
+                __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+                return i;
+            }
+            slot_hash = expected;
+        }
+        if(slot_hash == h) {
+            /* Another thread may still be filling it in */
+            while(!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE));
+            if(e->depth == (uint32_t)depth &&
+               memcmp(e->frames, frames, depth * sizeof(void*)) == 0) {
+                return i;
+            }
+        }
+    }
+    return 0;
+}
+
+stack_entry_t* stack_get(uint32_t id)
+{
+    if(!stack_table || id >= STACK_TABLE_SIZE) {
+        return NULL;
+    }
+    return &stack_table[id];
+}
+
+void stack_foreach(stack_visit_t visit, void *arg)
+{
+    uint32_t i;
+
+    if(!stack_table) {
+        return;
+    }
+    for(i = 0; i < STACK_TABLE_SIZE; i++) {
+        stack_entry_t *e = &stack_table[i];
+        if(i == 0 || __atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) {
+            visit(i, e, arg);
+        }
+    }
+}
+
+size_t stack_mem_usage(void)
+{
+    return __atomic_load_n(&stack_used, __ATOMIC_RELAXED) * sizeof(stack_entry_t);
+}
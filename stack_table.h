@@ -0,0 +1,117 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _STACK_TABLE_
+#define _STACK_TABLE_
+
+#include <stdint.h>
+#include "life_hist.h"
+
+/* Call stack capture and interning.
+ * stack_capture() walks the frame pointer chain, checking every frame
+ * against the thread's stack bounds, so it never faults, never allocates
+ * and is async-signal-safe. MEMPROF_UNWIND=dwarf switches to glibc's
+ * backtrace(), which also unwinds code built without frame pointers.
+ *
+ * Stacks are hash-consed into a fixed-size lock-free table; the slot
+ * index is the 32-bit stack id stored in allocation records. Id 0 means
+ * "no stack" and also collects stacks that did not fit in the table. */
+
+#define STACK_MAX_DEPTH   32
+#define STACK_TABLE_BITS  16
+#define STACK_TABLE_SIZE  (1 << STACK_TABLE_BITS)
+
+typedef enum {
+    UNWIND_FP,
+    UNWIND_DWARF,
+} unwind_mode_t;
+
+typedef struct {
+    uint64_t  hash;          /* 0: free slot */
+    uint32_t  ready;         /* frames are published */
+    uint32_t  depth;
+    void     *frames[STACK_MAX_DEPTH];
+    /* Per-site counters, updated with relaxed atomics */
+    int64_t   live_num;
+    int64_t   live_sz;
+    int64_t   num_alloc;
+    int64_t   alloc_sz;
+    int64_t   num_realloc;      /* reallocs of blocks born here */
+    int64_t   realloc_copied;   /* bytes those reallocs moved */
+    life_hist_t lifetimes;      /* freed blocks born here, by lifetime */
+} stack_entry_t;
+
+typedef void (*stack_visit_t)(uint32_t id, stack_entry_t *entry, void *arg);
+
+extern __thread int stack_thread_ready
+    __attribute__((tls_model("initial-exec")));
+
+int            stack_table_init(unwind_mode_t mode);
+void           stack_thread_init(void);
+int            stack_capture(void **frames, int max_depth);
+uint32_t       stack_intern(void **frames, int depth);
+stack_entry_t* stack_get(uint32_t id);
+void           stack_foreach(stack_visit_t visit, void *arg);
+size_t         stack_mem_usage(void);
+
+static inline void stack_account(uint32_t id, int64_t num, int64_t size, int64_t allocs)
+{
+    stack_entry_t *entry = stack_get(id);
+
+    if(!entry) {
+        return;
+    }
+    __atomic_add_fetch(&entry->live_num, num, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&entry->live_sz, size, __ATOMIC_RELAXED);
+    if(allocs) {
+        __atomic_add_fetch(&entry->num_alloc, allocs, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&entry->alloc_sz, size, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void stack_account_realloc(uint32_t id, int64_t copied)
+{
+    stack_entry_t *entry = stack_get(id);
+
+    if(!entry) {
+        return;
+    }
+    __atomic_add_fetch(&entry->num_realloc, 1, __ATOMIC_RELAXED);
+    if(copied) {
+        __atomic_add_fetch(&entry->realloc_copied, copied, __ATOMIC_RELAXED);
+    }
+}
+
+/* num blocks born at the site were freed after living ns */
+static inline void stack_account_free(uint32_t id, uint64_t ns, int64_t num)
+{
+    stack_entry_t *entry = stack_get(id);
+
+    if(!entry) {
+        return;
+    }
+    __atomic_add_fetch(&entry->lifetimes.count[life_hist_index(ns)], num, __ATOMIC_RELAXED);
+}
+
+#endif /* _STACK_TABLE_ */
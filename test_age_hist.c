@@ -0,0 +1,171 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "age_hist.h"
+
+/* Checks the live-set age histogram built from birth epoch rings:
+ * - a single birth lands in the bucket of its age, give or take half the
+ *   epoch it was read from, on both sides of every bucket boundary and at
+ *   random ages from 0 to 10 hours;
+ * - births and deaths recorded in different rings, as by different
+ *   threads, cancel out bucket by bucket, so the histogram matches one
+ *   built from the survivors alone, folded rings included. */
+
+#define NOW_NS       (10 * 86400 * 1000000000ull)  /* 10 days after boot */
+#define MAX_AGE_NS   (10 * 3600 * 1000000000ull)
+#define NUM_RANDOM   100000
+#define NUM_LIVE     20000
+
+static age_epochs_t  births;
+static age_epochs_t  deaths;
+static age_epochs_t  survivors;
+static uint64_t      birth_ns[NUM_LIVE];
+static long          errors = 0;
+
+static void expect(int ok, const char *what, uint64_t v)
+{
+    if(!ok && errors++ < 10) {
+        printf("FAIL: %s, at %llu\n", what, (unsigned long long)v);
+    }
+}
+
+static uint64_t next_rand(void)
+{
+    static uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+/* Log-uniform up to MAX_AGE_NS */
+static uint64_t random_age(void)
+{
+    uint64_t r = next_rand();
+
+    return (r >> 20) % MAX_AGE_NS >> (r % 40);
+}
+
+static int bucket_of(uint64_t age)
+{
+    int i;
+
+    for(i = AGE_HIST_BUCKETS - 1; i > 0 && age < age_hist_lower(i); i--) {
+    }
+    return i;
+}
+
+/* One allocation born age ns before NOW_NS lands in the bucket of an age
+ * within half the epoch it is read from. A level takes over from the finer
+ * one at about one of its own epochs of age, so that is up to half the age,
+ * and half a level 0 epoch for the youngest. */
+static void check_single(uint64_t age)
+{
+    static age_epochs_t  ages;
+    age_hist_t           hist;
+    uint64_t             slack = (age + (1ull << AGE_EPOCH_SHIFT)) / 2;
+    int                  got = -1;
+    int                  i;
+
+    memset(&ages, 0, sizeof(ages));
+    memset(&hist, 0, sizeof(hist));
+    age_epochs_add(&ages, NOW_NS - age, 1);
+    age_hist_collect(&hist, &ages, NOW_NS);
+    for(i = 0; i < AGE_HIST_BUCKETS; i++) {
+        if(hist.count[i] == 1 && got < 0) {
+            got = i;
+        }
+        else if(hist.count[i] != 0) {
+            got = AGE_HIST_BUCKETS;
+        }
+    }
+    expect(got >= 0 && got < AGE_HIST_BUCKETS, "one birth, one count", age);
+    expect(got >= bucket_of(age > slack ? age - slack : 0) &&
+           got <= bucket_of(age + slack), "bucket of the age", age);
+}
+
+static void collect(age_hist_t *hist, age_epochs_t *ages)
+{
+    age_hist_collect(hist, ages, NOW_NS);
+}
+
+int main(void)
+{
+    age_hist_t  mixed;
+    age_hist_t  alone;
+    int64_t     total = 0;
+    int         i;
+
+    for(i = 1; i < AGE_HIST_BUCKETS; i++) {
+        uint64_t lo = age_hist_lower(i);
+
+        check_single(lo - lo / 8);
+        check_single(lo);
+        check_single(lo + lo / 8);
+    }
+    check_single(0);
+    for(i = 0; i < NUM_RANDOM; i++) {
+        check_single(random_age());
+    }
+
+    /* Births in one ring, deaths of every other block in another: the two
+       collected together are the survivors collected alone */
+    for(i = 0; i < NUM_LIVE; i++) {
+        birth_ns[i] = NOW_NS - random_age();
+        age_epochs_add(&births, birth_ns[i], 1);
+        if(i & 1) {
+            age_epochs_add(&deaths, birth_ns[i], -1);
+        }
+        else {
+            age_epochs_add(&survivors, birth_ns[i], 1);
+        }
+    }
+    memset(&mixed, 0, sizeof(mixed));
+    memset(&alone, 0, sizeof(alone));
+    collect(&mixed, &births);
+    collect(&mixed, &deaths);
+    collect(&alone, &survivors);
+    for(i = 0; i < AGE_HIST_BUCKETS; i++) {
+        expect(mixed.count[i] == alone.count[i], "births and deaths of two rings", i);
+        total += alone.count[i];
+    }
+    expect(total == NUM_LIVE / 2, "survivors counted", total);
+
+    /* A ring folded into another, as at thread exit */
+    age_epochs_fold(&births, &deaths);
+    memset(&mixed, 0, sizeof(mixed));
+    collect(&mixed, &births);
+    for(i = 0; i < AGE_HIST_BUCKETS; i++) {
+        expect(mixed.count[i] == alone.count[i], "folded ring", i);
+    }
+
+    printf("%d single births, %d births with half of them dead in another ring\n",
+           NUM_RANDOM + 3 * (AGE_HIST_BUCKETS - 1) + 1, NUM_LIVE);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
@@ -0,0 +1,153 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "boot_arena.h"
+
+/* Checks the bootstrap arena. Threads started together allocate blocks of
+ * random sizes and alignments, check that each comes zeroed and fill it
+ * with a pattern of their own. Then every block must be aligned, owned by
+ * the arena, report its size, keep its pattern and overlap no other. The
+ * arena is then filled up: it fails cleanly and owns nothing outside. */
+
+#define NUM_THREADS  8
+#define NUM_BLOCKS   2000
+
+typedef struct {
+    char    *ptr;
+    size_t   size;
+    size_t   align;
+    int      owner;
+} block_t;
+
+static block_t            blocks[NUM_THREADS * NUM_BLOCKS];
+static pthread_barrier_t  start;
+static long               errors = 0;
+
+static void expect(int ok, const char *what, long v)
+{
+    if(!ok && __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED) <= 10) {
+        printf("FAIL: %s, at %ld\n", what, v);
+    }
+}
+
+static void* alloc_thread(void *arg)
+{
+    long      t = (long)arg;
+    uint64_t  rng = 0x9e3779b97f4a7c15ULL * (t + 1);
+    int       i;
+
+    pthread_barrier_wait(&start);
+    for(i = 0; i < NUM_BLOCKS; i++) {
+        block_t  *b = &blocks[t * NUM_BLOCKS + i];
+        size_t    j;
+
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        b->size = (rng >> 8) % 2048;
+        b->align = (rng & 3) ? 0 : (size_t)1 << (4 + (rng >> 4) % 9);
+        b->owner = t;
+        b->ptr = boot_alloc(b->size, b->align);
+        expect(b->ptr != NULL, "block", i);
+        if(!b->ptr) {
+            continue;
+        }
+        for(j = 0; j < b->size; j++) {
+            expect(b->ptr[j] == 0, "zeroed", j);
+        }
+        memset(b->ptr, t + 1, b->size);
+    }
+    return NULL;
+}
+
+static int by_address(const void *a, const void *b)
+{
+    const block_t *x = a;
+    const block_t *y = b;
+
+    return x->ptr < y->ptr ? -1 : x->ptr > y->ptr;
+}
+
+int main(void)
+{
+    pthread_t  threads[NUM_THREADS];
+    size_t     filled = 0;
+    long       i;
+    size_t     j;
+    int        local = 0;
+    void      *heap = malloc(16);
+    void      *p = NULL;
+
+    expect(!boot_owns(heap) && !boot_owns(&local), "owns nothing before use", 0);
+
+    pthread_barrier_init(&start, NULL, NUM_THREADS);
+    for(i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, alloc_thread, (void*)i);
+    }
+    for(i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for(i = 0; i < NUM_THREADS * NUM_BLOCKS; i++) {
+        block_t *b = &blocks[i];
+
+        if(!b->ptr) {
+            continue;
+        }
+        expect((uintptr_t)b->ptr % (b->align ? b->align : 16) == 0, "aligned", i);
+        expect(boot_owns(b->ptr) && boot_owns(b->ptr + b->size), "owned", i);
+        expect(boot_size(b->ptr) == b->size, "size", i);
+        for(j = 0; j < b->size; j++) {
+            expect(b->ptr[j] == b->owner + 1, "pattern kept", i);
+        }
+    }
+    qsort(blocks, NUM_THREADS * NUM_BLOCKS, sizeof(blocks[0]), by_address);
+    for(i = 1; i < NUM_THREADS * NUM_BLOCKS; i++) {
+        expect(!blocks[i - 1].ptr || blocks[i - 1].ptr + blocks[i - 1].size < blocks[i].ptr,
+               "blocks apart, with room for the size word", i);
+    }
+
+    /* Fill it up: then every request fails, and it still owns nothing
+       outside the reservation */
+    while((p = boot_alloc(1 << 20, 0)) != NULL) {
+        filled++;
+    }
+    expect(boot_alloc(1, 0) == NULL || boot_alloc(1 << 20, 0) == NULL, "full", 0);
+    expect(boot_alloc(SIZE_MAX, 0) == NULL && boot_alloc(16, (size_t)1 << 40) == NULL,
+           "too large", 0);
+    expect(!boot_owns(heap) && !boot_owns(&local) &&
+           !boot_owns(boot_arena_base + BOOT_ARENA_SIZE) && !boot_owns(boot_arena_base - 1),
+           "owns nothing outside", 0);
+    free(heap);
+
+    printf("%d threads, %d blocks each, then %zu 1M blocks to fill the arena\n",
+           NUM_THREADS, NUM_BLOCKS, filled);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
@@ -0,0 +1,229 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "size_hist.h"
+
+/* Checks the control channel. Runs itself again under ./memprofiler.so
+ * in table mode with MEMPROF_CONTROL set to a fresh directory, connects
+ * to its own socket and checks what the commands report about blocks it
+ * holds: snapshot counts and size bucket, reset, dump, help, and the
+ * errors of a bad argument and an unknown command. */
+
+#define NUM_BLOCKS  1000
+#define BLOCK_SIZE  100
+
+static void *blocks[NUM_BLOCKS];
+static char  reply[256 * 1024];
+static char  dump[256 * 1024];
+static long  errors = 0;
+
+static void expect(int ok, const char *what)
+{
+    if(!ok && errors++ < 10) {
+        printf("FAIL: %s\n", what);
+    }
+}
+
+/* Sends one request line, reads the reply up to its "." line */
+static int request(int fd, const char *line)
+{
+    size_t len = 0;
+
+    if(write(fd, line, strlen(line)) != (ssize_t)strlen(line) || write(fd, "\n", 1) != 1) {
+        return -1;
+    }
+    for(;;) {
+        ssize_t ret = read(fd, reply + len, sizeof(reply) - 1 - len);
+
+        if(ret <= 0) {
+            return -1;
+        }
+        len += ret;
+        reply[len] = '\0';
+        if((len == 2 && strcmp(reply, ".\n") == 0) ||
+           (len >= 3 && strcmp(reply + len - 3, "\n.\n") == 0)) {
+            return 0;
+        }
+    }
+}
+
+/* Value of the first "key value" line of the reply, -1 if none */
+static long long value(const char *key)
+{
+    char  *line = reply;
+    size_t klen = strlen(key);
+
+    while(line && *line) {
+        if(strncmp(line, key, klen) == 0 && line[klen] == ' ') {
+            return strtoll(line + klen + 1, NULL, 10);
+        }
+        line = strchr(line, '\n');
+        line = line ? line + 1 : NULL;
+    }
+    return -1;
+}
+
+/* Live count of the "size <lower> <count> <bytes>" line of size's bucket */
+static long long size_count(size_t size)
+{
+    char key[64];
+
+    snprintf(key, sizeof(key), "size %zu", size_hist_lower(size_hist_index(size)));
+    return value(key);
+}
+
+static int connect_self(const char *dir)
+{
+    struct sockaddr_un  addr;
+    int                 fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int                 tries = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/memprof.%d.sock", dir, (int)getpid());
+    for(tries = 0; tries < 200; tries++) {
+        if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        usleep(10000);
+    }
+    close(fd);
+    return -1;
+}
+
+static int run_child(const char *dir)
+{
+    char       path[512];
+    char       cmd[600];
+    char       needle[64];
+    long long  live_num, live_sz, in_bucket, num_alloc;
+    FILE      *fp = NULL;
+    size_t     len = 0;
+    int        fd = connect_self(dir);
+    int        found = 0;
+    int        i;
+
+    if(fd < 0) {
+        printf("FAIL: no control socket in %s\n", dir);
+        return 1;
+    }
+
+    expect(request(fd, "snapshot") == 0 && strncmp(reply, "ok\n", 3) == 0, "snapshot");
+    live_num = value("live_num");
+    live_sz = value("live_sz");
+    in_bucket = size_count(BLOCK_SIZE);
+    num_alloc = value("num_alloc");
+    expect(value("pid") == getpid(), "snapshot pid");
+    for(i = 0; i < NUM_BLOCKS; i++) {
+        blocks[i] = malloc(BLOCK_SIZE);
+    }
+    expect(request(fd, "snapshot") == 0, "snapshot");
+    expect(value("live_num") - live_num == NUM_BLOCKS, "snapshot live_num");
+    expect(value("live_sz") - live_sz == NUM_BLOCKS * BLOCK_SIZE, "snapshot live_sz");
+    expect(value("num_alloc") - num_alloc == NUM_BLOCKS, "snapshot num_alloc");
+    expect(size_count(BLOCK_SIZE) - (in_bucket < 0 ? 0 : in_bucket) == NUM_BLOCKS,
+           "snapshot size bucket");
+
+    /* reset restarts the overall counters, the live set stays */
+    expect(request(fd, "reset") == 0 && strcmp(reply, "ok\n.\n") == 0, "reset");
+    expect(request(fd, "snapshot") == 0, "snapshot");
+    expect(value("num_alloc") == 0, "num_alloc after reset");
+    expect(value("live_num") - live_num == NUM_BLOCKS, "live_num after reset");
+
+    /* dump lists every held block with its size */
+    snprintf(path, sizeof(path), "%s/dump", dir);
+    snprintf(cmd, sizeof(cmd), "dump %s", path);
+    expect(request(fd, cmd) == 0 && strncmp(reply, "ok\n", 3) == 0, "dump");
+    expect(value("records") >= NUM_BLOCKS, "dump records");
+    fp = fopen(path, "r");
+    if(fp) {
+        len = fread(dump, 1, sizeof(dump) - 1, fp);
+        fclose(fp);
+    }
+    dump[len] = '\0';
+    unlink(path);
+    for(i = 0; i < NUM_BLOCKS; i++) {
+        snprintf(needle, sizeof(needle), "%p %d ", blocks[i], BLOCK_SIZE);
+        found += strstr(dump, needle) != NULL;
+    }
+    expect(found == NUM_BLOCKS, "dump lists the blocks");
+
+    expect(request(fd, "help") == 0 && strstr(reply, "command snapshot\n") &&
+           strstr(reply, "command dump <path>\n"), "help");
+    expect(request(fd, "interval soon") == 0 && strncmp(reply, "error usage", 11) == 0,
+           "bad argument");
+    expect(request(fd, "bogus") == 0 && strncmp(reply, "error unknown command bogus", 27) == 0,
+           "unknown command");
+
+    for(i = 0; i < NUM_BLOCKS; i++) {
+        free(blocks[i]);
+    }
+    expect(request(fd, "snapshot") == 0 && value("live_num") == live_num, "snapshot after free");
+    close(fd);
+    return errors != 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char   dir[] = "/tmp/test_control.XXXXXX";
+    char  *args[] = {argv[0], "child", dir, NULL};
+    pid_t  pid = 0;
+    int    status = 1;
+
+    if(argc > 2 && strcmp(argv[1], "child") == 0) {
+        return run_child(argv[2]);
+    }
+
+    if(!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0) {
+        setenv("LD_PRELOAD", "./memprofiler.so", 1);
+        setenv("MEMPROF_MODE", "table", 1);
+        setenv("MEMPROF_CONTROL", dir, 1);
+        setenv("MEMPROF_INTERVAL", "0", 1);
+        setenv("MEMPROF_REPORT_FILE", "/dev/null", 1);
+        execv("/proc/self/exe", args);
+        _exit(127);
+    }
+    if(pid < 0 || waitpid(pid, &status, 0) != pid) {
+        status = 1;
+    }
+    rmdir(dir);
+
+    printf("snapshot, reset, dump, help and errors over the socket, %d blocks held\n", NUM_BLOCKS);
+    printf("%s\n", status == 0 ? "PASS" : "FAIL");
+    return status != 0;
+}
@@ -0,0 +1,176 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include "hash_table.h"
+
+/* Checks hash_table.c against a plain array holding the expected value
+ * of every key. Random inserts, deletes, conditional deletes and moves
+ * over NUM_KEYS keys make every shard grow several times, so lookups run
+ * while old arrays are still being drained. */
+
+#define NUM_KEYS    200000
+#define NUM_OPS     2000000
+#define CHECK_EVERY 250000
+
+static hash_table_t table = HASH_TABLE_INITIALIZER;
+static void        *expected[NUM_KEYS];
+static uint64_t     rng = 88172645463325252ULL;
+static long         errors = 0;
+
+static uint64_t next_rand(void)
+{
+    /* xorshift64 */
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/* Keys look like heap addresses: 16 byte aligned, close together */
+static void* key_of(size_t i)
+{
+    return (void*)(uintptr_t)(0x10000000 + 16 * i);
+}
+
+static void* val_of(uint64_t r)
+{
+    return (void*)(uintptr_t)((r | 1) & 0xffffffffffff);
+}
+
+static void expect(int ok, const char *what, size_t i)
+{
+    if(!ok && errors++ < 10) {
+        printf("FAIL: %s, key %zu\n", what, i);
+    }
+}
+
+typedef struct {
+    size_t  num;
+    size_t  bad;
+} visit_t;
+
+static void count_entry(void *key, void *val, void *arg)
+{
+    visit_t *v = (visit_t*)arg;
+    size_t   i = ((uintptr_t)key - 0x10000000) / 16;
+
+    v->num++;
+    if(i >= NUM_KEYS || expected[i] != val) {
+        v->bad++;
+    }
+}
+
+/* Replaced callback of hash_insert and hash_move */
+static void take_prev(void *key, void *val, void *arg)
+{
+    *(void**)arg = val;
+}
+
+/* Every key finds its expected value and the table holds nothing else */
+static void check_all(void)
+{
+    visit_t  v = {0, 0};
+    size_t   num = 0;
+    size_t   i;
+
+    for(i = 0; i < NUM_KEYS; i++) {
+        expect(hash_find(&table, key_of(i)) == expected[i], "find", i);
+        num += expected[i] != NULL;
+    }
+    hash_foreach(&table, count_entry, &v);
+    expect(v.num == num && v.bad == 0, "foreach", v.num);
+}
+
+int main(void)
+{
+    size_t  live = 0;
+    size_t  i;
+    long    op;
+
+    for(op = 1; op <= NUM_OPS; op++) {
+        uint64_t  r = next_rand();
+        size_t    j = (r >> 20) % NUM_KEYS;
+        void     *val = val_of(next_rand());
+        void     *prev = NULL;
+        int       moved = 0;
+
+        i = r % NUM_KEYS;
+        switch((r >> 40) % 8) {
+        case 0:
+        case 1:
+        case 2:
+            /* Mostly inserts, so the table keeps growing */
+            expect(hash_insert(&table, key_of(i), val, take_prev, &prev) == 0, "insert", i);
+            expect(prev == expected[i], "insert replaced value", i);
+            expected[i] = val;
+            break;
+        case 3:
+            expect(hash_delete(&table, key_of(i)) == expected[i], "delete", i);
+            expected[i] = NULL;
+            break;
+        case 4:
+            /* Only deletes while the key maps to the given value */
+            if(expected[i]) {
+                expect(hash_delete_val(&table, key_of(i), val_of(r)) != 0 ||
+                       val_of(r) == expected[i], "delete_val of another value", i);
+                expect(hash_delete_val(&table, key_of(i), expected[i]) == 0, "delete_val", i);
+                expected[i] = NULL;
+            }
+            break;
+        case 5:
+            expect(hash_find(&table, key_of(i)) == expected[i], "find", i);
+            break;
+        default:
+            /* Re-keys a value from i to j, as a realloc that moved would.
+               When i maps to another value it must stay as it is. */
+            moved = expected[i] && (r & 1);
+            if(i == j) {
+                break;
+            }
+            if(moved) {
+                val = expected[i];
+            }
+            expect(hash_move(&table, key_of(i), key_of(j), val, take_prev, &prev) == 0, "move", i);
+            expect(prev == expected[j], "move replaced value", j);
+            expected[j] = val;
+            if(moved) {
+                expected[i] = NULL;
+            }
+            break;
+        }
+        if(op % CHECK_EVERY == 0) {
+            check_all();
+        }
+    }
+
+    for(i = 0; i < NUM_KEYS; i++) {
+        live += expected[i] != NULL;
+    }
+    printf("%d ops over %d keys, %zu left, %zu KB of slots\n", NUM_OPS, NUM_KEYS, live,
+           hash_mem_usage(&table) / 1024);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
@@ -0,0 +1,136 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap_stats.h"
+
+/* Checks the heap and fragmentation figures:
+ * - a read is consistent in itself: the allocator's bytes add up and the
+ *   process is resident;
+ * - a large block shows up as mmap'd heap, then as resident and anonymous
+ *   memory once touched, and goes away when freed; small blocks show up in
+ *   the arena as used bytes, then as free ones;
+ * - heap_frag_add files blocks by requested size and scales the bytes,
+ *   not the count, by the weight. */
+
+#define BIG_SIZE     (64 << 20)
+#define NUM_SMALL    20000
+#define SMALL_SIZE   1000
+#define MB           (1 << 20)
+
+/* volatile, so the compiler keeps blocks it sees are never read */
+static char  *volatile big = NULL;
+static void  *volatile small[NUM_SMALL];
+static long            errors = 0;
+
+static void expect(int ok, const char *what, long long v)
+{
+    if(!ok && errors++ < 10) {
+        printf("FAIL: %s, got %lld\n", what, v);
+    }
+}
+
+static void read_heap(heap_stats_t *heap)
+{
+    expect(heap_stats_read(heap) == 0, "read", 0);
+    expect(heap->rss > 0, "resident", heap->rss);
+    expect(heap->heap_used >= 0 && heap->heap_free >= 0 && heap->heap_mmap >= 0,
+           "non-negative", heap->heap_used);
+    expect(heap->heap_used + heap->heap_free == heap->heap_total, "used and free add up",
+           heap->heap_total);
+    expect(heap->heap_top <= heap->heap_free, "releasable top is free", heap->heap_top);
+    expect(heap->heap_mmap <= heap->heap_used, "mmap'd blocks are used", heap->heap_mmap);
+    expect(heap->anon == -1 || (heap->anon > 0 && heap->anon < heap->rss),
+           "anonymous, not the mapped files", heap->anon);
+}
+
+int main(void)
+{
+    static heap_frag_t  frag;
+    heap_stats_t        before;
+    heap_stats_t        after;
+    int                 i = size_hist_index(100);
+    int                 j;
+
+    read_heap(&before);
+
+    /* Over the mmap threshold: mapped at once, resident only once touched */
+    big = malloc(BIG_SIZE);
+    read_heap(&after);
+    expect(after.heap_mmap - before.heap_mmap >= BIG_SIZE, "big block mapped",
+           after.heap_mmap - before.heap_mmap);
+    expect(after.rss - before.rss < BIG_SIZE / 2, "untouched", after.rss - before.rss);
+    memset(big, 1, BIG_SIZE);
+    read_heap(&after);
+    expect(after.rss - before.rss >= BIG_SIZE - MB, "touched resident", after.rss - before.rss);
+    expect(after.anon == -1 || after.anon - before.anon >= BIG_SIZE - MB, "touched anonymous",
+           after.anon - before.anon);
+    free(big);
+    read_heap(&after);
+    expect(after.heap_mmap == before.heap_mmap, "big block unmapped", after.heap_mmap);
+    expect(after.rss - before.rss < BIG_SIZE / 2, "released", after.rss - before.rss);
+
+    /* Under it: used in the arena, then free there */
+    read_heap(&before);
+    for(j = 0; j < NUM_SMALL; j++) {
+        small[j] = malloc(SMALL_SIZE);
+    }
+    read_heap(&after);
+    expect(after.heap_used - before.heap_used >= NUM_SMALL * SMALL_SIZE, "small blocks used",
+           after.heap_used - before.heap_used);
+    expect(after.heap_mmap == before.heap_mmap, "small blocks not mapped", after.heap_mmap);
+    /* Freed in reverse, keeping the first, so the arena cannot shrink */
+    for(j = NUM_SMALL - 1; j > 0; j--) {
+        free(small[j]);
+    }
+    read_heap(&before);
+    expect(after.heap_used - before.heap_used >= (NUM_SMALL - 1) * SMALL_SIZE,
+           "small blocks no longer used", after.heap_used - before.heap_used);
+    expect(before.heap_free >= (NUM_SMALL - 1) * SMALL_SIZE, "small blocks free",
+           before.heap_free);
+    free(small[0]);
+
+    /* A block stands for weight bytes per byte, and for num blocks */
+    heap_frag_add(&frag, 100, 104, 1.0, 1);
+    heap_frag_add(&frag, 100, 120, 2.5, 3);
+    heap_frag_add(&frag, 5000, 5016, 1.0, 1);
+    expect(frag.count[i] == 4, "count", frag.count[i]);
+    expect(frag.requested[i] == 100 + 250 && frag.usable[i] == 104 + 300, "weighted bytes",
+           frag.requested[i]);
+    expect(frag.count[size_hist_index(5000)] == 1 && size_hist_index(5000) != i &&
+           frag.usable[size_hist_index(5000)] == 5016, "by requested size",
+           frag.usable[size_hist_index(5000)]);
+    for(j = 0; j < SIZE_HIST_BUCKETS; j++) {
+        if(j != i && j != size_hist_index(5000)) {
+            expect(frag.count[j] == 0 && frag.requested[j] == 0, "other buckets empty", j);
+        }
+    }
+
+    printf("a %d MB block mapped, touched and freed, %d blocks of %d bytes used and freed\n",
+           BIG_SIZE / MB, NUM_SMALL, SMALL_SIZE);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
@@ -0,0 +1,157 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "life_hist.h"
+
+/* Checks the lifetime histogram of freed blocks:
+ * - every lifetime lies between the lower bound of its bucket and that of
+ *   the next, on both sides of every bucket boundary and at random
+ *   lifetimes up to hours, and the last bucket takes everything above;
+ * - quantiles interpolate within the bucket they fall in, are exact on
+ *   hand-built histograms and stay within the bucket of the true quantile
+ *   of random lifetimes. */
+
+#define NUM_RANDOM   100000
+
+static uint64_t  lifetimes[NUM_RANDOM];
+static long      errors = 0;
+
+static void expect(int ok, const char *what, uint64_t v)
+{
+    if(!ok && errors++ < 10) {
+        printf("FAIL: %s, at %llu\n", what, (unsigned long long)v);
+    }
+}
+
+static uint64_t next_rand(void)
+{
+    static uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+/* Spread evenly over the powers of two, from 1 ns to about 4.5 hours */
+static uint64_t random_lifetime(void)
+{
+    uint64_t r = next_rand();
+
+    return (r >> 20) & ((2ull << (r % 44)) - 1);
+}
+
+static void check_index(uint64_t ns)
+{
+    int i = life_hist_index(ns);
+
+    expect(i >= 0 && i < LIFE_HIST_BUCKETS, "index in range", ns);
+    expect(life_hist_lower(i) <= ns, "above the bucket's lower bound", ns);
+    expect(i == LIFE_HIST_BUCKETS - 1 || ns < life_hist_lower(i + 1),
+           "below the next bucket's lower bound", ns);
+}
+
+static int by_value(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(void)
+{
+    static life_hist_t  hist;
+    static const double qs[] = { 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99, 1.0 };
+    uint64_t            prev = 0;
+    int                 i;
+
+    /* Bounds: 0 and 128 ns, then doubling, with the last bucket open */
+    expect(life_hist_lower(0) == 0 && life_hist_lower(1) == 128, "first bounds", 0);
+    for(i = 1; i < LIFE_HIST_BUCKETS; i++) {
+        uint64_t lo = life_hist_lower(i);
+
+        expect(i == 1 || lo == 2 * life_hist_lower(i - 1), "doubling bounds", i);
+        expect(life_hist_index(lo - 1) == i - 1 && life_hist_index(lo) == i, "boundary", lo);
+        check_index(lo - 1);
+        check_index(lo);
+        check_index(lo + 1);
+    }
+    expect(life_hist_index(0) == 0 && life_hist_index(127) == 0, "under 128 ns", 127);
+    expect(life_hist_index(UINT64_MAX) == LIFE_HIST_BUCKETS - 1 &&
+           life_hist_index(1000 * life_hist_lower(LIFE_HIST_BUCKETS - 1)) == LIFE_HIST_BUCKETS - 1,
+           "last bucket open", UINT64_MAX);
+    for(i = 0; i < NUM_RANDOM; i++) {
+        lifetimes[i] = random_lifetime();
+        check_index(lifetimes[i]);
+    }
+
+    /* Hand-built: interpolated within the bucket */
+    expect(life_hist_quantile(&hist, 0.5) == 0 && life_hist_total(&hist) == 0, "empty", 0);
+    hist.count[3] = 10;   /* 512 - 1024 ns */
+    expect(life_hist_quantile(&hist, 0.5) == 768, "middle of one bucket",
+           life_hist_quantile(&hist, 0.5));
+    expect(life_hist_quantile(&hist, 1.0) == 1024, "top of one bucket",
+           life_hist_quantile(&hist, 1.0));
+    memset(&hist, 0, sizeof(hist));
+    hist.count[0] = 50;   /* 0 - 128 ns */
+    hist.count[5] = 50;   /* 2048 - 4096 ns */
+    expect(life_hist_total(&hist) == 100, "total", life_hist_total(&hist));
+    expect(life_hist_quantile(&hist, 0.25) == 64, "first quartile",
+           life_hist_quantile(&hist, 0.25));
+    expect(life_hist_quantile(&hist, 0.5) == 128, "median", life_hist_quantile(&hist, 0.5));
+    expect(life_hist_quantile(&hist, 0.75) == 3072, "third quartile",
+           life_hist_quantile(&hist, 0.75));
+    memset(&hist, 0, sizeof(hist));
+    hist.count[LIFE_HIST_BUCKETS - 1] = 5;
+    expect(life_hist_quantile(&hist, 0.5) == life_hist_lower(LIFE_HIST_BUCKETS - 1),
+           "open bucket", life_hist_quantile(&hist, 0.5));
+
+    /* Random: within the bucket of the true quantile, and non-decreasing */
+    memset(&hist, 0, sizeof(hist));
+    for(i = 0; i < NUM_RANDOM; i++) {
+        hist.count[life_hist_index(lifetimes[i])]++;
+    }
+    expect(life_hist_total(&hist) == NUM_RANDOM, "random total", life_hist_total(&hist));
+    qsort(lifetimes, NUM_RANDOM, sizeof(lifetimes[0]), by_value);
+    for(i = 0; i < (int)(sizeof(qs) / sizeof(qs[0])); i++) {
+        uint64_t exact = lifetimes[(int)(qs[i] * NUM_RANDOM) - 1];
+        uint64_t q = life_hist_quantile(&hist, qs[i]);
+        int      b = life_hist_index(exact);
+
+        expect(q >= life_hist_lower(b) && (b == LIFE_HIST_BUCKETS - 1 || q <= life_hist_lower(b + 1)),
+               "quantile in the bucket of the exact one", exact);
+        expect(q >= prev, "quantiles non-decreasing", q);
+        prev = q;
+    }
+
+    printf("%d buckets, index checked at every boundary and %d random lifetimes\n",
+           LIFE_HIST_BUCKETS, NUM_RANDOM);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
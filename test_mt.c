@@ -238,11 +238,6 @@ int main()
     }
     sleep(5);
 
-	/* call print stats once before the test ends 
-		Note: free(NULL) is safe and ignored as per C standard
-	*/
-	free(NULL);
-
     return 0;
 }
 
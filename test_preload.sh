@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# MIT License
+#
+# Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+# Preloads memprofiler.so into hosts that define symbols with the same
+# names as the profiler's internal helpers (bash has its own hash_insert),
+# and checks that the library exports nothing but the hooks
+
+so=${0%/*}/memprofiler.so
+
+extra=$(nm -D --defined-only "$so" | awk '{ print $3 }' |
+        grep -v -x -e malloc -e calloc -e realloc -e reallocarray -e free \
+                   -e posix_memalign -e aligned_alloc -e memalign -e valloc \
+                   -e pvalloc -e malloc_usable_size -e pthread_setname_np \
+                   -e '_Zn[wa]m.*' -e '_Zd[la]Pv.*')
+if [ -n "$extra" ]; then
+    echo "test_preload: FAIL, internal symbols exported:" $extra
+    exit 1
+fi
+
+for mode in table header; do
+    out=$(MEMPROF_MODE=$mode MEMPROF_INTERVAL=0 LD_PRELOAD="$so" bash -c 'echo hi' 2>/dev/null)
+    if [ "$out" != "hi" ]; then
+        echo "test_preload: FAIL, bash under MEMPROF_MODE=$mode"
+        exit 1
+    fi
+done
+echo "test_preload: bash runs in table and header mode, only the hooks are exported"
+echo "test_preload: PASS"
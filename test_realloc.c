@@ -0,0 +1,296 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "shm_stats_format.h"
+
+/* Realloc under memprofiler.so, run again in child processes under the
+ * profiler:
+ * - stress: table mode with a single arena and no tcache, so an address a
+ *   realloc moved away from is at once handed to a malloc of another
+ *   thread, while the realloc still has to re-key its record.
+ * - totals: in each tracking mode, the overall allocated bytes in the stats
+ *   segment grow by what the mallocs asked for plus what the reallocs grew
+ *   the blocks by, sampled or not: exactly without sampling, and short by
+ *   at most the allocator's slack of the unsampled blocks with it. */
+
+#define NUM_THREADS   8
+#define NUM_SLOTS     64
+#define NUM_OPS       200000
+#define NUM_RUNS      3
+
+#define NUM_BLOCKS    2000
+#define NUM_RESIZES   4
+#define SHM_INTERVAL_MS "20"
+
+/* An unsampled block has no record, its realloc's growth is taken from
+ * its usable size: glibc leaves less than 48 bytes of slack in a block
+ * below the mmap threshold */
+#define MAX_SIZE      20000
+#define MAX_SLACK     48
+
+static const char *const modes[][2] = {
+    {"table",  "0"},
+    {"header", "0"},
+    {"table",  "4096"},
+    {"header", "4096"},
+};
+
+static void *blocks[NUM_BLOCKS];
+static size_t block_sizes[NUM_BLOCKS];
+
+static uint64_t next_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/* Each thread mallocs, reallocs and frees blocks of its own, checking
+ * that a realloc kept the contents */
+static void* stress_thread(void *arg)
+{
+    uint64_t  rng = 0x9e3779b97f4a7c15ULL * ((uintptr_t)arg + 1);
+    char     *slots[NUM_SLOTS] = {NULL};
+    size_t    sizes[NUM_SLOTS] = {0};
+    long      op;
+    int       i;
+
+    for(op = 0; op < NUM_OPS; op++) {
+        uint64_t  r = next_rand(&rng);
+        size_t    size = 16 + (r >> 16) % 2048;
+        char     *p = NULL;
+
+        i = r % NUM_SLOTS;
+        if(!slots[i]) {
+            slots[i] = malloc(size);
+            sizes[i] = size;
+            memset(slots[i], (char)i, size);
+        }
+        else if((r >> 8) & 1) {
+            p = realloc(slots[i], size);
+            if(!p || p[0] != (char)i || p[(size < sizes[i] ? size : sizes[i]) - 1] != (char)i) {
+                printf("FAIL: realloc lost the contents of a block\n");
+                exit(1);
+            }
+            memset(p, (char)i, size);
+            slots[i] = p;
+            sizes[i] = size;
+        }
+        else {
+            free(slots[i]);
+            slots[i] = NULL;
+        }
+    }
+    for(i = 0; i < NUM_SLOTS; i++) {
+        free(slots[i]);
+    }
+    return NULL;
+}
+
+static int run_stress(void)
+{
+    pthread_t  threads[NUM_THREADS];
+    long       i;
+
+    for(i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, stress_thread, (void*)i);
+    }
+    for(i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
+}
+
+static int read_segment(shm_stats_t *out)
+{
+    char          path[64];
+    shm_stats_t  *seg = NULL;
+    int           fd = -1;
+    int           ret = -1;
+
+    snprintf(path, sizeof(path), "%s/%s%d", SHM_STATS_DIR, SHM_STATS_PREFIX, (int)getpid());
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+    seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(seg == MAP_FAILED) {
+        return -1;
+    }
+    ret = shm_stats_read(seg, out, 1000);
+    munmap(seg, sizeof(*seg));
+    return ret;
+}
+
+/* Overall allocated bytes, once the segment has been updated after the
+ * call */
+static int read_alloc_sz(int64_t *alloc_sz)
+{
+    static shm_stats_t  snap;
+    uint64_t            since = 0;
+    int                 tries = 0;
+
+    if(read_segment(&snap) != 0) {
+        return -1;
+    }
+    since = snap.update_ns;
+    for(tries = 0; tries < 200; tries++) {
+        usleep(10000);
+        if(read_segment(&snap) != 0) {
+            return -1;
+        }
+        if(snap.update_ns != since) {
+            *alloc_sz = snap.alloc_sz;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int run_totals(void)
+{
+    uint64_t  rng = 0x2545f4914f6cdd1dULL;
+    int64_t   base = 0;
+    int64_t   total = 0;
+    int64_t   expected = 0;
+    int       i, j;
+
+    if(read_alloc_sz(&base) != 0) {
+        printf("FAIL: no stats segment\n");
+        return 1;
+    }
+    for(i = 0; i < NUM_BLOCKS; i++) {
+        uint64_t r = next_rand(&rng);
+
+        block_sizes[i] = 1 + r % MAX_SIZE;
+        /* Some aligned blocks, which a header does not start */
+        blocks[i] = (r >> 32) % 4 ? malloc(block_sizes[i]) : memalign(64, block_sizes[i]);
+        expected += block_sizes[i];
+    }
+    for(j = 0; j < NUM_RESIZES; j++) {
+        for(i = 0; i < NUM_BLOCKS; i++) {
+            size_t size = 1 + next_rand(&rng) % MAX_SIZE;
+
+            blocks[i] = realloc(blocks[i], size);
+            if(size > block_sizes[i]) {
+                expected += size - block_sizes[i];
+            }
+            block_sizes[i] = size;
+        }
+    }
+    for(i = 0; i < NUM_BLOCKS; i++) {
+        free(blocks[i]);
+    }
+    if(read_alloc_sz(&total) != 0) {
+        printf("FAIL: no stats segment\n");
+        return 1;
+    }
+    /* Only unsampled reallocs may fall short, by the slack */
+    if(total - base > expected ||
+       total - base < expected - (strcmp(getenv("MEMPROF_SAMPLE_INTERVAL"), "0") ?
+                                  (int64_t)MAX_SLACK * NUM_BLOCKS * NUM_RESIZES : 0)) {
+        printf("FAIL: %s mode, sampling %s: %lld bytes allocated, expected %lld\n",
+               getenv("MEMPROF_MODE"), getenv("MEMPROF_SAMPLE_INTERVAL"),
+               (long long)(total - base), (long long)expected);
+        return 1;
+    }
+    return 0;
+}
+
+/* Runs what in a child under the profiler, 0 if it exited cleanly */
+static int run_child(char *argv0, const char *what, const char *mode, const char *sample)
+{
+    char  *args[] = {argv0, (char*)what, NULL};
+    pid_t  pid = 0;
+    int    status = 0;
+
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0) {
+        setenv("LD_PRELOAD", "./memprofiler.so", 1);
+        setenv("MEMPROF_MODE", mode, 1);
+        setenv("MEMPROF_SAMPLE_INTERVAL", sample, 1);
+        setenv("MEMPROF_INTERVAL", "0", 1);
+        setenv("MEMPROF_REPORT_FILE", "/dev/null", 1);
+        if(strcmp(what, "stress") == 0) {
+            setenv("GLIBC_TUNABLES", "glibc.malloc.tcache_count=0:glibc.malloc.arena_max=1", 1);
+        }
+        else {
+            setenv("MEMPROF_SHM", SHM_INTERVAL_MS, 1);
+        }
+        execv("/proc/self/exe", args);
+        _exit(127);
+    }
+    if(pid < 0 || waitpid(pid, &status, 0) != pid) {
+        return -1;
+    }
+    if(WIFSIGNALED(status)) {
+        printf("%s: killed by signal %d\n", what, WTERMSIG(status));
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int failed = 0;
+    int i;
+
+    if(argc > 1 && strcmp(argv[1], "stress") == 0) {
+        return run_stress();
+    }
+    if(argc > 1 && strcmp(argv[1], "totals") == 0) {
+        return run_totals();
+    }
+
+    for(i = 0; i < NUM_RUNS && !failed; i++) {
+        failed = run_child(argv[0], "stress", "table", "0") != 0;
+    }
+    printf("stress: %d threads, %d runs of %d malloc, realloc and free calls each\n",
+           NUM_THREADS, NUM_RUNS, NUM_OPS);
+    for(i = 0; i < (int)(sizeof(modes) / sizeof(modes[0])); i++) {
+        if(run_child(argv[0], "totals", modes[i][0], modes[i][1]) != 0) {
+            failed = 1;
+        }
+    }
+    printf("totals: %d blocks reallocated %d times in table and header mode, sampled or not\n",
+           NUM_BLOCKS, NUM_RESIZES);
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
@@ -0,0 +1,458 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "report_buf.h"
+
+/* Checks the report formatting. rbuf_printf against snprintf on the
+ * conversions the reports use, JSON string escapes and truncation; then
+ * runs itself under ./memprofiler.so once per MEMPROF_REPORT_FORMAT and
+ * checks that the exit report is valid text, JSON or Prometheus
+ * exposition format. The child names its thread with a quote and a
+ * backslash, which both the JSON and the Prometheus output must escape. */
+
+#define REPORT_PATH  "test_report_buf.out"
+#define NUM_BLOCKS   1000
+
+static long errors = 0;
+
+static void expect(int ok, const char *what, const char *detail)
+{
+    if(!ok && errors++ < 20) {
+        printf("FAIL: %s: %s\n", what, detail);
+    }
+}
+
+#define CHECK_FMT(...) do {                                             \
+        char   want[256];                                               \
+        char   got[256];                                                \
+        rbuf_t rb;                                                      \
+                                                                        \
+        snprintf(want, sizeof(want), __VA_ARGS__);                      \
+        rbuf_init(&rb, got, sizeof(got) - 1);                           \
+        rbuf_printf(&rb, __VA_ARGS__);                                  \
+        got[rb.len] = '\0';                                             \
+        expect(strcmp(want, got) == 0, #__VA_ARGS__, got);              \
+        num_checks++;                                                   \
+    } while(0)
+
+static int check_printf(void)
+{
+    int num_checks = 0;
+
+    CHECK_FMT("plain text, no conversion");
+    CHECK_FMT("%d %i %d %d", 0, -1, 2147483647, -2147483647 - 1);
+    CHECK_FMT("%lld %lld %lld", 0LL, 9223372036854775807LL, -9223372036854775807LL - 1);
+    CHECK_FMT("%ld %lu %zu %zd", -42L, 42UL, (size_t)-1, (ssize_t)-5);
+    CHECK_FMT("%u %x %X %o", 4000000000U, 0xdeadbeefU, 0xdeadbeefU, 0777U);
+    CHECK_FMT("%llx %#llx %#x %#o %#o", 0xffffffffffffffffULL, 0x1ULL, 0U, 8U, 0U);
+    CHECK_FMT("[%5d] [%-5d] [%05d] [%+d] [% d] [%+05d]", 42, 42, -42, 42, 42, -42);
+    CHECK_FMT("[%.3d] [%8.3d] [%.0d] [%-8.3x]", 7, -7, 0, 0xaU);
+    CHECK_FMT("[%*d] [%-*d] [%.*d] [%*d]", 6, 1, 6, 1, 4, 1, -6, 1);
+    CHECK_FMT("[%s] [%10s] [%-10s] [%.2s] [%c] [%3c] %%", "abc", "abc", "abc", "abc", 'x', 'y');
+    CHECK_FMT("%p %p", (void*)0x7fff12345678, (void*)0x10);
+    CHECK_FMT("%f %f %f %f", 0.0, 1.5, -2.25, 123456.125);
+    CHECK_FMT("%.0f %.1f %.3f %.6f %.9f", 2.5, 0.05, 1.0005, 1e-7, 3.141592653);
+    CHECK_FMT("[%10.2f] [%-10.2f] [%010.2f] [%+.2f]", 3.14159, 3.14159, -3.14159, 3.14159);
+    CHECK_FMT("%g %g %g %g %g", 0.0, 1.0, 0.5, 100000.0, 1000000.0);
+    CHECK_FMT("%g %g %g %g", 1e-4, 1e-5, 123456789.0, 0.000123456);
+    CHECK_FMT("%g %g %g %g", 1.5e300, 2.0e-300, 999999.5, 9.9999996);
+    CHECK_FMT("%.3g %.9g %.1g %g", 1234.5678, 1.0 / 3, 0.96, -42.125);
+    CHECK_FMT("%g %g %f %g", 1e19, 1.0 / 0.0, -1.0 / 0.0, __builtin_nan(""));
+    printf("printf: %d formats\n", num_checks);
+    return errors ? -1 : 0;
+}
+
+static int check_json_str(void)
+{
+    char    out[64];
+    rbuf_t  rb;
+
+    rbuf_init(&rb, out, sizeof(out) - 1);
+    rbuf_json_str(&rb, "a\"b\\c\nd\x01/e");
+    out[rb.len] = '\0';
+    expect(strcmp(out, "\"a\\\"b\\\\c\\u000ad\\u0001/e\"") == 0, "json string", out);
+
+    /* Output that does not fit is dropped, never written past the end */
+    memset(out, '#', sizeof(out));
+    rbuf_init(&rb, out, 8);
+    rbuf_printf(&rb, "%s %d", "0123456", 12345);
+    expect(rb.truncated && rb.len == 8 && out[8] == '#', "truncation", "");
+    rbuf_init(&rb, out, 8);
+    rbuf_puts(&rb, "01234567");
+    expect(!rb.truncated && rb.len == 8, "exact fit", "");
+    printf("json strings and truncation checked\n");
+    return errors ? -1 : 0;
+}
+
+/* Minimal JSON validator: returns the end of the value at p, or NULL */
+static const char* json_value(const char *p);
+
+static const char* json_ws(const char *p)
+{
+    while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+        p++;
+    }
+    return p;
+}
+
+static const char* json_string(const char *p)
+{
+    if(*p++ != '"') {
+        return NULL;
+    }
+    while(*p != '"') {
+        if((unsigned char)*p < 0x20) {
+            return NULL;
+        }
+        if(*p == '\\') {
+            p++;
+            if(*p == 'u') {
+                int i;
+
+                for(i = 1; i <= 4; i++) {
+                    if(!isxdigit((unsigned char)p[i])) {
+                        return NULL;
+                    }
+                }
+                p += 4;
+            }
+            else if(!strchr("\"\\/bfnrt", *p) || !*p) {
+                return NULL;
+            }
+        }
+        p++;
+    }
+    return p + 1;
+}
+
+static const char* json_number(const char *p)
+{
+    if(*p == '-') {
+        p++;
+    }
+    if(*p == '0') {
+        p++;
+    }
+    else if(isdigit((unsigned char)*p)) {
+        while(isdigit((unsigned char)*p)) {
+            p++;
+        }
+    }
+    else {
+        return NULL;
+    }
+    if(*p == '.') {
+        if(!isdigit((unsigned char)*++p)) {
+            return NULL;
+        }
+        while(isdigit((unsigned char)*p)) {
+            p++;
+        }
+    }
+    if(*p == 'e' || *p == 'E') {
+        p++;
+        if(*p == '+' || *p == '-') {
+            p++;
+        }
+        if(!isdigit((unsigned char)*p)) {
+            return NULL;
+        }
+        while(isdigit((unsigned char)*p)) {
+            p++;
+        }
+    }
+    return p;
+}
+
+/* Object members or array elements up to the closing char */
+static const char* json_items(const char *p, char close, int members)
+{
+    p = json_ws(p);
+    if(*p == close) {
+        return p + 1;
+    }
+    for(;;) {
+        if(members) {
+            if(!(p = json_string(json_ws(p)))) {
+                return NULL;
+            }
+            p = json_ws(p);
+            if(*p++ != ':') {
+                return NULL;
+            }
+        }
+        if(!(p = json_value(p))) {
+            return NULL;
+        }
+        p = json_ws(p);
+        if(*p == close) {
+            return p + 1;
+        }
+        if(*p++ != ',') {
+            return NULL;
+        }
+    }
+}
+
+static const char* json_value(const char *p)
+{
+    p = json_ws(p);
+    switch(*p) {
+    case '{':
+        return json_items(p + 1, '}', 1);
+    case '[':
+        return json_items(p + 1, ']', 0);
+    case '"':
+        return json_string(p);
+    case 't':
+        return strncmp(p, "true", 4) == 0 ? p + 4 : NULL;
+    case 'f':
+        return strncmp(p, "false", 5) == 0 ? p + 5 : NULL;
+    case 'n':
+        return strncmp(p, "null", 4) == 0 ? p + 4 : NULL;
+    default:
+        return json_number(p);
+    }
+}
+
+static int prom_name_char(char c, int first)
+{
+    return isalpha((unsigned char)c) || c == '_' || c == ':' ||
+           (!first && isdigit((unsigned char)c));
+}
+
+/* Whether a sample named name belongs to a family declared in types */
+static int prom_declared(const char *types, const char *name, size_t len)
+{
+    static const char *suffixes[] = {"", "_bucket", "_sum", "_count"};
+    char               family[256];
+    size_t             i;
+
+    for(i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        size_t slen = strlen(suffixes[i]);
+
+        if(len <= slen || len - slen >= sizeof(family) - 2 ||
+           strncmp(name + len - slen, suffixes[i], slen) != 0) {
+            continue;
+        }
+        family[0] = '\n';
+        memcpy(family + 1, name, len - slen);
+        family[len - slen + 1] = ' ';
+        family[len - slen + 2] = '\0';
+        if(strstr(types, family)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* One sample line: name{label="value",...} value */
+static int prom_sample(const char *line, const char *types)
+{
+    const char *p = line;
+    char       *end = NULL;
+
+    if(!prom_name_char(*p, 1)) {
+        return 0;
+    }
+    while(prom_name_char(*p, 0)) {
+        p++;
+    }
+    if(!prom_declared(types, line, p - line)) {
+        return 0;
+    }
+    if(*p == '{') {
+        p++;
+        while(*p != '}') {
+            if(!prom_name_char(*p, 1)) {
+                return 0;
+            }
+            while(prom_name_char(*p, 0)) {
+                p++;
+            }
+            if(*p++ != '=' || *p++ != '"') {
+                return 0;
+            }
+            while(*p != '"') {
+                if(!*p || *p == '\n') {
+                    return 0;
+                }
+                if(*p == '\\' && !strchr("\\\"n", *++p)) {
+                    return 0;
+                }
+                p++;
+            }
+            p++;
+            if(*p == ',') {
+                p++;
+            }
+        }
+        p++;
+    }
+    if(*p++ != ' ') {
+        return 0;
+    }
+    strtod(p, &end);
+    return end != p && *end == '\0';
+}
+
+static int check_prom(char *text)
+{
+    static char  types[1 << 16];
+    char        *line = NULL;
+    char        *save = NULL;
+    size_t       len = 1;
+    int          samples = 0;
+
+    strcpy(types, "\n");
+    for(line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        if(strncmp(line, "# TYPE ", 7) == 0) {
+            len += snprintf(types + len, sizeof(types) - len, "%s\n", line + 7);
+            if(len >= sizeof(types)) {
+                return -1;
+            }
+        }
+        else if(strncmp(line, "# HELP ", 7) != 0) {
+            expect(prom_sample(line, types), "prometheus line", line);
+            samples++;
+        }
+    }
+    return samples;
+}
+
+static char* read_file(const char *path)
+{
+    static char  buf[4 << 20];
+    FILE        *f = fopen(path, "r");
+    size_t       n = 0;
+
+    if(!f) {
+        return NULL;
+    }
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    return buf;
+}
+
+/* The child: a few features on, a strangely named thread, a live set */
+static int child_main(void)
+{
+    static void *blocks[NUM_BLOCKS];
+    int          i;
+
+    pthread_setname_np(pthread_self(), "we\"ird\\name");
+    for(i = 0; i < NUM_BLOCKS; i++) {
+        blocks[i] = malloc(100 + i);
+    }
+    for(i = 0; i < NUM_BLOCKS; i += 2) {
+        free(blocks[i]);
+    }
+    return 0;
+}
+
+static int run_child(char *argv0, const char *format)
+{
+    char  *args[] = {argv0, "child", NULL};
+    pid_t  pid = fork();
+    int    status = 0;
+
+    if(pid == 0) {
+        setenv("LD_PRELOAD", "./memprofiler.so", 1);
+        setenv("MEMPROF_REPORT_FORMAT", format, 1);
+        setenv("MEMPROF_REPORT_FILE", REPORT_PATH, 1);
+        setenv("MEMPROF_INTERVAL", "0", 1);
+        setenv("MEMPROF_STACK_DEPTH", "8", 1);
+        setenv("MEMPROF_LEAK_CHECK", "1", 1);
+        setenv("MEMPROF_HEAP_STATS", "1", 1);
+        execv("/proc/self/exe", args);
+        _exit(127);
+    }
+    if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+       WEXITSTATUS(status) != 0) {
+        expect(0, "child", format);
+        return -1;
+    }
+    return 0;
+}
+
+static int check_reports(char *argv0)
+{
+    char *text = NULL;
+    char *line = NULL;
+    char *save = NULL;
+    int   lines = 0;
+    int   samples = 0;
+
+    unlink(REPORT_PATH);
+    if(run_child(argv0, "text") == 0 && (text = read_file(REPORT_PATH))) {
+        expect(strstr(text, "Current Stats:") && strstr(text, "Leak check:"), "text report",
+               "sections missing");
+    }
+    unlink(REPORT_PATH);
+    if(run_child(argv0, "json") == 0 && (text = read_file(REPORT_PATH))) {
+        for(line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+            const char *end = json_value(line);
+
+            expect(end && *json_ws(end) == '\0', "json report", line);
+            expect(strstr(line, "we\\\"ird\\\\name") != NULL, "json thread name", line);
+            lines++;
+        }
+    }
+    unlink(REPORT_PATH);
+    if(run_child(argv0, "prom") == 0 && (text = read_file(REPORT_PATH))) {
+        expect(strstr(text, "thread=\"we\\\"ird\\\\name\"") != NULL, "prometheus thread name",
+               "not escaped");
+        samples = check_prom(text);
+    }
+    unlink(REPORT_PATH);
+
+    expect(lines > 0, "json report", "empty");
+    expect(samples > 0, "prometheus report", "empty");
+    printf("reports: text, %d json lines, %d prometheus samples\n", lines, samples);
+    return errors ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int failed = 0;
+
+    if(argc > 1 && strcmp(argv[1], "child") == 0) {
+        return child_main();
+    }
+    if(check_printf() != 0 || check_json_str() != 0 || check_reports(argv[0]) != 0) {
+        failed = 1;
+    }
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
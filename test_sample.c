@@ -0,0 +1,167 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include "shm_stats_format.h"
+#include "size_hist.h"
+
+/* Checks that the live counts estimated under sampling converge on the
+ * real ones. Runs itself again under ./memprofiler.so with sampling and
+ * the stats segment on, holds NUM_BLOCKS blocks of each size and compares
+ * what the segment shows for their size bucket. The sizes give weights
+ * with fractions all over the place, where rounding each block's weight
+ * would be off by -14% to +25%. */
+
+#define SAMPLE_INTERVAL  "1024"
+#define SHM_INTERVAL_MS  "20"
+#define NUM_BLOCKS       50000
+#define TOLERANCE        0.04    /* about 3 standard deviations at 128 bytes */
+
+static const size_t sizes[] = {128, 1000, 2000};
+
+static void *blocks[NUM_BLOCKS];
+
+static int read_segment(shm_stats_t *out)
+{
+    char          path[64];
+    shm_stats_t  *seg = NULL;
+    int           fd = -1;
+    int           ret = -1;
+
+    snprintf(path, sizeof(path), "%s/%s%d", SHM_STATS_DIR, SHM_STATS_PREFIX, (int)getpid());
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+    seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(seg == MAP_FAILED) {
+        return -1;
+    }
+    ret = shm_stats_read(seg, out, 1000);
+    munmap(seg, sizeof(*seg));
+    return ret;
+}
+
+/* Live count and bytes of the bucket of size, once the segment has been
+ * updated after the call */
+static int read_bucket(size_t size, int64_t *count, int64_t *bytes)
+{
+    static shm_stats_t  snap;
+    uint64_t            since = 0;
+    int                 i = size_hist_index(size);
+    int                 tries = 0;
+
+    if(read_segment(&snap) != 0) {
+        return -1;
+    }
+    since = snap.update_ns;
+    for(tries = 0; tries < 200; tries++) {
+        usleep(10000);
+        if(read_segment(&snap) != 0) {
+            return -1;
+        }
+        if(snap.update_ns != since) {
+            *count = snap.size_count[i];
+            *bytes = snap.size_bytes[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int check_size(size_t size)
+{
+    int64_t  base_count, base_bytes;
+    int64_t  count, bytes;
+    int64_t  end_count, end_bytes;
+    double   count_err, bytes_err;
+    int      i;
+
+    if(read_bucket(size, &base_count, &base_bytes) != 0) {
+        printf("FAIL: no stats segment\n");
+        return -1;
+    }
+    for(i = 0; i < NUM_BLOCKS; i++) {
+        blocks[i] = malloc(size);
+    }
+    if(read_bucket(size, &count, &bytes) != 0) {
+        printf("FAIL: no stats segment\n");
+        return -1;
+    }
+    for(i = 0; i < NUM_BLOCKS; i++) {
+        free(blocks[i]);
+    }
+    if(read_bucket(size, &end_count, &end_bytes) != 0) {
+        printf("FAIL: no stats segment\n");
+        return -1;
+    }
+
+    count_err = (double)(count - base_count) / NUM_BLOCKS - 1;
+    bytes_err = (double)(bytes - base_bytes) / ((double)NUM_BLOCKS * size) - 1;
+    printf("size %zu: count %+.2f%% bytes %+.2f%%\n", size, 100 * count_err, 100 * bytes_err);
+    if(fabs(count_err) > TOLERANCE || fabs(bytes_err) > TOLERANCE) {
+        printf("FAIL: estimate off by more than %.0f%%\n", 100 * TOLERANCE);
+        return -1;
+    }
+    /* Every free takes back exactly what its allocation added */
+    if(end_count != base_count || end_bytes != base_bytes) {
+        printf("FAIL: %lld blocks, %lld bytes left after freeing\n",
+               (long long)(end_count - base_count), (long long)(end_bytes - base_bytes));
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int failed = 0;
+    int i;
+
+    if(!getenv("MEMPROF_SHM")) {
+        setenv("LD_PRELOAD", "./memprofiler.so", 1);
+        setenv("MEMPROF_SAMPLE_INTERVAL", SAMPLE_INTERVAL, 1);
+        setenv("MEMPROF_SHM", SHM_INTERVAL_MS, 1);
+        setenv("MEMPROF_INTERVAL", "0", 1);
+        setenv("MEMPROF_REPORT_FILE", "/dev/null", 1);
+        execv("/proc/self/exe", argv);
+        perror("execv");
+        return 1;
+    }
+
+    for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        if(check_size(sizes[i]) != 0) {
+            failed = 1;
+        }
+    }
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
@@ -0,0 +1,202 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "shm_stats.h"
+
+/* Checks the stats segment seqlock. A writer thread publishes snapshots
+ * whose every counter holds the same value, the number of the update,
+ * while reader threads map the segment like an external monitor would
+ * and check that no copy they get mixes two updates and that updates
+ * never go back. Then that a fork() child publishes into a segment of
+ * its own, and that close removes the segment. */
+
+#define NUM_UPDATES  200000
+#define NUM_READERS  3
+
+static shm_stats_t  snaps[2];
+static int          done = 0;
+static long         errors = 0;
+
+static void expect(int ok, const char *what, long long v)
+{
+    if(!ok && __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED) <= 10) {
+        printf("FAIL: %s, at %lld\n", what, v);
+    }
+}
+
+/* Every counter of the body, from num_alloc on, set to v */
+static void fill(shm_stats_t *snap, int64_t v)
+{
+    int64_t *ctr = &snap->num_alloc;
+    int64_t *end = (int64_t*)(snap + 1);
+
+    while(ctr < end) {
+        *ctr++ = v;
+    }
+}
+
+/* -1 if the counters of the body differ, else their value */
+static int64_t uniform(const shm_stats_t *snap)
+{
+    const int64_t *ctr = &snap->num_alloc;
+    const int64_t *end = (const int64_t*)(snap + 1);
+    int64_t        v = *ctr;
+
+    while(ctr < end) {
+        if(*ctr++ != v) {
+            return -1;
+        }
+    }
+    return v;
+}
+
+static shm_stats_t* map_segment(pid_t pid)
+{
+    char         path[64];
+    shm_stats_t *seg = NULL;
+    int          fd = -1;
+
+    snprintf(path, sizeof(path), "%s/%s%d", SHM_STATS_DIR, SHM_STATS_PREFIX, (int)pid);
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return seg == MAP_FAILED ? NULL : seg;
+}
+
+static void* writer(void *arg)
+{
+    int64_t i;
+
+    for(i = 1; i <= NUM_UPDATES; i++) {
+        fill(&snaps[i & 1], i);
+        shm_stats_publish(&snaps[i & 1]);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void* reader(void *arg)
+{
+    static __thread shm_stats_t  snap;
+    shm_stats_t                 *seg = map_segment(getpid());
+    int64_t                      last = 0;
+    uint64_t                     last_seq = 0;
+    long                         reads = 0;
+
+    expect(seg != NULL, "map the segment", 0);
+    while(seg && !__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        int64_t v = 0;
+
+        if(shm_stats_read(seg, &snap, 1000) != 0) {
+            continue;
+        }
+        v = uniform(&snap);
+        expect(v >= 0, "a copy mixes two updates", snap.seq);
+        expect(v >= last && snap.seq >= last_seq && !(snap.seq & 1), "updates go back", v);
+        expect(v == 0 || snap.seq == 2 * (uint64_t)v, "seq of the update", v);
+        last = v > last ? v : last;
+        last_seq = snap.seq;
+        reads++;
+    }
+    if(seg) {
+        munmap(seg, sizeof(*seg));
+    }
+    return (void*)reads;
+}
+
+int main(void)
+{
+    pthread_t     readers[NUM_READERS];
+    pthread_t     wr;
+    shm_stats_t  *seg = NULL;
+    struct stat   st;
+    char          path[64];
+    long          reads = 0;
+    pid_t         pid = 0;
+    int           status = 1;
+    int           i;
+
+    if(shm_stats_open(100) != 0) {
+        printf("FAIL: could not create the segment\n");
+        return 1;
+    }
+    seg = map_segment(getpid());
+    expect(seg && memcmp(seg->magic, SHM_STATS_MAGIC, sizeof(seg->magic)) == 0 &&
+           seg->version == SHM_STATS_VERSION && seg->size == sizeof(shm_stats_t) &&
+           seg->pid == (uint32_t)getpid() && seg->interval_ms == 100 &&
+           strncmp(seg->cmd, "test_shm_stats", sizeof(seg->cmd)) == 0, "segment header", 0);
+
+    for(i = 0; i < NUM_READERS; i++) {
+        pthread_create(&readers[i], NULL, reader, NULL);
+    }
+    pthread_create(&wr, NULL, writer, NULL);
+    pthread_join(wr, NULL);
+    for(i = 0; i < NUM_READERS; i++) {
+        void *ret = NULL;
+
+        pthread_join(readers[i], &ret);
+        reads += (long)ret;
+    }
+    expect(seg && uniform(seg) == NUM_UPDATES && seg->seq == 2 * NUM_UPDATES, "last update", 0);
+
+    /* The child publishes into its own segment, the parent's stays */
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0) {
+        shm_stats_t *own = NULL;
+
+        shm_stats_fork_child();
+        fill(&snaps[0], 7);
+        shm_stats_publish(&snaps[0]);
+        own = map_segment(getpid());
+        status = own && own->pid == (uint32_t)getpid() && uniform(own) == 7 ? 0 : 1;
+        shm_stats_close();
+        _exit(status);
+    }
+    expect(pid > 0 && waitpid(pid, &status, 0) == pid && status == 0, "fork child segment", pid);
+    expect(seg && uniform(seg) == NUM_UPDATES, "parent segment after fork", 0);
+    snprintf(path, sizeof(path), "%s/%s%d", SHM_STATS_DIR, SHM_STATS_PREFIX, (int)pid);
+    expect(stat(path, &st) != 0, "child segment removed", pid);
+
+    shm_stats_close();
+    snprintf(path, sizeof(path), "%s/%s%d", SHM_STATS_DIR, SHM_STATS_PREFIX, (int)getpid());
+    expect(stat(path, &st) != 0, "segment removed", 0);
+
+    printf("%d updates, %ld consistent reads by %d readers\n", NUM_UPDATES, reads, NUM_READERS);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
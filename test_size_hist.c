@@ -0,0 +1,135 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "size_hist.h"
+
+/* Checks the log-linear size histogram: the bit-scan index against a
+ * reference that finds the power of two with a loop and the sub-bucket
+ * with a division, the bucket bounds on both sides of every boundary,
+ * the bucket widths, and that merged histograms keep exact totals. */
+
+#define NUM_RANDOM  10000000
+
+static long errors = 0;
+
+static void expect(int ok, const char *what, uint64_t v)
+{
+    if(!ok && errors++ < 10) {
+        printf("FAIL: %s, at %llu\n", what, (unsigned long long)v);
+    }
+}
+
+static int ref_index(size_t size)
+{
+    size_t pow = 1;
+    int    log = 0;
+
+    if(size < SIZE_HIST_SUB) {
+        return size;
+    }
+    if(size >= (size_t)1 << SIZE_HIST_MAX_BITS) {
+        return SIZE_HIST_BUCKETS - 1;
+    }
+    while(pow <= size / 2) {
+        pow *= 2;
+        log++;
+    }
+    return (log - SIZE_HIST_SUB_BITS + 1) * SIZE_HIST_SUB +
+           (int)((size - pow) / (pow / SIZE_HIST_SUB));
+}
+
+static uint64_t next_rand(void)
+{
+    static uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+int main(void)
+{
+    static size_hist_t  a;
+    static size_hist_t  b;
+    int64_t             count = 0;
+    int64_t             bytes = 0;
+    size_t              size;
+    long                n;
+    int                 i;
+
+    /* Every size up to 64K, then log-uniform random sizes up to 2^56 */
+    for(size = 0; size < 65536; size++) {
+        expect(size_hist_index(size) == ref_index(size), "index", size);
+    }
+    for(n = 0; n < NUM_RANDOM; n++) {
+        uint64_t r = next_rand();
+
+        size = (r >> 8) >> (r & 63);
+        size >>= (r >> 6) % 8;
+        expect(size_hist_index(size) == ref_index(size), "index", size);
+    }
+    expect(size_hist_index(((size_t)1 << SIZE_HIST_MAX_BITS) - 1) == SIZE_HIST_BUCKETS - 1,
+           "last bucket", SIZE_HIST_MAX_BITS);
+    expect(size_hist_index(SIZE_MAX) == SIZE_HIST_BUCKETS - 1, "last bucket", SIZE_MAX);
+
+    /* Bucket i holds [lower(i), lower(i + 1)), at most a quarter of its
+       lower bound wide once past the exact buckets */
+    expect(size_hist_lower(0) == 0, "lower", 0);
+    for(i = 1; i < SIZE_HIST_BUCKETS; i++) {
+        size_t lo = size_hist_lower(i);
+
+        expect(lo > size_hist_lower(i - 1), "increasing lower", i);
+        expect(size_hist_index(lo) == i, "index of lower", i);
+        expect(size_hist_index(lo - 1) == i - 1, "index below lower", i);
+        if(i >= 2 * SIZE_HIST_SUB) {
+            expect(lo - size_hist_lower(i - 1) <= size_hist_lower(i - 1) / SIZE_HIST_SUB,
+                   "bucket width", i - 1);
+        }
+    }
+
+    /* Merging adds bucket by bucket */
+    for(n = 0; n < 100000; n++) {
+        uint64_t r = next_rand();
+
+        size = (r >> 16) % (1 << 20);
+        size_hist_add(n & 1 ? &a : &b, size, 1, size);
+        count++;
+        bytes += size;
+    }
+    size_hist_merge(&a, &b);
+    for(i = 0; i < SIZE_HIST_BUCKETS; i++) {
+        count -= a.count[i];
+        bytes -= a.bytes[i];
+    }
+    expect(count == 0 && bytes == 0, "merged totals", 0);
+
+    printf("%d buckets, index checked on every size to 64K and %d random sizes\n",
+           SIZE_HIST_BUCKETS, NUM_RANDOM);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
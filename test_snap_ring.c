@@ -0,0 +1,179 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "snap_ring.h"
+
+/* Checks the snapshot ring: every retained snapshot rebuilds to the state
+ * it was taken from, and the growth between two is their difference. The
+ * ring is small, so old snapshots are folded into the base state all
+ * along. The states are generated, so any of them can be rebuilt for
+ * comparison. */
+
+#define RING_BYTES  (256 * 1024)
+#define NUM_SNAPS   300
+
+static snap_state_t  cur;       /* newest state added */
+static snap_state_t  ref;
+static snap_state_t  got;
+static long          errors = 0;
+
+static void expect(int ok, const char *what, long i)
+{
+    if(!ok && errors++ < 10) {
+        printf("FAIL: %s, at %ld\n", what, i);
+    }
+}
+
+static uint64_t mix(uint64_t x)
+{
+    /* MurmurHash3 64-bit finalizer */
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Number of cells step k changes: mostly few, now and then many */
+static int step_cells(int k)
+{
+    return k % 7 == 0 ? 3000 : 100;
+}
+
+/* Applies the changes of step k to state, both signs and all widths */
+static void apply_step(snap_state_t *state, int k)
+{
+    int c;
+
+    for(c = 0; c < step_cells(k); c++) {
+        uint64_t     r = mix((uint64_t)k << 32 | c);
+        snap_cell_t *cell = &state->cells[r % SNAP_CELLS];
+
+        cell->num += (int64_t)((r >> 40) & 0xff) - 128;
+        cell->bytes += (int64_t)((r >> 20) & 0xfffff) - 0x80000;
+        if(r % 101 == 0) {
+            cell->bytes += (int64_t)1 << 40;
+        }
+    }
+    state->time_ns = (uint64_t)k * 1000000;
+    state->total.num = k;
+    state->total.bytes = -7 * (int64_t)k;
+}
+
+static void build_state(snap_state_t *state, int k)
+{
+    int i;
+
+    memset(state, 0, sizeof(*state));
+    for(i = 1; i <= k; i++) {
+        apply_step(state, i);
+    }
+}
+
+static int same_cells(const snap_state_t *a, const snap_state_t *b)
+{
+    return memcmp(a->cells, b->cells, sizeof(a->cells)) == 0;
+}
+
+/* The growth from the oldest retained snapshot to the newest */
+static void check_diff(uint32_t oldest, uint32_t newest)
+{
+    int i;
+
+    build_state(&ref, oldest);
+    for(i = 0; i < SNAP_CELLS; i++) {
+        ref.cells[i].num = cur.cells[i].num - ref.cells[i].num;
+        ref.cells[i].bytes = cur.cells[i].bytes - ref.cells[i].bytes;
+    }
+    expect(snap_ring_diff(oldest, newest, &got) == 0, "diff", newest);
+    expect(same_cells(&got, &ref), "diff cells", newest);
+    expect(got.time_ns == (uint64_t)(newest - oldest) * 1000000, "diff time", newest);
+    expect(got.total.num == (int64_t)(newest - oldest), "diff total", newest);
+    expect(snap_ring_diff(newest, oldest, &got) != 0 || newest == oldest,
+           "diff backwards", newest);
+}
+
+static void check_list(uint32_t oldest, uint32_t newest)
+{
+    static snap_info_t  info[SNAP_RING_MAX];
+    int                 num = snap_ring_list(info, SNAP_RING_MAX);
+    int                 i;
+
+    expect(num == (int)(newest - oldest + 1), "list length", newest);
+    for(i = 0; i < num; i++) {
+        expect(info[i].seq == oldest + i && info[i].total.num == (int64_t)(oldest + i),
+               "list entry", info[i].seq);
+    }
+}
+
+int main(void)
+{
+    uint32_t  oldest = 0;
+    uint32_t  newest = 0;
+    int       k;
+
+    if(snap_ring_init(RING_BYTES) != 0) {
+        printf("FAIL: snap_ring_init\n");
+        return 1;
+    }
+    expect(snap_ring_bounds(&oldest, &newest) != 0, "bounds of an empty ring", 0);
+
+    for(k = 1; k <= NUM_SNAPS; k++) {
+        apply_step(&cur, k);
+        expect(snap_ring_add(&cur) == k, "add", k);
+        if(snap_ring_bounds(&oldest, &newest) != 0) {
+            expect(0, "bounds", k);
+            continue;
+        }
+        expect(newest == (uint32_t)k && oldest <= newest, "bounds", k);
+
+        /* The newest and the oldest rebuild, the one before is gone */
+        expect(snap_ring_get(newest, &got) == 0 && same_cells(&got, &cur) &&
+               got.time_ns == cur.time_ns && got.total.num == k, "newest", k);
+        build_state(&ref, oldest);
+        expect(snap_ring_get(oldest, &got) == 0 && same_cells(&got, &ref), "oldest", k);
+        expect(oldest == 1 || snap_ring_get(oldest - 1, &got) != 0, "evicted", k);
+        check_diff(oldest, newest);
+        check_list(oldest, newest);
+    }
+
+    expect(oldest > 1, "nothing folded into the base", 0);
+
+    /* A delta larger than the whole ring is refused, and leaves it alone */
+    memcpy(&ref, &cur, sizeof(ref));
+    for(k = 0; k < SNAP_CELLS; k++) {
+        ref.cells[k].num += 1;
+    }
+    expect(snap_ring_add(&ref) < 0, "oversized delta accepted", 0);
+    expect(snap_ring_get(newest, &got) == 0 && same_cells(&got, &cur), "after refusal", 0);
+
+    printf("%d snapshots in a %d KB ring, %u to %u retained at the end\n",
+           NUM_SNAPS, RING_BYTES / 1024, oldest, newest);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
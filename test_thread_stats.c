@@ -0,0 +1,177 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "thread_stats.h"
+
+/* Checks the counters kept per thread name. A pool of threads sharing a
+ * name counts allocations in their own slots, as the hooks do; half of
+ * them exit. Another thread frees part of the pool's blocks under its own
+ * name, then takes the pool's name. The pool must show up as one row,
+ * summing live and exited threads, with the frees taken off its live
+ * count, both while threads run and after all of them exited. */
+
+#define POOL_THREADS  6
+#define BLOCK_SIZE    32
+#define NUM_FREED     150
+#define NUM_RENAMED   7
+
+static pthread_barrier_t  running;   /* pool threads that stay, io and main */
+static pthread_barrier_t  checked;
+static uint8_t            pool_id = 0;
+static long               errors = 0;
+
+static void expect(int ok, const char *what, long v)
+{
+    if(!ok && errors++ < 10) {
+        printf("FAIL: %s, got %ld\n", what, v);
+    }
+}
+
+static void count_allocs(int64_t num)
+{
+    thread_stats_t     *stats = thread_stats_get();
+    thread_name_ctrs_t *name = thread_stats_name_ctrs(stats);
+
+    thread_stat_add(stats, &name->num_alloc, num);
+    thread_stat_add(stats, &name->alloc_sz, num * BLOCK_SIZE);
+    thread_stat_add(stats, &name->live_num, num);
+    thread_stat_add(stats, &name->live_sz, num * BLOCK_SIZE);
+}
+
+static void* pool_thread(void *arg)
+{
+    long i = (long)arg;
+
+    /* Named before its first allocation, as a thread pool names its workers */
+    pthread_setname_np(pthread_self(), "pool");
+    count_allocs((i + 1) * 100);
+    pool_id = thread_stats_get()->name_id;
+    if(i >= POOL_THREADS / 2) {
+        pthread_barrier_wait(&running);
+        pthread_barrier_wait(&checked);
+    }
+    return NULL;
+}
+
+static void* io_thread(void *arg)
+{
+    thread_stats_t *stats = NULL;
+
+    pthread_setname_np(pthread_self(), "io");
+    stats = thread_stats_get();
+
+    /* Frees count to the freeing thread's name, the live set to the name
+       the blocks were allocated under */
+    thread_stat_add(stats, &thread_stats_name_ctrs(stats)->num_free, NUM_FREED);
+    thread_stat_add(stats, &thread_stats_name_ctrs(stats)->free_sz, NUM_FREED * BLOCK_SIZE);
+    thread_stat_add(stats, &stats->by_name[pool_id].live_num, -NUM_FREED);
+    thread_stat_add(stats, &stats->by_name[pool_id].live_sz, -NUM_FREED * BLOCK_SIZE);
+
+    thread_stats_set_name((uintptr_t)pthread_self(), "pool");
+    count_allocs(NUM_RENAMED);
+    pthread_barrier_wait(&running);
+    pthread_barrier_wait(&checked);
+    return NULL;
+}
+
+static void check_names(int threads)
+{
+    static thread_name_stats_t  names[THREAD_NAMES_MAX];
+    int64_t                     allocs = NUM_RENAMED;
+    int                         num = thread_stats_by_name(names);
+    int                         num_pool = 0;
+    int                         num_io = 0;
+    int                         i;
+
+    for(i = 0; i < POOL_THREADS; i++) {
+        allocs += (i + 1) * 100;
+    }
+    for(i = 0; i < num; i++) {
+        num_pool += strcmp(names[i].name, "pool") == 0;
+        num_io += strcmp(names[i].name, "io") == 0;
+    }
+    expect(num_pool == 1 && num_io == 1 && strcmp(names[0].name, "other") == 0,
+           "one row per name", num);
+
+    expect(names[pool_id].threads == threads, "pool threads", names[pool_id].threads);
+    expect(names[pool_id].ctrs.num_alloc == allocs, "pool allocs", names[pool_id].ctrs.num_alloc);
+    expect(names[pool_id].ctrs.alloc_sz == allocs * BLOCK_SIZE, "pool bytes",
+           names[pool_id].ctrs.alloc_sz);
+    expect(names[pool_id].ctrs.num_free == 0, "pool frees", names[pool_id].ctrs.num_free);
+    expect(names[pool_id].ctrs.live_num == allocs - NUM_FREED, "pool live",
+           names[pool_id].ctrs.live_num);
+    expect(names[pool_id].ctrs.live_sz == (allocs - NUM_FREED) * BLOCK_SIZE, "pool live bytes",
+           names[pool_id].ctrs.live_sz);
+
+    for(i = 0; i < num; i++) {
+        if(strcmp(names[i].name, "io") == 0) {
+            expect(names[i].threads == 0, "io threads, renamed", names[i].threads);
+            expect(names[i].ctrs.num_alloc == 0 && names[i].ctrs.live_num == 0,
+                   "io allocs", names[i].ctrs.num_alloc);
+            expect(names[i].ctrs.num_free == NUM_FREED &&
+                   names[i].ctrs.free_sz == NUM_FREED * BLOCK_SIZE, "io frees",
+                   names[i].ctrs.num_free);
+        }
+    }
+}
+
+int main(void)
+{
+    pthread_t  pool[POOL_THREADS];
+    pthread_t  io;
+    long       i;
+
+    pthread_setname_np(pthread_self(), "main");
+    thread_stats_get();
+    pthread_barrier_init(&running, NULL, POOL_THREADS / 2 + 2);
+    pthread_barrier_init(&checked, NULL, POOL_THREADS / 2 + 2);
+
+    for(i = 0; i < POOL_THREADS; i++) {
+        pthread_create(&pool[i], NULL, pool_thread, (void*)i);
+    }
+    for(i = 0; i < POOL_THREADS / 2; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    pthread_create(&io, NULL, io_thread, NULL);
+
+    /* Half the pool exited, the rest and the renamed io thread run */
+    pthread_barrier_wait(&running);
+    check_names(POOL_THREADS / 2 + 1);
+    pthread_barrier_wait(&checked);
+
+    for(i = POOL_THREADS / 2; i < POOL_THREADS; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    pthread_join(io, NULL);
+    check_names(0);
+
+    printf("%d pool threads, %d exited early, and a thread renamed into the pool\n",
+           POOL_THREADS, POOL_THREADS / 2);
+    printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors != 0;
+}
@@ -0,0 +1,237 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "trace_reader.h"
+#include "prof_clock.h"
+
+/* Checks the trace encoding: the varint and zigzag helpers on their edge
+ * values, then a round trip of generated events from two threads through
+ * trace.c and libmemtrace.a. Each thread writes enough events to fill
+ * several chunks, with pointers and sizes of every width. */
+
+#define NUM_EVENTS  100000
+#define NUM_THREADS 2
+
+typedef struct {
+    trace_op_t  op;
+    uint64_t    ptr;
+    uint64_t    size;
+    uint64_t    extra;      /* old pointer or alignment */
+} test_event_t;
+
+static const char *trace_path = "test_trace.bin";
+static uint32_t    tids[NUM_THREADS];
+static uint64_t    last_ts[NUM_THREADS];
+static uint64_t    future_ts[NUM_THREADS];
+static long        errors = 0;
+
+static void expect(int ok, const char *what, long i)
+{
+    if(!ok && errors++ < 10) {
+        printf("FAIL: %s, at %ld\n", what, i);
+    }
+}
+
+static uint64_t mix(uint64_t x)
+{
+    /* MurmurHash3 64-bit finalizer */
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Event i of thread t. Mostly heap-like pointers close together, with
+ * now and then a far one, a NULL or a huge size. */
+static void gen_event(int t, long i, test_event_t *e)
+{
+    uint64_t r = mix((uint64_t)t << 32 | i);
+    uint64_t width = 1 + (r >> 58);
+
+    e->op = TRACE_OP_MALLOC + r % 5;
+    e->ptr = 0x55550000000ULL + ((r >> 8) & 0xffff) * 16;
+    if(r % 97 == 0) {
+        e->ptr = r >> 16 << 4;
+    }
+    else if(r % 89 == 0) {
+        e->ptr = 0;
+    }
+    e->size = e->op == TRACE_OP_FREE ? 0 : (r >> 20) & ((1ULL << (width - 1)) - 1);
+    if(r % 83 == 0 && e->op != TRACE_OP_FREE) {
+        e->size = UINT64_MAX;
+    }
+    e->extra = 0;
+    if(e->op == TRACE_OP_REALLOC) {
+        e->extra = mix(r) % 3 == 0 ? 0 : mix(r) >> 20 << 4;
+    }
+    else if(e->op == TRACE_OP_MEMALIGN) {
+        e->extra = 1ULL << (r % 13 + 4);
+    }
+}
+
+static int check_varints(void)
+{
+    static const uint64_t vals[] = {0, 1, 127, 128, 16383, 16384, 1ULL << 35,
+                                    (1ULL << 63) - 1, 1ULL << 63, UINT64_MAX};
+    static const int64_t  signed_vals[] = {0, -1, 1, -64, 64, INT64_MIN, INT64_MAX};
+    uint8_t               buf[16];
+    size_t                i;
+
+    for(i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+        uint8_t       *end = trace_put_varint(buf, vals[i]);
+        uint64_t       v = 0;
+        const uint8_t *got = trace_get_varint(buf, end, &v);
+
+        expect(got == end && v == vals[i], "varint round trip", i);
+        expect(end - buf <= 10, "varint longer than 10 bytes", i);
+        expect(trace_get_varint(buf, end - 1, &v) == NULL, "truncated varint accepted", i);
+    }
+    for(i = 0; i < sizeof(signed_vals) / sizeof(signed_vals[0]); i++) {
+        expect(trace_unzigzag(trace_zigzag(signed_vals[i])) == signed_vals[i],
+               "zigzag round trip", i);
+    }
+    /* Small magnitudes of either sign stay small */
+    expect(trace_zigzag(-1) == 1 && trace_zigzag(1) == 2 && trace_zigzag(-64) == 127,
+           "zigzag encoding", 0);
+    printf("varint and zigzag: %s\n", errors ? "errors" : "ok");
+    return errors ? -1 : 0;
+}
+
+static void* write_events(void *arg)
+{
+    int   t = (int)(intptr_t)arg;
+    long  i;
+
+    tids[t] = (uint32_t)syscall(SYS_gettid);
+    for(i = 0; i < NUM_EVENTS; i++) {
+        test_event_t e;
+
+        gen_event(t, i, &e);
+        trace_event(e.op, (void*)(uintptr_t)e.ptr, e.size, (void*)(uintptr_t)e.extra);
+    }
+
+    /* Stamped early, as realloc does: must not go back in time. Then one
+       stamped ahead, which must come back exactly. */
+    last_ts[t] = prof_clock_ns();
+    trace_event_at(TRACE_OP_FREE, last_ts[t] - 1000000, NULL, 0, NULL);
+    future_ts[t] = prof_clock_ns() + 5000000;
+    trace_event_at(TRACE_OP_FREE, future_ts[t], NULL, 0, NULL);
+    return NULL;
+}
+
+static int thread_index(uint32_t tid)
+{
+    int t;
+
+    for(t = 0; t < NUM_THREADS; t++) {
+        if(tids[t] == tid) {
+            return t;
+        }
+    }
+    return -1;
+}
+
+static int check_round_trip(void)
+{
+    trace_reader_t *reader = NULL;
+    trace_event_t   event;
+    pthread_t       thread;
+    long            seen[NUM_THREADS] = {0};
+    uint64_t        prev_ts[NUM_THREADS] = {0};
+    long            n = 0;
+    int             ret = 0;
+    int             t;
+
+    if(trace_open(trace_path) != 0) {
+        printf("FAIL: cannot create %s\n", trace_path);
+        return -1;
+    }
+    pthread_create(&thread, NULL, write_events, (void*)1);
+    write_events((void*)0);
+    pthread_join(thread, NULL);
+    trace_close();
+
+    reader = trace_reader_open(trace_path);
+    unlink(trace_path);
+    if(!reader) {
+        printf("FAIL: cannot read %s\n", trace_path);
+        return -1;
+    }
+    while((ret = trace_reader_next(reader, &event)) == 1) {
+        test_event_t e;
+        long         i;
+
+        n++;
+        t = thread_index(event.tid);
+        if(t < 0) {
+            expect(0, "event of an unknown thread", n);
+            continue;
+        }
+        i = seen[t]++;
+        expect(event.pid == (uint32_t)getpid(), "pid", i);
+        expect(event.ts >= prev_ts[t], "time going backwards", i);
+        prev_ts[t] = event.ts;
+        if(i == NUM_EVENTS) {
+            expect(event.ts >= last_ts[t] - 1000000 && event.op == TRACE_OP_FREE,
+                   "early stamp", i);
+            continue;
+        }
+        if(i == NUM_EVENTS + 1) {
+            expect(event.ts == future_ts[t], "stamp given", i);
+            continue;
+        }
+        gen_event(t, i, &e);
+        expect(event.op == e.op && event.ptr == e.ptr && event.size == e.size, "event", i);
+        expect(event.old_ptr == (e.op == TRACE_OP_REALLOC ? e.extra : 0), "realloc old pointer", i);
+        expect(event.align == (e.op == TRACE_OP_MEMALIGN ? e.extra : 0), "alignment", i);
+    }
+    trace_reader_close(reader);
+
+    expect(ret == 0, "corrupt trace", n);
+    for(t = 0; t < NUM_THREADS; t++) {
+        expect(seen[t] == NUM_EVENTS + 2, "events missing", t);
+    }
+    printf("round trip: %ld events from %d threads\n", n, NUM_THREADS);
+    return errors ? -1 : 0;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    if(check_varints() != 0 || check_round_trip() != 0) {
+        failed = 1;
+    }
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
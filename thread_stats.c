@@ -0,0 +1,282 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "thread_stats.h"
+
+__thread thread_stats_t *thread_stats_self
+    __attribute__((tls_model("initial-exec"))) = NULL;
+
+/* Counters of exited threads. Also used by threads that could not get a
+ * slot of their own, hence updated atomically. */
+static thread_stats_t retired_stats = { .shared = 1 };
+
+static pthread_once_t   stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t    stats_key;
+static pthread_mutex_t  stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Slot array, free slot stack and high water mark; under stats_lock */
+static thread_stats_t  *stats_slots = NULL;
+static int              free_slots[THREAD_STATS_MAX_THREADS];
+static int              num_free_slots = 0;
+static int              num_used_slots = 0;
+
+/* Interned thread names, never removed; under stats_lock */
+static char             thread_names[THREAD_NAMES_MAX][THREAD_NAME_LEN] = { "other" };
+static int              num_thread_names = 1;
+
+/* Adds len bytes of int64_t counters */
+static void fold_int64(void *dst, void *src, size_t len)
+{
+    int64_t *d = (int64_t*)dst;
+    int64_t *s = (int64_t*)src;
+    size_t   i;
+
+    for(i = 0; i < len / sizeof(int64_t); i++) {
+        __atomic_add_fetch(&d[i], __atomic_load_n(&s[i], __ATOMIC_RELAXED),
+                           __ATOMIC_RELAXED);
+    }
+}
+
+static void fold_counters(thread_counters_t *dst, thread_counters_t *src)
+{
+    fold_int64(dst, src, sizeof(*dst));
+}
+
+/* Caller holds stats_lock. Names that do not fit any more go to "other". */
+static uint8_t intern_name(const char *name)
+{
+    int i;
+
+    if(!name[0]) {
+        return 0;
+    }
+    for(i = 1; i < num_thread_names; i++) {
+        if(strncmp(thread_names[i], name, THREAD_NAME_LEN - 1) == 0) {
+            return i;
+        }
+    }
+    if(num_thread_names == THREAD_NAMES_MAX) {
+        return 0;
+    }
+    strncpy(thread_names[i], name, THREAD_NAME_LEN - 1);
+    return num_thread_names++;
+}
+
+/* Caller holds stats_lock */
+static void release_slot(thread_stats_t *stats)
+{
+    fold_counters(&retired_stats.ctrs, &stats->ctrs);
+    fold_int64(retired_stats.by_name, stats->by_name, sizeof(stats->by_name));
+    age_epochs_fold(&retired_stats.ages, &stats->ages);
+    memset(&stats->ctrs, 0, sizeof(stats->ctrs));
+    memset(&stats->by_name, 0, sizeof(stats->by_name));
+    memset(&stats->ages, 0, sizeof(stats->ages));
+    stats->name_id = 0;
+    stats->in_use = 0;
+    free_slots[num_free_slots++] = stats - stats_slots;
+}
+
+static void thread_exit(void *arg)
+{
+    thread_stats_t *stats = (thread_stats_t*)arg;
+
+    pthread_mutex_lock(&stats_lock);
+    release_slot(stats);
+    pthread_mutex_unlock(&stats_lock);
+
+    /* Allocations made by later TLS destructors go to the retired slot */
+    thread_stats_self = &retired_stats;
+}
+
+/* Threads other than the caller do not exist in a forked child */
+static void fork_child(void)
+{
+    int i;
+
+    pthread_mutex_init(&stats_lock, NULL);
+    for(i = 0; i < num_used_slots; i++) {
+        thread_stats_t *stats = &stats_slots[i];
+        if(stats->in_use && stats != thread_stats_self) {
+            release_slot(stats);
+        }
+    }
+    if(thread_stats_self && thread_stats_self != &retired_stats) {
+        thread_stats_self->tid = (pid_t)syscall(SYS_gettid);
+    }
+}
+
+static void stats_init(void)
+{
+    void *mem = mmap(NULL, THREAD_STATS_MAX_THREADS * sizeof(thread_stats_t),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if(mem != MAP_FAILED) {
+        stats_slots = (thread_stats_t*)mem;
+    }
+    pthread_key_create(&stats_key, thread_exit);
+    pthread_atfork(NULL, NULL, fork_child);
+}
+
+thread_stats_t* thread_stats_register(void)
+{
+    thread_stats_t *stats = &retired_stats;
+
+    pthread_once(&stats_once, stats_init);
+
+    pthread_mutex_lock(&stats_lock);
+    if(stats_slots && num_free_slots > 0) {
+        stats = &stats_slots[free_slots[--num_free_slots]];
+    }
+    else if(stats_slots && num_used_slots < THREAD_STATS_MAX_THREADS) {
+        stats = &stats_slots[num_used_slots++];
+    }
+    if(stats != &retired_stats) {
+        char name[THREAD_NAME_LEN] = "";
+
+        /* For the calling thread this is a prctl, it does not allocate */
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        stats->name_id = intern_name(name);
+        stats->stack = (uintptr_t)&stats;
+        stats->self = (uintptr_t)pthread_self();
+        stats->tid = (pid_t)syscall(SYS_gettid);
+        stats->in_use = 1;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    /* Publish before pthread_setspecific, which may itself allocate */
+    thread_stats_self = stats;
+    if(stats != &retired_stats) {
+        pthread_setspecific(stats_key, stats);
+    }
+    return stats;
+}
+
+void thread_stats_sum(thread_counters_t *out)
+{
+    int i;
+
+    memset(out, 0, sizeof(*out));
+
+    pthread_mutex_lock(&stats_lock);
+    fold_counters(out, &retired_stats.ctrs);
+    for(i = 0; i < num_used_slots; i++) {
+        if(stats_slots[i].in_use) {
+            fold_counters(out, &stats_slots[i].ctrs);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void thread_stats_age_hist(age_hist_t *out, uint64_t now_ns)
+{
+    int i;
+
+    memset(out, 0, sizeof(*out));
+
+    pthread_mutex_lock(&stats_lock);
+    age_hist_collect(out, &retired_stats.ages, now_ns);
+    for(i = 0; i < num_used_slots; i++) {
+        if(stats_slots[i].in_use) {
+            age_hist_collect(out, &stats_slots[i].ages, now_ns);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void thread_stats_age_add_shared(thread_stats_t *stats, uint64_t birth_ns, int64_t num)
+{
+    pthread_mutex_lock(&stats_lock);
+    age_epochs_add(&stats->ages, birth_ns, num);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+int thread_stats_threads(uintptr_t *stacks, uintptr_t *selves, pid_t *tids, int max)
+{
+    int i;
+    int num = 0;
+
+    pthread_mutex_lock(&stats_lock);
+    for(i = 0; i < num_used_slots && num < max; i++) {
+        if(stats_slots[i].in_use) {
+            stacks[num] = stats_slots[i].stack;
+            selves[num] = stats_slots[i].self;
+            tids[num] = stats_slots[i].tid;
+            num++;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return num;
+}
+
+void thread_stats_set_name(uintptr_t self, const char *name)
+{
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    for(i = 0; i < num_used_slots; i++) {
+        if(stats_slots[i].in_use && stats_slots[i].self == self) {
+            __atomic_store_n(&stats_slots[i].name_id, intern_name(name), __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+int thread_stats_by_name(thread_name_stats_t *out)
+{
+    int num = 0;
+    int i;
+
+    memset(out, 0, THREAD_NAMES_MAX * sizeof(*out));
+
+    pthread_mutex_lock(&stats_lock);
+    num = num_thread_names;
+    for(i = 0; i < THREAD_NAMES_MAX; i++) {
+        memcpy(out[i].name, thread_names[i], THREAD_NAME_LEN);
+        fold_int64(&out[i].ctrs, &retired_stats.by_name[i], sizeof(out[i].ctrs));
+    }
+    for(i = 0; i < num_used_slots; i++) {
+        thread_stats_t *stats = &stats_slots[i];
+        int             j;
+
+        if(!stats->in_use) {
+            continue;
+        }
+        out[stats->name_id].threads++;
+        for(j = 0; j < num; j++) {
+            fold_int64(&out[j].ctrs, &stats->by_name[j], sizeof(out[j].ctrs));
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return num;
+}
@@ -0,0 +1,158 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _THREAD_STATS_
+#define _THREAD_STATS_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "size_hist.h"
+#include "age_hist.h"
+#include "life_hist.h"
+
+/* Per-thread allocation counters.
+ * Every thread owns a cache-line aligned slot that only it writes, so
+ * counting is a plain load/store with no lock and no atomic read-modify-
+ * write. Readers sum all slots on demand, so a report costs O(threads *
+ * buckets) whatever the size of the live set. When a thread exits its slot is
+ * folded into the shared "retired" slot and recycled.
+ *
+ * Counters are also kept per thread name (pthread_setname_np), so a thread
+ * pool shows up as one row however many threads it had. Each slot has a
+ * row per name: a thread adds its allocations and frees to its own name,
+ * and the live count of a block to the name it was allocated under, all in
+ * its own slot. Names are interned, 0 is "other" (no slot, table full). */
+
+#define THREAD_STATS_MAX_THREADS  4096
+#define THREAD_NAMES_MAX          256   /* names fit the uint8_t name_id */
+#define THREAD_NAME_LEN           16    /* as in pthread_setname_np */
+
+/* Freed blocks by the number of reallocs they went through: 1, 2-3, 4-7,
+ * ... 64 and more (counts saturate at 127, see alloc_info_t) */
+#define REALLOC_CHAIN_BUCKETS     7
+
+typedef struct {
+    int64_t  num_alloc;
+    int64_t  alloc_sz;
+    int64_t  num_free;
+    int64_t  free_sz;
+    int64_t  live_num;   /* deltas, may go negative in a single slot */
+    int64_t  live_sz;
+    int64_t  cxx_num_alloc;   /* share of num_alloc/alloc_sz from operator new */
+    int64_t  cxx_alloc_sz;
+    size_hist_t live_hist;   /* live set by size, deltas like live_num */
+    int64_t  num_realloc;      /* reallocs of tracked blocks */
+    int64_t  realloc_moved;    /* of which the real realloc moved the block */
+    int64_t  realloc_copied;   /* bytes the moves copied */
+    int64_t  realloc_chains[REALLOC_CHAIN_BUCKETS];  /* freed blocks by reallocs */
+    life_hist_t lifetimes;     /* freed blocks by lifetime */
+    int64_t  lifetime_ns;      /* sum of their lifetimes */
+} thread_counters_t;
+
+typedef struct {
+    int64_t  num_alloc;
+    int64_t  alloc_sz;
+    int64_t  num_free;
+    int64_t  free_sz;
+    int64_t  live_num;   /* of blocks allocated under the name, deltas */
+    int64_t  live_sz;
+} thread_name_ctrs_t;
+
+typedef struct {
+    char                name[THREAD_NAME_LEN];
+    int                 threads;     /* live threads going by the name */
+    thread_name_ctrs_t  ctrs;        /* exited threads included */
+} thread_name_stats_t;
+
+typedef struct {
+    thread_counters_t  ctrs;
+    age_epochs_t       ages;     /* under the slots lock in shared slots */
+    uintptr_t          stack;    /* an address on the owner's stack */
+    uintptr_t          self;     /* the owner's pthread_self() */
+    pid_t              tid;      /* the owner's kernel thread id */
+    int                in_use;
+    int                shared;   /* written by several threads, use atomics */
+    uint8_t            name_id;  /* the owner's current name */
+    thread_name_ctrs_t by_name[THREAD_NAMES_MAX];
+} __attribute__((aligned(64))) thread_stats_t;
+
+extern __thread thread_stats_t *thread_stats_self
+    __attribute__((tls_model("initial-exec")));
+
+thread_stats_t* thread_stats_register(void);
+void            thread_stats_sum(thread_counters_t *out);
+void            thread_stats_age_hist(age_hist_t *out, uint64_t now_ns);
+void            thread_stats_age_add_shared(thread_stats_t *stats, uint64_t birth_ns,
+                                            int64_t num);
+
+/* Fills stacks[], selves[] and tids[] for up to max live threads, for the
+ * leak check. Returns the number filled. */
+int             thread_stats_threads(uintptr_t *stacks, uintptr_t *selves, pid_t *tids,
+                                     int max);
+
+/* Moves the thread whose pthread_self() is self to a new name */
+void            thread_stats_set_name(uintptr_t self, const char *name);
+
+/* Sums the counters of every name into out[THREAD_NAMES_MAX], indexed by
+ * name_id. Returns the number of names in use. */
+int             thread_stats_by_name(thread_name_stats_t *out);
+
+static inline thread_stats_t* thread_stats_get(void)
+{
+    thread_stats_t *stats = thread_stats_self;
+
+    if(__builtin_expect(stats == NULL, 0)) {
+        stats = thread_stats_register();
+    }
+    return stats;
+}
+
+static inline thread_name_ctrs_t* thread_stats_name_ctrs(thread_stats_t *stats)
+{
+    return &stats->by_name[__atomic_load_n(&stats->name_id, __ATOMIC_RELAXED)];
+}
+
+static inline void thread_stat_add(thread_stats_t *stats, int64_t *ctr, int64_t val)
+{
+    if(__builtin_expect(stats->shared, 0)) {
+        __atomic_add_fetch(ctr, val, __ATOMIC_RELAXED);
+    }
+    else {
+        /* single writer: relaxed store keeps readers free of torn values */
+        __atomic_store_n(ctr, *ctr + val, __ATOMIC_RELAXED);
+    }
+}
+
+/* The age rings are not atomic, several writers take the slots lock */
+static inline void thread_stats_age_add(thread_stats_t *stats, uint64_t birth_ns, int64_t num)
+{
+    if(__builtin_expect(stats->shared, 0)) {
+        thread_stats_age_add_shared(stats, birth_ns, num);
+    }
+    else {
+        age_epochs_add(&stats->ages, birth_ns, num);
+    }
+}
+
+#endif /* _THREAD_STATS_ */
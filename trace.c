@@ -0,0 +1,363 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "prof_clock.h"
+
+/* One mapping of TRACE_BUF_SIZE per thread: this struct, then the chunk
+ * header and the encoded events right behind it */
+typedef struct trace_buf {
+    struct trace_buf  *next;
+    struct trace_buf  *prev;
+    int                busy;      /* owner is appending, see trace_close() */
+    int                closed;
+    uint64_t           last_ts;
+    uintptr_t          last_ptr;
+    size_t             pos;       /* bytes of events in the chunk */
+    size_t             cap;
+    trace_chunk_hdr_t  chunk;
+    uint8_t            data[];
+} trace_buf_t;
+
+bool trace_enabled = false;
+
+static int       trace_fd = -1;
+static uint32_t  trace_pid = 0;
+static bool      trace_closed = false;
+
+/* Serializes trace_open() and trace_close() */
+static pthread_mutex_t  trace_ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread trace_buf_t *tbuf __attribute__((tls_model("initial-exec")));
+static __thread int          tbuf_exited __attribute__((tls_model("initial-exec")));
+
+/* Every live buffer, so that trace_close() can flush them all */
+static pthread_mutex_t  registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buf_t     *registry = NULL;
+
+static pthread_once_t  trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   trace_key;
+
+/* O_APPEND keeps each chunk contiguous when threads flush concurrently */
+static void write_all(const void *data, size_t len)
+{
+    const char *p = (const char*)data;
+
+    while(len > 0) {
+        ssize_t n = write(trace_fd, p, len);
+
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void buf_flush(trace_buf_t *buf)
+{
+    if(buf->pos == 0) {
+        return;
+    }
+    buf->chunk.len = buf->pos;
+    buf->chunk.pid = trace_pid;
+    write_all(&buf->chunk, sizeof(buf->chunk) + buf->pos);
+    buf->pos = 0;
+}
+
+static void buf_unlink(trace_buf_t *buf)
+{
+    if(buf->prev) {
+        buf->prev->next = buf->next;
+    }
+    else {
+        registry = buf->next;
+    }
+    if(buf->next) {
+        buf->next->prev = buf->prev;
+    }
+}
+
+/* Flushes the thread's events when it exits */
+static void thread_exit(void *arg)
+{
+    trace_buf_t *buf = (trace_buf_t*)arg;
+
+    pthread_mutex_lock(&registry_lock);
+    if(!buf->closed) {
+        buf_flush(buf);
+    }
+    buf_unlink(buf);
+    pthread_mutex_unlock(&registry_lock);
+
+    tbuf = NULL;
+    tbuf_exited = 1;
+    munmap(buf, TRACE_BUF_SIZE);
+}
+
+static void trace_init_key(void)
+{
+    pthread_key_create(&trace_key, thread_exit);
+}
+
+static trace_buf_t* buf_create(void)
+{
+    trace_buf_t *buf = mmap(NULL, TRACE_BUF_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(buf == MAP_FAILED) {
+        return NULL;
+    }
+    buf->cap = TRACE_BUF_SIZE - sizeof(trace_buf_t);
+    buf->chunk.magic = TRACE_CHUNK_MAGIC;
+    buf->chunk.tid = (uint32_t)syscall(SYS_gettid);
+
+    pthread_mutex_lock(&registry_lock);
+    buf->next = registry;
+    if(registry) {
+        registry->prev = buf;
+    }
+    registry = buf;
+    pthread_mutex_unlock(&registry_lock);
+
+    /* setspecific may allocate and come back here: publish tbuf first */
+    tbuf = buf;
+    pthread_once(&trace_once, trace_init_key);
+    pthread_setspecific(trace_key, buf);
+    return buf;
+}
+
+static uint8_t* encode_event(uint8_t *p, trace_op_t op, uint64_t ts, uint64_t *last_ts,
+                             uintptr_t ptr, uintptr_t *last_ptr, size_t size,
+                             uintptr_t old_ptr)
+{
+    *p++ = (uint8_t)op;
+    p = trace_put_varint(p, ts - *last_ts);
+    p = trace_put_varint(p, trace_zigzag((int64_t)(ptr - *last_ptr)));
+    if(op != TRACE_OP_FREE) {
+        p = trace_put_varint(p, size);
+    }
+    if(op == TRACE_OP_REALLOC) {
+        p = trace_put_varint(p, trace_zigzag((int64_t)(old_ptr - ptr)));
+    }
+    else if(op == TRACE_OP_MEMALIGN) {
+        p = trace_put_varint(p, old_ptr);
+    }
+    *last_ts = ts;
+    *last_ptr = ptr;
+    return p;
+}
+
+/* Allocator calls made while a thread is torn down, after its buffer is
+ * gone: written out as single-event chunks */
+static void write_single(trace_op_t op, uint64_t ts, uintptr_t ptr, size_t size,
+                         uintptr_t old_ptr)
+{
+    struct {
+        trace_chunk_hdr_t chunk;
+        uint8_t           data[TRACE_MAX_EVENT_SZ];
+    } single;
+    uint64_t   last_ts = ts;
+    uintptr_t  last_ptr = 0;
+    uint8_t   *end = NULL;
+
+    single.chunk.magic = TRACE_CHUNK_MAGIC;
+    single.chunk.pid = trace_pid;
+    single.chunk.tid = (uint32_t)syscall(SYS_gettid);
+    single.chunk.base_ts = ts;
+    end = encode_event(single.data, op, ts, &last_ts, ptr, &last_ptr, size, old_ptr);
+    single.chunk.len = end - single.data;
+    write_all(&single, sizeof(single.chunk) + single.chunk.len);
+}
+
+/* Points trace_fd at path, or at /dev/null. The descriptor number never
+ * changes once assigned, so a thread still writing a single event after
+ * trace_close() has checked trace_closed cannot hit an unrelated file. */
+static int trace_redirect(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+    if(fd < 0) {
+        return -1;
+    }
+    if(trace_fd < 0) {
+        trace_fd = fd;
+        return 0;
+    }
+    dup3(fd, trace_fd, O_CLOEXEC);
+    close(fd);
+    return 0;
+}
+
+int trace_open(const char *path)
+{
+    trace_file_hdr_t  hdr;
+    trace_buf_t      *buf = NULL;
+    int               ret = -1;
+
+    pthread_mutex_lock(&trace_ctl_lock);
+    if(trace_enabled || trace_redirect(path) != 0) {
+        goto out;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    write_all(&hdr, sizeof(hdr));
+
+    trace_pid = (uint32_t)getpid();
+
+    /* Restarting after trace_close(): its buffers are empty, hand them back */
+    pthread_mutex_lock(&registry_lock);
+    for(buf = registry; buf; buf = buf->next) {
+        __atomic_store_n(&buf->closed, 0, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    __atomic_store_n(&trace_closed, false, __ATOMIC_RELEASE);
+
+    trace_enabled = true;
+    ret = 0;
+out:
+    pthread_mutex_unlock(&trace_ctl_lock);
+    return ret;
+}
+
+void trace_event(trace_op_t op, void *ptr, size_t size, void *old_ptr)
+{
+    trace_event_at(op, prof_clock_ns(), ptr, size, old_ptr);
+}
+
+void trace_event_at(trace_op_t op, uint64_t ts, void *ptr, size_t size, void *old_ptr)
+{
+    trace_buf_t *buf = tbuf;
+
+    if(__builtin_expect(!buf, 0)) {
+        if(__atomic_load_n(&trace_closed, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        if(tbuf_exited) {
+            write_single(op, ts, (uintptr_t)ptr, size, (uintptr_t)old_ptr);
+            return;
+        }
+        buf = buf_create();
+        if(!buf) {
+            return;
+        }
+    }
+
+    /* Pairs with trace_close(): either it sees busy, or we see closed */
+    __atomic_store_n(&buf->busy, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&buf->closed, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&buf->busy, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if(buf->pos + TRACE_MAX_EVENT_SZ > buf->cap) {
+        buf_flush(buf);
+    }
+    if(buf->pos == 0) {
+        buf->chunk.base_ts = ts;
+        buf->last_ts = ts;
+        buf->last_ptr = 0;
+    }
+    /* An event stamped early may follow one logged meanwhile, by a signal
+       handler: deltas cannot go backwards */
+    if(ts < buf->last_ts) {
+        ts = buf->last_ts;
+    }
+    buf->pos = encode_event(buf->data + buf->pos, op, ts, &buf->last_ts,
+                            (uintptr_t)ptr, &buf->last_ptr, size,
+                            (uintptr_t)old_ptr) - buf->data;
+
+    __atomic_store_n(&buf->busy, 0, __ATOMIC_RELEASE);
+}
+
+void trace_close(void)
+{
+    trace_buf_t *buf = NULL;
+
+    pthread_mutex_lock(&trace_ctl_lock);
+    if(!trace_enabled) {
+        pthread_mutex_unlock(&trace_ctl_lock);
+        return;
+    }
+    trace_enabled = false;
+    __atomic_store_n(&trace_closed, true, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&registry_lock);
+    for(buf = registry; buf; buf = buf->next) {
+        __atomic_store_n(&buf->closed, 1, __ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&buf->busy, __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+        buf_flush(buf);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    trace_redirect("/dev/null");
+    pthread_mutex_unlock(&trace_ctl_lock);
+}
+
+/* The child keeps writing to the same file under its own pid. Events the
+ * parent had not flushed yet are the parent's to write. */
+void trace_fork_child(void)
+{
+    trace_buf_t *buf = registry;
+
+    /* Buffers outlive a stopped trace, so this runs even when disabled */
+    pthread_mutex_init(&trace_ctl_lock, NULL);
+    pthread_mutex_init(&registry_lock, NULL);
+    trace_pid = (uint32_t)getpid();
+
+    while(buf) {
+        trace_buf_t *next = buf->next;
+
+        if(buf != tbuf) {
+            munmap(buf, TRACE_BUF_SIZE);
+        }
+        buf = next;
+    }
+
+    registry = tbuf;
+    if(tbuf) {
+        tbuf->next = NULL;
+        tbuf->prev = NULL;
+        tbuf->pos = 0;
+        tbuf->chunk.tid = (uint32_t)syscall(SYS_gettid);
+    }
+}
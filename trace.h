@@ -0,0 +1,60 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _TRACE_
+#define _TRACE_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "trace_format.h"
+
+/* Binary allocation trace (MEMPROF_TRACE=path).
+ * Events are encoded into a private mmap'd buffer per thread and written
+ * out with one write(2) per TRACE_BUF_SIZE bytes. Format: trace_format.h.
+ * Nothing here calls malloc. */
+
+#define TRACE_BUF_SIZE  (256 * 1024)
+
+extern bool trace_enabled;
+
+/* Creates the trace file, also after trace_close() to start a new trace.
+ * Returns 0 on success, -1 on error or if a trace is already running. */
+int  trace_open(const char *path);
+
+/* old_ptr is the old pointer for TRACE_OP_REALLOC and the alignment for
+ * TRACE_OP_MEMALIGN, unused otherwise */
+void trace_event(trace_op_t op, void *ptr, size_t size, void *old_ptr);
+
+/* trace_event stamped ts (prof_clock_ns()), for calls that must be ordered
+ * by when they started */
+void trace_event_at(trace_op_t op, uint64_t ts, void *ptr, size_t size, void *old_ptr);
+
+/* Writes out every thread's pending events and stops tracing */
+void trace_close(void);
+
+/* Drops the buffers of threads that did not survive fork */
+void trace_fork_child(void);
+
+#endif /* _TRACE_ */
@@ -0,0 +1,120 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _TRACE_FORMAT_
+#define _TRACE_FORMAT_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* On-disk layout of MEMPROF_TRACE files, shared by the writer (trace.c)
+ * and the reader (trace_reader.c).
+ *
+ * file   := trace_file_hdr_t chunk*
+ * chunk  := trace_chunk_hdr_t event*     (len bytes of events)
+ * event  := op ts_delta ptr_delta [size] [old_ptr_delta | align]
+ *
+ * Each chunk holds the events of one thread, in order, and decodes on its
+ * own: deltas restart from the chunk header. op is one byte, the rest are
+ * LEB128 varints. ts_delta is in nanoseconds from the previous event;
+ * ptr_delta is the zigzag-encoded difference from the previous pointer;
+ * old_ptr_delta (realloc only) is relative to the returned pointer, align
+ * (memalign only) is the alignment. posix_memalign, aligned_alloc, valloc
+ * and pvalloc are all recorded as memalign. Frees and reallocs are stamped
+ * when called, before the old block is released, and allocations when they
+ * return, so another thread's reuse of a released address sorts after the
+ * release.
+ * Chunks of different threads interleave in flush order. All fixed-size
+ * fields are in the byte order of the traced host. */
+
+#define TRACE_MAGIC         "MEMTRACE"
+#define TRACE_VERSION       1
+#define TRACE_CHUNK_MAGIC   0x4b4e4843u    /* "CHNK" */
+
+typedef enum {
+    TRACE_OP_MALLOC = 1,
+    TRACE_OP_CALLOC,
+    TRACE_OP_REALLOC,
+    TRACE_OP_FREE,
+    TRACE_OP_MEMALIGN,
+} trace_op_t;
+
+typedef struct {
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  flags;
+} trace_file_hdr_t;
+
+typedef struct {
+    uint32_t  magic;
+    uint32_t  len;        /* bytes of events following the header */
+    uint32_t  pid;
+    uint32_t  tid;
+    uint64_t  base_ts;    /* CLOCK_MONOTONIC ns the first delta applies to */
+} trace_chunk_hdr_t;
+
+/* Longest encoding of one event: op + 4 varints of up to 10 bytes */
+#define TRACE_MAX_EVENT_SZ  41
+
+static inline uint8_t* trace_put_varint(uint8_t *p, uint64_t v)
+{
+    while(v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* Returns NULL if the varint runs past end */
+static inline const uint8_t* trace_get_varint(const uint8_t *p, const uint8_t *end,
+                                              uint64_t *v)
+{
+    uint64_t  r = 0;
+    int       shift = 0;
+
+    while(p < end && shift < 64) {
+        uint8_t b = *p++;
+
+        r |= (uint64_t)(b & 0x7f) << shift;
+        if(!(b & 0x80)) {
+            *v = r;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+static inline uint64_t trace_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t trace_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+#endif /* _TRACE_FORMAT_ */
@@ -0,0 +1,167 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace_reader.h"
+
+/* The whole file is mapped read-only and decoded in place */
+struct trace_reader {
+    const uint8_t            *map;
+    size_t                    map_len;
+    const uint8_t            *next_chunk;
+    const trace_chunk_hdr_t  *chunk;
+    const uint8_t            *pos;      /* next event of the current chunk */
+    const uint8_t            *end;
+    uint64_t                  last_ts;
+    uint64_t                  last_ptr;
+};
+
+trace_reader_t* trace_reader_open(const char *path)
+{
+    trace_reader_t          *reader = NULL;
+    const trace_file_hdr_t  *hdr = NULL;
+    struct stat              st;
+    void                    *map = MAP_FAILED;
+    int                      fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0) {
+        return NULL;
+    }
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*hdr)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(map == MAP_FAILED) {
+        return NULL;
+    }
+
+    hdr = (const trace_file_hdr_t*)map;
+    if(memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+       hdr->version != TRACE_VERSION) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    reader = calloc(1, sizeof(*reader));
+    if(!reader) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    reader->map = (const uint8_t*)map;
+    reader->map_len = st.st_size;
+    reader->next_chunk = reader->map + sizeof(*hdr);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    return reader;
+}
+
+/* Returns 1 when a chunk was loaded, 0 at end of file, -1 if corrupt */
+static int next_chunk(trace_reader_t *reader)
+{
+    const uint8_t           *map_end = reader->map + reader->map_len;
+    const trace_chunk_hdr_t *chunk = (const trace_chunk_hdr_t*)reader->next_chunk;
+
+    if(reader->next_chunk == map_end) {
+        return 0;
+    }
+    if(map_end - reader->next_chunk < (ptrdiff_t)sizeof(*chunk) ||
+       chunk->magic != TRACE_CHUNK_MAGIC ||
+       map_end - reader->next_chunk - sizeof(*chunk) < chunk->len) {
+        return -1;
+    }
+
+    reader->chunk = chunk;
+    reader->pos = (const uint8_t*)(chunk + 1);
+    reader->end = reader->pos + chunk->len;
+    reader->next_chunk = reader->end;
+    reader->last_ts = chunk->base_ts;
+    reader->last_ptr = 0;
+    return 1;
+}
+
+int trace_reader_next(trace_reader_t *reader, trace_event_t *event)
+{
+    const uint8_t *p = NULL;
+    uint64_t       v = 0;
+
+    while(reader->pos == reader->end) {
+        int ret = next_chunk(reader);
+
+        if(ret <= 0) {
+            return ret;
+        }
+    }
+
+    p = reader->pos;
+    memset(event, 0, sizeof(*event));
+    event->op = (trace_op_t)*p++;
+    if(event->op < TRACE_OP_MALLOC || event->op > TRACE_OP_MEMALIGN) {
+        return -1;
+    }
+    event->pid = reader->chunk->pid;
+    event->tid = reader->chunk->tid;
+
+    if(!(p = trace_get_varint(p, reader->end, &v))) {
+        return -1;
+    }
+    event->ts = reader->last_ts += v;
+
+    if(!(p = trace_get_varint(p, reader->end, &v))) {
+        return -1;
+    }
+    event->ptr = reader->last_ptr += trace_unzigzag(v);
+
+    if(event->op != TRACE_OP_FREE) {
+        if(!(p = trace_get_varint(p, reader->end, &event->size))) {
+            return -1;
+        }
+    }
+    if(event->op == TRACE_OP_REALLOC) {
+        if(!(p = trace_get_varint(p, reader->end, &v))) {
+            return -1;
+        }
+        event->old_ptr = event->ptr + trace_unzigzag(v);
+    }
+    else if(event->op == TRACE_OP_MEMALIGN) {
+        if(!(p = trace_get_varint(p, reader->end, &event->align))) {
+            return -1;
+        }
+    }
+
+    reader->pos = p;
+    return 1;
+}
+
+void trace_reader_close(trace_reader_t *reader)
+{
+    if(!reader) {
+        return;
+    }
+    munmap((void*)reader->map, reader->map_len);
+    free(reader);
+}
@@ -0,0 +1,56 @@
+/*
+MIT License
+
+Copyright (c) 2019 Varun Murthy (varun.tk@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _TRACE_READER_
+#define _TRACE_READER_
+
+#include <stdint.h>
+#include "trace_format.h"
+
+/* Reader for MEMPROF_TRACE files (libmemtrace.a).
+ * Events come back in file order: in order within a thread, with the
+ * chunks of different threads interleaved as they were flushed. */
+
+typedef struct {
+    uint64_t    ts;         /* CLOCK_MONOTONIC ns */
+    uint32_t    pid;
+    uint32_t    tid;
+    trace_op_t  op;
+    uint64_t    ptr;        /* returned pointer, freed pointer for free */
+    uint64_t    size;       /* requested size, 0 for free */
+    uint64_t    old_ptr;    /* realloc only */
+    uint64_t    align;      /* memalign only */
+} trace_event_t;
+
+typedef struct trace_reader trace_reader_t;
+
+/* Returns NULL if the file cannot be read or is not a trace */
+trace_reader_t* trace_reader_open(const char *path);
+
+/* Returns 1 and fills event, 0 at the end of the trace, -1 if corrupt */
+int  trace_reader_next(trace_reader_t *reader, trace_event_t *event);
+
+void trace_reader_close(trace_reader_t *reader);
+
+#endif /* _TRACE_READER_ */